@@ -0,0 +1,1053 @@
+/*
+ *  t_cose_bench_ossl.c
+ *
+ * Copyright 2019-2022, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+/* For clock_gettime() and pthreads when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "openssl/crypto.h"
+#include "t_cose/t_cose_sign1_sign.h"
+#include "t_cose/t_cose_sign1_verify.h"
+#include "t_cose/t_cose_key_set.h"
+#include "t_cose/t_cose_async.h"
+#include "t_cose/q_useful_buf.h"
+#include "t_cose_make_test_pub_key.h"
+#include "t_cose_crypto.h"
+#include "t_cose_standard_constants.h"
+#include "sha256.h" /* Brad Conte's SHA-256 to compare with */
+
+
+/**
+ * \file t_cose_bench_ossl.c
+ *
+ * \brief Micro-benchmarks for t_cose with OpenSSL.
+ *
+ * Each benchmark prints the time and the number of OpenSSL heap
+ * allocations per operation. The allocations are counted by
+ * installing counting wrappers with CRYPTO_set_mem_functions() before
+ * OpenSSL is otherwise used.
+ *
+ * The batch verify benchmark verifies the same messages as the
+ * verify benchmark, 64 at a time with t_cose_sign1_verify_batch().
+ *
+ * The hash benchmarks run the same number of hashes in each of 1 to
+ * 8 threads. Their time per operation is the elapsed time divided by
+ * the total number of hashes so it goes down as long as hashing
+ * scales with threads.
+ *
+ * The SHA-256 benchmarks hash the same small Sig_structures with the
+ * bundled Brad Conte hash and with OpenSSL one at a time and with
+ * t_cose_crypto_hash_batch(), which uses multi-buffer SHA-256 in 4,
+ * 8 or 16 lanes depending on the CPU. Their time per operation is
+ * for one hash.
+ *
+ * The key set benchmarks look up kids in a \ref t_cose_key_set from 1
+ * to 64 threads while another thread keeps publishing new
+ * generations of keys. The key set rwlock benchmarks do the same
+ * with the keys behind a pthread rwlock instead for comparison.
+ *
+ * The async benchmarks sign or verify through a \ref
+ * t_cose_async_pool of 1 to 8 workers. Their time per operation is
+ * the elapsed time for all of them so it shows the throughput.
+ *
+ * Build with and without T_COSE_ENABLE_OPENSSL_CTX_CACHE to compare
+ * the OpenSSL adapter with and without its per-thread caches.
+ *
+ * Run with no arguments to run all the benchmarks or give the names
+ * of the ones to run.
+ */
+
+
+/* Default number of operations for each benchmark */
+#define BENCH_ITERATIONS 2000
+
+
+static unsigned long s_alloc_count;
+
+/* The counting is atomic because some benchmarks run threads */
+static void *counting_malloc(size_t num, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    __atomic_add_fetch(&s_alloc_count, 1, __ATOMIC_RELAXED);
+    return malloc(num);
+}
+
+static void *counting_realloc(void *addr, size_t num, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    __atomic_add_fetch(&s_alloc_count, 1, __ATOMIC_RELAXED);
+    return realloc(addr, num);
+}
+
+static void counting_free(void *addr, const char *file, int line)
+{
+    (void)file;
+    (void)line;
+    free(addr);
+}
+
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
+}
+
+
+/*
+ * What a benchmark measured.
+ */
+struct bench_result {
+    unsigned long iterations;
+    unsigned long allocs;
+    double        elapsed_us;
+};
+
+
+static void print_result(const char *name, const struct bench_result *r)
+{
+    printf("%-32s %10.2f us/op %8.2f allocs/op\n",
+           name,
+           r->elapsed_us / (double)r->iterations,
+           (double)r->allocs / (double)r->iterations);
+}
+
+
+static const uint8_t s_payload_bytes[] = "The quick brown fox jumped over the lazy dog";
+
+
+/*
+ * Sign the same payload repeatedly with one key, prepared with
+ * t_cose_key_prepare() or not.
+ */
+static int bench_sign(int32_t              cose_algorithm_id,
+                      bool                 prepare,
+                      struct bench_result *r)
+{
+    struct t_cose_sign1_sign_ctx sign_ctx;
+    struct t_cose_key            key_pair;
+    struct t_cose_prepared_key   prepared;
+    struct t_cose_key            signing_key;
+    enum t_cose_err_t            result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(  signed_cose_buffer, 300);
+    struct q_useful_buf_c        signed_cose;
+    unsigned long                allocs_start;
+    double                       start;
+    unsigned long                i;
+
+    result = make_ecdsa_key_pair(cose_algorithm_id, &key_pair);
+    if(result) {
+        return (int)result;
+    }
+    signing_key = key_pair;
+    if(prepare) {
+        result = t_cose_key_prepare(key_pair, &prepared);
+        if(result) {
+            goto Done;
+        }
+        signing_key = t_cose_key_from_prepared(&prepared);
+    }
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, signing_key, NULL_Q_USEFUL_BUF_C);
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(s_payload_bytes),
+                                   signed_cose_buffer,
+                                  &signed_cose);
+        if(result) {
+            break;
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = BENCH_ITERATIONS;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return (int)result;
+}
+
+
+/*
+ * Verify the same COSE_Sign1 repeatedly with one key, prepared with
+ * t_cose_key_prepare() or not.
+ */
+static int bench_verify(int32_t              cose_algorithm_id,
+                        bool                 prepare,
+                        struct bench_result *r)
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_key              key_pair;
+    struct t_cose_prepared_key     prepared;
+    struct t_cose_key              verification_key;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          payload;
+    unsigned long                  allocs_start;
+    double                         start;
+    unsigned long                  i;
+
+    result = make_ecdsa_key_pair(cose_algorithm_id, &key_pair);
+    if(result) {
+        return (int)result;
+    }
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(s_payload_bytes),
+                               signed_cose_buffer,
+                              &signed_cose);
+    if(result) {
+        goto Done;
+    }
+
+    verification_key = key_pair;
+    if(prepare) {
+        result = t_cose_key_prepare(key_pair, &prepared);
+        if(result) {
+            goto Done;
+        }
+        verification_key = t_cose_key_from_prepared(&prepared);
+    }
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, verification_key);
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+        if(result) {
+            break;
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = BENCH_ITERATIONS;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return (int)result;
+}
+
+
+/* Number of messages given to t_cose_sign1_verify_batch() at once */
+#define BENCH_VERIFY_BATCH_SIZE 64
+
+
+/*
+ * Verify the same COSE_Sign1 repeatedly with one key, a batch at a
+ * time with t_cose_sign1_verify_batch().
+ */
+static int bench_verify_batch(int32_t cose_algorithm_id, struct bench_result *r)
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_key              key_pair;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          cose_sign1s[BENCH_VERIFY_BATCH_SIZE];
+    struct q_useful_buf_c          payloads[BENCH_VERIFY_BATCH_SIZE];
+    enum t_cose_err_t              item_errors[BENCH_VERIFY_BATCH_SIZE];
+    unsigned long                  allocs_start;
+    double                         start;
+    unsigned long                  i;
+
+    result = make_ecdsa_key_pair(cose_algorithm_id, &key_pair);
+    if(result) {
+        return (int)result;
+    }
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(s_payload_bytes),
+                               signed_cose_buffer,
+                              &signed_cose);
+    if(result) {
+        goto Done;
+    }
+    for(i = 0; i < BENCH_VERIFY_BATCH_SIZE; i++) {
+        cose_sign1s[i] = signed_cose;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(i = 0; i < BENCH_ITERATIONS; i += BENCH_VERIFY_BATCH_SIZE) {
+        result = t_cose_sign1_verify_batch(&verify_ctx,
+                                           cose_sign1s,
+                                           NULL,
+                                           payloads,
+                                           NULL,
+                                           item_errors,
+                                           BENCH_VERIFY_BATCH_SIZE);
+        if(result) {
+            break;
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = i;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return (int)result;
+}
+
+
+/* About the size of the Sig_structure for a small payload */
+#define BENCH_SIG_STRUCTURE_SIZE 100
+
+/* Maximum number of threads for the hash benchmarks */
+#define BENCH_MAX_THREADS 8
+
+
+static void *hash_thread(void *arg)
+{
+    enum t_cose_err_t          *result = arg;
+    struct t_cose_crypto_hash   hash_ctx;
+    uint8_t                     sig_structure[BENCH_SIG_STRUCTURE_SIZE];
+    Q_USEFUL_BUF_MAKE_STACK_UB( hash_buffer, T_COSE_CRYPTO_MAX_HASH_SIZE);
+    struct q_useful_buf_c       hash;
+    unsigned long               i;
+
+    memset(sig_structure, 0xa5, sizeof(sig_structure));
+
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        *result = t_cose_crypto_hash_start(&hash_ctx, COSE_ALGORITHM_SHA_256);
+        if(*result) {
+            break;
+        }
+        t_cose_crypto_hash_update(&hash_ctx,
+                                  (struct q_useful_buf_c){sig_structure,
+                                                          sizeof(sig_structure)});
+        *result = t_cose_crypto_hash_finish(&hash_ctx, hash_buffer, &hash);
+        if(*result) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Hash small Sig_structures in several threads at once.
+ */
+static int bench_hash(unsigned thread_count, struct bench_result *r)
+{
+    pthread_t         threads[BENCH_MAX_THREADS];
+    enum t_cose_err_t results[BENCH_MAX_THREADS];
+    unsigned long     allocs_start;
+    double            start;
+    unsigned          started;
+    unsigned          i;
+    int               return_value;
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(started = 0; started < thread_count; started++) {
+        results[started] = T_COSE_SUCCESS;
+        if(pthread_create(&threads[started], NULL, hash_thread, &results[started])) {
+            break;
+        }
+    }
+    return_value = started == thread_count ? 0 : -1;
+    for(i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if(results[i]) {
+            return_value = (int)results[i];
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = (unsigned long)started * BENCH_ITERATIONS;
+
+    return return_value;
+}
+
+
+static int bench_hash_1_thread(struct bench_result *r)
+{
+    return bench_hash(1, r);
+}
+
+static int bench_hash_2_threads(struct bench_result *r)
+{
+    return bench_hash(2, r);
+}
+
+static int bench_hash_4_threads(struct bench_result *r)
+{
+    return bench_hash(4, r);
+}
+
+static int bench_hash_8_threads(struct bench_result *r)
+{
+    return bench_hash(BENCH_MAX_THREADS, r);
+}
+
+
+/* Number of Sig_structures hashed at once by the SHA-256 benchmarks */
+#define BENCH_HASH_BATCH_SIZE 64
+
+enum bench_sha256_way {
+    SHA256_B_CON,   /* Brad Conte's sha256.c, one at a time */
+    SHA256_OPENSSL, /* The crypto adapter's hash, one at a time */
+    SHA256_BATCH    /* t_cose_crypto_hash_batch() */
+};
+
+
+/*
+ * Hash small Sig_structures with SHA-256, BENCH_HASH_BATCH_SIZE at
+ * a time, in one of the ways.
+ */
+static int bench_sha256(enum bench_sha256_way way, struct bench_result *r)
+{
+    static uint8_t               sig_structures[BENCH_HASH_BATCH_SIZE][BENCH_SIG_STRUCTURE_SIZE];
+    static uint8_t               hash_storage[BENCH_HASH_BATCH_SIZE][T_COSE_CRYPTO_SHA256_SIZE];
+    struct q_useful_buf_c        pieces[BENCH_HASH_BATCH_SIZE];
+    const struct q_useful_buf_c *inputs[BENCH_HASH_BATCH_SIZE];
+    struct q_useful_buf          buffers_for_hash[BENCH_HASH_BATCH_SIZE];
+    struct q_useful_buf_c        hashes[BENCH_HASH_BATCH_SIZE];
+    struct t_cose_crypto_hash    hash_ctx;
+    SHA256_CTX                   b_con_ctx;
+    enum t_cose_err_t            result;
+    unsigned long                allocs_start;
+    double                       start;
+    unsigned long                i;
+    size_t                       j;
+
+    memset(sig_structures, 0xa5, sizeof(sig_structures));
+    for(j = 0; j < BENCH_HASH_BATCH_SIZE; j++) {
+        pieces[j]           = (struct q_useful_buf_c){sig_structures[j],
+                                                      BENCH_SIG_STRUCTURE_SIZE};
+        inputs[j]           = &pieces[j];
+        buffers_for_hash[j] = Q_USEFUL_BUF_FROM_BYTE_ARRAY(hash_storage[j]);
+    }
+
+    result       = T_COSE_SUCCESS;
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(i = 0; i < BENCH_ITERATIONS && result == T_COSE_SUCCESS; i++) {
+        switch(way) {
+        case SHA256_B_CON:
+            for(j = 0; j < BENCH_HASH_BATCH_SIZE; j++) {
+                sha256_init(&b_con_ctx);
+                sha256_update(&b_con_ctx, pieces[j].ptr, pieces[j].len);
+                sha256_final(&b_con_ctx, hash_storage[j]);
+            }
+            break;
+
+        case SHA256_OPENSSL:
+            for(j = 0; j < BENCH_HASH_BATCH_SIZE && result == T_COSE_SUCCESS; j++) {
+                result = t_cose_crypto_hash_start(&hash_ctx, COSE_ALGORITHM_SHA_256);
+                if(result) {
+                    break;
+                }
+                t_cose_crypto_hash_update(&hash_ctx, pieces[j]);
+                result = t_cose_crypto_hash_finish(&hash_ctx, buffers_for_hash[j], &hashes[j]);
+            }
+            break;
+
+        case SHA256_BATCH:
+            result = t_cose_crypto_hash_batch(COSE_ALGORITHM_SHA_256,
+                                              inputs,
+                                              1,
+                                              buffers_for_hash,
+                                              hashes,
+                                              BENCH_HASH_BATCH_SIZE);
+            break;
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = i * BENCH_HASH_BATCH_SIZE;
+
+    return (int)result;
+}
+
+static int bench_sha256_b_con(struct bench_result *r)
+{
+    return bench_sha256(SHA256_B_CON, r);
+}
+
+static int bench_sha256_openssl(struct bench_result *r)
+{
+    return bench_sha256(SHA256_OPENSSL, r);
+}
+
+static int bench_sha256_batch(struct bench_result *r)
+{
+    return bench_sha256(SHA256_BATCH, r);
+}
+
+
+#ifdef T_COSE_ENABLE_KEY_SET
+
+/* Number of look ups by each thread in the key set benchmarks */
+#define KEY_SET_BENCH_ITERATIONS 200000
+
+/* Number of keys in each generation */
+#define KEY_SET_BENCH_KEYS 16
+
+/* Maximum number of threads for the key set benchmarks */
+#define KEY_SET_BENCH_MAX_THREADS 64
+
+#if KEY_SET_BENCH_MAX_THREADS > T_COSE_KEY_SET_MAX_READERS
+#error T_COSE_KEY_SET_MAX_READERS is too small for the key set benchmarks
+#endif
+
+
+/*
+ * The keys shared by the threads of a key set benchmark. Two
+ * generations of the same kids with different keys are published in
+ * turn.
+ */
+struct key_set_bench {
+    bool                                    use_rwlock;
+    struct t_cose_key_set                   set;
+    pthread_rwlock_t                        rwlock;
+    const struct t_cose_key_set_generation *rwlock_current;
+    struct t_cose_key_set_generation        generations[2];
+    struct t_cose_key_set_entry             entries[2][KEY_SET_BENCH_KEYS];
+    char                                    kids[KEY_SET_BENCH_KEYS][8];
+    int                                     stop;
+    unsigned long                           publishes;
+};
+
+static struct key_set_bench s_key_set_bench;
+
+
+/*
+ * Look up a kid under the rwlock. A linear search is fine as the
+ * time is in the lock.
+ */
+static enum t_cose_err_t
+rwlock_resolve(struct key_set_bench *bench, struct q_useful_buf_c kid, struct t_cose_key *key)
+{
+    const struct t_cose_key_set_generation *generation;
+    enum t_cose_err_t                       result;
+    size_t                                  i;
+
+    result = T_COSE_ERR_UNKNOWN_KEY;
+    pthread_rwlock_rdlock(&bench->rwlock);
+    generation = bench->rwlock_current;
+    for(i = 0; i < generation->count; i++) {
+        if(!q_useful_buf_compare(generation->entries[i].kid, kid)) {
+            *key   = generation->entries[i].key;
+            result = T_COSE_SUCCESS;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&bench->rwlock);
+
+    return result;
+}
+
+
+static void *key_set_reader_thread(void *arg)
+{
+    enum t_cose_err_t            *result = arg;
+    struct key_set_bench         *bench  = &s_key_set_bench;
+    struct t_cose_key_set_reader  reader;
+    struct t_cose_key             key;
+    struct q_useful_buf_c         kid;
+    unsigned long                 i;
+
+    if(!bench->use_rwlock) {
+        *result = t_cose_key_set_reader_register(&bench->set, &reader);
+        if(*result) {
+            return NULL;
+        }
+    }
+
+    for(i = 0; i < KEY_SET_BENCH_ITERATIONS; i++) {
+        kid = q_useful_buf_from_sz(bench->kids[i % KEY_SET_BENCH_KEYS]);
+        if(bench->use_rwlock) {
+            *result = rwlock_resolve(bench, kid, &key);
+        } else {
+            t_cose_key_set_read_begin(&reader);
+            *result = t_cose_key_set_resolve(&reader, T_COSE_ALGORITHM_ES256, kid, &key);
+            t_cose_key_set_read_end(&reader);
+        }
+        if(*result) {
+            break;
+        }
+    }
+
+    if(!bench->use_rwlock) {
+        t_cose_key_set_reader_unregister(&reader);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Keep publishing the other generation until told to stop. A
+ * generation is only published again once it has been reclaimed.
+ */
+static void *key_set_rotator_thread(void *arg)
+{
+    struct key_set_bench *bench = &s_key_set_bench;
+    struct timespec       pause = {0, 50000};
+    unsigned              next;
+
+    (void)arg;
+
+    next = 1;
+    while(!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        if(bench->use_rwlock) {
+            pthread_rwlock_wrlock(&bench->rwlock);
+            bench->rwlock_current = &bench->generations[next];
+            pthread_rwlock_unlock(&bench->rwlock);
+        } else {
+            t_cose_key_set_publish(&bench->set, &bench->generations[next]);
+            while(t_cose_key_set_reclaim(&bench->set) &&
+                  !__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+                sched_yield();
+            }
+        }
+        bench->publishes++;
+        next ^= 1;
+        nanosleep(&pause, NULL);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Look up kids in many threads at once while keys are being rotated.
+ */
+static int bench_key_set(unsigned thread_count, bool use_rwlock, struct bench_result *r)
+{
+    struct key_set_bench *bench = &s_key_set_bench;
+    pthread_t             threads[KEY_SET_BENCH_MAX_THREADS];
+    enum t_cose_err_t     results[KEY_SET_BENCH_MAX_THREADS];
+    pthread_t             rotator;
+    unsigned long         allocs_start;
+    double                start;
+    unsigned              started;
+    unsigned              i;
+    unsigned              g;
+    int                   return_value;
+
+    memset(bench, 0, sizeof(*bench));
+    bench->use_rwlock = use_rwlock;
+    for(i = 0; i < KEY_SET_BENCH_KEYS; i++) {
+        snprintf(bench->kids[i], sizeof(bench->kids[i]), "kid-%02u", i);
+        for(g = 0; g < 2; g++) {
+            bench->entries[g][i].kid              = q_useful_buf_from_sz(bench->kids[i]);
+            bench->entries[g][i].key.crypto_lib   = T_COSE_CRYPTO_LIB_UNIDENTIFIED;
+            bench->entries[g][i].key.k.key_handle = 1 + g * KEY_SET_BENCH_KEYS + i;
+        }
+    }
+    for(g = 0; g < 2; g++) {
+        t_cose_key_set_generation_init(&bench->generations[g], bench->entries[g], KEY_SET_BENCH_KEYS);
+    }
+
+    /* The generations belong to the benchmark so nothing to free */
+    t_cose_key_set_init(&bench->set, NULL, NULL);
+    t_cose_key_set_publish(&bench->set, &bench->generations[0]);
+    pthread_rwlock_init(&bench->rwlock, NULL);
+    bench->rwlock_current = &bench->generations[0];
+
+    if(pthread_create(&rotator, NULL, key_set_rotator_thread, NULL)) {
+        return -1;
+    }
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(started = 0; started < thread_count; started++) {
+        results[started] = T_COSE_SUCCESS;
+        if(pthread_create(&threads[started], NULL, key_set_reader_thread, &results[started])) {
+            break;
+        }
+    }
+    return_value = started == thread_count ? 0 : -1;
+    for(i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        if(results[i]) {
+            return_value = (int)results[i];
+        }
+    }
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = (unsigned long)started * KEY_SET_BENCH_ITERATIONS;
+
+    __atomic_store_n(&bench->stop, 1, __ATOMIC_RELAXED);
+    pthread_join(rotator, NULL);
+    t_cose_key_set_destroy(&bench->set);
+    pthread_rwlock_destroy(&bench->rwlock);
+
+    /* Rotating is the point so it is a failure if it didn't happen */
+    if(return_value == 0 && bench->publishes == 0) {
+        return_value = -2;
+    }
+
+    return return_value;
+}
+
+
+static int bench_key_set_1_thread(struct bench_result *r)
+{
+    return bench_key_set(1, false, r);
+}
+
+static int bench_key_set_2_threads(struct bench_result *r)
+{
+    return bench_key_set(2, false, r);
+}
+
+static int bench_key_set_4_threads(struct bench_result *r)
+{
+    return bench_key_set(4, false, r);
+}
+
+static int bench_key_set_8_threads(struct bench_result *r)
+{
+    return bench_key_set(8, false, r);
+}
+
+static int bench_key_set_16_threads(struct bench_result *r)
+{
+    return bench_key_set(16, false, r);
+}
+
+static int bench_key_set_32_threads(struct bench_result *r)
+{
+    return bench_key_set(32, false, r);
+}
+
+static int bench_key_set_64_threads(struct bench_result *r)
+{
+    return bench_key_set(KEY_SET_BENCH_MAX_THREADS, false, r);
+}
+
+static int bench_key_set_rwlock_1_thread(struct bench_result *r)
+{
+    return bench_key_set(1, true, r);
+}
+
+static int bench_key_set_rwlock_8_threads(struct bench_result *r)
+{
+    return bench_key_set(8, true, r);
+}
+
+static int bench_key_set_rwlock_64_threads(struct bench_result *r)
+{
+    return bench_key_set(KEY_SET_BENCH_MAX_THREADS, true, r);
+}
+
+#endif /* T_COSE_ENABLE_KEY_SET */
+
+
+static int bench_sign_es256(struct bench_result *r)
+{
+    return bench_sign(T_COSE_ALGORITHM_ES256, false, r);
+}
+
+static int bench_verify_es256(struct bench_result *r)
+{
+    return bench_verify(T_COSE_ALGORITHM_ES256, false, r);
+}
+
+static int bench_verify_batch_es256(struct bench_result *r)
+{
+    return bench_verify_batch(T_COSE_ALGORITHM_ES256, r);
+}
+
+static int bench_sign_es256_prepared(struct bench_result *r)
+{
+    return bench_sign(T_COSE_ALGORITHM_ES256, true, r);
+}
+
+static int bench_verify_es256_prepared(struct bench_result *r)
+{
+    return bench_verify(T_COSE_ALGORITHM_ES256, true, r);
+}
+
+#ifndef T_COSE_DISABLE_ES512
+static int bench_sign_es512(struct bench_result *r)
+{
+    return bench_sign(T_COSE_ALGORITHM_ES512, false, r);
+}
+
+static int bench_verify_es512(struct bench_result *r)
+{
+    return bench_verify(T_COSE_ALGORITHM_ES512, false, r);
+}
+#endif /* T_COSE_DISABLE_ES512 */
+
+#ifdef T_COSE_ENABLE_ASYNC
+
+static struct t_cose_async_request s_async_requests[BENCH_ITERATIONS];
+static uint8_t                     s_async_buffers[BENCH_ITERATIONS][300];
+static struct t_cose_async_pool    s_async_pool;
+
+
+static void async_done(void *done_ctx, struct t_cose_async_request *request)
+{
+    if(t_cose_async_request_error(request)) {
+        __atomic_add_fetch((unsigned long *)done_ctx, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Sign or verify on a thread pool with the given number of workers.
+ * When the queues are full, wait for them to empty.
+ */
+static int bench_async(unsigned             worker_count,
+                       bool                 sign,
+                       struct bench_result *r)
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_async_executor   executor;
+    struct t_cose_key              key_pair;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    unsigned long                  failures;
+    unsigned long                  allocs_start;
+    double                         start;
+    unsigned long                  i;
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return (int)result;
+    }
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(s_payload_bytes),
+                               signed_cose_buffer,
+                              &signed_cose);
+    if(result) {
+        goto Done;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    result = t_cose_async_pool_start(&s_async_pool, worker_count);
+    if(result) {
+        goto Done;
+    }
+    executor = t_cose_async_pool_executor(&s_async_pool);
+    failures = 0;
+
+    allocs_start = s_alloc_count;
+    start        = now_us();
+    for(i = 0; i < BENCH_ITERATIONS; i++) {
+        if(sign) {
+            t_cose_async_sign_request_init(&s_async_requests[i],
+                                           &sign_ctx,
+                                           NULL_Q_USEFUL_BUF_C,
+                                           Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(s_payload_bytes),
+                                           Q_USEFUL_BUF_FROM_BYTE_ARRAY(s_async_buffers[i]),
+                                           async_done,
+                                           &failures);
+        } else {
+            t_cose_async_verify_request_init(&s_async_requests[i],
+                                             &verify_ctx,
+                                             signed_cose,
+                                             NULL_Q_USEFUL_BUF_C,
+                                             async_done,
+                                             &failures);
+        }
+        result = t_cose_async_submit(&executor, &s_async_requests[i]);
+        if(result == T_COSE_ERR_QUEUE_FULL) {
+            t_cose_async_pool_wait(&s_async_pool);
+            result = t_cose_async_submit(&executor, &s_async_requests[i]);
+        }
+        if(result) {
+            break;
+        }
+    }
+    t_cose_async_pool_wait(&s_async_pool);
+    r->elapsed_us = now_us() - start;
+    r->allocs     = s_alloc_count - allocs_start;
+    r->iterations = BENCH_ITERATIONS;
+
+    t_cose_async_pool_stop(&s_async_pool);
+    if(result == T_COSE_SUCCESS && failures) {
+        result = T_COSE_ERR_FAIL;
+    }
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return (int)result;
+}
+
+static int bench_async_sign_1_worker(struct bench_result *r)
+{
+    return bench_async(1, true, r);
+}
+
+static int bench_async_sign_2_workers(struct bench_result *r)
+{
+    return bench_async(2, true, r);
+}
+
+static int bench_async_sign_4_workers(struct bench_result *r)
+{
+    return bench_async(4, true, r);
+}
+
+static int bench_async_sign_8_workers(struct bench_result *r)
+{
+    return bench_async(8, true, r);
+}
+
+static int bench_async_verify_1_worker(struct bench_result *r)
+{
+    return bench_async(1, false, r);
+}
+
+static int bench_async_verify_2_workers(struct bench_result *r)
+{
+    return bench_async(2, false, r);
+}
+
+static int bench_async_verify_4_workers(struct bench_result *r)
+{
+    return bench_async(4, false, r);
+}
+
+static int bench_async_verify_8_workers(struct bench_result *r)
+{
+    return bench_async(8, false, r);
+}
+
+#endif /* T_COSE_ENABLE_ASYNC */
+
+
+typedef int (bench_fn)(struct bench_result *);
+
+struct bench_entry {
+    const char *name;
+    bench_fn   *bench;
+};
+
+#define BENCH_ENTRY(bench_name) {#bench_name, bench_name}
+
+static const struct bench_entry s_benches[] = {
+    BENCH_ENTRY(bench_sign_es256),
+    BENCH_ENTRY(bench_verify_es256),
+    BENCH_ENTRY(bench_verify_batch_es256),
+    BENCH_ENTRY(bench_sign_es256_prepared),
+    BENCH_ENTRY(bench_verify_es256_prepared),
+#ifndef T_COSE_DISABLE_ES512
+    BENCH_ENTRY(bench_sign_es512),
+    BENCH_ENTRY(bench_verify_es512),
+#endif /* T_COSE_DISABLE_ES512 */
+    BENCH_ENTRY(bench_hash_1_thread),
+    BENCH_ENTRY(bench_hash_2_threads),
+    BENCH_ENTRY(bench_hash_4_threads),
+    BENCH_ENTRY(bench_hash_8_threads),
+    BENCH_ENTRY(bench_sha256_b_con),
+    BENCH_ENTRY(bench_sha256_openssl),
+    BENCH_ENTRY(bench_sha256_batch),
+#ifdef T_COSE_ENABLE_KEY_SET
+    BENCH_ENTRY(bench_key_set_1_thread),
+    BENCH_ENTRY(bench_key_set_2_threads),
+    BENCH_ENTRY(bench_key_set_4_threads),
+    BENCH_ENTRY(bench_key_set_8_threads),
+    BENCH_ENTRY(bench_key_set_16_threads),
+    BENCH_ENTRY(bench_key_set_32_threads),
+    BENCH_ENTRY(bench_key_set_64_threads),
+    BENCH_ENTRY(bench_key_set_rwlock_1_thread),
+    BENCH_ENTRY(bench_key_set_rwlock_8_threads),
+    BENCH_ENTRY(bench_key_set_rwlock_64_threads),
+#endif /* T_COSE_ENABLE_KEY_SET */
+#ifdef T_COSE_ENABLE_ASYNC
+    BENCH_ENTRY(bench_async_sign_1_worker),
+    BENCH_ENTRY(bench_async_sign_2_workers),
+    BENCH_ENTRY(bench_async_sign_4_workers),
+    BENCH_ENTRY(bench_async_sign_8_workers),
+    BENCH_ENTRY(bench_async_verify_1_worker),
+    BENCH_ENTRY(bench_async_verify_2_workers),
+    BENCH_ENTRY(bench_async_verify_4_workers),
+    BENCH_ENTRY(bench_async_verify_8_workers),
+#endif /* T_COSE_ENABLE_ASYNC */
+};
+
+
+static int is_selected(const char *name, int argc, const char *argv[])
+{
+    int i;
+
+    if(argc < 2) {
+        return 1;
+    }
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    struct bench_result result;
+    size_t              i;
+    int                 error;
+    int                 return_value = 0;
+
+    /* Must be before anything else touches OpenSSL */
+    if(!CRYPTO_set_mem_functions(counting_malloc, counting_realloc, counting_free)) {
+        printf("Could not install allocation counters\n");
+        return 1;
+    }
+
+    for(i = 0; i < sizeof(s_benches)/sizeof(s_benches[0]); i++) {
+        if(!is_selected(s_benches[i].name, argc, argv)) {
+            continue;
+        }
+        memset(&result, 0, sizeof(result));
+        error = (*s_benches[i].bench)(&result);
+        if(error) {
+            printf("%-32s FAILED (%d)\n", s_benches[i].name, error);
+            return_value = 1;
+            continue;
+        }
+        print_result(s_benches[i].name, &result);
+    }
+
+    return return_value;
+}
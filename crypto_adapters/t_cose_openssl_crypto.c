@@ -13,9 +13,14 @@
 
 #include "t_cose_crypto.h" /* The interface this code implements */
 
-#include <openssl/ecdsa.h> /* Needed for signature format conversion */
+#include <string.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/x509.h>
+#include "t_cose_sha256_mb.h" /* Multi-buffer SHA-256 for hash batches */
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+#include <pthread.h>
+#endif
 
 
 /**
@@ -50,8 +55,18 @@
  * The APIs that fit the above only work for DER-encoded signatures.
  * t_cose encodes signatures in a more simple way. This difference
  * requires the code here to do conversion which increases its size
- * and complexity and requires intermediate buffers and requires more
- * use of malloc.
+ * and complexity and requires intermediate buffers. The conversion
+ * is done here on stack buffers rather than with the OpenSSL
+ * ECDSA_SIG and BIGNUM APIs because those allocate memory several
+ * times per signature.
+ *
+ * Making and initializing an EVP_PKEY_CTX for every signature
+ * allocates and processes the key each time. With
+ * T_COSE_ENABLE_OPENSSL_CTX_CACHE defined a few initialized contexts
+ * are kept per thread, keyed by EVP_PKEY, so repeated operations with
+ * the same key skip that. See pkey_ctx_get(). In the same way the
+ * hash algorithms are fetched once per thread and hash contexts are
+ * reused rather than freed. See digest_get() and md_ctx_get().
  *
  * An older version of t_cose (anything from 2021) uses simpler
  * OpenSSL APIs. They still work but may be deprecated in the
@@ -61,6 +76,118 @@
  */
 
 
+/* DER tags and lengths for the ECDSA-Sig-Value structure from RFC 3279:
+ *
+ *   ECDSA-Sig-Value ::= SEQUENCE { r INTEGER, s INTEGER }
+ *
+ * With keys of at most 66 bytes an INTEGER is at most 67 bytes and
+ * always has a one-byte length. The SEQUENCE is at most 138 bytes
+ * so it has a one-byte length or a one-byte length after 0x81.
+ */
+#define DER_TAG_SEQUENCE     0x30
+#define DER_TAG_INTEGER      0x02
+#define DER_LENGTH_ONE_BYTE  0x81
+
+
+/**
+ * \brief Decode one DER INTEGER into a fixed-size big-endian number.
+ *
+ * \param[in,out] der   The DER to decode from. It is advanced past
+ *                      the INTEGER.
+ * \param[in] out       Where to put the number, zero padded on the
+ *                      left. Its length is the size of the number.
+ *
+ * \return 0 on success, non-zero if the DER is not a valid positive
+ *         INTEGER that fits.
+ */
+static int
+der_decode_integer(struct q_useful_buf_c *der, struct q_useful_buf out)
+{
+    const uint8_t *bytes = der->ptr;
+    size_t         int_len;
+
+    if(der->len < 2 || bytes[0] != DER_TAG_INTEGER) {
+        return 1;
+    }
+    int_len = bytes[1];
+    if(int_len == 0 || int_len >= 0x80 || int_len > der->len - 2) {
+        return 1;
+    }
+    bytes += 2;
+    *der = (struct q_useful_buf_c){bytes + int_len, der->len - 2 - int_len};
+
+    if(bytes[0] & 0x80) {
+        /* Negative numbers are never valid for r or s */
+        return 1;
+    }
+    /* Remove the leading zeros, including the one that keeps the top
+     * bit from being a sign bit. */
+    while(int_len > 0 && bytes[0] == 0) {
+        bytes++;
+        int_len--;
+    }
+    if(int_len > out.len) {
+        return 1;
+    }
+
+    memset(out.ptr, 0, out.len - int_len);
+    memcpy((uint8_t *)out.ptr + out.len - int_len, bytes, int_len);
+
+    return 0;
+}
+
+
+/**
+ * \brief Encode a fixed-size big-endian number as a DER INTEGER.
+ *
+ * \param[in] number  The number. Leading zeros are allowed.
+ * \param[in] out     Where to write. It must be big enough, which
+ *                    is checked by the caller.
+ *
+ * \return The number of bytes written.
+ */
+static size_t
+der_encode_integer(struct q_useful_buf_c number, uint8_t *out)
+{
+    const uint8_t *bytes = number.ptr;
+    size_t         len   = number.len;
+    size_t         pad;
+
+    /* Minimal encoding, but there is always at least one byte */
+    while(len > 1 && bytes[0] == 0) {
+        bytes++;
+        len--;
+    }
+    /* A leading zero is needed if the top bit is set so the number
+     * isn't taken as negative. */
+    pad = (bytes[0] & 0x80) ? 1 : 0;
+
+    out[0] = DER_TAG_INTEGER;
+    out[1] = (uint8_t)(len + pad);
+    out[2] = 0;
+    memcpy(out + 2 + pad, bytes, len);
+
+    return 2 + pad + len;
+}
+
+
+/**
+ * \brief Size of a DER INTEGER encoded by der_encode_integer().
+ */
+static size_t
+der_integer_size(struct q_useful_buf_c number)
+{
+    const uint8_t *bytes = number.ptr;
+    size_t         len   = number.len;
+
+    while(len > 1 && bytes[0] == 0) {
+        bytes++;
+        len--;
+    }
+    return 2 + ((bytes[0] & 0x80) ? 1u : 0u) + len;
+}
+
+
 /**
  * \brief Convert DER-encoded signature to COSE-serialized signature
  *
@@ -75,68 +202,48 @@
  * 8.1. The signature which consist of two integers, r and s,
  * are simply zero padded to the nearest byte length and
  * concatenated.
+ *
+ * The DER is decoded directly rather than through an \c ECDSA_SIG
+ * and \c BIGNUMs so there is no memory allocation.
  */
 static inline struct q_useful_buf_c
 signature_der_to_cose(unsigned               key_len,
                       struct q_useful_buf_c  der_signature,
                       struct q_useful_buf    signature_buffer)
 {
-    size_t                r_len;
-    size_t                s_len;
-    const BIGNUM         *r_bn;
-    const BIGNUM         *s_bn;
-    struct q_useful_buf_c cose_signature;
-    void                 *r_start_ptr;
-    void                 *s_start_ptr;
-    const unsigned char  *temp_der_sig_pointer;
-    ECDSA_SIG            *es;
+    const uint8_t        *bytes = der_signature.ptr;
+    size_t                seq_len;
+    struct q_useful_buf_c der;
 
-    /* Put DER-encode sig into an ECDSA_SIG so we can get the r and s out. */
-    temp_der_sig_pointer = der_signature.ptr;
-    es = d2i_ECDSA_SIG(NULL, &temp_der_sig_pointer, (long)der_signature.len);
-    if(es == NULL) {
-        cose_signature = NULL_Q_USEFUL_BUF_C;
-        goto Done;
+    if(signature_buffer.len < 2 * (size_t)key_len) {
+        return NULL_Q_USEFUL_BUF_C;
     }
 
-    /* Zero the buffer so that bytes r and s are padded with zeros */
-    q_useful_buf_set(signature_buffer, 0);
-
-    /* Get the signature r and s as BIGNUMs */
-    r_bn = NULL;
-    s_bn = NULL;
-    ECDSA_SIG_get0(es, &r_bn, &s_bn);
-    /* ECDSA_SIG_get0 returns void */
-
-
-    /* Internal consistency check that the r and s values will fit
-     * into the expected size. Be sure the output buffer is not
-     * overrun.
-     */
-    /* Cast is safe because BN_num_bytes() is documented to not return
-     * negative numbers.
-     */
-    r_len = (size_t)BN_num_bytes(r_bn);
-    s_len = (size_t)BN_num_bytes(s_bn);
-    if(r_len + s_len > signature_buffer.len) {
-        cose_signature = NULL_Q_USEFUL_BUF_C;
-        goto Done2;
+    /* The SEQUENCE head */
+    if(der_signature.len < 2 || bytes[0] != DER_TAG_SEQUENCE) {
+        return NULL_Q_USEFUL_BUF_C;
+    }
+    if(bytes[1] < 0x80) {
+        seq_len = bytes[1];
+        der = (struct q_useful_buf_c){bytes + 2, der_signature.len - 2};
+    } else if(bytes[1] == DER_LENGTH_ONE_BYTE && der_signature.len >= 3) {
+        seq_len = bytes[2];
+        der = (struct q_useful_buf_c){bytes + 3, der_signature.len - 3};
+    } else {
+        return NULL_Q_USEFUL_BUF_C;
+    }
+    if(seq_len != der.len) {
+        return NULL_Q_USEFUL_BUF_C;
     }
 
-    /* Copy r and s of signature to output buffer and set length */
-    r_start_ptr = (uint8_t *)(signature_buffer.ptr) + key_len - r_len;
-    BN_bn2bin(r_bn, r_start_ptr);
-
-    s_start_ptr = (uint8_t *)signature_buffer.ptr + 2 * key_len - s_len;
-    BN_bn2bin(s_bn, s_start_ptr);
-
-    cose_signature = (UsefulBufC){signature_buffer.ptr, 2 * key_len};
-
-Done2:
-    ECDSA_SIG_free(es);
+    /* r then s, each zero padded to the key length */
+    if(der_decode_integer(&der, (struct q_useful_buf){signature_buffer.ptr, key_len}) ||
+       der_decode_integer(&der, (struct q_useful_buf){(uint8_t *)signature_buffer.ptr + key_len, key_len}) ||
+       der.len != 0) {
+        return NULL_Q_USEFUL_BUF_C;
+    }
 
-Done:
-    return cose_signature;
+    return (struct q_useful_buf_c){signature_buffer.ptr, 2 * (size_t)key_len};
 }
 
 
@@ -157,8 +264,8 @@ Done:
  *
  * OpenSSL has a preference for DER-encoded signatures.
  *
- * This uses an ECDSA_SIG as an intermediary to convert
- * between the two.
+ * The DER is written directly into \c buffer rather than through an
+ * \c ECDSA_SIG and \c BIGNUMs so there is no memory allocation.
  */
 static enum t_cose_err_t
 signature_cose_to_der(unsigned                key_len,
@@ -166,101 +273,45 @@ signature_cose_to_der(unsigned                key_len,
                       struct q_useful_buf     buffer,
                       struct q_useful_buf_c  *der_signature)
 {
-    enum t_cose_err_t return_value;
-    BIGNUM           *signature_r_bn = NULL;
-    BIGNUM           *signature_s_bn = NULL;
-    int               ossl_result;
-    ECDSA_SIG        *signature;
-    unsigned char    *der_signature_ptr;
-    int               der_signature_len;
+    struct q_useful_buf_c r;
+    struct q_useful_buf_c s;
+    size_t                seq_len;
+    size_t                head_len;
+    uint8_t              *out;
 
     /* Check the signature length against expected */
-    if(cose_signature.len != key_len * 2) {
-        return_value = T_COSE_ERR_SIG_VERIFY;
-        goto Done;
-    }
-
-    /* Put the r and the s from the signature into big numbers */
-    signature_r_bn = BN_bin2bn(cose_signature.ptr, (int)key_len, NULL);
-    if(signature_r_bn == NULL) {
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
+    if(key_len == 0 || cose_signature.len != key_len * 2) {
+        return T_COSE_ERR_SIG_VERIFY;
     }
 
-    signature_s_bn = BN_bin2bn(((const uint8_t *)cose_signature.ptr)+key_len,
-                                    (int)key_len,
-                                    NULL);
-    if(signature_s_bn == NULL) {
-        BN_free(signature_r_bn);
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
-    }
-
-    /* Put the signature bytes into an ECDSA_SIG */
-    signature = ECDSA_SIG_new();
-    if(signature == NULL) {
-        /* Don't leak memory in error condition */
-        BN_free(signature_r_bn);
-        BN_free(signature_s_bn);
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
-    }
-
-    /* Put the r and s bignums into an ECDSA_SIG. Freeing
-     * ossl_sig_to_verify will now free r and s.
-     */
-    ossl_result = ECDSA_SIG_set0(signature,
-                                 signature_r_bn,
-                                 signature_s_bn);
-    if(ossl_result != 1) {
-        BN_free(signature_r_bn);
-        BN_free(signature_s_bn);
-        return_value = T_COSE_ERR_SIG_FAIL;
-        goto Done;
-    }
+    r = (struct q_useful_buf_c){cose_signature.ptr, key_len};
+    s = (struct q_useful_buf_c){(const uint8_t *)cose_signature.ptr + key_len, key_len};
 
-    /* Now output the ECDSA_SIG structure in DER format.
-     *
-     * Code safety is the priority here.  i2d_ECDSA_SIG() has two
-     * output buffer modes, one where it just writes to the buffer
-     * given and the other were it allocates memory.  It would be
-     * better to avoid the allocation, but the copy mode is not safe
-     * because you can't give it a buffer length. This is bad stuff
-     * from last century.
-     *
-     * So the allocation mode is used on the presumption that it is
-     * safe and correct even though there is more copying and memory
-     * use.
-     */
-    der_signature_ptr = NULL;
-    der_signature_len = i2d_ECDSA_SIG(signature, &der_signature_ptr);
-    ECDSA_SIG_free(signature);
-    if(der_signature_len < 0) {
-        return_value = T_COSE_ERR_SIG_FAIL;
-        goto Done;
+    seq_len  = der_integer_size(r) + der_integer_size(s);
+    head_len = seq_len < 0x80 ? 2 : 3;
+    if(seq_len > 0xff || head_len + seq_len > buffer.len) {
+        return T_COSE_ERR_SIG_FAIL;
     }
 
-    *der_signature = q_useful_buf_copy_ptr(buffer,
-                                           der_signature_ptr,
-                                           (size_t)der_signature_len);
-    if(q_useful_buf_c_is_null_or_empty(*der_signature)) {
-        return_value = T_COSE_ERR_SIG_FAIL;
-        goto Done;
+    out = buffer.ptr;
+    *out++ = DER_TAG_SEQUENCE;
+    if(head_len == 3) {
+        *out++ = DER_LENGTH_ONE_BYTE;
     }
+    *out++ = (uint8_t)seq_len;
+    out += der_encode_integer(r, out);
+    der_encode_integer(s, out);
 
-    OPENSSL_free(der_signature_ptr);
-
-    return_value = T_COSE_SUCCESS;
+    *der_signature = (struct q_useful_buf_c){buffer.ptr, head_len + seq_len};
 
-Done:
-    /* All the memory frees happen along the way in the code above. */
-    return return_value;
+    return T_COSE_SUCCESS;
 }
 
 
 /**
  * \brief Common checks and conversions for signing and verification key.
  *
+ * \param[in] cose_algorithm_id          The algorithm the key is for.
  * \param[in] t_cose_key                 The key to check and convert.
  * \param[out] return_ossl_ec_key        The OpenSSL key in memory.
  * \param[out] return_key_size_in_bytes  How big the key is.
@@ -270,16 +321,33 @@ Done:
  * It pulls the OpenSSL key out of \c t_cose_key and checks
  * it and figures out the number of bytes in the key rounded up. This
  * is also the size of r and s in the signature.
+ *
+ * For a prepared key the checks and size were done by
+ * t_cose_crypto_prepare_key() so only the algorithm is checked.
  */
 static enum t_cose_err_t
-key_convert_and_size(struct t_cose_key  t_cose_key,
+key_convert_and_size(int32_t            cose_algorithm_id,
+                     struct t_cose_key  t_cose_key,
                      EVP_PKEY         **return_ossl_ec_key,
                      unsigned          *return_key_size_in_bytes)
 {
-    enum t_cose_err_t  return_value;
-    int                key_len_bits; /* type unsigned is conscious choice */
-    unsigned           key_len_bytes; /* type unsigned is conscious choice */
-    EVP_PKEY          *ossl_ec_key;
+    enum t_cose_err_t                 return_value;
+    int                               key_len_bits; /* type unsigned is conscious choice */
+    unsigned                          key_len_bytes; /* type unsigned is conscious choice */
+    EVP_PKEY                         *ossl_ec_key;
+    const struct t_cose_prepared_key *prepared;
+
+    prepared = t_cose_crypto_prepared_key(t_cose_key);
+    if(prepared != NULL) {
+        if(prepared->cose_algorithm_id != cose_algorithm_id) {
+            return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+            goto Done;
+        }
+        *return_key_size_in_bytes = prepared->coordinate_size;
+        *return_ossl_ec_key = (EVP_PKEY *)prepared->key.k.key_ptr;
+        return_value = T_COSE_SUCCESS;
+        goto Done;
+    }
 
     /* Check the signing key and get it out of the union */
     if(t_cose_key.crypto_lib != T_COSE_CRYPTO_LIB_OPENSSL) {
@@ -327,15 +395,738 @@ enum t_cose_err_t t_cose_crypto_sig_size(int32_t           cose_algorithm_id,
         goto Done;
     }
 
-    return_value = key_convert_and_size(signing_key, &signing_key_evp, &key_len_bytes);
-    if(return_value != T_COSE_SUCCESS) {
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        signing_key,
+                                        &signing_key_evp,
+                                        &key_len_bytes);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* Double because signature is made of up r and s values */
+    *sig_size = key_len_bytes * 2;
+
+    return_value = T_COSE_SUCCESS;
+
+Done:
+    return return_value;
+}
+
+
+/* Which kind of operation an EVP_PKEY_CTX is initialized for */
+#define PKEY_CTX_SIGN   0
+#define PKEY_CTX_VERIFY 1
+
+/* Index of each hash for the digests cached per thread */
+#define DIGEST_INDEX_SHA_256 0
+#define DIGEST_INDEX_SHA_384 1
+#define DIGEST_INDEX_SHA_512 2
+#define DIGEST_COUNT         3
+
+
+/**
+ * \brief Make an EVP_PKEY_CTX and initialize it for signing or verifying.
+ *
+ * \param[in] key        The key.
+ * \param[in] operation  \c PKEY_CTX_SIGN or \c PKEY_CTX_VERIFY.
+ * \param[out] ctx       The new context.
+ *
+ * \return Error or \ref T_COSE_SUCCESS.
+ */
+static enum t_cose_err_t
+pkey_ctx_new(EVP_PKEY *key, int operation, EVP_PKEY_CTX **ctx)
+{
+    EVP_PKEY_CTX *new_ctx;
+    int           ossl_result;
+
+    new_ctx = EVP_PKEY_CTX_new(key, NULL);
+    if(new_ctx == NULL) {
+        return T_COSE_ERR_INSUFFICIENT_MEMORY;
+    }
+
+    if(operation == PKEY_CTX_SIGN) {
+        ossl_result = EVP_PKEY_sign_init(new_ctx);
+    } else {
+        ossl_result = EVP_PKEY_verify_init(new_ctx);
+    }
+    if(ossl_result != 1) {
+        EVP_PKEY_CTX_free(new_ctx);
+        return T_COSE_ERR_SIG_FAIL;
+    }
+
+    *ctx = new_ctx;
+
+    return T_COSE_SUCCESS;
+}
+
+
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+
+/* The number of keys each thread keeps contexts for */
+#ifndef T_COSE_OPENSSL_CTX_CACHE_SIZE
+#define T_COSE_OPENSSL_CTX_CACHE_SIZE 4
+#endif
+
+/* The number of finished hash contexts each thread keeps for reuse */
+#ifndef T_COSE_OPENSSL_MD_CTX_POOL_SIZE
+#define T_COSE_OPENSSL_MD_CTX_POOL_SIZE 4
+#endif
+
+/*
+ * The contexts for one key. Each context holds a reference to the
+ * key, so while either is non-NULL \c key can't be freed and its
+ * address can't be reused for another key.
+ */
+struct pkey_ctx_cache_entry {
+    EVP_PKEY      *key;
+    EVP_PKEY_CTX  *ctx[2]; /* Indexed by PKEY_CTX_SIGN / PKEY_CTX_VERIFY */
+    unsigned long  last_use;
+};
+
+/*
+ * The cache for one thread. It is only ever touched by its thread so
+ * there is no locking.
+ */
+struct thread_cache {
+    unsigned long               epoch;
+    unsigned long               use_count;
+    struct pkey_ctx_cache_entry entries[T_COSE_OPENSSL_CTX_CACHE_SIZE];
+
+    /* Fetched the first time each is used so later hashes don't go
+     * through the OpenSSL 3 provider store */
+    EVP_MD                     *digests[DIGEST_COUNT];
+
+    /* Hash contexts whose algorithm context is reused rather than
+     * freed and allocated again */
+    size_t                      md_ctx_pool_count;
+    EVP_MD_CTX                 *md_ctx_pool[T_COSE_OPENSSL_MD_CTX_POOL_SIZE];
+};
+
+static pthread_once_t s_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  s_cache_key;
+static int            s_cache_key_made;
+
+/* Bumped by t_cose_crypto_release_key_cache(). A thread empties its
+ * cache when this differs from the epoch its cache was filled in. */
+static unsigned long  s_cache_epoch;
+
+
+static void
+pkey_ctx_cache_flush(struct thread_cache *cache)
+{
+    size_t i;
+
+    for(i = 0; i < T_COSE_OPENSSL_CTX_CACHE_SIZE; i++) {
+        /* EVP_PKEY_CTX_free() checks for NULL */
+        EVP_PKEY_CTX_free(cache->entries[i].ctx[PKEY_CTX_SIGN]);
+        EVP_PKEY_CTX_free(cache->entries[i].ctx[PKEY_CTX_VERIFY]);
+        cache->entries[i] = (struct pkey_ctx_cache_entry){NULL, {NULL, NULL}, 0};
+    }
+}
+
+
+/* Called by pthreads when a thread with a cache exits */
+static void
+thread_cache_destroy(void *cache_ptr)
+{
+    struct thread_cache *cache = cache_ptr;
+    size_t               i;
+
+    pkey_ctx_cache_flush(cache);
+    for(i = 0; i < cache->md_ctx_pool_count; i++) {
+        EVP_MD_CTX_free(cache->md_ctx_pool[i]);
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    for(i = 0; i < DIGEST_COUNT; i++) {
+        /* EVP_MD_free() checks for NULL */
+        EVP_MD_free(cache->digests[i]);
+    }
+#endif
+    OPENSSL_free(cache);
+}
+
+
+static void
+thread_cache_make_key(void)
+{
+    s_cache_key_made = pthread_key_create(&s_cache_key, thread_cache_destroy) == 0;
+}
+
+
+/**
+ * \brief Get the calling thread's cache.
+ *
+ * \param[in] create  Whether to make the cache if the thread has none.
+ *
+ * \return The cache or \c NULL.
+ *
+ * The cache is emptied first if t_cose_crypto_release_key_cache()
+ * has been called since it was last used.
+ */
+static struct thread_cache *
+thread_cache_get(int create)
+{
+    struct thread_cache *cache;
+    unsigned long        epoch;
+
+    if(pthread_once(&s_cache_once, thread_cache_make_key) != 0 || !s_cache_key_made) {
+        return NULL;
+    }
+
+    epoch = __atomic_load_n(&s_cache_epoch, __ATOMIC_ACQUIRE);
+
+    cache = pthread_getspecific(s_cache_key);
+    if(cache == NULL) {
+        if(!create) {
+            return NULL;
+        }
+        cache = OPENSSL_zalloc(sizeof(struct thread_cache));
+        if(cache == NULL) {
+            return NULL;
+        }
+        if(pthread_setspecific(s_cache_key, cache) != 0) {
+            OPENSSL_free(cache);
+            return NULL;
+        }
+        cache->epoch = epoch;
+    }
+
+    if(cache->epoch != epoch) {
+        pkey_ctx_cache_flush(cache);
+        cache->epoch = epoch;
+    }
+
+    return cache;
+}
+
+
+/**
+ * \brief Find or make the cached context for a key.
+ *
+ * \param[in] cache      The calling thread's cache.
+ * \param[in] key        The key.
+ * \param[in] operation  \c PKEY_CTX_SIGN or \c PKEY_CTX_VERIFY.
+ * \param[out] ctx       The context.
+ *
+ * \return Error or \ref T_COSE_SUCCESS.
+ *
+ * When all the entries are in use the least recently used is
+ * replaced.
+ */
+static enum t_cose_err_t
+pkey_ctx_cache_lookup(struct thread_cache *cache,
+                      EVP_PKEY              *key,
+                      int                    operation,
+                      EVP_PKEY_CTX         **ctx)
+{
+    struct pkey_ctx_cache_entry *entry;
+    struct pkey_ctx_cache_entry *victim;
+    enum t_cose_err_t            return_value;
+    size_t                       i;
+
+    entry  = NULL;
+    victim = &cache->entries[0];
+    for(i = 0; i < T_COSE_OPENSSL_CTX_CACHE_SIZE; i++) {
+        if(cache->entries[i].key == key) {
+            entry = &cache->entries[i];
+            break;
+        }
+        if(cache->entries[i].last_use < victim->last_use) {
+            victim = &cache->entries[i];
+        }
+    }
+
+    if(entry == NULL) {
+        EVP_PKEY_CTX_free(victim->ctx[PKEY_CTX_SIGN]);
+        EVP_PKEY_CTX_free(victim->ctx[PKEY_CTX_VERIFY]);
+        *victim = (struct pkey_ctx_cache_entry){key, {NULL, NULL}, 0};
+        entry = victim;
+    }
+
+    if(entry->ctx[operation] == NULL) {
+        return_value = pkey_ctx_new(key, operation, &entry->ctx[operation]);
+        if(return_value != T_COSE_SUCCESS) {
+            if(entry->ctx[!operation] == NULL) {
+                /* Nothing holds the key so don't keep its address */
+                entry->key = NULL;
+            }
+            return return_value;
+        }
+    }
+
+    entry->last_use = ++cache->use_count;
+    *ctx = entry->ctx[operation];
+
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Get the calling thread's copy of a digest.
+ *
+ * \param[in] cache         The calling thread's cache.
+ * \param[in] digest_index  Which digest, \c DIGEST_INDEX_SHA_256...
+ * \param[in] nid           The OpenSSL NID of the digest.
+ *
+ * \return The digest or \c NULL if it can't be fetched.
+ */
+static const EVP_MD *
+thread_cache_digest(struct thread_cache *cache, int digest_index, int nid)
+{
+    if(cache->digests[digest_index] == NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        /* An explicit fetch is done once and kept. The digests
+         * returned by EVP_get_digestbynid() are fetched again
+         * implicitly by every EVP_DigestInit_ex(). */
+        cache->digests[digest_index] = EVP_MD_fetch(NULL, OBJ_nid2sn(nid), NULL);
+#else
+        /* Before OpenSSL 3 there is no fetching */
+        cache->digests[digest_index] = (EVP_MD *)EVP_get_digestbynid(nid);
+#endif
+    }
+
+    return cache->digests[digest_index];
+}
+
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+
+
+/**
+ * \brief Get an EVP_MD_CTX for a new hash.
+ *
+ * \return The context or \c NULL if out of memory.
+ *
+ * With T_COSE_ENABLE_OPENSSL_CTX_CACHE this reuses a context given
+ * back by md_ctx_put() in the same thread if there is one.
+ */
+static EVP_MD_CTX *
+md_ctx_get(void)
+{
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+    struct thread_cache *cache;
+
+    cache = thread_cache_get(1);
+    if(cache != NULL && cache->md_ctx_pool_count > 0) {
+        cache->md_ctx_pool_count--;
+        return cache->md_ctx_pool[cache->md_ctx_pool_count];
+    }
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+
+    return EVP_MD_CTX_new();
+}
+
+
+/**
+ * \brief Give back an EVP_MD_CTX from md_ctx_get().
+ *
+ * \param[in] md_ctx  The context. May be \c NULL.
+ *
+ * The context isn't reset so the next EVP_DigestInit_ex() with the
+ * same digest can reuse its algorithm context. It may be given back
+ * in a different thread from the one that got it.
+ */
+static void
+md_ctx_put(EVP_MD_CTX *md_ctx)
+{
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+    struct thread_cache *cache;
+
+    if(md_ctx == NULL) {
+        return;
+    }
+    cache = thread_cache_get(0);
+    if(cache != NULL && cache->md_ctx_pool_count < T_COSE_OPENSSL_MD_CTX_POOL_SIZE) {
+        cache->md_ctx_pool[cache->md_ctx_pool_count] = md_ctx;
+        cache->md_ctx_pool_count++;
+        return;
+    }
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+
+    EVP_MD_CTX_free(md_ctx);
+}
+
+
+/**
+ * \brief Get a digest.
+ *
+ * \param[in] digest_index  Which digest, \c DIGEST_INDEX_SHA_256...
+ * \param[in] nid           The OpenSSL NID of the digest.
+ *
+ * \return The digest or \c NULL if it is not supported.
+ */
+static const EVP_MD *
+digest_get(int digest_index, int nid)
+{
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+    struct thread_cache *cache;
+    const EVP_MD        *message_digest;
+
+    cache = thread_cache_get(1);
+    if(cache != NULL) {
+        message_digest = thread_cache_digest(cache, digest_index, nid);
+        if(message_digest != NULL) {
+            return message_digest;
+        }
+    }
+#else
+    (void)digest_index;
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+
+    return EVP_get_digestbynid(nid);
+}
+
+
+/**
+ * \brief Get the digest for a COSE hash algorithm.
+ *
+ * \param[in] cose_hash_alg_id  The COSE hash algorithm ID.
+ *
+ * \return The digest or \c NULL if it is not supported.
+ */
+static const EVP_MD *
+digest_for_hash_alg(int32_t cose_hash_alg_id)
+{
+    switch(cose_hash_alg_id) {
+
+    case COSE_ALGORITHM_SHA_256:
+        return digest_get(DIGEST_INDEX_SHA_256, NID_sha256);
+
+#ifndef T_COSE_DISABLE_ES384
+    case COSE_ALGORITHM_SHA_384:
+        return digest_get(DIGEST_INDEX_SHA_384, NID_sha384);
+#endif
+
+#ifndef T_COSE_DISABLE_ES512
+    case COSE_ALGORITHM_SHA_512:
+        return digest_get(DIGEST_INDEX_SHA_512, NID_sha512);
+#endif
+
+    default:
+        return NULL;
+    }
+}
+
+
+/**
+ * \brief Get an EVP_PKEY_CTX initialized for signing or verifying.
+ *
+ * \param[in] key           The key.
+ * \param[in] operation     \c PKEY_CTX_SIGN or \c PKEY_CTX_VERIFY.
+ * \param[out] ctx          The context to use.
+ * \param[out] ctx_to_free  What to pass to EVP_PKEY_CTX_free() when
+ *                          done. It is \c NULL when \c ctx is cached.
+ *
+ * \return Error or \ref T_COSE_SUCCESS.
+ *
+ * Without T_COSE_ENABLE_OPENSSL_CTX_CACHE this always makes a new
+ * context. With it the calling thread's cached context for the key
+ * is used, falling back to a new context if there is no cache.
+ */
+static enum t_cose_err_t
+pkey_ctx_get(EVP_PKEY      *key,
+             int            operation,
+             EVP_PKEY_CTX **ctx,
+             EVP_PKEY_CTX **ctx_to_free)
+{
+    enum t_cose_err_t return_value;
+
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+    struct thread_cache *cache;
+
+    cache = thread_cache_get(1);
+    if(cache != NULL) {
+        *ctx_to_free = NULL;
+        return pkey_ctx_cache_lookup(cache, key, operation, ctx);
+    }
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+
+    return_value = pkey_ctx_new(key, operation, ctx);
+    *ctx_to_free = return_value == T_COSE_SUCCESS ? *ctx : NULL;
+
+    return return_value;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_release_key_cache(struct t_cose_key key)
+{
+    /* Everything is emptied rather than just what is for this key as
+     * releasing a key is rare. */
+    (void)key;
+
+#ifdef T_COSE_ENABLE_OPENSSL_CTX_CACHE
+    /* Other threads' caches can't be touched from here. Bumping the
+     * epoch makes each of them empty itself the next time it is
+     * used. This thread's cache is emptied now. */
+    __atomic_add_fetch(&s_cache_epoch, 1, __ATOMIC_ACQ_REL);
+    (void)thread_cache_get(0);
+#endif /* T_COSE_ENABLE_OPENSSL_CTX_CACHE */
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_prepare_key(struct t_cose_key           key,
+                          struct t_cose_prepared_key *prepared)
+{
+    enum t_cose_err_t  return_value;
+    EVP_PKEY          *ossl_ec_key;
+    int32_t            cose_algorithm_id;
+    unsigned           key_len_bytes;
+
+    if(key.crypto_lib != T_COSE_CRYPTO_LIB_OPENSSL) {
+        return_value = T_COSE_ERR_INCORRECT_KEY_FOR_LIB;
+        goto Done;
+    }
+    if(key.k.key_ptr == NULL) {
+        return_value = T_COSE_ERR_EMPTY_KEY;
+        goto Done;
+    }
+    ossl_ec_key = (EVP_PKEY *)key.k.key_ptr;
+
+    if(EVP_PKEY_base_id(ossl_ec_key) != EVP_PKEY_EC) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    /* Only the curves that have a COSE ECDSA algorithm are
+     * accepted. The size in bits identifies them. */
+    switch(EVP_PKEY_bits(ossl_ec_key)) {
+    case 256: cose_algorithm_id = T_COSE_ALGORITHM_ES256; break;
+#ifndef T_COSE_DISABLE_ES384
+    case 384: cose_algorithm_id = T_COSE_ALGORITHM_ES384; break;
+#endif
+#ifndef T_COSE_DISABLE_ES512
+    case 521: cose_algorithm_id = T_COSE_ALGORITHM_ES512; break;
+#endif
+    default:
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        key,
+                                        &ossl_ec_key,
+                                        &key_len_bytes);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* OpenSSL 1.1 could precompute EC multiplication tables for a key
+     * with EC_KEY_precompute_mult(), but it is deprecated in OpenSSL 3
+     * and only helps multiplication by the generator which the
+     * built-in P-256 code already does with fixed tables. There is
+     * nothing more to keep here. */
+    prepared->key               = key;
+    prepared->cose_algorithm_id = cose_algorithm_id;
+    prepared->coordinate_size   = key_len_bytes;
+    prepared->sig_size          = key_len_bytes * 2;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * The DER encoding of a SubjectPublicKeyInfo up to the EC point for
+ * each curve, from RFC 5480. Appending the point makes a public key
+ * that d2i_PUBKEY() takes in every OpenSSL version without using the
+ * EC_KEY functions deprecated in OpenSSL 3.
+ */
+static const uint8_t spki_prefix_p256[] = {
+    0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d,
+    0x02, 0x01, 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01,
+    0x07, 0x03, 0x42, 0x00};
+#ifndef T_COSE_DISABLE_ES384
+static const uint8_t spki_prefix_p384[] = {
+    0x30, 0x76, 0x30, 0x10, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce, 0x3d,
+    0x02, 0x01, 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22, 0x03, 0x62,
+    0x00};
+#endif
+#ifndef T_COSE_DISABLE_ES512
+static const uint8_t spki_prefix_p521[] = {
+    0x30, 0x81, 0x9b, 0x30, 0x10, 0x06, 0x07, 0x2a, 0x86, 0x48, 0xce,
+    0x3d, 0x02, 0x01, 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23, 0x03,
+    0x81, 0x86, 0x00};
+#endif
+
+/* Big enough for the P-521 prefix and a 133 byte point */
+#define SPKI_MAX_SIZE 160
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_import_public_key(int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  public_key,
+                                struct t_cose_key     *key)
+{
+    enum t_cose_err_t  return_value;
+    const uint8_t     *prefix;
+    size_t             prefix_len;
+    size_t             coordinate_size;
+    uint8_t            spki[SPKI_MAX_SIZE];
+    const uint8_t     *spki_ptr;
+    EVP_PKEY          *ossl_key;
+
+    switch(cose_algorithm_id) {
+    case T_COSE_ALGORITHM_ES256:
+        prefix          = spki_prefix_p256;
+        prefix_len      = sizeof(spki_prefix_p256);
+        coordinate_size = 32;
+        break;
+#ifndef T_COSE_DISABLE_ES384
+    case T_COSE_ALGORITHM_ES384:
+        prefix          = spki_prefix_p384;
+        prefix_len      = sizeof(spki_prefix_p384);
+        coordinate_size = 48;
+        break;
+#endif
+#ifndef T_COSE_DISABLE_ES512
+    case T_COSE_ALGORITHM_ES512:
+        prefix          = spki_prefix_p521;
+        prefix_len      = sizeof(spki_prefix_p521);
+        coordinate_size = 66;
+        break;
+#endif
+    default:
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    /* Only uncompressed points. The prefixes encode their length. */
+    if(public_key.len != 1 + 2 * coordinate_size ||
+       ((const uint8_t *)public_key.ptr)[0] != 0x04) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    memcpy(spki, prefix, prefix_len);
+    memcpy(spki + prefix_len, public_key.ptr, public_key.len);
+
+    /* This checks the point is on the curve */
+    spki_ptr = spki;
+    ossl_key = d2i_PUBKEY(NULL, &spki_ptr, (long)(prefix_len + public_key.len));
+    if(ossl_key == NULL) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    key->crypto_lib = T_COSE_CRYPTO_LIB_OPENSSL;
+    key->k.key_ptr  = ossl_key;
+    return_value    = T_COSE_SUCCESS;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_free_key(struct t_cose_key key)
+{
+    /* Cached contexts hold their own reference to the EVP_PKEY so it
+     * isn't really freed, and its address isn't reused, until they
+     * are gone. */
+    EVP_PKEY_free((EVP_PKEY *)key.k.key_ptr);
+}
+
+
+/*
+ * Returns the length of the SubjectPublicKeyInfo prefix that spki
+ * starts with or 0 if it is not one of the supported curves.
+ */
+static size_t
+spki_prefix_len(const uint8_t *spki, size_t spki_len)
+{
+    static const struct {
+        const uint8_t *prefix;
+        size_t         len;
+    } prefixes[] = {
+        {spki_prefix_p256, sizeof(spki_prefix_p256)},
+#ifndef T_COSE_DISABLE_ES384
+        {spki_prefix_p384, sizeof(spki_prefix_p384)},
+#endif
+#ifndef T_COSE_DISABLE_ES512
+        {spki_prefix_p521, sizeof(spki_prefix_p521)},
+#endif
+    };
+    size_t i;
+
+    for(i = 0; i < sizeof(prefixes) / sizeof(prefixes[0]); i++) {
+        if(spki_len > prefixes[i].len &&
+           memcmp(spki, prefixes[i].prefix, prefixes[i].len) == 0) {
+            return prefixes[i].len;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_export_public_key(struct t_cose_key      key,
+                                struct q_useful_buf    buffer,
+                                struct q_useful_buf_c *public_key)
+{
+    enum t_cose_err_t                 return_value;
+    const struct t_cose_prepared_key *prepared;
+    EVP_PKEY                         *ossl_key;
+    uint8_t                           spki[SPKI_MAX_SIZE];
+    uint8_t                          *spki_ptr;
+    int                               spki_len;
+    size_t                            prefix_len;
+
+    prepared = t_cose_crypto_prepared_key(key);
+    if(prepared != NULL) {
+        key = prepared->key;
+    }
+    if(key.crypto_lib != T_COSE_CRYPTO_LIB_OPENSSL) {
+        return_value = T_COSE_ERR_INCORRECT_KEY_FOR_LIB;
+        goto Done;
+    }
+    ossl_key = (EVP_PKEY *)key.k.key_ptr;
+    if(ossl_key == NULL) {
+        return_value = T_COSE_ERR_EMPTY_KEY;
+        goto Done;
+    }
+
+    /* The SubjectPublicKeyInfo is the inverse of what is made in
+     * t_cose_crypto_import_public_key(). Its size is checked first
+     * because i2d_PUBKEY() doesn't know how big spki is. */
+    spki_len = i2d_PUBKEY(ossl_key, NULL);
+    if(spki_len <= 0 || spki_len > SPKI_MAX_SIZE) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+    spki_ptr = spki;
+    if(i2d_PUBKEY(ossl_key, &spki_ptr) != spki_len) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
         goto Done;
     }
 
-    /* Double because signature is made of up r and s values */
-    *sig_size = key_len_bytes * 2;
+    prefix_len = spki_prefix_len(spki, (size_t)spki_len);
+    if(prefix_len == 0) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
 
-    return_value = T_COSE_SUCCESS;
+    *public_key = q_useful_buf_copy(buffer,
+                                    (struct q_useful_buf_c){spki + prefix_len,
+                                                            (size_t)spki_len - prefix_len});
+    return_value = q_useful_buf_c_is_null(*public_key) ? T_COSE_ERR_TOO_SMALL :
+                                                         T_COSE_SUCCESS;
 
 Done:
     return return_value;
@@ -362,6 +1153,7 @@ t_cose_crypto_sign(const int32_t                cose_algorithm_id,
 
     enum t_cose_err_t      return_value;
     EVP_PKEY_CTX          *sign_context;
+    EVP_PKEY_CTX          *sign_context_to_free = NULL;
     EVP_PKEY              *signing_key_evp;
     int                    ossl_result;
     unsigned               key_size_bytes;
@@ -383,21 +1175,21 @@ t_cose_crypto_sign(const int32_t                cose_algorithm_id,
 
     /* Pull the pointer to the OpenSSL-format EVP_PKEY out of the
      * t_cose key structure and get the key size. */
-    return_value = key_convert_and_size(signing_key, &signing_key_evp, &key_size_bytes);
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        signing_key,
+                                        &signing_key_evp,
+                                        &key_size_bytes);
     if(return_value != T_COSE_SUCCESS) {
         goto Done2;
     }
 
-    /* Create and initialize the OpenSSL EVP_PKEY_CTX that is the
-     * signing context. */
-    sign_context = EVP_PKEY_CTX_new(signing_key_evp, NULL);
-    if(sign_context == NULL) {
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
-    }
-    ossl_result = EVP_PKEY_sign_init(sign_context);
-    if(ossl_result != 1) {
-        return_value = T_COSE_ERR_SIG_FAIL;
+    /* Get the OpenSSL EVP_PKEY_CTX that is the signing context. It
+     * may be cached from a previous signature with the same key. */
+    return_value = pkey_ctx_get(signing_key_evp,
+                                PKEY_CTX_SIGN,
+                                &sign_context,
+                                &sign_context_to_free);
+    if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
 
@@ -432,13 +1224,95 @@ Done:
     /* This checks for NULL before free, so it is not
      * necessary to check for NULL here.
      */
-    EVP_PKEY_CTX_free(sign_context);
+    EVP_PKEY_CTX_free(sign_context_to_free);
 
 Done2:
     return return_value;
 }
 
 
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_batch(const int32_t                cose_algorithm_id,
+                         const struct t_cose_key      signing_key,
+                         const struct q_useful_buf_c *hashes_to_sign,
+                         const struct q_useful_buf   *signature_buffers,
+                         struct q_useful_buf_c       *signatures,
+                         enum t_cose_err_t           *item_errors,
+                         const size_t                 count)
+{
+    enum t_cose_err_t      return_value;
+    EVP_PKEY_CTX          *sign_context;
+    EVP_PKEY_CTX          *sign_context_to_free = NULL;
+    EVP_PKEY              *signing_key_evp;
+    int                    ossl_result;
+    unsigned               key_size_bytes;
+    size_t                 i;
+    MakeUsefulBufOnStack(  der_format_buffer, T_COSE_MAX_SIG_SIZE + DER_SIG_ENCODE_OVER_HEAD);
+    struct q_useful_buf    der_format_signature;
+
+    /* The checks and set up here are the same as in
+     * t_cose_crypto_sign(). The difference is that they are done
+     * once for the whole batch. In particular the EVP_PKEY_CTX is
+     * allocated and initialized once. Creating it involves a malloc
+     * and some key processing so it is worth amortizing.
+     */
+    if(!t_cose_algorithm_is_ecdsa(cose_algorithm_id)) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        signing_key,
+                                        &signing_key_evp,
+                                        &key_size_bytes);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = pkey_ctx_get(signing_key_evp,
+                                PKEY_CTX_SIGN,
+                                &sign_context,
+                                &sign_context_to_free);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    for(i = 0; i < count; i++) {
+        /* EVP_PKEY_sign() takes the DER buffer size in and returns
+         * the DER signature length in the same variable so it has to
+         * be reset for each signature. */
+        der_format_signature = der_format_buffer;
+        ossl_result = EVP_PKEY_sign(sign_context,
+                                    der_format_signature.ptr, &der_format_signature.len,
+                                    hashes_to_sign[i].ptr, hashes_to_sign[i].len);
+        if(ossl_result != 1) {
+            item_errors[i] = T_COSE_ERR_SIG_FAIL;
+            continue;
+        }
+
+        signatures[i] = signature_der_to_cose(key_size_bytes,
+                                              q_usefulbuf_const(der_format_signature),
+                                              signature_buffers[i]);
+        if(q_useful_buf_c_is_null(signatures[i])) {
+            item_errors[i] = T_COSE_ERR_SIG_FAIL;
+            continue;
+        }
+
+        item_errors[i] = T_COSE_SUCCESS;
+    }
+
+    return_value = T_COSE_SUCCESS;
+
+Done:
+    EVP_PKEY_CTX_free(sign_context_to_free);
+
+    return return_value;
+}
+
+
 
 /*
  * See documentation in t_cose_crypto.h
@@ -452,7 +1326,8 @@ t_cose_crypto_verify(const int32_t                cose_algorithm_id,
 {
     int                    ossl_result;
     enum t_cose_err_t      return_value;
-    EVP_PKEY_CTX          *verify_context = NULL;
+    EVP_PKEY_CTX          *verify_context;
+    EVP_PKEY_CTX          *verify_context_to_free = NULL;
     EVP_PKEY              *verification_key_evp;
     unsigned               key_size;
     MakeUsefulBufOnStack(  der_format_buffer, T_COSE_MAX_SIG_SIZE + DER_SIG_ENCODE_OVER_HEAD);
@@ -470,7 +1345,8 @@ t_cose_crypto_verify(const int32_t                cose_algorithm_id,
     /* Get the verification key in an EVP_PKEY structure which is what
      * is needed for sig verification. This also gets the key size
      * which is needed to convert the format of the signature. */
-    return_value = key_convert_and_size(verification_key,
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        verification_key,
                                         &verification_key_evp,
                                         &key_size);
     if(return_value != T_COSE_SUCCESS) {
@@ -491,18 +1367,15 @@ t_cose_crypto_verify(const int32_t                cose_algorithm_id,
     }
 
 
-    /* Create the verification context and set it up with the
-     * necessary verification key.
+    /* Get the verification context set up with the necessary
+     * verification key. It may be cached from a previous
+     * verification with the same key.
      */
-    verify_context = EVP_PKEY_CTX_new(verification_key_evp, NULL);
-    if(verify_context == NULL) {
-        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
-        goto Done;
-    }
-
-    ossl_result = EVP_PKEY_verify_init(verify_context);
-    if(ossl_result != 1) {
-        return_value = T_COSE_ERR_SIG_FAIL;
+    return_value = pkey_ctx_get(verification_key_evp,
+                                PKEY_CTX_VERIFY,
+                                &verify_context,
+                                &verify_context_to_free);
+    if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
 
@@ -528,7 +1401,7 @@ t_cose_crypto_verify(const int32_t                cose_algorithm_id,
     return_value = T_COSE_SUCCESS;
 
 Done:
-    EVP_PKEY_CTX_free(verify_context);
+    EVP_PKEY_CTX_free(verify_context_to_free);
 
     return return_value;
 }
@@ -536,45 +1409,232 @@ Done:
 
 
 
-/*
- * See documentation in t_cose_crypto.h
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+
+/**
+ * \brief Get the digest used with an ECDSA algorithm.
+ *
+ * \param[in] cose_algorithm_id  The COSE ECDSA algorithm ID.
+ *
+ * \return The digest or \c NULL if it is not supported.
  */
-enum t_cose_err_t
-t_cose_crypto_hash_start(struct t_cose_crypto_hash *hash_ctx,
-                         int32_t                    cose_hash_alg_id)
+static const EVP_MD *
+digest_for_ecdsa_alg(int32_t cose_algorithm_id)
 {
-    int           ossl_result;
-    int           nid;
-    const EVP_MD *message_digest;
-
-    switch(cose_hash_alg_id) {
+    switch(cose_algorithm_id) {
 
-    case COSE_ALGORITHM_SHA_256:
-        nid = NID_sha256;
-        break;
+    case COSE_ALGORITHM_ES256:
+        return digest_for_hash_alg(COSE_ALGORITHM_SHA_256);
 
 #ifndef T_COSE_DISABLE_ES384
-    case COSE_ALGORITHM_SHA_384:
-        nid = NID_sha384;
-        break;
+    case COSE_ALGORITHM_ES384:
+        return digest_for_hash_alg(COSE_ALGORITHM_SHA_384);
 #endif
 
 #ifndef T_COSE_DISABLE_ES512
-    case COSE_ALGORITHM_SHA_512:
-        nid = NID_sha512;
-        break;
+    case COSE_ALGORITHM_ES512:
+        return digest_for_hash_alg(COSE_ALGORITHM_SHA_512);
 #endif
 
     default:
-        return T_COSE_ERR_UNSUPPORTED_HASH;
+        return NULL;
+    }
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_message(const int32_t                cose_algorithm_id,
+                           const struct t_cose_key      signing_key,
+                           const struct q_useful_buf_c *message_pieces,
+                           const size_t                 piece_count,
+                           const struct q_useful_buf    signature_buffer,
+                           struct q_useful_buf_c       *signature)
+{
+    enum t_cose_err_t      return_value;
+    EVP_MD_CTX            *sign_context = NULL;
+    EVP_PKEY              *signing_key_evp;
+    const EVP_MD          *message_digest;
+    unsigned               key_size_bytes;
+    size_t                 i;
+    MakeUsefulBufOnStack(  der_format_signature, T_COSE_MAX_SIG_SIZE + DER_SIG_ENCODE_OVER_HEAD);
+
+    /* The same checks as in t_cose_crypto_sign() */
+    message_digest = digest_for_ecdsa_alg(cose_algorithm_id);
+    if(message_digest == NULL) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        signing_key,
+                                        &signing_key_evp,
+                                        &key_size_bytes);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    sign_context = EVP_MD_CTX_new();
+    if(sign_context == NULL) {
+        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
+        goto Done;
+    }
+
+    /* The pieces are hashed and signed by OpenSSL in one
+     * EVP_DigestSign operation rather than through a separate hash
+     * context. */
+    if(EVP_DigestSignInit(sign_context, NULL, message_digest, NULL, signing_key_evp) != 1) {
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
+    }
+    for(i = 0; i < piece_count; i++) {
+        if(message_pieces[i].len == 0) {
+            continue;
+        }
+        if(EVP_DigestSignUpdate(sign_context,
+                                message_pieces[i].ptr,
+                                message_pieces[i].len) != 1) {
+            return_value = T_COSE_ERR_SIG_FAIL;
+            goto Done;
+        }
+    }
+    if(EVP_DigestSignFinal(sign_context,
+                           der_format_signature.ptr,
+                           &der_format_signature.len) != 1) {
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
+    }
+
+    *signature = signature_der_to_cose(key_size_bytes,
+                                       q_usefulbuf_const(der_format_signature),
+                                       signature_buffer);
+    if(q_useful_buf_c_is_null(*signature)) {
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
+    }
+
+    return_value = T_COSE_SUCCESS;
+
+Done:
+    EVP_MD_CTX_free(sign_context);
+
+    return return_value;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_verify_message(const int32_t                cose_algorithm_id,
+                             const struct t_cose_key      verification_key,
+                             const struct q_useful_buf_c  kid,
+                             const struct q_useful_buf_c *message_pieces,
+                             const size_t                 piece_count,
+                             const struct q_useful_buf_c  cose_signature)
+{
+    int                    ossl_result;
+    enum t_cose_err_t      return_value;
+    EVP_MD_CTX            *verify_context = NULL;
+    EVP_PKEY              *verification_key_evp;
+    const EVP_MD          *message_digest;
+    unsigned               key_size;
+    size_t                 i;
+    MakeUsefulBufOnStack(  der_format_buffer, T_COSE_MAX_SIG_SIZE + DER_SIG_ENCODE_OVER_HEAD);
+    struct q_useful_buf_c  der_format_signature;
+
+    /* This implementation doesn't use any key store with the ability
+     * to look up a key based on kid. */
+    (void)kid;
+
+    /* The same checks and conversion as in t_cose_crypto_verify() */
+    message_digest = digest_for_ecdsa_alg(cose_algorithm_id);
+    if(message_digest == NULL) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    return_value = key_convert_and_size(cose_algorithm_id,
+                                        verification_key,
+                                        &verification_key_evp,
+                                        &key_size);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = signature_cose_to_der(key_size,
+                                         cose_signature,
+                                         der_format_buffer,
+                                        &der_format_signature);
+    if(return_value) {
+        goto Done;
+    }
+
+    verify_context = EVP_MD_CTX_new();
+    if(verify_context == NULL) {
+        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
+        goto Done;
+    }
+
+    if(EVP_DigestVerifyInit(verify_context, NULL, message_digest, NULL, verification_key_evp) != 1) {
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
     }
+    for(i = 0; i < piece_count; i++) {
+        if(message_pieces[i].len == 0) {
+            continue;
+        }
+        if(EVP_DigestVerifyUpdate(verify_context,
+                                  message_pieces[i].ptr,
+                                  message_pieces[i].len) != 1) {
+            return_value = T_COSE_ERR_SIG_FAIL;
+            goto Done;
+        }
+    }
+    ossl_result = EVP_DigestVerifyFinal(verify_context,
+                                        der_format_signature.ptr,
+                                        der_format_signature.len);
+    if(ossl_result == 0) {
+        /* The operation succeeded, but the signature doesn't match */
+        return_value = T_COSE_ERR_SIG_VERIFY;
+        goto Done;
+    } else if (ossl_result != 1) {
+        /* Failed before even trying to verify the signature */
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
+    }
+
+    return_value = T_COSE_SUCCESS;
+
+Done:
+    EVP_MD_CTX_free(verify_context);
 
-    message_digest = EVP_get_digestbynid(nid);
+    return return_value;
+}
+
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_start(struct t_cose_crypto_hash *hash_ctx,
+                         int32_t                    cose_hash_alg_id)
+{
+    int           ossl_result;
+    const EVP_MD *message_digest;
+
+    message_digest = digest_for_hash_alg(cose_hash_alg_id);
     if(message_digest == NULL){
         return T_COSE_ERR_UNSUPPORTED_HASH;
     }
 
-    hash_ctx->evp_ctx = EVP_MD_CTX_new();
+    hash_ctx->evp_ctx = md_ctx_get();
     if(hash_ctx->evp_ctx == NULL) {
         return T_COSE_ERR_INSUFFICIENT_MEMORY;
     }
@@ -631,9 +1691,104 @@ t_cose_crypto_hash_finish(struct t_cose_crypto_hash *hash_ctx,
 
     *hash_result = (UsefulBufC){buffer_to_hold_result.ptr, hash_result_len};
 
-    EVP_MD_CTX_free(hash_ctx->evp_ctx);
+    md_ctx_put(hash_ctx->evp_ctx);
 
     /* OpenSSL returns 1 for success, not 0 */
     return ossl_result ? T_COSE_SUCCESS : T_COSE_ERR_HASH_GENERAL_FAIL;
 }
 
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_clone(struct t_cose_crypto_hash       *dest_ctx,
+                         const struct t_cose_crypto_hash *src_ctx)
+{
+    int ossl_result;
+
+    if(!src_ctx->update_error) {
+        return T_COSE_ERR_HASH_GENERAL_FAIL;
+    }
+
+    dest_ctx->evp_ctx = md_ctx_get();
+    if(dest_ctx->evp_ctx == NULL) {
+        return T_COSE_ERR_INSUFFICIENT_MEMORY;
+    }
+
+    /* This copies the digest state, not just the digest type, so
+     * hashing continues from where src_ctx is. */
+    ossl_result = EVP_MD_CTX_copy_ex(dest_ctx->evp_ctx, src_ctx->evp_ctx);
+    if(ossl_result == 0) {
+        EVP_MD_CTX_free(dest_ctx->evp_ctx);
+        return T_COSE_ERR_HASH_GENERAL_FAIL;
+    }
+
+    dest_ctx->cose_hash_alg_id = src_ctx->cose_hash_alg_id;
+    dest_ctx->update_error     = src_ctx->update_error;
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_hash_abort(struct t_cose_crypto_hash *hash_ctx)
+{
+    md_ctx_put(hash_ctx->evp_ctx);
+    hash_ctx->evp_ctx = NULL;
+}
+
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_batch(int32_t                              cose_hash_alg_id,
+                         const struct q_useful_buf_c * const *inputs,
+                         size_t                               piece_count,
+                         const struct q_useful_buf           *buffers_for_hash,
+                         struct q_useful_buf_c               *hashes,
+                         size_t                               count)
+{
+    struct t_cose_crypto_hash hash_ctx;
+    enum t_cose_err_t         return_value;
+    size_t                    i;
+    size_t                    j;
+
+#ifdef T_COSE_ENABLE_MULTI_BUFFER_SHA256
+    if(cose_hash_alg_id == COSE_ALGORITHM_SHA_256 && count > 1) {
+        for(i = 0; i < count; i++) {
+            if(buffers_for_hash[i].len < T_COSE_CRYPTO_SHA256_SIZE) {
+                return T_COSE_ERR_HASH_BUFFER_SIZE;
+            }
+        }
+        t_cose_sha256_mb(inputs, piece_count, buffers_for_hash, count);
+        for(i = 0; i < count; i++) {
+            hashes[i] = (struct q_useful_buf_c){buffers_for_hash[i].ptr,
+                                                T_COSE_CRYPTO_SHA256_SIZE};
+        }
+        return T_COSE_SUCCESS;
+    }
+#endif /* T_COSE_ENABLE_MULTI_BUFFER_SHA256 */
+
+    /* Other hashes and a single input are hashed one at a time */
+    for(i = 0; i < count; i++) {
+        return_value = t_cose_crypto_hash_start(&hash_ctx, cose_hash_alg_id);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+        for(j = 0; j < piece_count; j++) {
+            t_cose_crypto_hash_update(&hash_ctx, inputs[i][j]);
+        }
+        return_value = t_cose_crypto_hash_finish(&hash_ctx, buffers_for_hash[i], &hashes[i]);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+    }
+
+    return T_COSE_SUCCESS;
+}
@@ -36,6 +36,7 @@
 
 #include "t_cose_crypto.h"  /* The interface this implements */
 #include <psa/crypto.h>     /* PSA Crypto Interface to mbed crypto or such */
+#include "t_cose_sha256_mb.h" /* Multi-buffer SHA-256 for hash batches */
 
 
 
@@ -86,6 +87,37 @@ static enum t_cose_err_t psa_status_to_t_cose_error_signing(psa_status_t err)
 }
 
 
+/**
+ * \brief Get the PSA key ID out of a \ref t_cose_key.
+ *
+ * \param[in] cose_algorithm_id  The algorithm the key is for.
+ * \param[in] key                The key, possibly a prepared key.
+ * \param[out] key_id            The PSA key ID.
+ *
+ * \return \ref T_COSE_ERR_WRONG_TYPE_OF_KEY if \c key is a prepared
+ * key for another algorithm or \ref T_COSE_SUCCESS.
+ */
+static enum t_cose_err_t
+psa_key_id(int32_t               cose_algorithm_id,
+           struct t_cose_key     key,
+           mbedtls_svc_key_id_t *key_id)
+{
+    const struct t_cose_prepared_key *prepared;
+
+    prepared = t_cose_crypto_prepared_key(key);
+    if(prepared != NULL) {
+        if(prepared->cose_algorithm_id != cose_algorithm_id) {
+            return T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        }
+        key = prepared->key;
+    }
+
+    *key_id = (mbedtls_svc_key_id_t)key.k.key_handle;
+
+    return T_COSE_SUCCESS;
+}
+
+
 /*
  * See documentation in t_cose_crypto.h
  */
@@ -123,7 +155,12 @@ t_cose_crypto_verify(int32_t               cose_algorithm_id,
         goto Done;
     }
 
-    verification_key_psa = (mbedtls_svc_key_id_t)verification_key.k.key_handle;
+    return_value = psa_key_id(cose_algorithm_id,
+                              verification_key,
+                             &verification_key_psa);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
 
     psa_result = psa_verify_hash(verification_key_psa,
                                  psa_alg_id,
@@ -139,6 +176,176 @@ t_cose_crypto_verify(int32_t               cose_algorithm_id,
 }
 
 
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_release_key_cache(struct t_cose_key key)
+{
+    /* Nothing is cached per key by this adapter */
+    (void)key;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_prepare_key(struct t_cose_key           key,
+                          struct t_cose_prepared_key *prepared)
+{
+    enum t_cose_err_t     return_value;
+    mbedtls_svc_key_id_t  key_psa;
+    psa_key_attributes_t  key_attributes;
+    psa_key_type_t        key_type;
+    psa_status_t          status;
+    size_t                key_len_bytes;
+    int32_t               cose_algorithm_id;
+
+    if(key.crypto_lib != T_COSE_CRYPTO_LIB_PSA) {
+        return T_COSE_ERR_INCORRECT_KEY_FOR_LIB;
+    }
+
+    /* This is the one call to psa_get_key_attributes() that
+     * t_cose_crypto_sig_size() would otherwise make every time. */
+    key_psa = (mbedtls_svc_key_id_t)key.k.key_handle;
+    key_attributes = psa_key_attributes_init();
+    status = psa_get_key_attributes(key_psa, &key_attributes);
+    return_value = psa_status_to_t_cose_error_signing(status);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    key_type = psa_get_key_type(&key_attributes);
+    if(!PSA_KEY_TYPE_IS_ECC(key_type) ||
+       PSA_KEY_TYPE_ECC_GET_FAMILY(key_type) != PSA_ECC_FAMILY_SECP_R1) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    switch(psa_get_key_bits(&key_attributes)) {
+    case 256: cose_algorithm_id = COSE_ALGORITHM_ES256; break;
+#ifndef T_COSE_DISABLE_ES384
+    case 384: cose_algorithm_id = COSE_ALGORITHM_ES384; break;
+#endif
+#ifndef T_COSE_DISABLE_ES512
+    case 521: cose_algorithm_id = COSE_ALGORITHM_ES512; break;
+#endif
+    default:
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+        goto Done;
+    }
+
+    key_len_bytes = PSA_BITS_TO_BYTES(psa_get_key_bits(&key_attributes));
+
+    prepared->key               = key;
+    prepared->cose_algorithm_id = cose_algorithm_id;
+    prepared->coordinate_size   = (uint32_t)key_len_bytes;
+    prepared->sig_size          = (uint32_t)key_len_bytes * 2;
+
+Done:
+    psa_reset_key_attributes(&key_attributes);
+    return return_value;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_import_public_key(int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  public_key,
+                                struct t_cose_key     *key)
+{
+    enum t_cose_err_t     return_value;
+    psa_algorithm_t       psa_alg_id;
+    psa_key_attributes_t  key_attributes;
+    mbedtls_svc_key_id_t  key_psa;
+    psa_status_t          status;
+
+    psa_alg_id = cose_alg_id_to_psa_alg_id(cose_algorithm_id);
+    if(!PSA_ALG_IS_ECDSA(psa_alg_id)) {
+        return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+    }
+
+    /* The curve size comes from the length of the point. It is only
+     * usable for verification with the algorithm of the message. */
+    key_attributes = psa_key_attributes_init();
+    psa_set_key_type(&key_attributes,
+                     PSA_KEY_TYPE_ECC_PUBLIC_KEY(PSA_ECC_FAMILY_SECP_R1));
+    psa_set_key_usage_flags(&key_attributes, PSA_KEY_USAGE_VERIFY_HASH);
+    psa_set_key_algorithm(&key_attributes, psa_alg_id);
+
+    status = psa_import_key(&key_attributes,
+                            public_key.ptr,
+                            public_key.len,
+                            &key_psa);
+    if(status == PSA_ERROR_INSUFFICIENT_MEMORY) {
+        return_value = T_COSE_ERR_INSUFFICIENT_MEMORY;
+    } else if(status != PSA_SUCCESS) {
+        return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+    } else {
+        /* This relies on MBEDTLS_PSA_CRYPTO_KEY_ID_ENCODES_OWNER
+         * being not defined as in t_cose_make_psa_test_key.c */
+        key->crypto_lib   = T_COSE_CRYPTO_LIB_PSA;
+        key->k.key_handle = (uint64_t)key_psa;
+        return_value      = T_COSE_SUCCESS;
+    }
+
+    psa_reset_key_attributes(&key_attributes);
+    return return_value;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_free_key(struct t_cose_key key)
+{
+    psa_destroy_key((mbedtls_svc_key_id_t)key.k.key_handle);
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_export_public_key(struct t_cose_key      key,
+                                struct q_useful_buf    buffer,
+                                struct q_useful_buf_c *public_key)
+{
+    const struct t_cose_prepared_key *prepared;
+    psa_status_t                      status;
+    size_t                            public_key_len;
+
+    prepared = t_cose_crypto_prepared_key(key);
+    if(prepared != NULL) {
+        key = prepared->key;
+    }
+    if(key.crypto_lib != T_COSE_CRYPTO_LIB_PSA) {
+        return T_COSE_ERR_INCORRECT_KEY_FOR_LIB;
+    }
+
+    /* For an ECC key pair or public key this is the uncompressed point */
+    status = psa_export_public_key((mbedtls_svc_key_id_t)key.k.key_handle,
+                                   buffer.ptr,
+                                   buffer.len,
+                                   &public_key_len);
+    switch(status) {
+    case PSA_SUCCESS:
+        *public_key = (struct q_useful_buf_c){buffer.ptr, public_key_len};
+        return T_COSE_SUCCESS;
+    case PSA_ERROR_BUFFER_TOO_SMALL:
+        return T_COSE_ERR_TOO_SMALL;
+    case PSA_ERROR_INVALID_HANDLE:
+        return T_COSE_ERR_EMPTY_KEY;
+    default:
+        return T_COSE_ERR_WRONG_TYPE_OF_KEY;
+    }
+}
+
+
 /*
  * See documentation in t_cose_crypto.h
  */
@@ -172,7 +379,12 @@ t_cose_crypto_sign(int32_t                cose_algorithm_id,
         goto Done;
     }
 
-    signing_key_psa = (mbedtls_svc_key_id_t)signing_key.k.key_handle;
+    return_value = psa_key_id(cose_algorithm_id,
+                              signing_key,
+                             &signing_key_psa);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
 
     /* It is assumed that this call is checking the signature_buffer
      * length and won't write off the end of it.
@@ -199,6 +411,41 @@ t_cose_crypto_sign(int32_t                cose_algorithm_id,
 }
 
 
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_batch(int32_t                      cose_algorithm_id,
+                         struct t_cose_key            signing_key,
+                         const struct q_useful_buf_c *hashes_to_sign,
+                         const struct q_useful_buf   *signature_buffers,
+                         struct q_useful_buf_c       *signatures,
+                         enum t_cose_err_t           *item_errors,
+                         size_t                       count)
+{
+    size_t i;
+
+    /* PSA keys are referenced by handle and there is no signing
+     * context to set up, so there is nothing to amortize. The
+     * algorithm is checked once so an unsupported algorithm fails the
+     * whole batch as the interface requires.
+     */
+    if(!PSA_ALG_IS_ECDSA(cose_alg_id_to_psa_alg_id(cose_algorithm_id))) {
+        return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+    }
+
+    for(i = 0; i < count; i++) {
+        item_errors[i] = t_cose_crypto_sign(cose_algorithm_id,
+                                            signing_key,
+                                            hashes_to_sign[i],
+                                            signature_buffers[i],
+                                           &signatures[i]);
+    }
+
+    return T_COSE_SUCCESS;
+}
+
+
 /*
  * See documentation in t_cose_crypto.h
  */
@@ -212,6 +459,7 @@ enum t_cose_err_t t_cose_crypto_sig_size(int32_t           cose_algorithm_id,
     size_t                key_len_bytes;
     psa_key_attributes_t  key_attributes;
     psa_status_t          status;
+    const struct t_cose_prepared_key *prepared;
 
     /* If desperate to save code, this can return the constant
      * T_COSE_MAX_SIG_SIZE instead of doing an exact calculation.  The
@@ -226,6 +474,18 @@ enum t_cose_err_t t_cose_crypto_sig_size(int32_t           cose_algorithm_id,
         goto Done;
     }
 
+    prepared = t_cose_crypto_prepared_key(signing_key);
+    if(prepared != NULL) {
+        /* The key attributes were read once when it was prepared */
+        if(prepared->cose_algorithm_id != cose_algorithm_id) {
+            return_value = T_COSE_ERR_WRONG_TYPE_OF_KEY;
+            goto Done;
+        }
+        *sig_size = prepared->sig_size;
+        return_value = T_COSE_SUCCESS;
+        goto Done;
+    }
+
     signing_key_psa = (mbedtls_svc_key_id_t)signing_key.k.key_handle;
     key_attributes = psa_key_attributes_init();
     status = psa_get_key_attributes(signing_key_psa, &key_attributes);
@@ -367,3 +627,86 @@ t_cose_crypto_hash_finish(struct t_cose_crypto_hash *hash_ctx,
 Done:
     return psa_status_to_t_cose_error_hash(hash_ctx->status);
 }
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_clone(struct t_cose_crypto_hash       *dest_ctx,
+                         const struct t_cose_crypto_hash *src_ctx)
+{
+    /* psa_hash_clone() requires the target to be in the initial
+     * state. */
+    dest_ctx->ctx = psa_hash_operation_init();
+
+    dest_ctx->status = src_ctx->status;
+    if(dest_ctx->status == PSA_SUCCESS) {
+        dest_ctx->status = psa_hash_clone(&(src_ctx->ctx), &(dest_ctx->ctx));
+    }
+
+    return psa_status_to_t_cose_error_hash(dest_ctx->status);
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_hash_abort(struct t_cose_crypto_hash *hash_ctx)
+{
+    (void)psa_hash_abort(&(hash_ctx->ctx));
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_batch(int32_t                              cose_hash_alg_id,
+                         const struct q_useful_buf_c * const *inputs,
+                         size_t                               piece_count,
+                         const struct q_useful_buf           *buffers_for_hash,
+                         struct q_useful_buf_c               *hashes,
+                         size_t                               count)
+{
+    struct t_cose_crypto_hash hash_ctx;
+    enum t_cose_err_t         return_value;
+    size_t                    i;
+    size_t                    j;
+
+#if defined(T_COSE_ENABLE_MULTI_BUFFER_SHA256) && defined(T_COSE_PSA_USE_MULTI_BUFFER_SHA256)
+    /* Only when asked for because this bypasses PSA, so any driver or
+     * hardware accelerator for SHA-256 is not used. */
+    if(cose_hash_alg_id == COSE_ALGORITHM_SHA_256 && count > 1) {
+        for(i = 0; i < count; i++) {
+            if(buffers_for_hash[i].len < T_COSE_CRYPTO_SHA256_SIZE) {
+                return T_COSE_ERR_HASH_BUFFER_SIZE;
+            }
+        }
+        t_cose_sha256_mb(inputs, piece_count, buffers_for_hash, count);
+        for(i = 0; i < count; i++) {
+            hashes[i] = (struct q_useful_buf_c){buffers_for_hash[i].ptr,
+                                                T_COSE_CRYPTO_SHA256_SIZE};
+        }
+        return T_COSE_SUCCESS;
+    }
+#endif /* T_COSE_ENABLE_MULTI_BUFFER_SHA256 && T_COSE_PSA_USE_MULTI_BUFFER_SHA256 */
+
+    /* Hashed one at a time with PSA */
+    for(i = 0; i < count; i++) {
+        return_value = t_cose_crypto_hash_start(&hash_ctx, cose_hash_alg_id);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+        for(j = 0; j < piece_count; j++) {
+            t_cose_crypto_hash_update(&hash_ctx, inputs[i][j]);
+        }
+        return_value = t_cose_crypto_hash_finish(&hash_ctx, buffers_for_hash[i], &hashes[i]);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+    }
+
+    return T_COSE_SUCCESS;
+}
@@ -32,6 +32,9 @@
 /* The Brad Conte hash implementaiton bundled with t_cose */
 #include "sha256.h"
 
+/* Multi-buffer SHA-256 for t_cose_crypto_hash_batch() */
+#include "t_cose_sha256_mb.h"
+
 /* Use of this file requires definition of T_COSE_USE_B_CON_SHA256 when
  * making t_cose_crypto.h.
  *
@@ -63,6 +66,76 @@ enum t_cose_err_t t_cose_crypto_sig_size(int32_t           cose_algorithm_id,
 }
 
 
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_release_key_cache(struct t_cose_key key)
+{
+    /* Nothing is cached per key by this adapter */
+    (void)key;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_prepare_key(struct t_cose_key           key,
+                          struct t_cose_prepared_key *prepared)
+{
+    /* There are no keys without a signature algorithm */
+    (void)key;
+    (void)prepared;
+
+    return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_import_public_key(int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  public_key,
+                                struct t_cose_key     *key)
+{
+    /* There are no public keys without a signature algorithm */
+    (void)cose_algorithm_id;
+    (void)public_key;
+    (void)key;
+
+    return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_free_key(struct t_cose_key key)
+{
+    (void)key;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_export_public_key(struct t_cose_key      key,
+                                struct q_useful_buf    buffer,
+                                struct q_useful_buf_c *public_key)
+{
+    /* There are no keys without a signature algorithm */
+    (void)key;
+    (void)buffer;
+    (void)public_key;
+
+    return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+}
+
+
 /*
  * See documentation in t_cose_crypto.h
  */
@@ -82,6 +155,29 @@ t_cose_crypto_sign(int32_t                cose_algorithm_id,
 }
 
 
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_batch(int32_t                      cose_algorithm_id,
+                         struct t_cose_key            signing_key,
+                         const struct q_useful_buf_c *hashes_to_sign,
+                         const struct q_useful_buf   *signature_buffers,
+                         struct q_useful_buf_c       *signatures,
+                         enum t_cose_err_t           *item_errors,
+                         size_t                       count)
+{
+    (void)cose_algorithm_id;
+    (void)signing_key;
+    (void)hashes_to_sign;
+    (void)signature_buffers;
+    (void)signatures;
+    (void)item_errors;
+    (void)count;
+    return T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+}
+
+
 /*
  * See documentation in t_cose_crypto.h
  */
@@ -168,3 +264,89 @@ t_cose_crypto_hash_finish(struct t_cose_crypto_hash *hash_ctx,
 
     return 0;
 }
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_clone(struct t_cose_crypto_hash       *dest_ctx,
+                         const struct t_cose_crypto_hash *src_ctx)
+{
+    /* The b_con context holds no pointers so a copy of it is a full
+     * independent copy of the hash state. */
+    *dest_ctx = *src_ctx;
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+void
+t_cose_crypto_hash_abort(struct t_cose_crypto_hash *hash_ctx)
+{
+    /* Nothing is allocated by this hash implementation */
+    (void)hash_ctx;
+}
+
+
+/*
+ * See documentation in t_cose_crypto.h
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_batch(int32_t                              cose_hash_alg_id,
+                         const struct q_useful_buf_c * const *inputs,
+                         size_t                               piece_count,
+                         const struct q_useful_buf           *buffers_for_hash,
+                         struct q_useful_buf_c               *hashes,
+                         size_t                               count)
+{
+    struct t_cose_crypto_hash hash_ctx;
+    enum t_cose_err_t         return_value;
+    size_t                    i;
+    size_t                    j;
+
+#ifdef T_COSE_ENABLE_HASH_FAIL_TEST
+    if(hash_test_mode != 0) {
+        return T_COSE_ERR_HASH_GENERAL_FAIL;
+    }
+#endif
+
+    if(cose_hash_alg_id != COSE_ALGORITHM_SHA_256) {
+        return T_COSE_ERR_UNSUPPORTED_HASH;
+    }
+    for(i = 0; i < count; i++) {
+        if(buffers_for_hash[i].len < T_COSE_CRYPTO_SHA256_SIZE) {
+            return T_COSE_ERR_HASH_BUFFER_SIZE;
+        }
+    }
+
+#ifdef T_COSE_ENABLE_MULTI_BUFFER_SHA256
+    if(count > 1) {
+        t_cose_sha256_mb(inputs, piece_count, buffers_for_hash, count);
+        for(i = 0; i < count; i++) {
+            hashes[i] = (struct q_useful_buf_c){buffers_for_hash[i].ptr,
+                                                T_COSE_CRYPTO_SHA256_SIZE};
+        }
+        return T_COSE_SUCCESS;
+    }
+#endif /* T_COSE_ENABLE_MULTI_BUFFER_SHA256 */
+
+    for(i = 0; i < count; i++) {
+        return_value = t_cose_crypto_hash_start(&hash_ctx, cose_hash_alg_id);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+        for(j = 0; j < piece_count; j++) {
+            t_cose_crypto_hash_update(&hash_ctx, inputs[i][j]);
+        }
+        return_value = t_cose_crypto_hash_finish(&hash_ctx, buffers_for_hash[i], &hashes[i]);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+    }
+
+    return T_COSE_SUCCESS;
+}
@@ -0,0 +1,397 @@
+/*
+ *  t_cose_async.h
+ *
+ * Copyright 2019-2022, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_ASYNC_H__
+#define __T_COSE_ASYNC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_sign.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef T_COSE_ENABLE_ASYNC
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef T_COSE_ENABLE_ASYNC
+
+/**
+ * \file t_cose_async.h
+ *
+ * \brief Sign and verify on other threads with a callback on completion.
+ *
+ * A \ref t_cose_async_request is one sign or verify. The caller owns
+ * it, sets it up with t_cose_async_sign_request_init() or
+ * t_cose_async_verify_request_init() and submits it to an executor
+ * with t_cose_async_submit(). The executor runs it on one of its
+ * threads and the callback is called there with the result.
+ *
+ *     t_cose_async_pool_start(&pool, 0);
+ *     executor = t_cose_async_pool_executor(&pool);
+ *
+ *     t_cose_async_verify_request_init(&request, &verify_ctx, cose_sign1,
+ *                                      NULL_Q_USEFUL_BUF_C, done, done_ctx);
+ *     result = t_cose_async_submit(&executor, &request);
+ *     ...
+ *     t_cose_async_pool_stop(&pool);
+ *
+ * The request takes a copy of the signing or verification context so
+ * the context can be changed or reused as soon as the request is
+ * made, and any number of requests can be made from one context. The
+ * buffers, keys, key resolver, kid filter and verify cache the
+ * context refers to are shared, so they must stay valid until the
+ * request completes and must be safe to use from several threads. A
+ * key resolver in particular is called on the executor's threads. A
+ * header cache is not thread safe so it is not used by requests.
+ *
+ * The default executor is a \ref t_cose_async_pool, a pool of worker
+ * threads each with its own bounded queue. Requests are spread over
+ * the queues and a worker with nothing to do steals requests from
+ * the queues of the others. Requests submitted from a
+ * completion callback go on the queue of the worker running it. When
+ * every queue is full t_cose_async_submit() fails with \ref
+ * T_COSE_ERR_QUEUE_FULL rather than blocking or allocating, so a
+ * caller producing requests faster than they are completed must hold
+ * back, for example with t_cose_async_pool_wait(). A callback must
+ * not wait for room as only the workers make room. It can run the
+ * request itself with t_cose_async_request_run() instead.
+ *
+ * Other executors can be used by filling in a \ref
+ * t_cose_async_executor with a submit function that arranges for
+ * t_cose_async_request_run() to be called on the request.
+ *
+ * No memory is allocated. This needs POSIX threads and the GCC \c
+ * __atomic built-ins. It is only in the build when \c
+ * T_COSE_ENABLE_ASYNC is defined.
+ */
+
+
+/**
+ * The maximum number of worker threads in a \ref t_cose_async_pool.
+ */
+#ifndef T_COSE_ASYNC_MAX_WORKERS
+#define T_COSE_ASYNC_MAX_WORKERS 16
+#endif
+
+
+/**
+ * The number of requests each worker's queue holds. It must be a
+ * power of two.
+ */
+#ifndef T_COSE_ASYNC_QUEUE_SIZE
+#define T_COSE_ASYNC_QUEUE_SIZE 256
+#endif
+
+
+struct t_cose_async_request;
+
+
+/**
+ * \brief Type of callback called when a request completes.
+ *
+ * \param[in] done_ctx  The context given when the request was made.
+ * \param[in] request   The completed request.
+ *
+ * This is called on the thread that ran the request. Get the outcome
+ * with t_cose_async_request_error() and the other getters. The
+ * request belongs to the caller again once this is called and may be
+ * freed or reused here, for example to submit it again.
+ */
+typedef void
+t_cose_async_done_cb(void                        *done_ctx,
+                     struct t_cose_async_request *request);
+
+
+/**
+ * One asynchronous sign or verify. The caller should allocate it, but
+ * it is private and should not be accessed by the caller. It must
+ * not be touched between submitting it and its callback being called.
+ */
+struct t_cose_async_request {
+    /* Private data structure */
+    union {
+        struct t_cose_sign1_sign_ctx   sign;
+        struct t_cose_sign1_verify_ctx verify;
+    } ctx;
+    bool                        is_sign;
+    struct q_useful_buf_c       input;  /* Payload or COSE_Sign1 */
+    struct q_useful_buf_c       aad;
+    struct q_useful_buf         out_buf;
+    struct q_useful_buf_c       output; /* COSE_Sign1 or payload */
+    struct t_cose_parameters    parameters;
+    enum t_cose_err_t           error;
+    t_cose_async_done_cb       *done_cb;
+    void                       *done_ctx;
+};
+
+
+/**
+ * An executor that runs requests. Fill this in to use an executor
+ * other than \ref t_cose_async_pool.
+ */
+struct t_cose_async_executor {
+    /** Arrange for t_cose_async_request_run() to be called on \c
+     * request soon, usually on another thread. Return \ref
+     * T_COSE_SUCCESS or an error such as \ref T_COSE_ERR_QUEUE_FULL if
+     * the request can't be taken. */
+    enum t_cose_err_t (*submit)(void                        *executor_ctx,
+                                struct t_cose_async_request *request);
+    /** Passed to \c submit. */
+    void               *executor_ctx;
+};
+
+
+struct t_cose_async_pool;
+
+
+/* Private data structure. One worker's queue. The worker and those
+ * stealing from it all take the oldest request. */
+struct t_cose_async_queue {
+    struct t_cose_async_pool    *pool;
+    pthread_mutex_t              lock;
+    size_t                       head;
+    size_t                       tail;
+    struct t_cose_async_request *slots[T_COSE_ASYNC_QUEUE_SIZE];
+};
+
+
+/**
+ * The default executor, a work-stealing thread pool. The caller
+ * should allocate it, but it is private and should not be accessed by
+ * the caller. It is about 35KB with the default sizes.
+ */
+struct t_cose_async_pool {
+    /* Private data structure */
+    unsigned                  worker_count;
+    unsigned                  next_queue;
+    size_t                    queued;     /* In a queue, not started */
+    size_t                    in_flight;  /* Submitted, not completed */
+    unsigned                  sleeping;
+    bool                      stopping;
+    pthread_mutex_t           lock;
+    pthread_cond_t            work_cond;
+    pthread_cond_t            drained_cond;
+    pthread_key_t             worker_key;
+    pthread_t                 threads[T_COSE_ASYNC_MAX_WORKERS];
+    struct t_cose_async_queue queues[T_COSE_ASYNC_MAX_WORKERS];
+};
+
+
+/**
+ * \brief Make a request to sign a payload.
+ *
+ * \param[out] request   The request to initialize.
+ * \param[in] context    The signing context to copy. It must be set
+ *                       up as for t_cose_sign1_sign_aad().
+ * \param[in] aad        The Additional Authenticated Data or
+ *                       \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload    The payload to sign.
+ * \param[in] out_buf    Pointer and length of buffer to output to.
+ * \param[in] done_cb    Called when the request completes.
+ * \param[in] done_ctx   Passed to \c done_cb.
+ *
+ * When the request completes t_cose_async_request_output() gives
+ * the \c COSE_Sign1 in \c out_buf. \c aad, \c payload and \c
+ * out_buf must stay valid until then.
+ */
+void
+t_cose_async_sign_request_init(struct t_cose_async_request        *request,
+                               const struct t_cose_sign1_sign_ctx *context,
+                               struct q_useful_buf_c               aad,
+                               struct q_useful_buf_c               payload,
+                               struct q_useful_buf                 out_buf,
+                               t_cose_async_done_cb               *done_cb,
+                               void                               *done_ctx);
+
+
+/**
+ * \brief Make a request to verify a \c COSE_Sign1.
+ *
+ * \param[out] request    The request to initialize.
+ * \param[in] context     The verification context to copy. It must be
+ *                        set up as for t_cose_sign1_verify_aad().
+ * \param[in] cose_sign1  The \c COSE_Sign1 to verify.
+ * \param[in] aad         The Additional Authenticated Data or
+ *                        \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] done_cb     Called when the request completes.
+ * \param[in] done_ctx    Passed to \c done_cb.
+ *
+ * When the request completes t_cose_async_request_output() gives the
+ * payload, pointing into \c cose_sign1, and
+ * t_cose_async_request_parameters() the header parameters. \c
+ * cose_sign1 and \c aad must stay valid until then.
+ */
+void
+t_cose_async_verify_request_init(struct t_cose_async_request          *request,
+                                 const struct t_cose_sign1_verify_ctx *context,
+                                 struct q_useful_buf_c                 cose_sign1,
+                                 struct q_useful_buf_c                 aad,
+                                 t_cose_async_done_cb                 *done_cb,
+                                 void                                 *done_ctx);
+
+
+/**
+ * \brief Submit a request to an executor.
+ *
+ * \param[in] executor  The executor to run the request.
+ * \param[in] request   The request.
+ *
+ * \return \ref T_COSE_SUCCESS if the request was taken, otherwise the
+ * error from the executor, for example \ref T_COSE_ERR_QUEUE_FULL.
+ *
+ * The callback is called exactly once for a request that is taken,
+ * possibly before this returns. It is not called for a request that
+ * isn't.
+ */
+enum t_cose_err_t
+t_cose_async_submit(const struct t_cose_async_executor *executor,
+                    struct t_cose_async_request        *request);
+
+
+/**
+ * \brief Run a request now on the calling thread.
+ *
+ * \param[in] request  The request.
+ *
+ * This signs or verifies and then calls the request's callback. It
+ * is for executors to call.
+ */
+void
+t_cose_async_request_run(struct t_cose_async_request *request);
+
+
+/**
+ * \brief Get the outcome of a completed request.
+ *
+ * \param[in] request  The completed request.
+ *
+ * \return The error from signing or verifying, \ref T_COSE_SUCCESS if
+ * it worked.
+ */
+static enum t_cose_err_t
+t_cose_async_request_error(const struct t_cose_async_request *request);
+
+
+/**
+ * \brief Get the output of a completed request.
+ *
+ * \param[in] request  The completed request.
+ *
+ * \return The \c COSE_Sign1 for a sign or the payload for a verify.
+ * \c NULL_Q_USEFUL_BUF_C if the request failed.
+ */
+static struct q_useful_buf_c
+t_cose_async_request_output(const struct t_cose_async_request *request);
+
+
+/**
+ * \brief Get the header parameters of a completed verify request.
+ *
+ * \param[in] request  The completed verify request.
+ *
+ * \return The header parameters of the \c COSE_Sign1.
+ */
+static const struct t_cose_parameters *
+t_cose_async_request_parameters(const struct t_cose_async_request *request);
+
+
+/**
+ * \brief Start a thread pool.
+ *
+ * \param[out] pool          The pool to start.
+ * \param[in] worker_count   The number of worker threads. 0 for one
+ *                           for each online CPU. At most \ref
+ *                           T_COSE_ASYNC_MAX_WORKERS are started.
+ *
+ * \return \ref T_COSE_ERR_THREADS if the threads couldn't be started.
+ *
+ * Stop the pool with t_cose_async_pool_stop() before discarding it.
+ */
+enum t_cose_err_t
+t_cose_async_pool_start(struct t_cose_async_pool *pool,
+                        unsigned                  worker_count);
+
+
+/**
+ * \brief Get the executor for a thread pool.
+ *
+ * \param[in] pool  The started pool.
+ *
+ * \return The executor to pass to t_cose_async_submit().
+ */
+struct t_cose_async_executor
+t_cose_async_pool_executor(struct t_cose_async_pool *pool);
+
+
+/**
+ * \brief Wait for all requests submitted to a thread pool to complete.
+ *
+ * \param[in] pool  The pool.
+ *
+ * This includes requests submitted by callbacks while waiting. It
+ * must not be called from a callback.
+ */
+void
+t_cose_async_pool_wait(struct t_cose_async_pool *pool);
+
+
+/**
+ * \brief Stop a thread pool.
+ *
+ * \param[in] pool  The pool.
+ *
+ * Requests already submitted are completed first, but those that
+ * their callbacks submit are refused. After this submitting to the
+ * pool fails with \ref T_COSE_ERR_THREADS. It must not be called
+ * from a callback or while other threads are submitting.
+ */
+void
+t_cose_async_pool_stop(struct t_cose_async_pool *pool);
+
+
+
+
+/* ------------------------------------------------------------------------
+ * Inline implementations of public functions defined above.
+ */
+static inline enum t_cose_err_t
+t_cose_async_request_error(const struct t_cose_async_request *request)
+{
+    return request->error;
+}
+
+
+static inline struct q_useful_buf_c
+t_cose_async_request_output(const struct t_cose_async_request *request)
+{
+    return request->output;
+}
+
+
+static inline const struct t_cose_parameters *
+t_cose_async_request_parameters(const struct t_cose_async_request *request)
+{
+    return &(request->parameters);
+}
+
+#endif /* T_COSE_ENABLE_ASYNC */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_ASYNC_H__ */
@@ -46,6 +46,52 @@ extern "C" {
  *
  * \c T_COSE_DISABLE_CONTENT_TYPE -- Disables the content type
  * parameters for both signing and verifying.
+ *
+ * \c T_COSE_ENABLE_FILE_IO -- Enables signing and verifying of
+ * detached payloads in files and opening key index and kid filter
+ * files. Needs POSIX file I/O and mmap(). See t_cose_sign1_file.h.
+ *
+ * \c T_COSE_ENABLE_KEY_SET -- Enables the shared key set that can be
+ * replaced while in use. Needs the GCC \c __atomic built-ins. See
+ * t_cose_key_set.h.
+ *
+ * \c T_COSE_ENABLE_ASYNC -- Enables asynchronous signing and
+ * verifying and the thread pool to run them. Needs POSIX threads and
+ * the GCC \c __atomic built-ins. See t_cose_async.h.
+ *
+ * \c T_COSE_ENABLE_VERIFY_CACHE -- Enables the cache of messages that
+ * verified. Needs the GCC \c __atomic built-ins and POSIX
+ * clock_gettime(). See t_cose_verify_cache.h.
+ *
+ * \c T_COSE_ENABLE_MULTI_BUFFER_SHA256 -- Enables the multi-buffer
+ * SHA-256 that batch signing and verifying use to hash several
+ * messages at once. Needs the GCC vector extensions. Not worth it on
+ * CPUs without vector units or when the crypto library's hash runs in
+ * hardware. See t_cose_crypto_hash_batch() in t_cose_crypto.h.
+ *
+ * \c T_COSE_PSA_USE_MULTI_BUFFER_SHA256 -- With PSA Crypto, hash
+ * batches with the multi-buffer SHA-256 rather than with PSA. This
+ * bypasses PSA drivers and hardware accelerators for SHA-256 so it
+ * is only worth it where SHA-256 runs in software on a CPU with
+ * vector units. Needs \c T_COSE_ENABLE_MULTI_BUFFER_SHA256. Without
+ * it batches are hashed one message at a time with PSA.
+ *
+ * \c T_COSE_ENABLE_OPENSSL_CTX_CACHE -- With OpenSSL, keep an
+ * initialized signing and verification context per key, the hash
+ * algorithms and finished hash contexts in each thread rather than
+ * making them for every signature. This needs POSIX threads. See
+ * t_cose_key_release_cached().
+ *
+ * \c T_COSE_ENABLE_SIGN_MESSAGE -- Give the to-be-signed bytes to
+ * the crypto library to hash and sign in one operation rather than
+ * hashing them first, for crypto adapters that support it, which is
+ * only OpenSSL now. See t_cose_crypto_sign_message() in
+ * t_cose_crypto.h.
+ *
+ * The features enabled with \c T_COSE_ENABLE_ are off by default so
+ * the library needs no more than C99 and the crypto library. The
+ * ones that change public headers must be defined the same way when
+ * building the library and the code that uses it.
  */
 
 
@@ -108,7 +154,10 @@ enum t_cose_crypto_lib_t {
     T_COSE_CRYPTO_LIB_OPENSSL = 1,
      /** \c key_handle is a \c psa_key_handle_t in Arm's Platform Security
       * Architecture */
-    T_COSE_CRYPTO_LIB_PSA = 2
+    T_COSE_CRYPTO_LIB_PSA = 2,
+    /** \c key_ptr points to a \ref t_cose_prepared_key filled in by
+     * t_cose_key_prepare(). */
+    T_COSE_CRYPTO_LIB_PREPARED = 3
 };
 
 
@@ -160,6 +209,27 @@ struct t_cose_key {
 #endif
 
 
+/**
+ * \brief Release anything cached for a key by the crypto integration.
+ *
+ * \param[in] key  The key that is going to be freed.
+ *
+ * Crypto library integrations may cache state per key, such as
+ * initialized signing contexts, to make repeated signing and
+ * verification faster. Call this before freeing a key that has been
+ * used so the cached state doesn't hold on to it. It does nothing if
+ * nothing is cached.
+ *
+ * With OpenSSL and \c T_COSE_ENABLE_OPENSSL_CTX_CACHE the calling
+ * thread's cache is emptied right away. Other threads empty theirs
+ * the next time they sign or verify. The cached contexts hold
+ * references on the \c EVP_PKEY so freeing it while another thread
+ * still has it cached is safe.
+ */
+void
+t_cose_key_release_cached(struct t_cose_key key);
+
+
 /* Private value. Intentionally not documented for Doxygen.  This is
  * the size allocated for the encoded protected header parameters.  It
  * needs to be big enough for encode_protected_parameters() to
@@ -176,6 +246,14 @@ struct t_cose_key {
 #define T_COSE_SIGN1_MAX_SIZE_PROTECTED_PARAMETERS (1+1+5+17)
 
 
+/**
+ * The largest to-be-signed hash held in a \ref
+ * t_cose_sign1_verify_prepared or a \ref t_cose_sign1_sign_pending.
+ * This is the size of SHA-512.
+ */
+#define T_COSE_SIGN1_MAX_TBS_HASH_SIZE 64
+
+
 /**
  * Error codes return by t_cose.
  */
@@ -341,9 +419,111 @@ enum t_cose_err_t {
     /** More than \ref T_COSE_MAX_TAGS_TO_RETURN unprocessed tags when
      * verifying a signature. */
     T_COSE_ERR_TOO_MANY_TAGS = 37,
+
+    /** The total length of the payload chunks given to a streaming
+     * sign or verify is not the payload length given when it was
+     * started. */
+    T_COSE_ERR_PAYLOAD_LENGTH = 38,
+
+    /** Opening, mapping or reading a payload file failed. */
+    T_COSE_ERR_FILE_IO = 39,
+
+    /** All the reader slots of a \ref t_cose_key_set are in use. */
+    T_COSE_ERR_TOO_MANY_READERS = 40,
+
+    /** A key index is not in the format of a version that is
+     * understood or is damaged. See t_cose_key_index.h. */
+    T_COSE_ERR_KEY_INDEX_FORMAT = 41,
+
+    /** The kid is not in the allow \ref t_cose_kid_filter set for
+     * verification or is in the deny one. */
+    T_COSE_ERR_KID_REJECTED = 42,
+
+    /** A kid filter is not in the format of a version that is
+     * understood or is damaged. See t_cose_kid_filter.h. */
+    T_COSE_ERR_KID_FILTER_FORMAT = 43,
+
+    /** The queue of an asynchronous executor is full. Try again once
+     * some requests have completed. See t_cose_async.h. */
+    T_COSE_ERR_QUEUE_FULL = 44,
+
+    /** Threads couldn't be started or the executor is stopped. See
+     * t_cose_async.h. */
+    T_COSE_ERR_THREADS = 45,
+};
+
+
+/**
+ * A key that has been checked once by t_cose_key_prepare() along with
+ * what was learned about it. Signing, verification and signature size
+ * computation use what is cached here rather than querying the crypto
+ * library for it every time.
+ *
+ * This doesn't own \c key. It must stay valid as long as the prepared
+ * key is used and is freed by the caller as usual. Nothing needs to be
+ * freed for the prepared key itself.
+ */
+struct t_cose_prepared_key {
+    /** The key that was prepared. */
+    struct t_cose_key key;
+    /** The COSE algorithm ID that goes with the key's curve, for
+     * example \ref T_COSE_ALGORITHM_ES256 for P-256. */
+    int32_t           cose_algorithm_id;
+    /** The size of each of r and s in a signature in bytes. This is
+     * the key size rounded up to a whole byte. */
+    uint32_t          coordinate_size;
+    /** The size of a signature made with the key in bytes. */
+    uint32_t          sig_size;
 };
 
 
+/**
+ * \brief Check a key once and cache its metadata.
+ *
+ * \param[in] key        The key to prepare.
+ * \param[out] prepared  Filled in with the key and its metadata.
+ *
+ * \retval T_COSE_ERR_INCORRECT_KEY_FOR_LIB
+ *         The key is not for the integrated crypto library.
+ * \retval T_COSE_ERR_EMPTY_KEY
+ *         The key is \c NULL.
+ * \retval T_COSE_ERR_WRONG_TYPE_OF_KEY
+ *         The key is not an EC key on a curve with a COSE algorithm.
+ *
+ * Use t_cose_key_from_prepared() to get a \ref t_cose_key to pass to
+ * the signing and verification functions. When one of these is used
+ * with an algorithm other than \c cose_algorithm_id, \ref
+ * T_COSE_ERR_WRONG_TYPE_OF_KEY is returned.
+ *
+ * This is worth doing for keys used for many messages. The key
+ * doesn't have to be checked and measured each time.
+ */
+enum t_cose_err_t
+t_cose_key_prepare(struct t_cose_key           key,
+                   struct t_cose_prepared_key *prepared);
+
+
+/**
+ * \brief Get a \ref t_cose_key that refers to a prepared key.
+ *
+ * \param[in] prepared  The key filled in by t_cose_key_prepare().
+ *
+ * \return A key that can be passed to signing and verification.
+ *
+ * \c prepared must stay valid as long as the returned key is used.
+ */
+static inline struct t_cose_key
+t_cose_key_from_prepared(struct t_cose_prepared_key *prepared)
+{
+    struct t_cose_key key;
+
+    key.crypto_lib = T_COSE_CRYPTO_LIB_PREPARED;
+    key.k.key_ptr  = prepared;
+
+    return key;
+}
+
+
 
 
 /**
@@ -371,6 +551,36 @@ enum t_cose_err_t {
 #define T_COSE_EMPTY_UINT_CONTENT_TYPE UINT16_MAX+1
 
 
+
+/**
+ * The size of \ref t_cose_hash_storage. It must be large enough for
+ * the hash context of the crypto library in use, which is checked
+ * when t_cose is compiled. The default is large enough for all the
+ * crypto adaptation layers in this repository. It can be reduced to
+ * the size needed by a particular crypto library.
+ */
+#ifndef T_COSE_HASH_STORAGE_SIZE
+#define T_COSE_HASH_STORAGE_SIZE 256
+#endif
+
+
+/**
+ * Storage for a hash in progress that is kept between calls to
+ * t_cose, such as a precomputed midstate or a streaming
+ * sign. The hash context type is private to t_cose and depends
+ * on the crypto library so this is only sized and aligned to hold
+ * it. It should not be accessed by the caller.
+ */
+struct t_cose_hash_storage {
+    /* Private data structure */
+    union {
+        uint8_t   bytes[T_COSE_HASH_STORAGE_SIZE];
+        uint64_t  align_u64; /* For alignment of the hash context */
+        void     *align_ptr; /* For alignment of the hash context */
+    } u;
+};
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,205 @@
+/*
+ *  t_cose_header_cache.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_HEADER_CACHE_H__
+#define __T_COSE_HEADER_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_header_cache.h
+ *
+ * \brief Remember parsed protected header parameters.
+ *
+ * Messages from the same signer usually have byte-for-byte the same
+ * protected header parameters, often just the algorithm ID. A \ref
+ * t_cose_header_cache given to t_cose_sign1_set_header_cache()
+ * remembers the protected parameters of recent messages. When they
+ * are seen again they are not parsed again, and hashing of the
+ * to-be-signed bytes starts from a saved hash midstate that already
+ * covers the "Signature1" context string and the protected
+ * parameters.
+ *
+ *     t_cose_header_cache_init(&cache);
+ *     t_cose_sign1_set_header_cache(&verify_ctx, &cache);
+ *     ...
+ *     t_cose_header_cache_clear(&cache);
+ *
+ * Entries are found by the exact bytes of the protected parameters
+ * so a hit gives the same result as parsing them. The buffers in the
+ * returned parameters, for example a kid in the protected
+ * parameters, point into the message being verified.
+ *
+ * Protected parameters longer than \ref T_COSE_HEADER_CACHE_MAX_SIZE
+ * or with critical or unknown parameters are not cached. Unknown
+ * parameters have to be checked against the critical parameters list
+ * together with those in the unprotected parameters, so they are
+ * parsed every time. When the cache is full the least recently used
+ * entry is replaced.
+ *
+ * No memory is allocated by the cache itself, but a hash midstate may
+ * hold resources of the crypto library, so call
+ * t_cose_header_cache_clear() before discarding the cache. The cache
+ * is about 1.5KB with the default sizes. It is not thread safe. Use
+ * one per thread or lock around its use.
+ */
+
+
+/**
+ * The number of entries. A verifier seldom sees more than a few
+ * different protected parameters so this is small and searched
+ * linearly.
+ */
+#ifndef T_COSE_HEADER_CACHE_SIZE
+#define T_COSE_HEADER_CACHE_SIZE 4
+#endif
+
+
+/**
+ * The longest protected parameters that are cached. This is enough
+ * for an algorithm ID, a content type and a 32-byte kid. It must be
+ * less than 255.
+ */
+#ifndef T_COSE_HEADER_CACHE_MAX_SIZE
+#define T_COSE_HEADER_CACHE_MAX_SIZE 64
+#endif
+
+
+/* Private data structure. Where a parameter is in the protected
+ * parameters. An offset of UINT8_MAX means NULL_Q_USEFUL_BUF_C. */
+struct t_cose_header_cache_span {
+    uint8_t offset;
+    uint8_t len;
+};
+
+
+/* Private data structure. One cached protected parameters. */
+struct t_cose_header_cache_entry {
+    struct t_cose_hash_storage      midstate;
+    uint64_t                        last_use; /* 0 means the entry is empty */
+    int32_t                         cose_algorithm_id;
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    uint32_t                        content_type_uint;
+    struct t_cose_header_cache_span content_type_tstr;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+    struct t_cose_header_cache_span kid;
+    struct t_cose_header_cache_span iv;
+    struct t_cose_header_cache_span partial_iv;
+    bool                            has_midstate;
+    uint8_t                         protected_len;
+    uint8_t                         protected_bytes[T_COSE_HEADER_CACHE_MAX_SIZE];
+};
+
+
+/**
+ * The header cache. The caller should allocate it, but it is private
+ * and should not be accessed by the caller.
+ */
+struct t_cose_header_cache {
+    /* Private data structure */
+    uint64_t                         use_clock;
+    struct t_cose_header_cache_entry entries[T_COSE_HEADER_CACHE_SIZE];
+};
+
+
+/**
+ * \brief Initialize a header cache.
+ *
+ * \param[out] cache  The cache to initialize.
+ */
+void
+t_cose_header_cache_init(struct t_cose_header_cache *cache);
+
+
+/**
+ * \brief Remove all entries from the cache.
+ *
+ * \param[in] cache  The cache.
+ *
+ * This releases the hash midstates. The cache can still be used
+ * afterwards.
+ */
+void
+t_cose_header_cache_clear(struct t_cose_header_cache *cache);
+
+
+/**
+ * \brief Semi-private function to find cached protected parameters.
+ *
+ * \param[in] cache                 The cache.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[out] parameters           The parameters, pointing into
+ *                                  \c protected_parameters. Only
+ *                                  written on a hit.
+ *
+ * \return \c true if they were found.
+ *
+ * This is used by t_cose_sign1_verify() and should not be called
+ * directly.
+ */
+bool
+t_cose_header_cache_find(struct t_cose_header_cache *cache,
+                         struct q_useful_buf_c       protected_parameters,
+                         struct t_cose_parameters   *parameters);
+
+
+/**
+ * \brief Semi-private function to add protected parameters to the cache.
+ *
+ * \param[in] cache                 The cache.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] parameters            The parameters parsed from just
+ *                                  \c protected_parameters.
+ *
+ * The caller must only add protected parameters that parsed
+ * successfully and have no critical or unknown parameters.
+ *
+ * This is used by t_cose_sign1_verify() and should not be called
+ * directly.
+ */
+void
+t_cose_header_cache_add(struct t_cose_header_cache     *cache,
+                        struct q_useful_buf_c           protected_parameters,
+                        const struct t_cose_parameters *parameters);
+
+
+/**
+ * \brief Semi-private function to get the to-be-signed hash midstate.
+ *
+ * \param[in] cache                 The cache.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ *
+ * \return The hash context after the start of the to-be-signed bytes
+ * up to and including \c protected_parameters, or \c NULL if there
+ * isn't one. It must be cloned, not used directly.
+ *
+ * This is used by t_cose_sign1_verify() and should not be called
+ * directly.
+ */
+const struct t_cose_hash_storage *
+t_cose_header_cache_midstate(const struct t_cose_header_cache *cache,
+                             struct q_useful_buf_c             protected_parameters);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_HEADER_CACHE_H__ */
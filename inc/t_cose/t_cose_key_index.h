@@ -0,0 +1,273 @@
+/*
+ *  t_cose_key_index.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_KEY_INDEX_H__
+#define __T_COSE_KEY_INDEX_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_key_index.h
+ *
+ * \brief Look up verification keys by kid in a memory-mapped index file.
+ *
+ * This is for verifiers of messages from very many signers, for
+ * example EAT from a fleet of devices that each have their own key.
+ * The public keys are kept in an index file made once with
+ * t_cose_key_index_encode() or the \c t_cose_key_index_build tool.
+ * The verifier maps it with t_cose_key_index_open(), which takes
+ * about the same time whatever the size of the file. The key for a
+ * kid is only imported into the crypto library when a message with
+ * that kid is verified, and only the pages of the file holding the
+ * kids looked up are read from disk.
+ *
+ * t_cose_key_index_resolve() is a key resolver. It makes a new key
+ * every time so it is normally used behind a \ref t_cose_kid_cache
+ * that frees evicted keys with t_cose_key_index_free_key().
+ *
+ *     t_cose_key_index_open(&index, "/var/lib/fleet.tcki");
+ *     t_cose_kid_cache_init(&cache,
+ *                           t_cose_key_index_resolve,
+ *                           t_cose_key_index_free_key,
+ *                           &index);
+ *     t_cose_sign1_set_key_resolver(&verify_ctx,
+ *                                   t_cose_kid_cache_resolve,
+ *                                   &cache);
+ *
+ * The memory used then depends on the number of keys in the caches,
+ * not on the number of keys in the index. The index itself is only
+ * read so any number of threads, each with its own cache, can share
+ * it. Keys from this set up may be freed on any later look up. For
+ * t_cose_sign1_verify_prepare(), pin them with
+ * t_cose_kid_cache_resolve_pinned() and t_cose_kid_cache_release()
+ * instead. See t_cose_kid_cache.h.
+ *
+ * The index format, version 1, is as follows. All integers are
+ * unsigned little-endian unless noted.
+ *
+ *     offset  size  field
+ *          0     4  magic "TCKI"
+ *          4     2  version, 1
+ *          6     2  bucket bits, b
+ *          8     4  number of entries, n
+ *         12     4  reserved, 0
+ *         16     8  offset of the entry table
+ *         24     8  offset of the kid and key data
+ *         32     8  total size of the index
+ *         40        bucket table, 2^b + 1 entry numbers of 4 bytes
+ *
+ * The entry table is n entries of 24 bytes.
+ *
+ *          0     4  FNV-1a hash of the kid
+ *          4     2  kid length
+ *          6     2  public key length
+ *          8     4  COSE algorithm ID, signed
+ *         12     4  reserved, 0
+ *         16     8  offset of the kid; the public key follows it
+ *
+ * The entries are sorted by hash and then by kid. The top b bits of
+ * the hash select a bucket. Bucket i's entries are entry number
+ * bucket_table[i] up to but not including bucket_table[i + 1]. There
+ * is about one entry per bucket so a look up reads one bucket table
+ * entry, one or two entries and one kid.
+ *
+ * The public key is an uncompressed EC point, 0x04 followed by the X
+ * and Y coordinates, as in SEC 1 section 2.3.3.
+ *
+ * Opening and closing the index file needs POSIX file I/O and
+ * mmap(). They are only built with \c T_COSE_ENABLE_FILE_IO, but an
+ * index in memory can still be used with
+ * t_cose_key_index_init_buffer().
+ */
+
+
+/** The version of the index format written and understood. */
+#define T_COSE_KEY_INDEX_VERSION 1
+
+
+/**
+ * One key to put in an index with t_cose_key_index_encode().
+ */
+struct t_cose_key_index_entry {
+    /** The kid. Up to 65535 bytes. */
+    struct q_useful_buf_c kid;
+    /** The COSE algorithm the key is for, for example \ref
+     * T_COSE_ALGORITHM_ES256. */
+    int32_t               cose_algorithm_id;
+    /** The public key as an uncompressed EC point. */
+    struct q_useful_buf_c public_key;
+};
+
+
+/**
+ * An open key index. The caller should allocate it, but it is
+ * private and should not be accessed by the caller.
+ */
+struct t_cose_key_index {
+    /* Private data structure */
+    const uint8_t *bytes;
+    size_t         len;
+    uint32_t       entry_count;
+    uint32_t       bucket_bits;
+    const uint8_t *entries;
+    int            is_mapped;
+};
+
+
+/**
+ * \brief Make a key index.
+ *
+ * \param[in,out] entries  The keys. They are sorted in place.
+ * \param[in] count        The number of keys.
+ * \param[in] buffer       Where to put the index. If \c buffer.ptr
+ *                         is \c NULL only the size is computed.
+ * \param[out] index       The index made or just its size.
+ *
+ * \retval T_COSE_ERR_TOO_SMALL
+ *         \c buffer is too small.
+ * \retval T_COSE_ERR_INVALID_ARGUMENT
+ *         A kid or public key is too long, or two entries have the
+ *         same kid.
+ *
+ * Write \c index to a file to open it later with
+ * t_cose_key_index_open(). The public keys are not checked here.
+ */
+enum t_cose_err_t
+t_cose_key_index_encode(struct t_cose_key_index_entry *entries,
+                        size_t                         count,
+                        struct q_useful_buf            buffer,
+                        struct q_useful_buf_c         *index);
+
+
+/**
+ * \brief Use a key index that is already in memory.
+ *
+ * \param[out] index  The key index to initialize.
+ * \param[in] bytes   The index. It must stay valid while \c index is used.
+ *
+ * \return \ref T_COSE_ERR_KEY_INDEX_FORMAT if \c bytes is not a key
+ * index of a version understood.
+ */
+enum t_cose_err_t
+t_cose_key_index_init_buffer(struct t_cose_key_index *index,
+                             struct q_useful_buf_c    bytes);
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+/**
+ * \brief Memory map a key index file.
+ *
+ * \param[out] index  The key index to initialize.
+ * \param[in] path    The path of the file.
+ *
+ * \retval T_COSE_ERR_FILE_IO
+ *         The file couldn't be opened or mapped.
+ * \retval T_COSE_ERR_KEY_INDEX_FORMAT
+ *         The file is not a key index of a version understood.
+ *
+ * Nothing is read from the file here but the header. Close the index
+ * with t_cose_key_index_close(). As with any use of mmap(), the file
+ * must not be truncated while it is open. Replace it by renaming a
+ * new file over it instead.
+ */
+enum t_cose_err_t
+t_cose_key_index_open(struct t_cose_key_index *index,
+                      const char              *path);
+
+
+/**
+ * \brief Unmap a key index file.
+ *
+ * \param[in] index  The key index opened with t_cose_key_index_open().
+ *
+ * Keys made by t_cose_key_index_resolve() don't refer to the file so
+ * they may be freed after this.
+ */
+void
+t_cose_key_index_close(struct t_cose_key_index *index);
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+
+/**
+ * \brief Find the public key for a kid in a key index.
+ *
+ * \param[in] index               The key index.
+ * \param[in] kid                 The kid to look up.
+ * \param[out] cose_algorithm_id  The algorithm the key is for.
+ * \param[out] public_key         The public key as an uncompressed EC
+ *                                point. It points into the index.
+ *
+ * \retval T_COSE_ERR_UNKNOWN_KEY
+ *         There is no key for \c kid.
+ * \retval T_COSE_ERR_KEY_INDEX_FORMAT
+ *         The entry found runs off the end of the index.
+ */
+enum t_cose_err_t
+t_cose_key_index_find(const struct t_cose_key_index *index,
+                      struct q_useful_buf_c          kid,
+                      int32_t                       *cose_algorithm_id,
+                      struct q_useful_buf_c         *public_key);
+
+
+/**
+ * \brief Find the key for a kid in a key index and import it.
+ *
+ * \param[in] index              The \ref t_cose_key_index.
+ * \param[in] cose_algorithm_id  The algorithm of the message.
+ * \param[in] kid                The kid to look up.
+ * \param[out] key               The key, imported into the crypto library.
+ *
+ * \retval T_COSE_ERR_UNKNOWN_KEY
+ *         There is no key for \c kid.
+ * \retval T_COSE_ERR_WRONG_TYPE_OF_KEY
+ *         The key for \c kid is for another algorithm or its public
+ *         key could not be imported.
+ *
+ * This is a \ref t_cose_key_resolver_cb to give to
+ * t_cose_sign1_set_key_resolver() or t_cose_kid_cache_init() with the
+ * index as its context. Each successful call makes a new key that
+ * must be freed with t_cose_key_index_free_key().
+ */
+enum t_cose_err_t
+t_cose_key_index_resolve(void                  *index,
+                         int32_t                cose_algorithm_id,
+                         struct q_useful_buf_c  kid,
+                         struct t_cose_key     *key);
+
+
+/**
+ * \brief Free a key made by t_cose_key_index_resolve().
+ *
+ * \param[in] index  Not used.
+ * \param[in] key    The key to free.
+ *
+ * This is a \ref t_cose_key_evicted_cb to give to
+ * t_cose_kid_cache_init(). It is also a \ref t_cose_key_release_cb to
+ * give to t_cose_sign1_set_key_release() when
+ * t_cose_key_index_resolve() is used without a cache.
+ */
+void
+t_cose_key_index_free_key(void *index, struct t_cose_key key);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_KEY_INDEX_H__ */
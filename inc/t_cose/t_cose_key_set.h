@@ -0,0 +1,312 @@
+/*
+ *  t_cose_key_set.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_KEY_SET_H__
+#define __T_COSE_KEY_SET_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_key_set.h
+ *
+ * \brief A set of verification keys that can be replaced while in use.
+ *
+ * A \ref t_cose_key_set holds the trusted verification keys by kid
+ * for many verifying threads. A rotator thread replaces the whole set
+ * with a new generation of keys while the verifiers keep going. This
+ * is for key rotation in services that verify a lot.
+ *
+ * Each verifying thread has a \ref t_cose_key_set_reader and
+ * verifies between t_cose_key_set_read_begin() and
+ * t_cose_key_set_read_end() with t_cose_key_set_resolve() as the key
+ * resolver.
+ *
+ *     t_cose_key_set_read_begin(&reader);
+ *     t_cose_sign1_set_key_resolver(&verify_ctx,
+ *                                   t_cose_key_set_resolve,
+ *                                   &reader);
+ *     result = t_cose_sign1_verify(&verify_ctx, cose_sign1, &payload, NULL);
+ *     t_cose_key_set_read_end(&reader);
+ *
+ * The rotator publishes a new \ref t_cose_key_set_generation with
+ * t_cose_key_set_publish() and calls t_cose_key_set_reclaim() from
+ * time to time to free the old generations no reader can still be
+ * using.
+ *
+ * This is epoch-based reclamation. Beginning a read copies the
+ * current epoch to the reader's slot and ending it clears the
+ * slot. These are plain stores to a slot that is aligned to a cache
+ * line of its own plus a memory fence, not atomic read-modify-writes
+ * of shared data, so readers don't contend with each other however
+ * many there are. A generation retired at some epoch is freed once every slot
+ * is clear or has a later epoch.
+ *
+ * Publishing and reclaiming must be done by one thread at a time,
+ * usually a single rotator thread. Readers never block the rotator
+ * and the rotator never blocks readers, but a reader that stays in a
+ * read for a long time holds up reclaiming.
+ *
+ * No memory is allocated. The caller allocates the set, readers and
+ * generations and frees generations in the callback given to
+ * t_cose_key_set_init().
+ *
+ * This needs the GCC or Clang \c __atomic built-ins. It is only in
+ * the build when \c T_COSE_ENABLE_KEY_SET is defined.
+ */
+
+
+/**
+ * The maximum number of readers that can be registered with a key set
+ * at once.
+ */
+#ifndef T_COSE_KEY_SET_MAX_READERS
+#define T_COSE_KEY_SET_MAX_READERS 64
+#endif
+
+
+/**
+ * One key in a \ref t_cose_key_set_generation.
+ */
+struct t_cose_key_set_entry {
+    /** The kid of the key. */
+    struct q_useful_buf_c kid;
+    /** The verification key. */
+    struct t_cose_key     key;
+};
+
+
+/**
+ * One generation of keys in a key set. The entries must not change
+ * once it is published.
+ */
+struct t_cose_key_set_generation {
+    /* Private data structure */
+    const struct t_cose_key_set_entry *entries;
+    size_t                             count;
+    uint64_t                           retire_epoch;
+    struct t_cose_key_set_generation  *next_retired;
+};
+
+
+/**
+ * \brief Type of callback that frees a generation no longer in use.
+ *
+ * \param[in] cb_context  The context given to t_cose_key_set_init().
+ * \param[in] generation  The generation to free along with its keys.
+ */
+typedef void
+t_cose_key_set_free_cb(void                             *cb_context,
+                       struct t_cose_key_set_generation *generation);
+
+
+/* Private data structure. Each reader's epoch is on its own cache
+ * line so readers don't slow each other down by sharing lines. Both
+ * the size and the alignment must be a cache line for this. Being
+ * padded to 64 bytes isn't enough without the alignment. The slots
+ * would start part way into a line and each would span two. */
+struct t_cose_key_set_slot {
+    uint64_t epoch; /* 0 when not reading */
+    uint32_t in_use;
+    uint8_t  pad[64 - sizeof(uint64_t) - sizeof(uint32_t)];
+} __attribute__((aligned(64)));
+
+
+/**
+ * A shared set of verification keys. The caller should allocate it,
+ * but it is private and should not be accessed by the caller. It is
+ * about 4KB with the default number of readers.
+ *
+ * It is aligned to 64 bytes so each reader slot is on its own cache
+ * line. The compiler takes care of this for static and stack
+ * variables. Allocate it from the heap with aligned_alloc() or
+ * posix_memalign() rather than malloc().
+ */
+struct t_cose_key_set {
+    /* Private data structure */
+    struct t_cose_key_set_generation *current;
+    uint64_t                          epoch;
+    struct t_cose_key_set_generation *retired;
+    t_cose_key_set_free_cb           *free_generation;
+    void                             *cb_context;
+    struct t_cose_key_set_slot        slots[T_COSE_KEY_SET_MAX_READERS];
+};
+
+
+/**
+ * One thread's access to a key set. The caller should allocate it,
+ * but it is private and should not be accessed by the caller.
+ */
+struct t_cose_key_set_reader {
+    /* Private data structure */
+    struct t_cose_key_set                  *set;
+    struct t_cose_key_set_slot             *slot;
+    const struct t_cose_key_set_generation *generation;
+};
+
+
+/**
+ * \brief Initialize a key set.
+ *
+ * \param[out] set              The key set to initialize.
+ * \param[in] free_generation   Called for each generation that is no
+ *                              longer in use. May be \c NULL.
+ * \param[in] cb_context        Passed to \c free_generation.
+ *
+ * The set starts with no keys.
+ */
+void
+t_cose_key_set_init(struct t_cose_key_set  *set,
+                    t_cose_key_set_free_cb *free_generation,
+                    void                   *cb_context);
+
+
+/**
+ * \brief Make a generation of keys.
+ *
+ * \param[out] generation  The generation to initialize.
+ * \param[in,out] entries  The keys. They are sorted by kid in place.
+ * \param[in] count        The number of keys.
+ *
+ * \c entries and the kids and keys in them must stay valid until the
+ * generation is freed.
+ */
+void
+t_cose_key_set_generation_init(struct t_cose_key_set_generation *generation,
+                               struct t_cose_key_set_entry      *entries,
+                               size_t                            count);
+
+
+/**
+ * \brief Replace the keys in a key set.
+ *
+ * \param[in] set         The key set.
+ * \param[in] generation  The new keys.
+ *
+ * Readers that begin after this use the new keys. The generation
+ * replaced is retired and freed by a later t_cose_key_set_reclaim()
+ * once the readers using it are done.
+ */
+void
+t_cose_key_set_publish(struct t_cose_key_set            *set,
+                       struct t_cose_key_set_generation *generation);
+
+
+/**
+ * \brief Free retired generations no reader is using.
+ *
+ * \param[in] set  The key set.
+ *
+ * \return The number of retired generations still in use.
+ *
+ * This doesn't wait. Call it again later if it returns non-zero.
+ */
+size_t
+t_cose_key_set_reclaim(struct t_cose_key_set *set);
+
+
+/**
+ * \brief Free all the generations in a key set.
+ *
+ * \param[in] set  The key set.
+ *
+ * There must be no readers registered.
+ */
+void
+t_cose_key_set_destroy(struct t_cose_key_set *set);
+
+
+/**
+ * \brief Register a reader with a key set.
+ *
+ * \param[in] set      The key set.
+ * \param[out] reader  The reader to use in one thread.
+ *
+ * \return \ref T_COSE_ERR_TOO_MANY_READERS if \ref
+ * T_COSE_KEY_SET_MAX_READERS are already registered.
+ *
+ * Typically each verifying thread registers once when it starts.
+ */
+enum t_cose_err_t
+t_cose_key_set_reader_register(struct t_cose_key_set        *set,
+                               struct t_cose_key_set_reader *reader);
+
+
+/**
+ * \brief Unregister a reader.
+ *
+ * \param[in] reader  The reader. It must not be in a read.
+ */
+void
+t_cose_key_set_reader_unregister(struct t_cose_key_set_reader *reader);
+
+
+/**
+ * \brief Begin using the keys in a key set.
+ *
+ * \param[in] reader  The reader.
+ *
+ * The keys that are current now stay valid until
+ * t_cose_key_set_read_end() even if new keys are published.
+ */
+void
+t_cose_key_set_read_begin(struct t_cose_key_set_reader *reader);
+
+
+/**
+ * \brief End using the keys in a key set.
+ *
+ * \param[in] reader  The reader.
+ *
+ * No key found since t_cose_key_set_read_begin() may be used after
+ * this.
+ */
+void
+t_cose_key_set_read_end(struct t_cose_key_set_reader *reader);
+
+
+/**
+ * \brief Find the key for a kid in a key set.
+ *
+ * \param[in] reader             The \ref t_cose_key_set_reader in a read.
+ * \param[in] cose_algorithm_id  Not used.
+ * \param[in] kid                The kid to look up.
+ * \param[out] key               The key found.
+ *
+ * \return \ref T_COSE_ERR_UNKNOWN_KEY if there is no key for \c kid.
+ *
+ * This is a \ref t_cose_key_resolver_cb to give to
+ * t_cose_sign1_set_key_resolver() with the reader as its context.
+ * It looks in the generation that was current when the read began.
+ *
+ * Don't put a \ref t_cose_kid_cache in front of this. It would keep
+ * keys after their generation is freed.
+ */
+enum t_cose_err_t
+t_cose_key_set_resolve(void                  *reader,
+                       int32_t                cose_algorithm_id,
+                       struct q_useful_buf_c  kid,
+                       struct t_cose_key     *key);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_KEY_SET_H__ */
@@ -0,0 +1,254 @@
+/*
+ *  t_cose_kid_cache.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_KID_CACHE_H__
+#define __T_COSE_KID_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_kid_cache.h
+ *
+ * \brief Remember the verification keys found for recently seen kids.
+ *
+ * A \ref t_cose_kid_cache sits in front of a key resolver that is
+ * slow, for example one that looks keys up in a database or loads
+ * them from files. It is itself a key resolver so it is given to
+ * t_cose_sign1_set_key_resolver() like this.
+ *
+ *     t_cose_kid_cache_init(&cache, my_resolver, my_evicted, my_context);
+ *     t_cose_sign1_set_key_resolver(&verify_ctx,
+ *                                   t_cose_kid_cache_resolve,
+ *                                   &cache);
+ *
+ * The keys are kept in an open-addressing hash table keyed by the kid
+ * bytes. It holds up to \ref T_COSE_KID_CACHE_SIZE keys. When it is
+ * full the least recently used key is evicted to make room. Keys for
+ * kids longer than \ref T_COSE_KID_CACHE_MAX_KID_SIZE and failed
+ * look ups are not cached. The key for the last uncached kid is held
+ * until the next look up or t_cose_kid_cache_clear() so it is still
+ * passed to the evicted callback.
+ *
+ * The cache is keyed only by kid. The algorithm ID is passed to the
+ * resolver on a miss, but a hit returns the same key whatever the
+ * algorithm.
+ *
+ * No memory is allocated. The table is in the \ref t_cose_kid_cache
+ * which is about 2KB with the default sizes. It is not thread
+ * safe. Use one per thread or lock around its use.
+ *
+ * A key returned by t_cose_kid_cache_resolve() is only good until
+ * the next look up, which may evict it. That is enough for
+ * t_cose_sign1_verify() and the other verifies that use the key
+ * straight away. A key that must outlive later look ups, as with
+ * t_cose_sign1_verify_prepare() when the evicted callback frees keys,
+ * is pinned by looking it up with t_cose_kid_cache_resolve_pinned()
+ * instead, like this.
+ *
+ *     t_cose_sign1_set_key_resolver(&verify_ctx,
+ *                                   t_cose_kid_cache_resolve_pinned,
+ *                                   &cache);
+ *     t_cose_sign1_set_key_release(&verify_ctx, t_cose_kid_cache_release);
+ *
+ * A pinned key is not evicted, and one removed while pinned is not
+ * passed to the evicted callback, until it is given back with
+ * t_cose_kid_cache_release(). While all the keys in the cache are
+ * pinned, new keys are not cached; they are passed to the evicted
+ * callback when they are released.
+ */
+
+
+/**
+ * The maximum number of keys kept. It must be a power of two. The
+ * hash table has twice this many slots so probe sequences stay short.
+ */
+#ifndef T_COSE_KID_CACHE_SIZE
+#define T_COSE_KID_CACHE_SIZE 16
+#endif
+
+
+/**
+ * The longest kid that is cached. Keys for longer kids are looked up
+ * with the resolver every time. This is big enough for a SHA-256
+ * thumbprint.
+ */
+#ifndef T_COSE_KID_CACHE_MAX_KID_SIZE
+#define T_COSE_KID_CACHE_MAX_KID_SIZE 32
+#endif
+
+
+/**
+ * \brief Type of callback to tell the owner of a key it was evicted.
+ *
+ * \param[in] cb_context  The context given to t_cose_kid_cache_init().
+ * \param[in] key         The key that is no longer in the cache.
+ *
+ * This is called when a key is evicted to make room, removed with
+ * t_cose_kid_cache_remove() or t_cose_kid_cache_clear(). A key for a
+ * kid that is too long to cache is passed to it on the next look up.
+ * A resolver that makes a new key for each look up frees it here.
+ *
+ * For a pinned key this is put off until the last pin is released
+ * with t_cose_kid_cache_release().
+ */
+typedef void
+t_cose_key_evicted_cb(void *cb_context, struct t_cose_key key);
+
+
+/* Private data structure. One slot of the hash table. */
+struct t_cose_kid_cache_entry {
+    struct t_cose_key key;
+    uint64_t          last_use; /* 0 means the slot is empty */
+    uint32_t          hash;
+    uint32_t          pins;
+    bool              is_removed; /* Removed, but waiting for pins to go */
+    uint8_t           kid_len;
+    uint8_t           kid[T_COSE_KID_CACHE_MAX_KID_SIZE];
+};
+
+
+/**
+ * The kid cache. The caller should allocate it, but it is private
+ * and should not be accessed by the caller.
+ */
+struct t_cose_kid_cache {
+    /* Private data structure */
+    t_cose_key_resolver_cb       *resolver;
+    t_cose_key_evicted_cb        *evicted;
+    void                         *cb_context;
+    uint64_t                      use_clock;
+    size_t                        count;
+    struct t_cose_key             uncached_key;
+    bool                          has_uncached_key;
+    struct t_cose_kid_cache_entry slots[T_COSE_KID_CACHE_SIZE * 2];
+};
+
+
+/**
+ * \brief Initialize a kid cache.
+ *
+ * \param[out] cache     The cache to initialize.
+ * \param[in] resolver   The resolver that finds keys that aren't cached.
+ * \param[in] evicted    Called for each key that leaves the cache. May
+ *                       be \c NULL.
+ * \param[in] cb_context Passed to \c resolver and \c evicted.
+ */
+void
+t_cose_kid_cache_init(struct t_cose_kid_cache *cache,
+                      t_cose_key_resolver_cb  *resolver,
+                      t_cose_key_evicted_cb   *evicted,
+                      void                    *cb_context);
+
+
+/**
+ * \brief Find the key for a kid in the cache or with its resolver.
+ *
+ * \param[in] cache              The \ref t_cose_kid_cache.
+ * \param[in] cose_algorithm_id  Passed to the resolver on a miss.
+ * \param[in] kid                The kid to look up.
+ * \param[out] key               The key found.
+ *
+ * \return \ref T_COSE_SUCCESS or the error from the resolver.
+ *
+ * This is a \ref t_cose_key_resolver_cb to give to
+ * t_cose_sign1_set_key_resolver() with the cache as its context. It
+ * may also be called directly.
+ */
+enum t_cose_err_t
+t_cose_kid_cache_resolve(void                  *cache,
+                         int32_t                cose_algorithm_id,
+                         struct q_useful_buf_c  kid,
+                         struct t_cose_key     *key);
+
+
+/**
+ * \brief Find the key for a kid and pin it in the cache.
+ *
+ * \param[in] cache              The \ref t_cose_kid_cache.
+ * \param[in] cose_algorithm_id  Passed to the resolver on a miss.
+ * \param[in] kid                The kid to look up.
+ * \param[out] key               The key found.
+ *
+ * \return \ref T_COSE_SUCCESS or the error from the resolver.
+ *
+ * This is t_cose_kid_cache_resolve() except that the key found stays
+ * valid until it is given to t_cose_kid_cache_release(), whatever
+ * look ups, removals or clears happen in between. Every key this
+ * returns must be released exactly once. Give this to
+ * t_cose_sign1_set_key_resolver() together with
+ * t_cose_kid_cache_release() to t_cose_sign1_set_key_release() so
+ * t_cose releases the keys it looks up.
+ */
+enum t_cose_err_t
+t_cose_kid_cache_resolve_pinned(void                  *cache,
+                                int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  kid,
+                                struct t_cose_key     *key);
+
+
+/**
+ * \brief Unpin a key from t_cose_kid_cache_resolve_pinned().
+ *
+ * \param[in] cache  The \ref t_cose_kid_cache.
+ * \param[in] key    The key to unpin.
+ *
+ * If this was the last pin of a key that has since been evicted or
+ * removed, or of one that was never cached, the key is passed to the
+ * evicted callback now. This is a \ref t_cose_key_release_cb to give
+ * to t_cose_sign1_set_key_release().
+ */
+void
+t_cose_kid_cache_release(void *cache, struct t_cose_key key);
+
+
+/**
+ * \brief Remove the key for a kid from the cache.
+ *
+ * \param[in] cache  The cache.
+ * \param[in] kid    The kid whose key is removed.
+ *
+ * Use this when the key for a kid is revoked or replaced. It does
+ * nothing if the kid is not cached. Later look ups don't find a
+ * pinned key once it is removed, but it is kept until it is released.
+ */
+void
+t_cose_kid_cache_remove(struct t_cose_kid_cache *cache,
+                        struct q_useful_buf_c    kid);
+
+
+/**
+ * \brief Remove all keys from the cache.
+ *
+ * \param[in] cache  The cache.
+ *
+ * Call this before discarding the cache so the evicted callback is
+ * called for every key in it. Keys that are pinned are passed to it
+ * when they are released, so release them before discarding the
+ * cache.
+ */
+void
+t_cose_kid_cache_clear(struct t_cose_kid_cache *cache);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_KID_CACHE_H__ */
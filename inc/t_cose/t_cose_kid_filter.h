@@ -0,0 +1,221 @@
+/*
+ *  t_cose_kid_filter.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_KID_FILTER_H__
+#define __T_COSE_KID_FILTER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_kid_filter.h
+ *
+ * \brief Reject messages with unknown or revoked kids before verifying.
+ *
+ * A kid filter is a Bloom filter of kids. Given to
+ * t_cose_sign1_set_kid_filter() it is checked as soon as the
+ * unprotected header parameters are decoded, so a message with a kid
+ * that was never issued or that has been revoked fails with \ref
+ * T_COSE_ERR_KID_REJECTED before the payload is hashed, the key is
+ * looked up or any public key operation is done. Checking a kid
+ * costs one hash of the kid and reads one 64-byte block of the
+ * filter.
+ *
+ * A filter is made with one of two modes.
+ *
+ * - \ref T_COSE_KID_FILTER_ALLOW filters hold the kids that were
+ *   issued. Kids not in the filter are rejected. A small fraction of
+ *   unknown kids, the false positive rate, get through and then fail
+ *   in the key look up as they would without a filter.
+ *
+ * - \ref T_COSE_KID_FILTER_DENY filters hold revoked kids. Kids in
+ *   the filter are rejected. The false positive rate here is the
+ *   fraction of good kids that are rejected, so use enough bits per
+ *   kid to make it tolerable. 16 bits per kid gives roughly 1 in
+ *   1,000, 24 bits 1 in 15,000 and 32 bits 1 in 150,000.
+ *
+ * A filter never lets through a kid that it should reject.
+ *
+ * Filters are made with t_cose_kid_filter_encode() and are meant to
+ * be shipped as files and memory mapped with t_cose_kid_filter_open()
+ * so a revocation list of millions of kids costs neither start up
+ * time nor memory beyond the pages touched. A filter is only read
+ * so it can be shared by any number of threads and verification
+ * contexts.
+ *
+ * The filter format, version 1, is as follows. All integers are
+ * unsigned little-endian.
+ *
+ *     offset  size  field
+ *          0     4  magic "TCKF"
+ *          4     2  version, 1
+ *          6     1  mode, 1 for allow and 2 for deny
+ *          7     1  bits set per kid, k, 1 to 16
+ *          8     4  number of 64-byte blocks, m, at least 1
+ *         12     4  number of kids added, for information only
+ *         16     8  total size of the filter, 24 + 64 * m
+ *         24        the blocks
+ *
+ * A kid is hashed with 64-bit FNV-1a followed by the MurmurHash3
+ * 64-bit finalizer, fmix64. The top 32 bits of the hash, h, select
+ * block (h * m) >> 32. The bits set in the block come 9 at a time
+ * from the low 63 bits of x, where x starts as the hash and is
+ * replaced by fmix64(x + i) before bits i = 0, 7 and 14. Bit i is
+ * (x >> (9 * (i mod 7))) mod 512. Bit j of a block is bit j mod 8 of
+ * byte j / 8.
+ *
+ * Opening and closing filter files needs POSIX file I/O and
+ * mmap(). They are only built with \c T_COSE_ENABLE_FILE_IO, but a
+ * filter in memory can still be used with
+ * t_cose_kid_filter_init_buffer().
+ */
+
+
+/** The version of the filter format written and understood. */
+#define T_COSE_KID_FILTER_VERSION 1
+
+
+/**
+ * What a kid being in a filter means.
+ */
+enum t_cose_kid_filter_mode {
+    /** The filter holds the known kids. Others are rejected. */
+    T_COSE_KID_FILTER_ALLOW = 1,
+    /** The filter holds revoked kids. They are rejected. */
+    T_COSE_KID_FILTER_DENY  = 2
+};
+
+
+/**
+ * A kid filter in use. The caller should allocate it, but it is
+ * private and should not be accessed by the caller.
+ */
+struct t_cose_kid_filter {
+    /* Private data structure */
+    const uint8_t *bytes;
+    size_t         len;
+    const uint8_t *blocks;
+    uint32_t       block_count;
+    uint8_t        hash_count;
+    uint8_t        mode;
+    int            is_mapped;
+};
+
+
+/**
+ * \brief Make a kid filter.
+ *
+ * \param[in] mode          \ref T_COSE_KID_FILTER_ALLOW or
+ *                          \ref T_COSE_KID_FILTER_DENY.
+ * \param[in] kids          The kids to put in the filter.
+ * \param[in] count         The number of kids.
+ * \param[in] bits_per_kid  The size of the filter in bits per kid,
+ *                          4 to 64. More gives fewer false positives.
+ * \param[in] buffer        Where to put the filter. If \c buffer.ptr
+ *                          is \c NULL only the size is computed.
+ * \param[out] filter       The filter made or just its size.
+ *
+ * \retval T_COSE_ERR_TOO_SMALL
+ *         \c buffer is too small.
+ * \retval T_COSE_ERR_INVALID_ARGUMENT
+ *         \c mode or \c bits_per_kid is out of range, or there are
+ *         too many kids.
+ *
+ * The same kid may be given more than once. Write \c filter to a
+ * file to open it later with t_cose_kid_filter_open().
+ */
+enum t_cose_err_t
+t_cose_kid_filter_encode(enum t_cose_kid_filter_mode  mode,
+                         const struct q_useful_buf_c *kids,
+                         size_t                       count,
+                         unsigned                     bits_per_kid,
+                         struct q_useful_buf          buffer,
+                         struct q_useful_buf_c       *filter);
+
+
+/**
+ * \brief Use a kid filter that is already in memory.
+ *
+ * \param[out] filter  The kid filter to initialize.
+ * \param[in] bytes    The filter. It must stay valid while \c filter
+ *                     is used.
+ *
+ * \return \ref T_COSE_ERR_KID_FILTER_FORMAT if \c bytes is not a kid
+ * filter of a version understood.
+ */
+enum t_cose_err_t
+t_cose_kid_filter_init_buffer(struct t_cose_kid_filter *filter,
+                              struct q_useful_buf_c     bytes);
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+/**
+ * \brief Memory map a kid filter file.
+ *
+ * \param[out] filter  The kid filter to initialize.
+ * \param[in] path     The path of the file.
+ *
+ * \retval T_COSE_ERR_FILE_IO
+ *         The file couldn't be opened or mapped.
+ * \retval T_COSE_ERR_KID_FILTER_FORMAT
+ *         The file is not a kid filter of a version understood.
+ *
+ * Nothing is read from the file here but the header. Close the filter
+ * with t_cose_kid_filter_close(). As with any use of mmap(), the file
+ * must not be truncated while it is open. Replace it by renaming a
+ * new file over it instead.
+ */
+enum t_cose_err_t
+t_cose_kid_filter_open(struct t_cose_kid_filter *filter,
+                       const char               *path);
+
+
+/**
+ * \brief Unmap a kid filter file.
+ *
+ * \param[in] filter  The kid filter opened with t_cose_kid_filter_open().
+ *
+ * It must no longer be set in any verification context.
+ */
+void
+t_cose_kid_filter_close(struct t_cose_kid_filter *filter);
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+
+/**
+ * \brief Check a kid against a kid filter.
+ *
+ * \param[in] filter  The kid filter.
+ * \param[in] kid     The kid to check.
+ *
+ * \return \ref T_COSE_ERR_KID_REJECTED if \c kid is not in an allow
+ * filter or may be in a deny filter, otherwise \ref T_COSE_SUCCESS.
+ *
+ * This is what t_cose_sign1_verify() calls when a filter is set. It
+ * can also be called directly, for example to drop messages early in
+ * a network front end.
+ */
+enum t_cose_err_t
+t_cose_kid_filter_check(const struct t_cose_kid_filter *filter,
+                        struct q_useful_buf_c           kid);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_KID_FILTER_H__ */
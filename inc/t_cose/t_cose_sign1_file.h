@@ -0,0 +1,206 @@
+/*
+ *  t_cose_sign1_file.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_SIGN1_FILE_H__
+#define __T_COSE_SIGN1_FILE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_sign.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * \file t_cose_sign1_file.h
+ *
+ * \brief Sign and verify \c COSE_Sign1 with a detached payload in a file.
+ *
+ * These take the detached payload as a POSIX file descriptor or path
+ * rather than as a buffer in memory. They are built on the streaming
+ * functions t_cose_sign1_sign_detached_begin() and
+ * t_cose_sign1_verify_detached_begin().
+ *
+ * Regular files are memory mapped a window at a time with sequential
+ * access advice so the payload is hashed straight out of the page
+ * cache without being copied. Other files, such as pipes and
+ * sockets, are read into a buffer supplied by the caller a piece at
+ * a time. No memory is allocated either way and the memory used
+ * doesn't depend on the size of the payload.
+ *
+ * As with any use of mmap(), a regular file must not be truncated
+ * while it is being hashed.
+ *
+ * This needs POSIX file I/O and mmap(). It is only in the build when
+ * \c T_COSE_ENABLE_FILE_IO is defined.
+ */
+
+
+/**
+ * Pass this as \c payload_len to t_cose_sign1_sign_detached_fd() or
+ * t_cose_sign1_verify_detached_fd() to use the size of the file. It
+ * can only be used with regular files.
+ */
+#define T_COSE_PAYLOAD_LEN_FROM_FILE SIZE_MAX
+
+
+/**
+ * The size of the part of a regular file that is memory mapped at
+ * one time. This limits the address space used so large files can
+ * be handled on 32-bit machines. It must be a multiple of the page
+ * size.
+ */
+#ifndef T_COSE_FILE_MMAP_WINDOW
+#define T_COSE_FILE_MMAP_WINDOW (64 * 1024 * 1024)
+#endif
+
+
+/**
+ * \brief  Create and sign a \c COSE_Sign1 with a detached payload read from a file.
+ *
+ * \param[in] context      The t_cose signing context.
+ * \param[in] aad          The Additional Authenticated Data or
+ *                         \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] fd           File descriptor to read the payload from.
+ * \param[in] payload_len  Length of the payload or
+ *                         \ref T_COSE_PAYLOAD_LEN_FROM_FILE.
+ * \param[in] read_buffer  Buffer for reading files that can't be
+ *                         memory mapped. May be \c NULL_Q_USEFUL_BUF
+ *                         for regular files.
+ * \param[in] out_buf      Pointer and length of buffer to output to.
+ * \param[out] result      Pointer and length of the resulting \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * \retval T_COSE_ERR_FILE_IO
+ *         The file could not be read.
+ * \retval T_COSE_ERR_PAYLOAD_LENGTH
+ *         The file ended before \c payload_len bytes were read or
+ *         \ref T_COSE_PAYLOAD_LEN_FROM_FILE was given for a file
+ *         that is not a regular file.
+ *
+ * This gives the same result as t_cose_sign1_sign_detached() with the
+ * contents of the file as the payload.
+ *
+ * The payload starts at the current position of \c fd. For a regular
+ * file with \ref T_COSE_PAYLOAD_LEN_FROM_FILE it goes to the end of
+ * the file. Otherwise exactly \c payload_len bytes are read. The
+ * position of \c fd is left after the payload.
+ *
+ * The length of the payload must be known before hashing starts
+ * because it is part of the signed bytes before the payload, so it
+ * must be given for pipes and other files without a size.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_fd(struct t_cose_sign1_sign_ctx *context,
+                              struct q_useful_buf_c         aad,
+                              int                           fd,
+                              size_t                        payload_len,
+                              struct q_useful_buf           read_buffer,
+                              struct q_useful_buf           out_buf,
+                              struct q_useful_buf_c        *result);
+
+
+/**
+ * \brief  Create and sign a \c COSE_Sign1 with a detached payload in a named file.
+ *
+ * \param[in] context      The t_cose signing context.
+ * \param[in] aad          The Additional Authenticated Data or
+ *                         \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] path         Path of the file with the payload.
+ * \param[in] read_buffer  Buffer for reading files that can't be
+ *                         memory mapped.
+ * \param[in] out_buf      Pointer and length of buffer to output to.
+ * \param[out] result      Pointer and length of the resulting \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This opens \c path and calls t_cose_sign1_sign_detached_fd() with
+ * \ref T_COSE_PAYLOAD_LEN_FROM_FILE. The whole file is the payload.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_file(struct t_cose_sign1_sign_ctx *context,
+                                struct q_useful_buf_c         aad,
+                                const char                   *path,
+                                struct q_useful_buf           read_buffer,
+                                struct q_useful_buf           out_buf,
+                                struct q_useful_buf_c        *result);
+
+
+/**
+ * \brief Verify a \c COSE_Sign1 with a detached payload read from a file.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[in] cose_sign1    Pointer and length of CBOR encoded \c COSE_Sign1
+ *                          message that is to be verified.
+ * \param[in] aad           The Additional Authenticated Data or
+ *                          \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] fd            File descriptor to read the payload from.
+ * \param[in] payload_len   Length of the payload or
+ *                          \ref T_COSE_PAYLOAD_LEN_FROM_FILE.
+ * \param[in] read_buffer   Buffer for reading files that can't be
+ *                          memory mapped. May be \c NULL_Q_USEFUL_BUF
+ *                          for regular files.
+ * \param[out] parameters   Place to return parsed parameters. May be \c NULL.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This gives the same result as t_cose_sign1_verify_detached() with
+ * the contents of the file as the payload. The file is read as
+ * described for t_cose_sign1_sign_detached_fd(). The \c COSE_Sign1
+ * is decoded and checked before any of the file is read.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_fd(struct t_cose_sign1_verify_ctx *context,
+                                struct q_useful_buf_c           cose_sign1,
+                                struct q_useful_buf_c           aad,
+                                int                             fd,
+                                size_t                          payload_len,
+                                struct q_useful_buf             read_buffer,
+                                struct t_cose_parameters       *parameters);
+
+
+/**
+ * \brief Verify a \c COSE_Sign1 with a detached payload in a named file.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[in] cose_sign1    Pointer and length of CBOR encoded \c COSE_Sign1
+ *                          message that is to be verified.
+ * \param[in] aad           The Additional Authenticated Data or
+ *                          \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] path          Path of the file with the payload.
+ * \param[in] read_buffer   Buffer for reading files that can't be
+ *                          memory mapped.
+ * \param[out] parameters   Place to return parsed parameters. May be \c NULL.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This opens \c path and calls t_cose_sign1_verify_detached_fd() with
+ * \ref T_COSE_PAYLOAD_LEN_FROM_FILE. The whole file is the payload.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_file(struct t_cose_sign1_verify_ctx *context,
+                                  struct q_useful_buf_c           cose_sign1,
+                                  struct q_useful_buf_c           aad,
+                                  const char                     *path,
+                                  struct q_useful_buf             read_buffer,
+                                  struct t_cose_parameters       *parameters);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_SIGN1_FILE_H__ */
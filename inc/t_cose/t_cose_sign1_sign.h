@@ -52,7 +52,8 @@ extern "C" {
  * This implementation has a mode where a CBOR-format payload can be
  * output directly into the output buffer. This saves having two
  * copies of the payload in memory. For this mode use
- * t_cose_sign1_encode_parameters() and
+ * t_cose_sign1_sign_encode_payload() with a callback that outputs the
+ * payload, or t_cose_sign1_encode_parameters() and
  * t_cose_sign1_encode_signature(). For a simpler API that just takes
  * the payload as an input buffer use t_cose_sign1_sign().
  *
@@ -61,6 +62,50 @@ extern "C" {
  */
 
 
+/**
+ * This holds the hash of the part of the to-be-signed bytes that is
+ * the same for every message made with a signing context. See
+ * t_cose_sign1_sign_set_midstate(). The caller should allocate it,
+ * but it is private and should not be accessed by the caller.
+ */
+struct t_cose_sign1_midstate {
+    /* Private data structure */
+    int32_t                     cose_algorithm_id;
+    struct t_cose_hash_storage  hash_ctx;
+};
+
+
+/**
+ * This holds the state of a streaming detached sign in progress. See
+ * t_cose_sign1_sign_detached_begin(). The caller should allocate it,
+ * but it is private and should not be accessed by the caller.
+ */
+struct t_cose_sign1_sign_stream {
+    /* Private data structure */
+    size_t                      payload_remaining;
+    enum t_cose_err_t           error;
+    bool                        hash_started;
+    struct t_cose_hash_storage  hash_ctx;
+};
+
+
+/**
+ * This holds a \c COSE_Sign1 that is encoded up to the signature
+ * and is waiting for the signature from an external signer. See
+ * t_cose_sign1_sign_external_begin(). The caller should allocate it,
+ * but it is private and should not be accessed by the caller. It is
+ * about 100 bytes.
+ */
+struct t_cose_sign1_sign_pending {
+    /* Private data structure */
+    struct q_useful_buf         out_buf;
+    size_t                      encoded_len;
+    int32_t                     cose_algorithm_id;
+    uint8_t                     tbs_hash_len;
+    uint8_t                     tbs_hash[T_COSE_SIGN1_MAX_TBS_HASH_SIZE];
+};
+
+
 /**
  * This is the context for creating a \c COSE_Sign1 structure. The
  * caller should allocate it and pass it to the functions here.  This
@@ -77,6 +122,9 @@ struct t_cose_sign1_sign_ctx {
     uint32_t              content_type_uint;
     const char *          content_type_tstr;
 #endif
+    const struct t_cose_sign1_midstate *midstate;
+    struct q_useful_buf_c encoded_protected_parameters; /* From header template */
+    struct q_useful_buf_c encoded_unprotected_parameters;
 };
 
 
@@ -215,6 +263,74 @@ t_cose_sign1_set_content_type_tstr(struct t_cose_sign1_sign_ctx *context,
 #endif /* T_COSE_DISABLE_CONTENT_TYPE */
 
 
+/**
+ * \brief Set the unprotected header parameters as an encoded map.
+ *
+ * \param[in] context                  The t_cose signing context.
+ * \param[in] unprotected_parameters   A complete CBOR-encoded map.
+ *
+ * This gives the unprotected header parameters already encoded so
+ * that parameters other than the kid and content type can be
+ * included and no encoding of them is needed when signing. The bytes
+ * are copied into the \c COSE_Sign1 unchanged. They must be a single
+ * well-formed CBOR map. They are not checked.
+ *
+ * This replaces all the unprotected parameters t_cose would have
+ * output, so the kid given to t_cose_sign1_set_signing_key() and the
+ * content type are not added. If they are needed they must be in \c
+ * unprotected_parameters. (The short-circuit kid is also not added
+ * so a short-circuit signed message with this set can only be
+ * verified if the map includes it).
+ *
+ * The memory for \c unprotected_parameters must remain valid until
+ * signing is complete, unless t_cose_sign1_sign_set_header_template()
+ * is used.
+ *
+ * Pass \c NULL_Q_USEFUL_BUF_C to go back to t_cose encoding the
+ * unprotected parameters.
+ */
+static inline void
+t_cose_sign1_set_encoded_unprotected_parameters(struct t_cose_sign1_sign_ctx *context,
+                                                struct q_useful_buf_c         unprotected_parameters);
+
+
+/**
+ * \brief Encode the header parameters once for all messages.
+ *
+ * \param[in] context          The t_cose signing context.
+ * \param[in] template_buffer  Buffer for the encoded header parameters.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * \retval T_COSE_ERR_TOO_SMALL
+ *         \c template_buffer is too small.
+ *
+ * Normally the protected and unprotected header parameters are
+ * CBOR-encoded for every message signed. This encodes them once into
+ * \c template_buffer. After this every message signed with \c
+ * context has the encoded bytes copied into it without any
+ * encoding. This makes signing of many small messages faster.
+ *
+ * This must be called after the signing key, kid and content type
+ * are set. Changes made to them after this are not reflected in the
+ * header parameters. Calling t_cose_sign1_sign_init() discards the
+ * template.
+ *
+ * \c template_buffer must remain valid as long as \c context is
+ * used. \c T_COSE_SIGN1_MAX_SIZE_PROTECTED_PARAMETERS plus the size
+ * of the kid plus 20 bytes is enough for any header parameters
+ * except a MIME content type. A buffer with a \c NULL pointer
+ * can't be used as the bytes must be kept.
+ *
+ * If t_cose_sign1_set_encoded_unprotected_parameters() was called
+ * then only the protected parameters are put in the template. The
+ * encoded unprotected parameters are used directly as given.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_set_header_template(struct t_cose_sign1_sign_ctx *context,
+                                      struct q_useful_buf           template_buffer);
+
+
 
 /**
  * \brief  Create and sign a \c COSE_Sign1 message with a payload in one call.
@@ -325,6 +441,403 @@ t_cose_sign1_sign_detached(struct t_cose_sign1_sign_ctx *context,
                            struct q_useful_buf_c        *result);
 
 
+/**
+ * \brief  Compute the size of a \c COSE_Sign1 without hashing or signing.
+ *
+ * \param[in] context              The t_cose signing context.
+ * \param[in] payload_len          Length of the payload.
+ * \param[in] payload_is_detached  The payload will be detached.
+ * \param[out] cose_sign1_size     The size of the \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This gives the exact size of the \c COSE_Sign1 that
+ * t_cose_sign1_sign_aad(), t_cose_sign1_sign_detached() or
+ * t_cose_sign1_sign_in_place() will output for a payload of \c
+ * payload_len bytes with \c context as it is configured. Call it
+ * after setting the options, kid, content type and such.
+ *
+ * Unlike passing a \c NULL output buffer to t_cose_sign1_sign(), the
+ * payload isn't needed or hashed and the cryptographic library isn't
+ * called. The cost does not depend on the payload length.
+ *
+ * The signature size comes from the algorithm ID, not the key, so it
+ * is correct only if the key is on the curve that goes with the
+ * algorithm, for example P-256 for \ref T_COSE_ALGORITHM_ES256, as
+ * COSE recommends. Use the \c NULL output buffer size calculation if
+ * other key sizes must be handled.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_size(struct t_cose_sign1_sign_ctx *context,
+                       size_t                        payload_len,
+                       bool                          payload_is_detached,
+                       size_t                       *cose_sign1_size);
+
+
+/**
+ * \brief  Create and sign a \c COSE_Sign1 around a payload already in the output buffer.
+ *
+ * \param[in] context         The t_cose signing context.
+ * \param[in] aad             The Additional Authenticated Data or
+ *                            \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] buffer          Pointer and length of the buffer holding
+ *                            the payload and to output to.
+ * \param[in] payload_offset  Offset of the payload in \c buffer.
+ * \param[in] payload_len     Length of the payload.
+ * \param[out] result         Pointer and length of the resulting
+ *                            \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This gives the same \c COSE_Sign1 as t_cose_sign1_sign_aad(), but
+ * the payload is not copied. The tag, array head, header parameters
+ * and payload length are written into the headroom just before the
+ * payload and the signature into the tailroom just after it. This
+ * suits network stacks that have the payload in a packet buffer with
+ * space reserved at both ends.
+ *
+ * \c result is within \c buffer. It usually doesn't start at the
+ * beginning of \c buffer because the headroom is bigger than
+ * needed. The bytes of \c buffer outside of the payload may be
+ * overwritten even if there is an error.
+ *
+ * \ref T_COSE_ERR_TOO_SMALL is returned if there is not enough
+ * headroom or tailroom. The total needed is the size of the \c
+ * COSE_Sign1 less the payload length. It can be found with
+ * t_cose_sign1_sign_size(). The headroom is everything but the
+ * signature, which is one to three bytes of CBOR head plus the
+ * signature.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_in_place(struct t_cose_sign1_sign_ctx *context,
+                           struct q_useful_buf_c         aad,
+                           struct q_useful_buf           buffer,
+                           size_t                        payload_offset,
+                           size_t                        payload_len,
+                           struct q_useful_buf_c        *result);
+
+
+/**
+ * \brief  Start a detached-payload sign with the payload given in chunks.
+ *
+ * \param[in] context      The t_cose signing context.
+ * \param[out] stream      State of the sign in progress.
+ * \param[in] aad          The Additional Authenticated Data or
+ *                         \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload_len  The total length of the payload.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the same as t_cose_sign1_sign_detached() except the payload
+ * is passed in pieces with t_cose_sign1_sign_detached_update() rather
+ * than all at once. The payload never needs to be in memory all at
+ * once so very large payloads like firmware images can be signed
+ * with only the memory needed for one piece.
+ *
+ * The length of the payload must be known up front because it is
+ * part of the bytes hashed before the payload. The \c context is set
+ * up exactly as for t_cose_sign1_sign_detached() and is used again
+ * by t_cose_sign1_sign_detached_finish().
+ *
+ * On success, the sign must be completed with
+ * t_cose_sign1_sign_detached_finish() or
+ * t_cose_sign1_sign_detached_abort() so resources held by the hash
+ * are released. On error there is nothing to release, and
+ * t_cose_sign1_sign_detached_finish() returns the same error if it
+ * is called anyway.
+ *
+ * The output is exactly the same as t_cose_sign1_sign_detached() with
+ * the payload all in one buffer.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_begin(struct t_cose_sign1_sign_ctx    *context,
+                                 struct t_cose_sign1_sign_stream *stream,
+                                 struct q_useful_buf_c            aad,
+                                 size_t                           payload_len);
+
+
+/**
+ * \brief  Give the next piece of the payload to a streaming sign.
+ *
+ * \param[in] stream         State of the sign in progress.
+ * \param[in] payload_chunk  The next bytes of the payload.
+ *
+ * The pieces can be any size including zero. Errors, such as more
+ * payload than was given to t_cose_sign1_sign_detached_begin(), are
+ * remembered and returned by t_cose_sign1_sign_detached_finish().
+ */
+void
+t_cose_sign1_sign_detached_update(struct t_cose_sign1_sign_stream *stream,
+                                  struct q_useful_buf_c            payload_chunk);
+
+
+/**
+ * \brief  Complete a streaming detached-payload sign.
+ *
+ * \param[in] context  The t_cose signing context.
+ * \param[in] stream   State of the sign in progress.
+ * \param[in] out_buf  Pointer and length of buffer to output to.
+ * \param[out] result  Pointer and length of the resulting \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * \retval T_COSE_ERR_PAYLOAD_LENGTH
+ *         The total length of the payload pieces is not the length
+ *         given to t_cose_sign1_sign_detached_begin().
+ *
+ * This finishes the hash of the payload, signs and outputs the \c
+ * COSE_Sign1 message with a \c NULL payload. \c stream is complete
+ * after this whether it succeeds or not.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_finish(struct t_cose_sign1_sign_ctx    *context,
+                                  struct t_cose_sign1_sign_stream *stream,
+                                  struct q_useful_buf              out_buf,
+                                  struct q_useful_buf_c           *result);
+
+
+/**
+ * \brief  Abandon a streaming detached-payload sign.
+ *
+ * \param[in] stream  State of the sign in progress.
+ *
+ * This releases the resources of a sign that was started with
+ * t_cose_sign1_sign_detached_begin() and will not be finished.
+ */
+void
+t_cose_sign1_sign_detached_abort(struct t_cose_sign1_sign_stream *stream);
+
+
+/**
+ * \brief  Encode a \c COSE_Sign1 up to the signature for an external signer.
+ *
+ * \param[in] context    The t_cose signing context.
+ * \param[in] aad        The Additional Authenticated Data or
+ *                       \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload    The payload to sign.
+ * \param[in] out_buf    Pointer and length of buffer to output to.
+ * \param[out] pending   State of the \c COSE_Sign1 waiting for its
+ *                       signature.
+ * \param[out] tbs_hash  The hash of the to-be-signed bytes to give
+ *                       to the signer.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This splits t_cose_sign1_sign_aad() in two for signers that are
+ * slow to answer, such as a remote HSM. This does everything up to
+ * the signature: the tag, the array, the header parameters and the
+ * payload are output to \c out_buf and the to-be-signed bytes are
+ * hashed. The hash is sent to the signer however it likes and the
+ * signature it returns is given to
+ * t_cose_sign1_sign_external_finish() to complete the message.
+ *
+ * No CBOR encoder or crypto library state is kept while waiting for
+ * the signature. All that is needed is \c pending, which has a copy
+ * of the hash, and \c out_buf, so a thread can have hundreds of
+ * messages waiting on a signer at once. \c tbs_hash points into \c
+ * pending. \c context, \c aad and \c payload are no longer needed
+ * when this returns. \c pending needs no clean up if the signature
+ * never comes.
+ *
+ * \c out_buf must be big enough for the complete \c COSE_Sign1,
+ * including the signature, and must not be touched until
+ * t_cose_sign1_sign_external_finish() is called. Its size can be
+ * found with t_cose_sign1_sign_size(). Size calculation by passing a
+ * \c NULL pointer is not supported.
+ *
+ * The signer must sign the hash with the algorithm set in
+ * t_cose_sign1_sign_init() without hashing it again. The signing key
+ * in \c context is not used here. t_cose_sign1_sign_external_local()
+ * is a signer that works this way in the same process.
+ *
+ * The output is exactly the same as t_cose_sign1_sign_aad() with the
+ * same signature.
+ */
+static enum t_cose_err_t
+t_cose_sign1_sign_external_begin(struct t_cose_sign1_sign_ctx     *context,
+                                 struct q_useful_buf_c             aad,
+                                 struct q_useful_buf_c             payload,
+                                 struct q_useful_buf               out_buf,
+                                 struct t_cose_sign1_sign_pending *pending,
+                                 struct q_useful_buf_c            *tbs_hash);
+
+
+/**
+ * \brief  Encode a detached-payload \c COSE_Sign1 up to the signature for an external signer.
+ *
+ * \param[in] context           The t_cose signing context.
+ * \param[in] aad               The Additional Authenticated Data or
+ *                              \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] detached_payload  The detached payload to sign.
+ * \param[in] out_buf           Pointer and length of buffer to output to.
+ * \param[out] pending          State of the \c COSE_Sign1 waiting for
+ *                              its signature.
+ * \param[out] tbs_hash         The hash of the to-be-signed bytes to
+ *                              give to the signer.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the same as t_cose_sign1_sign_external_begin() except the
+ * payload is detached as for t_cose_sign1_sign_detached().
+ */
+static enum t_cose_err_t
+t_cose_sign1_sign_external_begin_detached(struct t_cose_sign1_sign_ctx     *context,
+                                          struct q_useful_buf_c             aad,
+                                          struct q_useful_buf_c             detached_payload,
+                                          struct q_useful_buf               out_buf,
+                                          struct t_cose_sign1_sign_pending *pending,
+                                          struct q_useful_buf_c            *tbs_hash);
+
+
+/**
+ * \brief  Complete a \c COSE_Sign1 with a signature from an external signer.
+ *
+ * \param[in] pending    State from t_cose_sign1_sign_external_begin().
+ * \param[in] signature  The signature of the hash of the to-be-signed
+ *                       bytes.
+ * \param[out] result    Pointer and length of the resulting
+ *                       \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * \retval T_COSE_ERR_SIG_FAIL
+ *         \c signature is not the size for the algorithm.
+ * \retval T_COSE_ERR_TOO_SMALL
+ *         The output buffer given to t_cose_sign1_sign_external_begin()
+ *         has no room for the signature.
+ *
+ * This appends the signature to the output buffer given to
+ * t_cose_sign1_sign_external_begin(). \c result starts at the start
+ * of that buffer. The signature is not checked other than for its
+ * size.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_finish(struct t_cose_sign1_sign_pending *pending,
+                                  struct q_useful_buf_c             signature,
+                                  struct q_useful_buf_c            *result);
+
+
+/**
+ * \brief  Sign a to-be-signed hash in process as an external signer would.
+ *
+ * \param[in] context     The t_cose signing context.
+ * \param[in] tbs_hash    The hash from t_cose_sign1_sign_external_begin().
+ * \param[in] buffer      Buffer for the signature, at least the size
+ *                        of a signature for the algorithm.
+ * \param[out] signature  The signature.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This signs \c tbs_hash the way t_cose_sign1_sign() would with the
+ * signing key, algorithm and options in \c context, including
+ * short-circuit signing. It stands in for a remote signer in tests
+ * and is a model for the signing an external signer must do.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_local(struct t_cose_sign1_sign_ctx *context,
+                                 struct q_useful_buf_c         tbs_hash,
+                                 struct q_useful_buf           buffer,
+                                 struct q_useful_buf_c        *signature);
+
+
+/**
+ * \brief  Create and sign many \c COSE_Sign1 messages with the same key.
+ *
+ * \param[in] context       The t_cose signing context.
+ * \param[in] payloads      Array of \c count payloads to sign.
+ * \param[in] out_bufs      Array of \c count buffers to output to.
+ * \param[out] results      Array of \c count resulting \c COSE_Sign1
+ *                          messages.
+ * \param[out] item_errors  Array of \c count error codes, one for
+ *                          each payload.
+ * \param[in] count         The number of payloads to sign.
+ *
+ * \return \ref T_COSE_SUCCESS if every payload was signed, otherwise
+ *         the error for the first payload that failed.
+ *
+ * This produces the same output as calling t_cose_sign1_sign() once
+ * for each payload, but is faster when signing large numbers of
+ * messages with the same key. Checking of the algorithm, encoding of
+ * the protected header parameters, computing the signature size and
+ * setting up of the cryptographic library's signing context is done
+ * once for all of the payloads rather than once for each. The
+ * to-be-signed bytes of several messages are hashed side by side,
+ * with multi-buffer SHA-256 when \c T_COSE_ENABLE_MULTI_BUFFER_SHA256
+ * is defined, so a midstate from t_cose_sign1_sign_set_midstate() is not used.
+ *
+ * The \c context is set up exactly as for t_cose_sign1_sign() and the
+ * same header parameters are used for every message.
+ *
+ * The outcome for each payload is in \c item_errors. A payload that
+ * fails, for example because its output buffer is too small, doesn't
+ * affect the signing of the others. The \c results entry for a
+ * payload that failed is \c NULL_Q_USEFUL_BUF_C. An error that
+ * applies to the key or algorithm such as
+ * \ref T_COSE_ERR_UNSUPPORTED_SIGNING_ALG is reported for every
+ * payload.
+ *
+ * Sizes can be calculated by giving entries in \c out_bufs with a
+ * \c NULL pointer as described for t_cose_sign1_sign().
+ *
+ * There is no batch version with AAD or detached payloads.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_batch(struct t_cose_sign1_sign_ctx *context,
+                        const struct q_useful_buf_c  *payloads,
+                        const struct q_useful_buf    *out_bufs,
+                        struct q_useful_buf_c        *results,
+                        enum t_cose_err_t            *item_errors,
+                        size_t                        count);
+
+
+
+/**
+ * \brief  Precompute the hash of the fixed part of the to-be-signed bytes.
+ *
+ * \param[in] context    The t_cose signing context.
+ * \param[out] midstate  Storage for the precomputed hash state.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * The bytes that are hashed and signed for a \c COSE_Sign1 start
+ * with a fixed context string and the encoded protected header
+ * parameters. These are the same for every message signed with \c
+ * context. This hashes them once and keeps the state of the hash
+ * part way through in \c midstate. After this, each message signed
+ * with \c context starts with a copy of that state and only hashes
+ * the AAD and the payload. This saves a significant share of the
+ * hashing for small payloads such as CWTs.
+ *
+ * This must be called after t_cose_sign1_sign_init(). \c midstate is
+ * used by \c context until t_cose_sign1_sign_init() is called on it
+ * again, so it must remain valid until then. The output is exactly
+ * the same with or without a midstate.
+ *
+ * Some crypto libraries allocate memory for a hash in progress, so
+ * t_cose_sign1_midstate_free() must be called when \c midstate is no
+ * longer needed.
+ *
+ * If this returns an error \c context does not use a midstate and
+ * t_cose_sign1_midstate_free() need not be called.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_set_midstate(struct t_cose_sign1_sign_ctx *context,
+                               struct t_cose_sign1_midstate *midstate);
+
+
+/**
+ * \brief  Release a precomputed hash state.
+ *
+ * \param[in] midstate  The hash state to release.
+ *
+ * This releases any resources held by a midstate that was set up
+ * with t_cose_sign1_sign_set_midstate(). No signing context may use
+ * \c midstate after this.
+ */
+void
+t_cose_sign1_midstate_free(struct t_cose_sign1_midstate *midstate);
+
+
 
 /**
  * \brief  Output first part and parameters for a \c COSE_Sign1 message.
@@ -412,6 +925,64 @@ t_cose_sign1_encode_signature_aad(struct t_cose_sign1_sign_ctx *context,
                                   QCBOREncodeContext          *cbor_encode_ctx);
 
 
+/**
+ * \brief Type of function that encodes a payload for
+ *        t_cose_sign1_sign_encode_payload().
+ *
+ * \param[in] payload_ctx      Context passed to
+ *                             t_cose_sign1_sign_encode_payload().
+ * \param[in] cbor_encode_ctx  Encoding context to output the payload to.
+ *
+ * \return \ref T_COSE_SUCCESS or an error that stops the signing and is
+ *         returned by t_cose_sign1_sign_encode_payload().
+ *
+ * This is called with \c cbor_encode_ctx positioned inside the
+ * payload bstr. It should add the payload with \c QCBOREncode_AddXxx
+ * calls, usually as one CBOR item such as a map of claims. It must
+ * close everything it opens. Encoding errors are tracked by \c
+ * cbor_encode_ctx so they don't have to be returned.
+ */
+typedef enum t_cose_err_t
+t_cose_payload_encode_cb(void               *payload_ctx,
+                         QCBOREncodeContext *cbor_encode_ctx);
+
+
+/**
+ * \brief Create and sign a \c COSE_Sign1 with a payload output by a callback.
+ *
+ * \param[in] context       The t_cose signing context.
+ * \param[in] aad           The Additional Authenticated Data or
+ *                          \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] encode_cb     Function that encodes the payload.
+ * \param[in] payload_ctx   Context passed to \c encode_cb.
+ * \param[in] out_buf       Pointer and length of buffer to output to.
+ * \param[out] result       Pointer and length of the resulting \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This gives the same result as encoding the payload into a buffer
+ * and passing it to t_cose_sign1_sign_aad(), but the payload is
+ * encoded straight into \c out_buf so there is no intermediate
+ * buffer or copy. It does for the caller what is otherwise done
+ * with t_cose_sign1_encode_parameters() and
+ * t_cose_sign1_encode_signature_aad().
+ *
+ * The payload is hashed where it lies in \c out_buf after \c
+ * encode_cb returns.
+ *
+ * As with t_cose_sign1_sign_aad(), \c out_buf may have a \c NULL
+ * pointer to compute the size of the \c COSE_Sign1. \c encode_cb is
+ * called in that case too and should output the same payload.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_encode_payload(struct t_cose_sign1_sign_ctx *context,
+                                 struct q_useful_buf_c         aad,
+                                 t_cose_payload_encode_cb     *encode_cb,
+                                 void                         *payload_ctx,
+                                 struct q_useful_buf           out_buf,
+                                 struct q_useful_buf_c        *result);
+
+
 
 
 
@@ -445,6 +1016,14 @@ t_cose_sign1_set_signing_key(struct t_cose_sign1_sign_ctx *me,
 }
 
 
+static inline void
+t_cose_sign1_set_encoded_unprotected_parameters(struct t_cose_sign1_sign_ctx *me,
+                                                struct q_useful_buf_c         unprotected_parameters)
+{
+    me->encoded_unprotected_parameters = unprotected_parameters;
+}
+
+
 /**
  * \brief Semi-private function that ouputs the COSE parameters, startng a
  *        \c COSE_Sign1 message.
@@ -579,6 +1158,70 @@ t_cose_sign1_sign_detached(struct t_cose_sign1_sign_ctx *me,
 }
 
 
+/**
+ * \brief Semi-private function that encodes up to the signature for an external signer.
+ *
+ * \param[in] context              The t_cose signing context.
+ * \param[in] payload_is_detached  If \c true, then \c payload is detached.
+ * \param[in] payload              The payload, inline or detached.
+ * \param[in] aad                  The Additional Authenticated Data or
+ *                                 \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] out_buf              Pointer and length of buffer to output to.
+ * \param[out] pending             State of the \c COSE_Sign1 waiting
+ *                                 for its signature.
+ * \param[out] tbs_hash            The hash of the to-be-signed bytes.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is a private function internal to the implementation. Call
+ * t_cose_sign1_sign_external_begin() instead of this.
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_begin_internal(struct t_cose_sign1_sign_ctx     *context,
+                                          bool                              payload_is_detached,
+                                          struct q_useful_buf_c             payload,
+                                          struct q_useful_buf_c             aad,
+                                          struct q_useful_buf               out_buf,
+                                          struct t_cose_sign1_sign_pending *pending,
+                                          struct q_useful_buf_c            *tbs_hash);
+
+
+static inline enum t_cose_err_t
+t_cose_sign1_sign_external_begin(struct t_cose_sign1_sign_ctx     *me,
+                                 struct q_useful_buf_c             aad,
+                                 struct q_useful_buf_c             payload,
+                                 struct q_useful_buf               out_buf,
+                                 struct t_cose_sign1_sign_pending *pending,
+                                 struct q_useful_buf_c            *tbs_hash)
+{
+    return t_cose_sign1_sign_external_begin_internal(me,
+                                                     false,
+                                                     payload,
+                                                     aad,
+                                                     out_buf,
+                                                     pending,
+                                                     tbs_hash);
+}
+
+
+static inline enum t_cose_err_t
+t_cose_sign1_sign_external_begin_detached(struct t_cose_sign1_sign_ctx     *me,
+                                          struct q_useful_buf_c             aad,
+                                          struct q_useful_buf_c             detached_payload,
+                                          struct q_useful_buf               out_buf,
+                                          struct t_cose_sign1_sign_pending *pending,
+                                          struct q_useful_buf_c            *tbs_hash)
+{
+    return t_cose_sign1_sign_external_begin_internal(me,
+                                                     true,
+                                                     detached_payload,
+                                                     aad,
+                                                     out_buf,
+                                                     pending,
+                                                     tbs_hash);
+}
+
+
 static inline enum t_cose_err_t
 t_cose_sign1_encode_signature_aad(struct t_cose_sign1_sign_ctx *me,
                                   struct q_useful_buf_c         aad,
@@ -187,14 +187,118 @@ struct t_cose_parameters {
 
 
 /**
- * Context for signature verification.  It is about 56 bytes on a
- * 64-bit machine and 42 bytes on a 32-bit machine.
+ * \brief Type of callback that finds the verification key for a kid.
+ *
+ * \param[in] cb_context         The context given to
+ *                               t_cose_sign1_set_key_resolver().
+ * \param[in] cose_algorithm_id  The algorithm ID from the protected
+ *                               header parameters.
+ * \param[in] kid                The kid from the header parameters or
+ *                               \c NULL_Q_USEFUL_BUF_C if there is none.
+ * \param[out] key               The verification key.
+ *
+ * \return \ref T_COSE_SUCCESS if \c key was set, \ref
+ * T_COSE_ERR_UNKNOWN_KEY if there is no key for \c kid or some other
+ * error. The error is returned by the verification.
+ *
+ * \c kid points into the \c COSE_Sign1 being verified. It is only
+ * valid for the duration of the call. The key returned must stay
+ * valid until the verification is complete, or if a release callback
+ * is set with t_cose_sign1_set_key_release(), until it is released.
+ */
+typedef enum t_cose_err_t
+t_cose_key_resolver_cb(void                  *cb_context,
+                       int32_t                cose_algorithm_id,
+                       struct q_useful_buf_c  kid,
+                       struct t_cose_key     *key);
+
+
+/**
+ * \brief Type of callback to give back a key from the key resolver.
+ *
+ * \param[in] cb_context  The context given to
+ *                        t_cose_sign1_set_key_resolver().
+ * \param[in] key         A key the resolver returned.
+ *
+ * This is called once for each key the resolver returns, when t_cose
+ * is done with it. See t_cose_sign1_set_key_release().
+ */
+typedef void
+t_cose_key_release_cb(void *cb_context, struct t_cose_key key);
+
+
+/* See t_cose_kid_filter.h */
+struct t_cose_kid_filter;
+
+/* See t_cose_verify_cache.h */
+struct t_cose_verify_cache;
+
+/* See t_cose_header_cache.h */
+struct t_cose_header_cache;
+
+
+/**
+ * Context for signature verification.  It is about 96 bytes on a
+ * 64-bit machine and 62 bytes on a 32-bit machine.
  */
 struct t_cose_sign1_verify_ctx {
     /* Private data structure */
-    struct t_cose_key     verification_key;
-    uint32_t              option_flags;
-    uint64_t              auTags[T_COSE_MAX_TAGS_TO_RETURN];
+    struct t_cose_key               verification_key;
+    t_cose_key_resolver_cb         *key_resolver;
+    t_cose_key_release_cb          *key_release;
+    void                           *key_resolver_context;
+    const struct t_cose_kid_filter *kid_filter;
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+    struct t_cose_verify_cache     *verify_cache;
+#endif
+    struct t_cose_header_cache     *header_cache;
+    uint32_t                        option_flags;
+    uint64_t                        auTags[T_COSE_MAX_TAGS_TO_RETURN];
+};
+
+
+/**
+ * This holds the state of a streaming detached-payload verification
+ * in progress. See t_cose_sign1_verify_detached_begin(). The caller
+ * should allocate it, but it is private and should not be accessed by
+ * the caller.
+ */
+struct t_cose_sign1_verify_stream {
+    /* Private data structure */
+    struct t_cose_parameters    parameters;
+    struct q_useful_buf_c       signature;
+    size_t                      payload_remaining;
+    enum t_cose_err_t           error;
+    bool                        hash_started;
+    bool                        is_short_circuit;
+    struct t_cose_key           verification_key;
+    t_cose_key_release_cb      *key_release;
+    void                       *key_release_context;
+    struct t_cose_hash_storage  hash_ctx;
+};
+
+
+/**
+ * This holds a \c COSE_Sign1 that has been decoded and hashed and is
+ * ready for its signature to be checked. See
+ * t_cose_sign1_verify_prepare(). The caller should allocate it, but
+ * it is private and should not be accessed by the caller. It is about
+ * 270 bytes on a 64-bit machine.
+ */
+struct t_cose_sign1_verify_prepared {
+    /* Private data structure */
+    struct t_cose_parameters    parameters;
+    struct q_useful_buf_c       protected_parameters;
+    struct q_useful_buf_c       aad;
+    struct q_useful_buf_c       payload;
+    struct q_useful_buf_c       signature;
+    struct t_cose_key           verification_key;
+    t_cose_key_release_cb      *key_release;
+    void                       *key_release_context;
+    bool                        is_short_circuit;
+    bool                        is_decode_only;
+    size_t                      tbs_hash_len;
+    uint8_t                     tbs_hash[T_COSE_SIGN1_MAX_TBS_HASH_SIZE];
 };
 
 
@@ -258,12 +362,137 @@ t_cose_sign1_verify_init(struct t_cose_sign1_verify_ctx *context,
  * 3 always works no matter what is done in the cryptographic
  * adaptation layer because it never calls out to it. The OpenSSL
  * adaptor supports 1 and 2.
+ *
+ * Look up by kid can also be done in one pass with
+ * t_cose_sign1_set_key_resolver(). It takes precedence over the key
+ * set here.
  */
 static void
 t_cose_sign1_set_verification_key(struct t_cose_sign1_verify_ctx *context,
                                   struct t_cose_key               verification_key);
 
 
+/**
+ * \brief Set a callback to find the verification key by kid.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[in] resolver      The callback or \c NULL to use the key set
+ *                          by t_cose_sign1_set_verification_key().
+ * \param[in] cb_context    Passed to \c resolver.
+ *
+ * This is for verifiers that receive messages signed by many
+ * keys. Once the header parameters are decoded \c resolver is called
+ * with the kid and the algorithm ID and the key it returns is used
+ * to verify the signature. The \c COSE_Sign1 is only decoded once,
+ * unlike with \ref T_COSE_OPT_DECODE_ONLY.
+ *
+ * The resolver is not called for short-circuit signatures or with
+ * \ref T_COSE_OPT_DECODE_ONLY. Use \ref T_COSE_OPT_REQUIRE_KID to
+ * reject messages without a kid before the resolver is called.
+ *
+ * t_cose_kid_cache_resolve() in t_cose_kid_cache.h is a resolver
+ * that remembers the keys found by another resolver for recently
+ * seen kids.
+ */
+static void
+t_cose_sign1_set_key_resolver(struct t_cose_sign1_verify_ctx *context,
+                              t_cose_key_resolver_cb         *resolver,
+                              void                           *cb_context);
+
+
+/**
+ * \brief Set a callback to give back keys from the key resolver.
+ *
+ * \param[in,out] context  The t_cose signature verification context.
+ * \param[in] release      The callback or \c NULL for none.
+ *
+ * \c release is called with the context given to
+ * t_cose_sign1_set_key_resolver() and each key the resolver returned
+ * once the verification that looked it up is done with it, whether
+ * it succeeded or not. For t_cose_sign1_verify_prepare() that is in
+ * t_cose_sign1_verify_complete() or
+ * t_cose_sign1_verify_prepared_release(). For a streaming verify it
+ * is in t_cose_sign1_verify_detached_finish() or
+ * t_cose_sign1_verify_detached_abort().
+ *
+ * This lets a resolver hand out keys that stay valid however many
+ * look ups happen before they are released, for example
+ * t_cose_kid_cache_resolve_pinned() with t_cose_kid_cache_release(),
+ * or a resolver that makes a new key each time, such as
+ * t_cose_key_index_resolve(), with t_cose_key_index_free_key().
+ */
+static void
+t_cose_sign1_set_key_release(struct t_cose_sign1_verify_ctx *context,
+                             t_cose_key_release_cb          *release);
+
+
+/**
+ * \brief Set a filter to reject unknown or revoked kids early.
+ *
+ * \param[in,out] context  The t_cose signature verification context.
+ * \param[in] filter       The kid filter or \c NULL for none.
+ *
+ * The kid is checked against \c filter as soon as the unprotected
+ * header parameters are decoded. If it is rejected,
+ * t_cose_sign1_verify() and t_cose_sign1_verify_detached_begin()
+ * return \ref T_COSE_ERR_KID_REJECTED without decoding the rest of
+ * the message, hashing or looking up the key. The kid is still
+ * returned in the parameters.
+ *
+ * This applies with \ref T_COSE_OPT_DECODE_ONLY and to the
+ * short-circuit kid too. Messages without a kid are not checked; use
+ * \ref T_COSE_OPT_REQUIRE_KID to reject them.
+ *
+ * The filter is only read so one can be shared by many contexts and
+ * threads. It must stay valid while \c context is used. See
+ * t_cose_kid_filter.h.
+ */
+static void
+t_cose_sign1_set_kid_filter(struct t_cose_sign1_verify_ctx *context,
+                            const struct t_cose_kid_filter *filter);
+
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+/**
+ * \brief Set a cache of messages that verified.
+ *
+ * \param[in,out] context  The t_cose signature verification context.
+ * \param[in] cache        The cache or \c NULL for none.
+ *
+ * A message that verified before with the same key, resolver and
+ * options is not verified again. t_cose_sign1_verify() returns the
+ * payload and parameters right away. See t_cose_verify_cache.h for
+ * when entries expire and what isn't cached.
+ *
+ * One cache can be shared by many contexts and threads. It must stay
+ * valid while \c context is used.
+ */
+static void
+t_cose_sign1_set_verify_cache(struct t_cose_sign1_verify_ctx *context,
+                              struct t_cose_verify_cache     *cache);
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+
+/**
+ * \brief Set a cache of parsed protected header parameters.
+ *
+ * \param[in,out] context  The t_cose signature verification context.
+ * \param[in] cache        The cache or \c NULL for none.
+ *
+ * Protected header parameters seen before are not parsed again and
+ * hashing of the to-be-signed bytes starts from where it got to after
+ * them last time. This applies to t_cose_sign1_verify(),
+ * t_cose_sign1_verify_detached() and
+ * t_cose_sign1_verify_detached_begin(). See t_cose_header_cache.h.
+ *
+ * The cache is not thread safe. It must stay valid while \c context
+ * is used.
+ */
+static void
+t_cose_sign1_set_header_cache(struct t_cose_sign1_verify_ctx *context,
+                              struct t_cose_header_cache     *cache);
+
+
 /**
  * \brief Verify a \c COSE_Sign1.
  *
@@ -387,6 +616,285 @@ t_cose_sign1_verify_detached(struct t_cose_sign1_verify_ctx *context,
                              struct t_cose_parameters       *parameters);
 
 
+/**
+ * \brief Start verifying a COSE_Sign1 with a detached payload given in chunks.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[out] stream       State of the verification in progress.
+ * \param[in] cose_sign1    Pointer and length of CBOR encoded \c COSE_Sign1
+ *                          message that is to be verified.
+ * \param[in] aad           The Additional Authenticated Data or
+ *                          \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload_len   The total length of the detached payload.
+ * \param[out] parameters   Place to return parsed parameters. May be \c NULL.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the same as t_cose_sign1_verify_detached() except the
+ * detached payload is passed in pieces with
+ * t_cose_sign1_verify_detached_update() rather than all at once. The
+ * memory needed doesn't depend on the size of the payload so very
+ * large payloads can be verified as they are read. Each piece is
+ * hashed as it is given so hashing can proceed while the next piece
+ * is being read.
+ *
+ * This decodes the \c COSE_Sign1, checks its header parameters and
+ * starts the hash. The errors for a bad \c COSE_Sign1 are returned
+ * here before any payload is processed. \c cose_sign1 must remain
+ * valid until t_cose_sign1_verify_detached_finish() is called as the
+ * signature in it is used then.
+ *
+ * The verification key is not used until
+ * t_cose_sign1_verify_detached_finish() so it may be set after this
+ * using the kid returned in \c parameters. If a key resolver is set
+ * with t_cose_sign1_set_key_resolver() it is called here so an
+ * unknown kid fails before any payload is hashed.
+ *
+ * On success, this must be completed with
+ * t_cose_sign1_verify_detached_finish() or
+ * t_cose_sign1_verify_detached_abort() so resources held by the hash
+ * are released. On error there is nothing to release, and
+ * t_cose_sign1_verify_detached_finish() returns the same error if it
+ * is called anyway.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_begin(struct t_cose_sign1_verify_ctx    *context,
+                                   struct t_cose_sign1_verify_stream *stream,
+                                   struct q_useful_buf_c              cose_sign1,
+                                   struct q_useful_buf_c              aad,
+                                   size_t                             payload_len,
+                                   struct t_cose_parameters          *parameters);
+
+
+/**
+ * \brief Give the next piece of the detached payload to a streaming verify.
+ *
+ * \param[in] stream         State of the verification in progress.
+ * \param[in] payload_chunk  The next bytes of the payload.
+ *
+ * The pieces can be any size including zero. Errors, such as more
+ * payload than was given to t_cose_sign1_verify_detached_begin(),
+ * are remembered and returned by
+ * t_cose_sign1_verify_detached_finish().
+ */
+void
+t_cose_sign1_verify_detached_update(struct t_cose_sign1_verify_stream *stream,
+                                    struct q_useful_buf_c              payload_chunk);
+
+
+/**
+ * \brief Complete a streaming detached-payload verify.
+ *
+ * \param[in] context  The t_cose signature verification context.
+ * \param[in] stream   State of the verification in progress.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * \retval T_COSE_ERR_PAYLOAD_LENGTH
+ *         The total length of the payload pieces is not the length
+ *         given to t_cose_sign1_verify_detached_begin().
+ * \retval T_COSE_ERR_SIG_VERIFY
+ *         The signature did not verify.
+ *
+ * This finishes the hash and checks the signature. \c stream is
+ * complete after this whether it succeeds or not.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_finish(struct t_cose_sign1_verify_ctx    *context,
+                                    struct t_cose_sign1_verify_stream *stream);
+
+
+/**
+ * \brief Abandon a streaming detached-payload verify.
+ *
+ * \param[in] stream  State of the verification in progress.
+ *
+ * This releases the resources of a verification that was started
+ * with t_cose_sign1_verify_detached_begin() and will not be finished.
+ */
+void
+t_cose_sign1_verify_detached_abort(struct t_cose_sign1_verify_stream *stream);
+
+
+/**
+ * \brief Decode and hash a \c COSE_Sign1 without checking its signature.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[in] cose_sign1    Pointer and length of CBOR encoded \c COSE_Sign1
+ *                          message that is to be verified.
+ * \param[in] aad           The Additional Authenticated Data or
+ *                          \c NULL_Q_USEFUL_BUF_C.
+ * \param[out] payload      Pointer and length of the payload.
+ * \param[out] parameters   Place to return parsed parameters. May be \c NULL.
+ * \param[out] prepared     The message ready for
+ *                          t_cose_sign1_verify_complete().
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the first half of t_cose_sign1_verify_aad(). It does
+ * everything except the public key operation: the message is decoded,
+ * the header parameters are checked, the verification key is found
+ * and the to-be-signed bytes are hashed. The signature is checked
+ * later by t_cose_sign1_verify_complete(), which needs neither \c
+ * context nor anything else to be passed. A message that fails to
+ * decode is rejected here without ever using the crypto library's
+ * public key operations, so this can run on threads that parse and
+ * route messages while a separate pool does the verification.
+ *
+ * The payload and parameters returned are not yet authenticated and
+ * must not be trusted until t_cose_sign1_verify_complete() succeeds.
+ *
+ * \c prepared points into \c cose_sign1 and \c aad, and holds the
+ * key from t_cose_sign1_set_verification_key() or the key resolver.
+ * They must stay valid until t_cose_sign1_verify_complete() is
+ * called. Only call t_cose_sign1_verify_complete() if this
+ * succeeded. On error there is nothing to release.
+ *
+ * A key from the resolver is held until
+ * t_cose_sign1_verify_complete() or, for a message that won't be
+ * completed, t_cose_sign1_verify_prepared_release(). If a release
+ * callback is set with t_cose_sign1_set_key_release() it is called
+ * then, so a resolver can keep the key from being freed by look ups
+ * for other messages in between. That is needed with a \ref
+ * t_cose_kid_cache whose evicted callback frees keys; use
+ * t_cose_kid_cache_resolve_pinned() and t_cose_kid_cache_release().
+ * Without a release callback \c prepared can be copied or discarded,
+ * but the resolver's keys must outlive it.
+ *
+ * If the crypto adapter hashes and verifies in one operation the
+ * hashing is left to t_cose_sign1_verify_complete().
+ *
+ * A verification cache set with t_cose_sign1_set_verify_cache() is
+ * not used. With \ref T_COSE_OPT_DECODE_ONLY nothing is hashed and
+ * t_cose_sign1_verify_complete() does nothing.
+ */
+static enum t_cose_err_t
+t_cose_sign1_verify_prepare(struct t_cose_sign1_verify_ctx      *context,
+                            struct q_useful_buf_c                cose_sign1,
+                            struct q_useful_buf_c                aad,
+                            struct q_useful_buf_c               *payload,
+                            struct t_cose_parameters            *parameters,
+                            struct t_cose_sign1_verify_prepared *prepared);
+
+
+/**
+ * \brief Decode and hash a \c COSE_Sign1 with a detached payload.
+ *
+ * \param[in,out] context      The t_cose signature verification context.
+ * \param[in] cose_sign1       Pointer and length of CBOR encoded
+ *                             \c COSE_Sign1 message that is to be verified.
+ * \param[in] aad              The Additional Authenticated Data or
+ *                             \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] detached_payload Pointer and length of the payload.
+ * \param[out] parameters      Place to return parsed parameters. May be
+ *                             \c NULL.
+ * \param[out] prepared        The message ready for
+ *                             t_cose_sign1_verify_complete().
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the same as t_cose_sign1_verify_prepare() for a detached
+ * payload. \c detached_payload must also stay valid until
+ * t_cose_sign1_verify_complete() is called.
+ */
+static enum t_cose_err_t
+t_cose_sign1_verify_prepare_detached(struct t_cose_sign1_verify_ctx      *context,
+                                     struct q_useful_buf_c                cose_sign1,
+                                     struct q_useful_buf_c                aad,
+                                     struct q_useful_buf_c                detached_payload,
+                                     struct t_cose_parameters            *parameters,
+                                     struct t_cose_sign1_verify_prepared *prepared);
+
+
+/**
+ * \brief Check the signature of a prepared \c COSE_Sign1.
+ *
+ * \param[in] prepared  The message from t_cose_sign1_verify_prepare()
+ *                      or t_cose_sign1_verify_prepare_detached().
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the second half of t_cose_sign1_verify_aad(). It is the
+ * public key operation and then
+ * t_cose_sign1_verify_prepared_release(). It may be called on any
+ * thread, but the release callback, if there is one, is called on
+ * that thread. A \ref t_cose_kid_cache is not thread safe so lock
+ * around this if it is called on another thread than the one that
+ * looks up keys.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_complete(struct t_cose_sign1_verify_prepared *prepared);
+
+
+/**
+ * \brief Release the key held by a prepared \c COSE_Sign1.
+ *
+ * \param[in] prepared  The message from t_cose_sign1_verify_prepare()
+ *                      or t_cose_sign1_verify_prepare_detached().
+ *
+ * This gives the key from the key resolver to the callback set with
+ * t_cose_sign1_set_key_release(). Call it for a message that was
+ * prepared but will not be completed.
+ * t_cose_sign1_verify_complete() calls it, and calling it again does
+ * nothing.
+ */
+void
+t_cose_sign1_verify_prepared_release(struct t_cose_sign1_verify_prepared *prepared);
+
+
+/**
+ * \brief Verify many \c COSE_Sign1 messages.
+ *
+ * \param[in,out] context   The t_cose signature verification context.
+ * \param[in] cose_sign1s   Array of \c count \c COSE_Sign1 messages.
+ * \param[in] aads          Array of \c count Additional Authenticated
+ *                          Data, any of which may be
+ *                          \c NULL_Q_USEFUL_BUF_C, or \c NULL for none.
+ * \param[out] payloads     Array of \c count payloads.
+ * \param[out] parameters   Array of \c count parsed parameters or
+ *                          \c NULL.
+ * \param[out] item_errors  Array of \c count error codes, one for
+ *                          each message.
+ * \param[in] count         The number of messages to verify.
+ *
+ * \return \ref T_COSE_SUCCESS if every message verified, otherwise
+ *         the error for the first message that failed.
+ *
+ * The outcome for each message is in \c item_errors and is the same
+ * as from t_cose_sign1_verify_aad() with \c context. The keys come
+ * from the key resolver set with t_cose_sign1_set_key_resolver() or
+ * the one key set with t_cose_sign1_set_verification_key(). A message
+ * that fails doesn't affect the verification of the others.
+ *
+ * The messages are worked on a chunk at a time. Every message in a
+ * chunk is decoded, then all of them are hashed, then the key for
+ * each is found and its signature checked, so each step runs back to
+ * back over the chunk with its state held in one array for each
+ * field. This is faster than calling t_cose_sign1_verify_aad() for
+ * each message when verifying large numbers of them. The messages of
+ * a chunk are hashed side by side, with multi-buffer SHA-256 when
+ * \c T_COSE_ENABLE_MULTI_BUFFER_SHA256 is defined, except those with a
+ * midstate in the header cache. The key resolver is called for one
+ * message at a time right before its signature is checked, so a
+ * resolver that frees the key it returned last time, such as
+ * t_cose_kid_cache_resolve(), works here.
+ *
+ * The payloads point into \c cose_sign1s. A verification cache set
+ * with t_cose_sign1_set_verify_cache() is not used. Afterwards
+ * t_cose_sign1_get_nth_tag() returns the tags of the last message.
+ *
+ * There is no batch version for detached payloads.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_batch(struct t_cose_sign1_verify_ctx *context,
+                          const struct q_useful_buf_c    *cose_sign1s,
+                          const struct q_useful_buf_c    *aads,
+                          struct q_useful_buf_c          *payloads,
+                          struct t_cose_parameters       *parameters,
+                          enum t_cose_err_t              *item_errors,
+                          size_t                          count);
+
+
 /**
  * \brief Return unprocessed tags from most recent signature verify.
  *
@@ -421,6 +929,14 @@ t_cose_sign1_verify_init(struct t_cose_sign1_verify_ctx *me,
 {
     me->option_flags = option_flags;
     me->verification_key = T_COSE_NULL_KEY;
+    me->key_resolver = NULL;
+    me->key_release = NULL;
+    me->key_resolver_context = NULL;
+    me->kid_filter = NULL;
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+    me->verify_cache = NULL;
+#endif
+    me->header_cache = NULL;
 }
 
 
@@ -432,6 +948,50 @@ t_cose_sign1_set_verification_key(struct t_cose_sign1_verify_ctx *me,
 }
 
 
+static inline void
+t_cose_sign1_set_key_resolver(struct t_cose_sign1_verify_ctx *me,
+                              t_cose_key_resolver_cb         *resolver,
+                              void                           *cb_context)
+{
+    me->key_resolver = resolver;
+    me->key_resolver_context = cb_context;
+}
+
+
+static inline void
+t_cose_sign1_set_key_release(struct t_cose_sign1_verify_ctx *me,
+                             t_cose_key_release_cb          *release)
+{
+    me->key_release = release;
+}
+
+
+static inline void
+t_cose_sign1_set_kid_filter(struct t_cose_sign1_verify_ctx *me,
+                            const struct t_cose_kid_filter *filter)
+{
+    me->kid_filter = filter;
+}
+
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+static inline void
+t_cose_sign1_set_verify_cache(struct t_cose_sign1_verify_ctx *me,
+                              struct t_cose_verify_cache     *cache)
+{
+    me->verify_cache = cache;
+}
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+
+static inline void
+t_cose_sign1_set_header_cache(struct t_cose_sign1_verify_ctx *me,
+                              struct t_cose_header_cache     *cache)
+{
+    me->header_cache = cache;
+}
+
+
 static inline uint64_t
 t_cose_sign1_get_nth_tag(const struct t_cose_sign1_verify_ctx *context,
                          size_t                                n)
@@ -470,6 +1030,36 @@ t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
                              bool                            is_detached);
 
 
+/**
+ * \brief Semi-private function to decode and hash a COSE_Sign1.
+ *
+ * \param[in,out] me        The t_cose signature verification context.
+ * \param[in] sign1         Pointer and length of CBOR encoded \c COSE_Sign1
+ *                          message that is to be verified.
+ * \param[in] aad           The Additional Authenticated Data or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in,out] payload   Pointer and length of the payload.
+ * \param[out] parameters   Place to return parsed parameters. May be \c NULL.
+ * \param[in] is_detached   Indicates the payload is detached.
+ * \param[out] prepared     The message ready for
+ *                          t_cose_sign1_verify_complete().
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This does the work for t_cose_sign1_verify_prepare() and
+ * t_cose_sign1_verify_prepare_detached(). It is a semi-private
+ * function which means its interface isn't guaranteed so it should
+ * not to call it directly.
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_prepare_internal(struct t_cose_sign1_verify_ctx      *me,
+                                     struct q_useful_buf_c                sign1,
+                                     struct q_useful_buf_c                aad,
+                                     struct q_useful_buf_c               *payload,
+                                     struct t_cose_parameters            *parameters,
+                                     bool                                 is_detached,
+                                     struct t_cose_sign1_verify_prepared *prepared);
+
+
 static inline enum t_cose_err_t
 t_cose_sign1_verify(struct t_cose_sign1_verify_ctx *me,
                     struct q_useful_buf_c           sign1,
@@ -516,6 +1106,42 @@ t_cose_sign1_verify_detached(struct t_cose_sign1_verify_ctx *me,
                                          true);
 }
 
+
+static inline enum t_cose_err_t
+t_cose_sign1_verify_prepare(struct t_cose_sign1_verify_ctx      *me,
+                            struct q_useful_buf_c                cose_sign1,
+                            struct q_useful_buf_c                aad,
+                            struct q_useful_buf_c               *payload,
+                            struct t_cose_parameters            *parameters,
+                            struct t_cose_sign1_verify_prepared *prepared)
+{
+    return t_cose_sign1_verify_prepare_internal(me,
+                                                cose_sign1,
+                                                aad,
+                                                payload,
+                                                parameters,
+                                                false,
+                                                prepared);
+}
+
+
+static inline enum t_cose_err_t
+t_cose_sign1_verify_prepare_detached(struct t_cose_sign1_verify_ctx      *me,
+                                     struct q_useful_buf_c                cose_sign1,
+                                     struct q_useful_buf_c                aad,
+                                     struct q_useful_buf_c                detached_payload,
+                                     struct t_cose_parameters            *parameters,
+                                     struct t_cose_sign1_verify_prepared *prepared)
+{
+    return t_cose_sign1_verify_prepare_internal(me,
+                                                cose_sign1,
+                                                aad,
+                                                &detached_payload,
+                                                parameters,
+                                                true,
+                                                prepared);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,223 @@
+/*
+ *  t_cose_verify_cache.h
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifndef __T_COSE_VERIFY_CACHE_H__
+#define __T_COSE_VERIFY_CACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_common.h"
+#include "t_cose/t_cose_sign1_verify.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+
+/**
+ * \file t_cose_verify_cache.h
+ *
+ * \brief Remember messages that verified so repeats aren't verified again.
+ *
+ * Some verifiers, for example an API gateway checking bearer CWTs,
+ * see the same \c COSE_Sign1 many times over. A \ref
+ * t_cose_verify_cache given to t_cose_sign1_set_verify_cache()
+ * remembers each message that verified successfully. When the same
+ * message is verified again in the same way the payload and header
+ * parameters are returned without hashing the payload, finding the
+ * key or checking the signature.
+ *
+ *     t_cose_verify_cache_init(&cache, 300);
+ *     t_cose_sign1_set_verify_cache(&verify_ctx, &cache);
+ *
+ * Entries are found by the SHA-256 of the whole \c COSE_Sign1, the
+ * AAD, a detached payload and what determines the key: the public
+ * key bytes of the key set with t_cose_sign1_set_verification_key(),
+ * the key resolver and its context, and the option flags. The key's
+ * handle or pointer is not used because it can be reused for a
+ * different key after the first is freed. If the crypto adapter can't
+ * export the public key the cache is not used. The digest has to be
+ * cryptographic because a hit is taken as a good signature; with a
+ * weaker one a message made to collide with a cached one would be
+ * accepted. Only the digest is kept, not the message, so entries are
+ * small. Hashing a short token this way costs a small fraction of an
+ * ECDSA verification.
+ *
+ * A hit is only as good as the key was when the entry was added, so
+ * entries expire after the time to live given to
+ * t_cose_verify_cache_init(). Call t_cose_verify_cache_clear() when a
+ * key is revoked or a resolver's keys are replaced. A kid filter
+ * set with t_cose_sign1_set_kid_filter() is still checked on a hit.
+ *
+ * The cache holds \ref T_COSE_VERIFY_CACHE_SIZE entries in sets of
+ * \ref T_COSE_VERIFY_CACHE_WAYS. Each set has its own spin lock so
+ * the cache can be shared by any number of threads and verification
+ * contexts with little contention; a lock is only held to copy one
+ * entry. When a set is full the entry added longest ago is replaced.
+ *
+ * No memory is allocated. The cache is about 30KB with the default
+ * sizes. Failed verifications, \ref T_COSE_OPT_DECODE_ONLY and the
+ * streaming detached-payload verification are never cached.
+ *
+ * This uses the GCC \c __atomic built-ins for the locks and POSIX
+ * clock_gettime(). It is only in the build when \c
+ * T_COSE_ENABLE_VERIFY_CACHE is defined.
+ */
+
+
+/**
+ * The number of entries. It must be a power of two and a multiple of
+ * \ref T_COSE_VERIFY_CACHE_WAYS.
+ */
+#ifndef T_COSE_VERIFY_CACHE_SIZE
+#define T_COSE_VERIFY_CACHE_SIZE 256
+#endif
+
+
+/**
+ * The number of entries in a set. A message can only be cached in the
+ * set its digest selects.
+ */
+#ifndef T_COSE_VERIFY_CACHE_WAYS
+#define T_COSE_VERIFY_CACHE_WAYS 4
+#endif
+
+
+/** The size of the digest entries are found by. */
+#define T_COSE_VERIFY_CACHE_DIGEST_SIZE 32
+
+
+/* Private data structure. Where a returned buffer is in the
+ * COSE_Sign1. An offset of UINT32_MAX means NULL_Q_USEFUL_BUF_C. */
+struct t_cose_verify_cache_span {
+    uint32_t offset;
+    uint32_t len;
+};
+
+
+/* Private data structure. One cached verification. */
+struct t_cose_verify_cache_entry {
+    uint8_t                         digest[T_COSE_VERIFY_CACHE_DIGEST_SIZE];
+    uint64_t                        expires; /* 0 means the entry is empty */
+    uint64_t                        tags[T_COSE_MAX_TAGS_TO_RETURN];
+    struct t_cose_verify_cache_span payload;
+    struct t_cose_verify_cache_span kid;
+    struct t_cose_verify_cache_span iv;
+    struct t_cose_verify_cache_span partial_iv;
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    struct t_cose_verify_cache_span content_type_tstr;
+    uint32_t                        content_type_uint;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+    int32_t                         cose_algorithm_id;
+};
+
+
+/* Private data structure. A set of entries and its lock. */
+struct t_cose_verify_cache_set {
+    struct t_cose_verify_cache_entry ways[T_COSE_VERIFY_CACHE_WAYS];
+    uint8_t                          lock;
+};
+
+
+/**
+ * The verification cache. The caller should allocate it, but it is
+ * private and should not be accessed by the caller.
+ */
+struct t_cose_verify_cache {
+    /* Private data structure */
+    uint32_t                       ttl_seconds;
+    struct t_cose_verify_cache_set sets[T_COSE_VERIFY_CACHE_SIZE / T_COSE_VERIFY_CACHE_WAYS];
+};
+
+
+/**
+ * \brief Initialize a verification cache.
+ *
+ * \param[out] cache       The cache to initialize.
+ * \param[in] ttl_seconds  How long an entry is used for after it is
+ *                         added. 0 turns caching off.
+ *
+ * This must not be called while other threads use the cache.
+ */
+void
+t_cose_verify_cache_init(struct t_cose_verify_cache *cache,
+                         uint32_t                    ttl_seconds);
+
+
+/**
+ * \brief Remove all entries from the cache.
+ *
+ * \param[in] cache  The cache.
+ *
+ * This may be called while other threads use the cache. A
+ * verification already past its look up in the cache may still add
+ * its entry afterwards.
+ */
+void
+t_cose_verify_cache_clear(struct t_cose_verify_cache *cache);
+
+
+/**
+ * \brief Semi-private function to find a cached verification.
+ *
+ * \param[in] cache       The cache.
+ * \param[in] digest      The digest of the message and how it is verified.
+ * \param[in] cose_sign1  The \c COSE_Sign1 being verified.
+ * \param[out] payload    The payload, pointing into \c cose_sign1.
+ *                        Not set for detached payloads.
+ * \param[out] parameters The header parameters, pointing into
+ *                        \c cose_sign1.
+ * \param[out] tags       The unprocessed tags.
+ *
+ * \return \c true if it was found.
+ *
+ * This is used by t_cose_sign1_verify() and should not be called
+ * directly.
+ */
+bool
+t_cose_verify_cache_find(struct t_cose_verify_cache *cache,
+                         const uint8_t              *digest,
+                         struct q_useful_buf_c       cose_sign1,
+                         struct q_useful_buf_c      *payload,
+                         struct t_cose_parameters   *parameters,
+                         uint64_t                   *tags);
+
+
+/**
+ * \brief Semi-private function to add a verification to the cache.
+ *
+ * \param[in] cache       The cache.
+ * \param[in] digest      The digest of the message and how it is verified.
+ * \param[in] cose_sign1  The \c COSE_Sign1 that verified.
+ * \param[in] payload     The payload.
+ * \param[in] parameters  The header parameters.
+ * \param[in] tags        The unprocessed tags.
+ *
+ * This is used by t_cose_sign1_verify() and should not be called
+ * directly.
+ */
+void
+t_cose_verify_cache_add(struct t_cose_verify_cache     *cache,
+                        const uint8_t                  *digest,
+                        struct q_useful_buf_c           cose_sign1,
+                        struct q_useful_buf_c           payload,
+                        const struct t_cose_parameters *parameters,
+                        const uint64_t                 *tags);
+
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_VERIFY_CACHE_H__ */
@@ -0,0 +1,404 @@
+/*
+ *  t_cose_async.c
+ *
+ * Copyright 2019-2022, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+/* For pthreads and sysconf() when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "t_cose/t_cose_async.h"
+
+#ifdef T_COSE_ENABLE_ASYNC
+
+#include <string.h>
+#include <unistd.h>
+
+
+/**
+ * \file t_cose_async.c
+ *
+ * \brief Asynchronous sign and verify and a work-stealing thread pool.
+ *
+ * Each queue has its own mutex, held only to add or take one
+ * request, so workers mostly use only their own queue's lock. The
+ * counts of queued and in-flight requests are atomics shared by all.
+ *
+ * A worker goes to sleep only after counting itself as sleeping and
+ * then seeing no queued requests. A submitter counts its request as
+ * queued and then wakes a worker if any are sleeping. Both are
+ * sequentially consistent so either the worker sees the request or
+ * the submitter sees the sleeper.
+ */
+
+
+#define QUEUE_MASK (T_COSE_ASYNC_QUEUE_SIZE - 1)
+
+#if (T_COSE_ASYNC_QUEUE_SIZE & QUEUE_MASK) != 0
+#error T_COSE_ASYNC_QUEUE_SIZE must be a power of two
+#endif
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+void
+t_cose_async_sign_request_init(struct t_cose_async_request        *request,
+                               const struct t_cose_sign1_sign_ctx *context,
+                               struct q_useful_buf_c               aad,
+                               struct q_useful_buf_c               payload,
+                               struct q_useful_buf                 out_buf,
+                               t_cose_async_done_cb               *done_cb,
+                               void                               *done_ctx)
+{
+    memset(request, 0, sizeof(*request));
+    request->ctx.sign = *context;
+    request->is_sign  = true;
+    request->input    = payload;
+    request->aad      = aad;
+    request->out_buf  = out_buf;
+    request->done_cb  = done_cb;
+    request->done_ctx = done_ctx;
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+void
+t_cose_async_verify_request_init(struct t_cose_async_request          *request,
+                                 const struct t_cose_sign1_verify_ctx *context,
+                                 struct q_useful_buf_c                 cose_sign1,
+                                 struct q_useful_buf_c                 aad,
+                                 t_cose_async_done_cb                 *done_cb,
+                                 void                                 *done_ctx)
+{
+    memset(request, 0, sizeof(*request));
+    request->ctx.verify = *context;
+    /* It can't be shared by threads */
+    request->ctx.verify.header_cache = NULL;
+    request->is_sign    = false;
+    request->input      = cose_sign1;
+    request->aad        = aad;
+    request->done_cb    = done_cb;
+    request->done_ctx   = done_ctx;
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+enum t_cose_err_t
+t_cose_async_submit(const struct t_cose_async_executor *executor,
+                    struct t_cose_async_request        *request)
+{
+    return (*executor->submit)(executor->executor_ctx, request);
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+void
+t_cose_async_request_run(struct t_cose_async_request *request)
+{
+    if(request->is_sign) {
+        request->error = t_cose_sign1_sign_aad_internal(&(request->ctx.sign),
+                                                        false,
+                                                        request->input,
+                                                        request->aad,
+                                                        request->out_buf,
+                                                        &(request->output));
+    } else {
+        request->error = t_cose_sign1_verify_aad(&(request->ctx.verify),
+                                                 request->input,
+                                                 request->aad,
+                                                 &(request->output),
+                                                 &(request->parameters));
+    }
+    if(request->error != T_COSE_SUCCESS) {
+        request->output = NULL_Q_USEFUL_BUF_C;
+    }
+
+    /* The request is the caller's again from here */
+    (*request->done_cb)(request->done_ctx, request);
+}
+
+
+static bool
+queue_add(struct t_cose_async_queue   *queue,
+          struct t_cose_async_request *request)
+{
+    bool added = false;
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail - queue->head < T_COSE_ASYNC_QUEUE_SIZE) {
+        queue->slots[queue->tail & QUEUE_MASK] = request;
+        __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELAXED);
+        added = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return added;
+}
+
+
+static struct t_cose_async_request *
+queue_take(struct t_cose_async_queue *queue)
+{
+    struct t_cose_async_request *request = NULL;
+
+    /* Empty queues are passed over without taking their locks. A
+     * request added just after this is found on the next look. */
+    if(__atomic_load_n(&queue->head, __ATOMIC_RELAXED) ==
+       __atomic_load_n(&queue->tail, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    if(queue->head != queue->tail) {
+        request = queue->slots[queue->head & QUEUE_MASK];
+        __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return request;
+}
+
+
+/*
+ * Take a request from the worker's own queue, else steal one from
+ * the others, starting with the next one along so thieves spread out.
+ */
+static struct t_cose_async_request *
+take_request(struct t_cose_async_pool *pool, unsigned self)
+{
+    struct t_cose_async_request *request;
+    unsigned                     i;
+
+    request = queue_take(&pool->queues[self]);
+    for(i = 1; request == NULL && i < pool->worker_count; i++) {
+        request = queue_take(&pool->queues[(self + i) % pool->worker_count]);
+    }
+
+    return request;
+}
+
+
+static void
+complete_one(struct t_cose_async_pool *pool)
+{
+    if(__atomic_sub_fetch(&pool->in_flight, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->drained_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+
+static void *
+worker_thread(void *arg)
+{
+    struct t_cose_async_queue   *own  = arg;
+    struct t_cose_async_pool    *pool = own->pool;
+    struct t_cose_async_request *request;
+    unsigned                     self;
+    bool                         stop;
+
+    self = (unsigned)(own - pool->queues);
+    pthread_setspecific(pool->worker_key, own);
+
+    for(;;) {
+        request = take_request(pool, self);
+        if(request != NULL) {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+            t_cose_async_request_run(request);
+            complete_one(pool);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 &&
+              !__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        /* Queued requests are still run when stopping */
+        stop = __atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST) &&
+               __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if(stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+static enum t_cose_err_t
+pool_submit(void *executor_ctx, struct t_cose_async_request *request)
+{
+    struct t_cose_async_pool  *pool = executor_ctx;
+    struct t_cose_async_queue *own;
+    unsigned                   start;
+    unsigned                   i;
+    bool                       added;
+
+    if(__atomic_load_n(&pool->stopping, __ATOMIC_SEQ_CST)) {
+        return T_COSE_ERR_THREADS;
+    }
+
+    /* Counted before it is added so a worker that takes it straight
+     * away never takes the counts below zero */
+    __atomic_add_fetch(&pool->in_flight, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    /* A callback's requests go to its worker first, where they are
+     * likely to be run next with warm caches */
+    own = pthread_getspecific(pool->worker_key);
+    if(own != NULL) {
+        start = (unsigned)(own - pool->queues);
+    } else {
+        start = __atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED);
+    }
+
+    added = false;
+    for(i = 0; !added && i < pool->worker_count; i++) {
+        added = queue_add(&pool->queues[(start + i) % pool->worker_count], request);
+    }
+    if(!added) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+        complete_one(pool);
+        return T_COSE_ERR_QUEUE_FULL;
+    }
+
+    if(__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Stop and join the first started workers and release everything.
+ */
+static void
+stop_workers(struct t_cose_async_pool *pool, unsigned started)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(i = 0; i < started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    for(i = 0; i < pool->worker_count; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+    pthread_cond_destroy(&pool->drained_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_key_delete(pool->worker_key);
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+enum t_cose_err_t
+t_cose_async_pool_start(struct t_cose_async_pool *pool,
+                        unsigned                  worker_count)
+{
+    long     cpu_count;
+    unsigned started;
+    unsigned i;
+
+    if(worker_count == 0) {
+        cpu_count    = sysconf(_SC_NPROCESSORS_ONLN);
+        worker_count = cpu_count > 0 ? (unsigned)cpu_count : 1;
+    }
+    if(worker_count > T_COSE_ASYNC_MAX_WORKERS) {
+        worker_count = T_COSE_ASYNC_MAX_WORKERS;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    if(pthread_key_create(&pool->worker_key, NULL)) {
+        return T_COSE_ERR_THREADS;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->drained_cond, NULL);
+
+    /* Workers look at all the queues so they are all set up first */
+    pool->worker_count = worker_count;
+    for(i = 0; i < worker_count; i++) {
+        pool->queues[i].pool = pool;
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+
+    for(started = 0; started < worker_count; started++) {
+        if(pthread_create(&pool->threads[started], NULL, worker_thread, &pool->queues[started])) {
+            stop_workers(pool, started);
+            return T_COSE_ERR_THREADS;
+        }
+    }
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+struct t_cose_async_executor
+t_cose_async_pool_executor(struct t_cose_async_pool *pool)
+{
+    struct t_cose_async_executor executor;
+
+    executor.submit       = pool_submit;
+    executor.executor_ctx = pool;
+
+    return executor;
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+void
+t_cose_async_pool_wait(struct t_cose_async_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(__atomic_load_n(&pool->in_flight, __ATOMIC_SEQ_CST) != 0) {
+        pthread_cond_wait(&pool->drained_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Public function. See t_cose_async.h
+ */
+void
+t_cose_async_pool_stop(struct t_cose_async_pool *pool)
+{
+    stop_workers(pool, pool->worker_count);
+}
+
+#endif /* T_COSE_ENABLE_ASYNC */
@@ -43,10 +43,14 @@ extern "C" {
  * various platforms and OSs. The functions are:
  *   - t_cose_t_crypto_sig_size()
  *   - t_cose_crypto_pub_key_sign()
+ *   - t_cose_crypto_sign_batch()
  *   - t_cose_crypto_pub_key_verify()
  *   - t_cose_crypto_hash_start()
  *   - t_cose_crypto_hash_update()
  *   - t_cose_crypto_hash_finish()
+ *   - t_cose_crypto_hash_clone()
+ *   - t_cose_crypto_hash_abort()
+ *   - t_cose_crypto_hash_batch()
  *
  * This runs entirely off of COSE-style algorithm identifiers.  They
  * are simple integers and thus work nice as function parameters. An
@@ -155,6 +159,125 @@ t_cose_crypto_sig_size(int32_t            cose_algorithm_id,
                        size_t            *sig_size);
 
 
+/**
+ * \brief Release any state cached for a key.
+ *
+ * \param[in] key  The key.
+ *
+ * This implements t_cose_key_release_cached(). Adapters that don't
+ * cache anything per key implement it as doing nothing.
+ */
+void
+t_cose_crypto_release_key_cache(struct t_cose_key key);
+
+
+/**
+ * \brief Check a key and fill in its cached metadata.
+ *
+ * \param[in] key        The key to prepare.
+ * \param[out] prepared  Where to put the key and its metadata.
+ *
+ * \return An error code or \ref T_COSE_SUCCESS.
+ *
+ * This implements t_cose_key_prepare(). The adapter's signing,
+ * verification and signature size functions must accept a key of
+ * type \ref T_COSE_CRYPTO_LIB_PREPARED, use the metadata in it and
+ * return \ref T_COSE_ERR_WRONG_TYPE_OF_KEY if the algorithm is not
+ * the one it was prepared for. t_cose_crypto_prepared_key() helps
+ * with this.
+ */
+enum t_cose_err_t
+t_cose_crypto_prepare_key(struct t_cose_key           key,
+                          struct t_cose_prepared_key *prepared);
+
+
+/**
+ * \brief Make a verification key from a public EC point.
+ *
+ * \param[in] cose_algorithm_id  The algorithm the key is for. This
+ *                               selects the curve.
+ * \param[in] public_key         The uncompressed EC point, 0x04
+ *                               followed by X and Y.
+ * \param[out] key               The key made.
+ *
+ * \retval T_COSE_ERR_UNSUPPORTED_SIGNING_ALG
+ *         The algorithm is not supported.
+ * \retval T_COSE_ERR_WRONG_TYPE_OF_KEY
+ *         \c public_key is not a point on the curve.
+ * \retval T_COSE_ERR_INSUFFICIENT_MEMORY
+ *         The crypto library couldn't allocate the key.
+ *
+ * This is used by t_cose_key_index_resolve() to import keys when
+ * they are first needed. The key must be freed with
+ * t_cose_crypto_free_key().
+ */
+enum t_cose_err_t
+t_cose_crypto_import_public_key(int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  public_key,
+                                struct t_cose_key     *key);
+
+
+/**
+ * \brief Free a key made by t_cose_crypto_import_public_key().
+ *
+ * \param[in] key  The key to free.
+ */
+void
+t_cose_crypto_free_key(struct t_cose_key key);
+
+
+/** The size of the largest public key, a P-521 uncompressed point. */
+#define T_COSE_CRYPTO_MAX_PUBLIC_KEY_SIZE (1 + 2 * 66)
+
+
+/**
+ * \brief Get the public key of a key as bytes.
+ *
+ * \param[in] key          The key. It may be a prepared key or a
+ *                         key pair.
+ * \param[in] buffer       Where to put the public key. \ref
+ *                         T_COSE_CRYPTO_MAX_PUBLIC_KEY_SIZE is
+ *                         always big enough.
+ * \param[out] public_key  The uncompressed EC point, 0x04 followed by
+ *                         X and Y.
+ *
+ * \retval T_COSE_ERR_INCORRECT_KEY_FOR_LIB
+ *         The key is not for this crypto library.
+ * \retval T_COSE_ERR_EMPTY_KEY
+ *         There is no key.
+ * \retval T_COSE_ERR_WRONG_TYPE_OF_KEY
+ *         The key is not an EC key on a supported curve.
+ * \retval T_COSE_ERR_TOO_SMALL
+ *         \c buffer is too small.
+ *
+ * This is the inverse of t_cose_crypto_import_public_key(). It is
+ * used by the verification cache to identify the key by what it is
+ * rather than where it is; a key handle or pointer can be reused for
+ * a different key once the first is freed.
+ */
+enum t_cose_err_t
+t_cose_crypto_export_public_key(struct t_cose_key      key,
+                                struct q_useful_buf    buffer,
+                                struct q_useful_buf_c *public_key);
+
+
+/**
+ * \brief Get the prepared key from a \ref t_cose_key if it is one.
+ *
+ * \param[in] key  The key passed to the adapter.
+ *
+ * \return The prepared key or \c NULL if \c key is not a prepared key.
+ */
+static inline const struct t_cose_prepared_key *
+t_cose_crypto_prepared_key(struct t_cose_key key)
+{
+    if(key.crypto_lib != T_COSE_CRYPTO_LIB_PREPARED) {
+        return NULL;
+    }
+    return (const struct t_cose_prepared_key *)key.k.key_ptr;
+}
+
+
 /**
  * \brief Perform public key signing. Part of the t_cose crypto
  * adaptation layer.
@@ -219,6 +342,52 @@ t_cose_crypto_sign(int32_t                cose_algorithm_id,
                    struct q_useful_buf_c *signature);
 
 
+/**
+ * \brief Perform public key signing of several hashes with one key.
+ * Part of the t_cose crypto adaptation layer.
+ *
+ * \param[in] cose_algorithm_id  The algorithm to sign with. Same as for
+ *                               t_cose_crypto_sign().
+ * \param[in] signing_key        Indicates or contains key to sign with.
+ * \param[in] hashes_to_sign     Array of \c count hashes to sign.
+ * \param[in] signature_buffers  Array of \c count buffers into which
+ *                               the signatures are put.
+ * \param[out] signatures        Array of \c count signatures returned.
+ * \param[out] item_errors       Array of \c count error codes, one for
+ *                               each hash signed.
+ * \param[in] count              Number of hashes to sign.
+ *
+ * \retval T_COSE_SUCCESS
+ *         Setup for signing succeeded. The outcome of signing each
+ *         hash is in \c item_errors.
+ * \retval T_COSE_ERR_UNSUPPORTED_SIGNING_ALG
+ *         The requested signing algorithm, \c cose_algorithm_id, is not
+ *         supported. Nothing was signed.
+ *
+ * Other errors that t_cose_crypto_sign() returns may be returned here
+ * when they apply to the key or algorithm and thus to all the
+ * hashes. In that case, nothing was signed and the contents of
+ * \c item_errors are undefined.
+ *
+ * This is the same as calling t_cose_crypto_sign() \c count times,
+ * but allows the implementation to do the work that depends only on
+ * the key and algorithm once. For example, an implementation may
+ * look up the key, check its type and allocate a signing context once
+ * and use it for all the hashes.
+ *
+ * An implementation that has no such per-key work may simply call
+ * t_cose_crypto_sign() in a loop.
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_batch(int32_t                      cose_algorithm_id,
+                         struct t_cose_key            signing_key,
+                         const struct q_useful_buf_c *hashes_to_sign,
+                         const struct q_useful_buf   *signature_buffers,
+                         struct q_useful_buf_c       *signatures,
+                         enum t_cose_err_t           *item_errors,
+                         size_t                       count);
+
+
 /**
  * \brief Perform public key signature verification. Part of the
  * t_cose crypto adaptation layer.
@@ -277,6 +446,93 @@ t_cose_crypto_verify(int32_t               cose_algorithm_id,
                      struct q_useful_buf_c signature);
 
 
+/*
+ * A crypto adapter that can sign and verify the to-be-signed bytes
+ * directly, hashing them itself, says so here by defining
+ * T_COSE_CRYPTO_HAS_SIGN_MESSAGE. It must then implement
+ * t_cose_crypto_sign_message() and t_cose_crypto_verify_message().
+ *
+ * This is for crypto libraries and hardware where hashing and
+ * signing in one operation is cheaper. With OpenSSL EVP_DigestSign()
+ * allocates more than a separate hash and EVP_PKEY_sign() so it is
+ * only used when T_COSE_ENABLE_SIGN_MESSAGE is defined. PSA
+ * psa_sign_message() needs the message in one contiguous buffer so
+ * it is not used.
+ */
+#if defined(T_COSE_USE_OPENSSL_CRYPTO) && defined(T_COSE_ENABLE_SIGN_MESSAGE)
+#define T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+#endif
+
+
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+/**
+ * \brief Hash and sign a message in one operation. Optional part of
+ * the t_cose crypto adaptation layer.
+ *
+ * \param[in] cose_algorithm_id  The algorithm to sign with. Same as for
+ *                               t_cose_crypto_sign().
+ * \param[in] signing_key        Indicates or contains key to sign with.
+ * \param[in] message_pieces     Array of \c piece_count pieces that
+ *                               together are the message to sign.
+ *                               Pieces may be empty.
+ * \param[in] piece_count        Number of pieces.
+ * \param[in] signature_buffer   Pointer and length of buffer into which
+ *                               the resulting signature is put.
+ * \param[out] signature         Pointer and length of the signature
+ *                               returned.
+ *
+ * \return The same errors as t_cose_crypto_sign() and
+ *         t_cose_crypto_hash_start().
+ *
+ * This gives the same signature as hashing the pieces in order with
+ * the hash that goes with \c cose_algorithm_id and then calling
+ * t_cose_crypto_sign(). It allows crypto libraries and hardware that
+ * hash and sign in one operation to be used without a separate hash
+ * context.
+ *
+ * t_cose passes the to-be-signed bytes in pieces as they are in
+ * memory rather than copying them together so the implementation
+ * has to either stream them into the crypto library or hash them
+ * itself.
+ */
+enum t_cose_err_t
+t_cose_crypto_sign_message(int32_t                      cose_algorithm_id,
+                           struct t_cose_key            signing_key,
+                           const struct q_useful_buf_c *message_pieces,
+                           size_t                       piece_count,
+                           struct q_useful_buf          signature_buffer,
+                           struct q_useful_buf_c       *signature);
+
+
+/**
+ * \brief Hash and verify a message in one operation. Optional part of
+ * the t_cose crypto adaptation layer.
+ *
+ * \param[in] cose_algorithm_id  The algorithm to use for verification.
+ * \param[in] verification_key   The verification key to use.
+ * \param[in] kid                The COSE kid (key ID) or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] message_pieces     Array of \c piece_count pieces that
+ *                               together are the message that was
+ *                               signed. Pieces may be empty.
+ * \param[in] piece_count        Number of pieces.
+ * \param[in] signature          The COSE-format signature.
+ *
+ * \return The same errors as t_cose_crypto_verify() and
+ *         t_cose_crypto_hash_start().
+ *
+ * This is the verification counterpart of
+ * t_cose_crypto_sign_message().
+ */
+enum t_cose_err_t
+t_cose_crypto_verify_message(int32_t                      cose_algorithm_id,
+                             struct t_cose_key            verification_key,
+                             struct q_useful_buf_c        kid,
+                             const struct q_useful_buf_c *message_pieces,
+                             size_t                       piece_count,
+                             struct q_useful_buf_c        signature);
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+
 
 
 #ifdef T_COSE_USE_PSA_CRYPTO
@@ -493,6 +749,101 @@ t_cose_crypto_hash_finish(struct t_cose_crypto_hash *hash_ctx,
                           struct q_useful_buf_c     *hash_result);
 
 
+/**
+ * \brief Copy the state of a cryptographic hash in progress. Part of
+ * the t_cose crypto adaptation layer.
+ *
+ * \param[out] dest_ctx  Pointer to the hash context to copy to.
+ * \param[in] src_ctx    Pointer to the hash context to copy from.
+ *
+ * \retval T_COSE_SUCCESS
+ *         Success.
+ * \retval T_COSE_ERR_INSUFFICIENT_MEMORY
+ *         No memory for the copy of the hash state.
+ * \retval T_COSE_ERR_HASH_GENERAL_FAIL
+ *         Some general failure of the hash function, including an
+ *         error that occurred earlier in \c src_ctx.
+ *
+ * After this, \c dest_ctx is a hash in progress that has had the
+ * same bytes fed to it as \c src_ctx. Both can be continued
+ * independently. \c src_ctx is not modified so the same hash state
+ * can be copied many times. This is used to hash the part of the
+ * to-be-signed bytes that is the same for every message once and
+ * reuse that "midstate" for each message.
+ *
+ * Each copy must be completed with t_cose_crypto_hash_finish() or
+ * t_cose_crypto_hash_abort(). \c dest_ctx should not be a hash in
+ * progress as it is overwritten.
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_clone(struct t_cose_crypto_hash       *dest_ctx,
+                         const struct t_cose_crypto_hash *src_ctx);
+
+
+/**
+ * \brief Abandon a cryptographic hash. Part of the t_cose crypto
+ * adaptation layer.
+ *
+ * \param[in,out] hash_ctx  Pointer to the hash context.
+ *
+ * This releases any resources held by a hash that was started with
+ * t_cose_crypto_hash_start() or t_cose_crypto_hash_clone() and that
+ * will not be completed with t_cose_crypto_hash_finish(). Some
+ * crypto libraries allocate memory for a hash in progress so this
+ * must be called for such a hash. It must not be called for a hash
+ * that was finished.
+ */
+void
+t_cose_crypto_hash_abort(struct t_cose_crypto_hash *hash_ctx);
+
+
+/**
+ * \brief Hash several inputs at once. Part of the t_cose crypto
+ * adaptation layer.
+ *
+ * \param[in] cose_hash_alg_id   Algorithm ID that identifies the
+ *                               hash to use. Same as for
+ *                               t_cose_crypto_hash_start().
+ * \param[in] inputs             Array of \c count inputs, each an
+ *                               array of \c piece_count pieces that
+ *                               are hashed as if concatenated.
+ * \param[in] piece_count        The number of pieces in each input.
+ * \param[in] buffers_for_hash   Array of \c count buffers into which
+ *                               the hashes are put.
+ * \param[out] hashes            Array of \c count hashes returned.
+ * \param[in] count              Number of inputs to hash.
+ *
+ * \retval T_COSE_ERR_UNSUPPORTED_HASH
+ *         The requested algorithm is unknown or unsupported.
+ * \retval T_COSE_ERR_HASH_GENERAL_FAIL
+ *         Some general failure of the hash function.
+ * \retval T_COSE_ERR_HASH_BUFFER_SIZE
+ *         One of the buffers to hold a hash was too small.
+ * \retval T_COSE_SUCCESS
+ *         Success. All the hashes were made.
+ *
+ * This gives the same hashes as hashing each input in turn with
+ * t_cose_crypto_hash_start(), t_cose_crypto_hash_update() for each
+ * piece and t_cose_crypto_hash_finish(). A piece with a \c NULL
+ * pointer is hashed as empty. Hashes don't fail for one input and
+ * not another so there is one error for all of them.
+ *
+ * It allows an implementation to hash the inputs side by side, for
+ * example with the multi-buffer SHA-256 in t_cose_sha256_mb.h when
+ * \c T_COSE_ENABLE_MULTI_BUFFER_SHA256 is defined, which is much
+ * faster for many small inputs than hashing them one after the
+ * other. An implementation that has no such hash may simply loop
+ * over the inputs.
+ */
+enum t_cose_err_t
+t_cose_crypto_hash_batch(int32_t                              cose_hash_alg_id,
+                         const struct q_useful_buf_c * const *inputs,
+                         size_t                               piece_count,
+                         const struct q_useful_buf           *buffers_for_hash,
+                         struct q_useful_buf_c               *hashes,
+                         size_t                               count);
+
+
 
 /**
  * \brief Indicate whether a COSE algorithm is ECDSA or not.
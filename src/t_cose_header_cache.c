@@ -0,0 +1,221 @@
+/*
+ *  t_cose_header_cache.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include "t_cose/t_cose_header_cache.h"
+#include "t_cose_crypto.h"
+#include "t_cose_util.h"
+#include <string.h>
+
+
+/**
+ * \file t_cose_header_cache.c
+ *
+ * \brief Cache of parsed protected header parameters and hash midstates.
+ *
+ * Buffers returned by a hit have to point into the protected
+ * parameters of the message being verified, not the one that was
+ * cached, so entries hold offsets rather than pointers.
+ */
+
+
+#define NO_SPAN UINT8_MAX
+
+
+/*
+ * Makes the span of buf in protected. Returns false if buf is not in
+ * protected.
+ */
+static bool
+make_span(struct q_useful_buf_c            protected,
+          struct q_useful_buf_c            buf,
+          struct t_cose_header_cache_span *span)
+{
+    uintptr_t start = (uintptr_t)protected.ptr;
+    uintptr_t p     = (uintptr_t)buf.ptr;
+
+    if(buf.ptr == NULL) {
+        span->offset = NO_SPAN;
+        span->len    = 0;
+        return true;
+    }
+    if(p < start || p - start > protected.len || protected.len - (p - start) < buf.len) {
+        return false;
+    }
+    span->offset = (uint8_t)(p - start);
+    span->len    = (uint8_t)buf.len;
+    return true;
+}
+
+
+static struct q_useful_buf_c
+from_span(struct q_useful_buf_c protected, struct t_cose_header_cache_span span)
+{
+    if(span.offset == NO_SPAN) {
+        return NULL_Q_USEFUL_BUF_C;
+    }
+    return (struct q_useful_buf_c){(const uint8_t *)protected.ptr + span.offset, span.len};
+}
+
+
+static const struct t_cose_header_cache_entry *
+find_entry(const struct t_cose_header_cache *cache,
+           struct q_useful_buf_c             protected)
+{
+    const struct t_cose_header_cache_entry *entry;
+
+    if(protected.len > T_COSE_HEADER_CACHE_MAX_SIZE) {
+        return NULL;
+    }
+
+    for(entry = cache->entries; entry < cache->entries + T_COSE_HEADER_CACHE_SIZE; entry++) {
+        if(entry->last_use != 0 &&
+           entry->protected_len == protected.len &&
+           !memcmp(entry->protected_bytes, protected.ptr, protected.len)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+empty_entry(struct t_cose_header_cache_entry *entry)
+{
+    if(entry->has_midstate) {
+        t_cose_crypto_hash_abort(hash_from_storage(&(entry->midstate)));
+        entry->has_midstate = false;
+    }
+    entry->last_use = 0;
+}
+
+
+/*
+ * Public function. See t_cose_header_cache.h
+ */
+void
+t_cose_header_cache_init(struct t_cose_header_cache *cache)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+
+/*
+ * Public function. See t_cose_header_cache.h
+ */
+void
+t_cose_header_cache_clear(struct t_cose_header_cache *cache)
+{
+    size_t i;
+
+    for(i = 0; i < T_COSE_HEADER_CACHE_SIZE; i++) {
+        empty_entry(&cache->entries[i]);
+    }
+}
+
+
+/*
+ * Semi-private function. See t_cose_header_cache.h
+ */
+bool
+t_cose_header_cache_find(struct t_cose_header_cache *cache,
+                         struct q_useful_buf_c       protected_parameters,
+                         struct t_cose_parameters   *parameters)
+{
+    struct t_cose_header_cache_entry *entry;
+
+    /* Cast is OK because cache isn't const */
+    entry = (struct t_cose_header_cache_entry *)find_entry(cache, protected_parameters);
+    if(entry == NULL) {
+        return false;
+    }
+
+    cache->use_clock++;
+    entry->last_use = cache->use_clock;
+
+    parameters->cose_algorithm_id = entry->cose_algorithm_id;
+    parameters->kid               = from_span(protected_parameters, entry->kid);
+    parameters->iv                = from_span(protected_parameters, entry->iv);
+    parameters->partial_iv        = from_span(protected_parameters, entry->partial_iv);
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    parameters->content_type_tstr = from_span(protected_parameters, entry->content_type_tstr);
+    parameters->content_type_uint = entry->content_type_uint;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+
+    return true;
+}
+
+
+/*
+ * Semi-private function. See t_cose_header_cache.h
+ */
+void
+t_cose_header_cache_add(struct t_cose_header_cache     *cache,
+                        struct q_useful_buf_c           protected_parameters,
+                        const struct t_cose_parameters *parameters)
+{
+    struct t_cose_header_cache_entry *entry;
+    size_t                            i;
+
+    if(protected_parameters.len == 0 ||
+       protected_parameters.len > T_COSE_HEADER_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    /* An empty entry, else the least recently used */
+    entry = &cache->entries[0];
+    for(i = 1; i < T_COSE_HEADER_CACHE_SIZE && entry->last_use != 0; i++) {
+        if(cache->entries[i].last_use < entry->last_use) {
+            entry = &cache->entries[i];
+        }
+    }
+    empty_entry(entry);
+
+    if(!make_span(protected_parameters, parameters->kid, &entry->kid) ||
+       !make_span(protected_parameters, parameters->iv, &entry->iv) ||
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+       !make_span(protected_parameters, parameters->content_type_tstr, &entry->content_type_tstr) ||
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+       !make_span(protected_parameters, parameters->partial_iv, &entry->partial_iv)) {
+        return;
+    }
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    entry->content_type_uint = parameters->content_type_uint;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+    entry->cose_algorithm_id = parameters->cose_algorithm_id;
+    entry->protected_len     = (uint8_t)protected_parameters.len;
+    memcpy(entry->protected_bytes, protected_parameters.ptr, protected_parameters.len);
+
+    /* Without a midstate, for example for an unsupported algorithm,
+     * the entry still saves the parsing. */
+    entry->has_midstate = create_tbs_hash_start(parameters->cose_algorithm_id,
+                                                protected_parameters,
+                                                hash_from_storage(&(entry->midstate))) == T_COSE_SUCCESS;
+
+    cache->use_clock++;
+    entry->last_use = cache->use_clock;
+}
+
+
+/*
+ * Semi-private function. See t_cose_header_cache.h
+ */
+const struct t_cose_hash_storage *
+t_cose_header_cache_midstate(const struct t_cose_header_cache *cache,
+                             struct q_useful_buf_c             protected_parameters)
+{
+    const struct t_cose_header_cache_entry *entry;
+
+    entry = find_entry(cache, protected_parameters);
+    if(entry == NULL || !entry->has_midstate) {
+        return NULL;
+    }
+    return &(entry->midstate);
+}
@@ -0,0 +1,451 @@
+/*
+ *  t_cose_key_index.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+/* For mmap(), posix_madvise() and friends when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "t_cose/t_cose_key_index.h"
+#include "t_cose_crypto.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef T_COSE_ENABLE_FILE_IO
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * \file t_cose_key_index.c
+ *
+ * \brief Look up verification keys by kid in a memory-mapped index file.
+ *
+ * The index is read a byte at a time with the little-endian helpers
+ * below so it works on any byte order and alignment. Every offset and
+ * length read from it is checked against its size so a damaged file
+ * gives an error rather than a read outside the mapping.
+ */
+
+
+#define INDEX_MAGIC          "TCKI"
+#define INDEX_HEADER_SIZE    40
+#define INDEX_ENTRY_SIZE     24
+#define INDEX_MAX_BUCKET_BITS 30
+
+
+static void
+put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, (uint16_t)v);
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void
+put_u64(uint8_t *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t
+get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t
+get_u64(const uint8_t *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+
+/*
+ * FNV-1a. This is part of the index format so it must not change.
+ */
+static uint32_t
+kid_hash(struct q_useful_buf_c kid)
+{
+    const uint8_t *bytes = (const uint8_t *)kid.ptr;
+    uint32_t       hash  = 2166136261u;
+    size_t         i;
+
+    for(i = 0; i < kid.len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static uint32_t
+bucket_of(uint32_t hash, uint32_t bucket_bits)
+{
+    /* The top bits so that sorting by hash also sorts by bucket */
+    return bucket_bits == 0 ? 0 : hash >> (32 - bucket_bits);
+}
+
+
+/*
+ * qsort() comparison for entries. Hashes are recomputed each time,
+ * but this is only done when making an index.
+ */
+static int
+entry_compare(const void *a, const void *b)
+{
+    const struct t_cose_key_index_entry *entry_a = a;
+    const struct t_cose_key_index_entry *entry_b = b;
+    uint32_t                             hash_a;
+    uint32_t                             hash_b;
+
+    hash_a = kid_hash(entry_a->kid);
+    hash_b = kid_hash(entry_b->kid);
+    if(hash_a != hash_b) {
+        return hash_a < hash_b ? -1 : 1;
+    }
+    return q_useful_buf_compare(entry_a->kid, entry_b->kid);
+}
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+enum t_cose_err_t
+t_cose_key_index_encode(struct t_cose_key_index_entry *entries,
+                        size_t                         count,
+                        struct q_useful_buf            buffer,
+                        struct q_useful_buf_c         *index)
+{
+    uint32_t  bucket_bits;
+    size_t    bucket_count;
+    size_t    entries_offset;
+    size_t    data_offset;
+    size_t    total_size;
+    size_t    data_size;
+    size_t    i;
+    size_t    bucket;
+    size_t    next_bucket;
+    uint8_t  *out;
+    uint8_t  *entry;
+
+    if(count > UINT32_MAX) {
+        return T_COSE_ERR_INVALID_ARGUMENT;
+    }
+
+    data_size = 0;
+    for(i = 0; i < count; i++) {
+        if(q_useful_buf_c_is_null(entries[i].kid) ||
+           entries[i].kid.len > UINT16_MAX ||
+           entries[i].public_key.len > UINT16_MAX) {
+            return T_COSE_ERR_INVALID_ARGUMENT;
+        }
+        data_size += entries[i].kid.len + entries[i].public_key.len;
+    }
+
+    /* About one entry per bucket */
+    for(bucket_bits = 0;
+        bucket_bits < INDEX_MAX_BUCKET_BITS && ((size_t)1 << bucket_bits) < count;
+        bucket_bits++);
+    bucket_count = (size_t)1 << bucket_bits;
+
+    entries_offset = INDEX_HEADER_SIZE + (bucket_count + 1) * 4;
+    entries_offset = (entries_offset + 7) & ~(size_t)7;
+    data_offset    = entries_offset + count * INDEX_ENTRY_SIZE;
+    total_size     = data_offset + data_size;
+
+    if(buffer.ptr == NULL) {
+        /* Just computing the size */
+        *index = (struct q_useful_buf_c){NULL, total_size};
+        return T_COSE_SUCCESS;
+    }
+    if(buffer.len < total_size) {
+        return T_COSE_ERR_TOO_SMALL;
+    }
+
+    qsort(entries, count, sizeof(entries[0]), entry_compare);
+    for(i = 1; i < count; i++) {
+        if(!q_useful_buf_compare(entries[i-1].kid, entries[i].kid)) {
+            return T_COSE_ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    out = buffer.ptr;
+    memset(out, 0, data_offset);
+    memcpy(out, INDEX_MAGIC, 4);
+    put_u16(out + 4, T_COSE_KEY_INDEX_VERSION);
+    put_u16(out + 6, (uint16_t)bucket_bits);
+    put_u32(out + 8, (uint32_t)count);
+    put_u64(out + 16, entries_offset);
+    put_u64(out + 24, data_offset);
+    put_u64(out + 32, total_size);
+
+    /* Each bucket starts at the first entry whose bucket is at least it */
+    bucket = 0;
+    for(i = 0; i < count; i++) {
+        next_bucket = bucket_of(kid_hash(entries[i].kid), bucket_bits);
+        for(; bucket <= next_bucket; bucket++) {
+            put_u32(out + INDEX_HEADER_SIZE + bucket * 4, (uint32_t)i);
+        }
+    }
+    for(; bucket <= bucket_count; bucket++) {
+        put_u32(out + INDEX_HEADER_SIZE + bucket * 4, (uint32_t)count);
+    }
+
+    for(i = 0; i < count; i++) {
+        entry = out + entries_offset + i * INDEX_ENTRY_SIZE;
+        put_u32(entry, kid_hash(entries[i].kid));
+        put_u16(entry + 4, (uint16_t)entries[i].kid.len);
+        put_u16(entry + 6, (uint16_t)entries[i].public_key.len);
+        put_u32(entry + 8, (uint32_t)entries[i].cose_algorithm_id);
+        put_u64(entry + 16, data_offset);
+
+        memcpy(out + data_offset, entries[i].kid.ptr, entries[i].kid.len);
+        data_offset += entries[i].kid.len;
+        if(entries[i].public_key.len) {
+            memcpy(out + data_offset, entries[i].public_key.ptr, entries[i].public_key.len);
+        }
+        data_offset += entries[i].public_key.len;
+    }
+
+    *index = (struct q_useful_buf_c){out, total_size};
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+enum t_cose_err_t
+t_cose_key_index_init_buffer(struct t_cose_key_index *index,
+                             struct q_useful_buf_c    bytes)
+{
+    const uint8_t *header = bytes.ptr;
+    uint32_t       bucket_bits;
+    uint32_t       entry_count;
+    uint64_t       entries_offset;
+    uint64_t       data_offset;
+
+    if(bytes.len < INDEX_HEADER_SIZE ||
+       memcmp(header, INDEX_MAGIC, 4) ||
+       get_u16(header + 4) != T_COSE_KEY_INDEX_VERSION) {
+        return T_COSE_ERR_KEY_INDEX_FORMAT;
+    }
+
+    bucket_bits    = get_u16(header + 6);
+    entry_count    = get_u32(header + 8);
+    entries_offset = get_u64(header + 16);
+    data_offset    = get_u64(header + 24);
+
+    /* Done in this order none of these can overflow */
+    if(get_u64(header + 32) != bytes.len ||
+       bucket_bits > INDEX_MAX_BUCKET_BITS ||
+       entries_offset < INDEX_HEADER_SIZE + (((uint64_t)1 << bucket_bits) + 1) * 4 ||
+       entries_offset > bytes.len ||
+       (bytes.len - entries_offset) / INDEX_ENTRY_SIZE < entry_count ||
+       data_offset < entries_offset + (uint64_t)entry_count * INDEX_ENTRY_SIZE ||
+       data_offset > bytes.len) {
+        return T_COSE_ERR_KEY_INDEX_FORMAT;
+    }
+
+    index->bytes       = bytes.ptr;
+    index->len         = bytes.len;
+    index->entry_count = entry_count;
+    index->bucket_bits = bucket_bits;
+    index->entries     = header + entries_offset;
+    index->is_mapped   = 0;
+
+    return T_COSE_SUCCESS;
+}
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+/*
+ * Public function. See t_cose_key_index.h
+ */
+enum t_cose_err_t
+t_cose_key_index_open(struct t_cose_key_index *index,
+                      const char              *path)
+{
+    enum t_cose_err_t return_value;
+    struct stat       file_stat;
+    void             *map;
+    size_t            map_len;
+    int               fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+    if(fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return_value = T_COSE_ERR_FILE_IO;
+        goto Done;
+    }
+    if((uintmax_t)file_stat.st_size < INDEX_HEADER_SIZE ||
+       (uintmax_t)file_stat.st_size > SIZE_MAX) {
+        return_value = T_COSE_ERR_KEY_INDEX_FORMAT;
+        goto Done;
+    }
+    map_len = (size_t)file_stat.st_size;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        return_value = T_COSE_ERR_FILE_IO;
+        goto Done;
+    }
+    /* Look ups touch a few scattered pages so read-ahead is wasted */
+    (void)posix_madvise(map, map_len, POSIX_MADV_RANDOM);
+
+    return_value = t_cose_key_index_init_buffer(index, (struct q_useful_buf_c){map, map_len});
+    if(return_value != T_COSE_SUCCESS) {
+        munmap(map, map_len);
+        goto Done;
+    }
+    index->is_mapped = 1;
+
+Done:
+    /* The mapping stays valid after the file is closed */
+    close(fd);
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+void
+t_cose_key_index_close(struct t_cose_key_index *index)
+{
+    if(index->is_mapped) {
+        munmap((void *)index->bytes, index->len);
+    }
+    index->bytes       = NULL;
+    index->len         = 0;
+    index->entry_count = 0;
+    index->is_mapped   = 0;
+}
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+enum t_cose_err_t
+t_cose_key_index_find(const struct t_cose_key_index *index,
+                      struct q_useful_buf_c          kid,
+                      int32_t                       *cose_algorithm_id,
+                      struct q_useful_buf_c         *public_key)
+{
+    const uint8_t *bucket_entry;
+    const uint8_t *entry;
+    uint32_t       hash;
+    uint32_t       i;
+    uint32_t       end;
+    uint16_t       kid_len;
+    uint16_t       public_key_len;
+    uint64_t       offset;
+
+    if(q_useful_buf_c_is_null(kid) || index->entry_count == 0) {
+        return T_COSE_ERR_UNKNOWN_KEY;
+    }
+
+    hash         = kid_hash(kid);
+    bucket_entry = index->bytes + INDEX_HEADER_SIZE + (size_t)bucket_of(hash, index->bucket_bits) * 4;
+    i            = get_u32(bucket_entry);
+    end          = get_u32(bucket_entry + 4);
+    if(end > index->entry_count) {
+        return T_COSE_ERR_KEY_INDEX_FORMAT;
+    }
+
+    for(; i < end; i++) {
+        entry = index->entries + (size_t)i * INDEX_ENTRY_SIZE;
+        if(get_u32(entry) != hash) {
+            continue;
+        }
+        kid_len        = get_u16(entry + 4);
+        public_key_len = get_u16(entry + 6);
+        offset         = get_u64(entry + 16);
+        if(offset > index->len || index->len - offset < (size_t)kid_len + public_key_len) {
+            return T_COSE_ERR_KEY_INDEX_FORMAT;
+        }
+        if(kid_len != kid.len || memcmp(index->bytes + offset, kid.ptr, kid_len)) {
+            continue;
+        }
+
+        *cose_algorithm_id = (int32_t)get_u32(entry + 8);
+        public_key->ptr    = index->bytes + offset + kid_len;
+        public_key->len    = public_key_len;
+        return T_COSE_SUCCESS;
+    }
+
+    return T_COSE_ERR_UNKNOWN_KEY;
+}
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+enum t_cose_err_t
+t_cose_key_index_resolve(void                  *key_index,
+                         int32_t                cose_algorithm_id,
+                         struct q_useful_buf_c  kid,
+                         struct t_cose_key     *key)
+{
+    enum t_cose_err_t     return_value;
+    int32_t               key_algorithm_id;
+    struct q_useful_buf_c public_key;
+
+    return_value = t_cose_key_index_find((const struct t_cose_key_index *)key_index,
+                                         kid,
+                                         &key_algorithm_id,
+                                         &public_key);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+
+    /* A message claiming another algorithm than the key's is not
+     * going to verify so don't bother importing the key */
+    if(key_algorithm_id != cose_algorithm_id) {
+        return T_COSE_ERR_WRONG_TYPE_OF_KEY;
+    }
+
+    return t_cose_crypto_import_public_key(key_algorithm_id, public_key, key);
+}
+
+
+/*
+ * Public function. See t_cose_key_index.h
+ */
+void
+t_cose_key_index_free_key(void *key_index, struct t_cose_key key)
+{
+    (void)key_index;
+
+    t_cose_crypto_free_key(key);
+}
@@ -0,0 +1,290 @@
+/*
+ *  t_cose_key_set.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include "t_cose/t_cose_key_set.h"
+
+#ifdef T_COSE_ENABLE_KEY_SET
+
+
+/**
+ * \file t_cose_key_set.c
+ *
+ * \brief A set of verification keys that can be replaced while in use.
+ *
+ * The rotator stores the new generation and then the new epoch, both
+ * with release ordering. A reader loads the epoch and then the
+ * generation, both with acquire ordering, so a reader that sees an
+ * epoch sees a generation at least as new as that epoch.
+ *
+ * Each side has a full fence between its store and its load of the
+ * other's data. Either the rotator sees the reader's epoch in its
+ * slot when it reclaims, or the reader sees the new generation. A
+ * reader can never be using a generation that is freed.
+ */
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_init(struct t_cose_key_set  *set,
+                    t_cose_key_set_free_cb *free_generation,
+                    void                   *cb_context)
+{
+    size_t i;
+
+    set->current         = NULL;
+    /* Epoch 0 in a slot means not reading so epochs start at 1 */
+    set->epoch           = 1;
+    set->retired         = NULL;
+    set->free_generation = free_generation;
+    set->cb_context      = cb_context;
+    for(i = 0; i < T_COSE_KEY_SET_MAX_READERS; i++) {
+        set->slots[i].epoch  = 0;
+        set->slots[i].in_use = 0;
+    }
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_generation_init(struct t_cose_key_set_generation *generation,
+                               struct t_cose_key_set_entry      *entries,
+                               size_t                            count)
+{
+    struct t_cose_key_set_entry entry;
+    size_t                      i;
+    size_t                      j;
+
+    /* Insertion sort because key sets are small and this is only
+     * done when rotating keys */
+    for(i = 1; i < count; i++) {
+        entry = entries[i];
+        for(j = i; j > 0 && q_useful_buf_compare(entries[j-1].kid, entry.kid) > 0; j--) {
+            entries[j] = entries[j-1];
+        }
+        entries[j] = entry;
+    }
+
+    generation->entries      = entries;
+    generation->count        = count;
+    generation->retire_epoch = 0;
+    generation->next_retired = NULL;
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_publish(struct t_cose_key_set            *set,
+                       struct t_cose_key_set_generation *generation)
+{
+    struct t_cose_key_set_generation *old;
+    uint64_t                          epoch;
+
+    /* Only the rotator writes these so plain reads are fine */
+    old   = set->current;
+    epoch = set->epoch + 1;
+
+    __atomic_store_n(&set->current, generation, __ATOMIC_RELEASE);
+    __atomic_store_n(&set->epoch, epoch, __ATOMIC_RELEASE);
+
+    if(old != NULL) {
+        old->retire_epoch = epoch;
+        old->next_retired = set->retired;
+        set->retired      = old;
+    }
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+size_t
+t_cose_key_set_reclaim(struct t_cose_key_set *set)
+{
+    struct t_cose_key_set_generation **link;
+    struct t_cose_key_set_generation  *generation;
+    uint64_t                           oldest;
+    uint64_t                           epoch;
+    size_t                             still_used;
+    size_t                             i;
+
+    /* Pairs with the fence in t_cose_key_set_read_begin() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    oldest = UINT64_MAX;
+    for(i = 0; i < T_COSE_KEY_SET_MAX_READERS; i++) {
+        epoch = __atomic_load_n(&set->slots[i].epoch, __ATOMIC_ACQUIRE);
+        if(epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    /* A generation retired at an epoch can only be in use by readers
+     * that began before that epoch */
+    still_used = 0;
+    link = &set->retired;
+    while(*link != NULL) {
+        generation = *link;
+        if(generation->retire_epoch <= oldest) {
+            *link = generation->next_retired;
+            if(set->free_generation != NULL) {
+                (set->free_generation)(set->cb_context, generation);
+            }
+        } else {
+            link = &generation->next_retired;
+            still_used++;
+        }
+    }
+
+    return still_used;
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_destroy(struct t_cose_key_set *set)
+{
+    struct t_cose_key_set_generation *generation;
+
+    while(set->retired != NULL) {
+        generation   = set->retired;
+        set->retired = generation->next_retired;
+        if(set->free_generation != NULL) {
+            (set->free_generation)(set->cb_context, generation);
+        }
+    }
+    if(set->current != NULL && set->free_generation != NULL) {
+        (set->free_generation)(set->cb_context, set->current);
+    }
+    set->current = NULL;
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+enum t_cose_err_t
+t_cose_key_set_reader_register(struct t_cose_key_set        *set,
+                               struct t_cose_key_set_reader *reader)
+{
+    uint32_t expected;
+    size_t   i;
+
+    for(i = 0; i < T_COSE_KEY_SET_MAX_READERS; i++) {
+        expected = 0;
+        if(__atomic_compare_exchange_n(&set->slots[i].in_use,
+                                       &expected,
+                                       1,
+                                       false,
+                                       __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED)) {
+            reader->set        = set;
+            reader->slot       = &set->slots[i];
+            reader->generation = NULL;
+            return T_COSE_SUCCESS;
+        }
+    }
+
+    return T_COSE_ERR_TOO_MANY_READERS;
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_reader_unregister(struct t_cose_key_set_reader *reader)
+{
+    __atomic_store_n(&reader->slot->in_use, 0, __ATOMIC_RELEASE);
+    reader->slot = NULL;
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_read_begin(struct t_cose_key_set_reader *reader)
+{
+    uint64_t epoch;
+
+    epoch = __atomic_load_n(&reader->set->epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&reader->slot->epoch, epoch, __ATOMIC_RELAXED);
+
+    /* The epoch must be visible in the slot before the generation is
+     * loaded. Pairs with the fence in t_cose_key_set_reclaim(). */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    reader->generation = __atomic_load_n(&reader->set->current, __ATOMIC_ACQUIRE);
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+void
+t_cose_key_set_read_end(struct t_cose_key_set_reader *reader)
+{
+    reader->generation = NULL;
+    __atomic_store_n(&reader->slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Public function. See t_cose_key_set.h
+ */
+enum t_cose_err_t
+t_cose_key_set_resolve(void                  *key_set_reader,
+                       int32_t                cose_algorithm_id,
+                       struct q_useful_buf_c  kid,
+                       struct t_cose_key     *key)
+{
+    const struct t_cose_key_set_reader     *reader;
+    const struct t_cose_key_set_generation *generation;
+    size_t                                  low;
+    size_t                                  high;
+    size_t                                  middle;
+    int                                     compare;
+
+    (void)cose_algorithm_id;
+
+    reader     = (const struct t_cose_key_set_reader *)key_set_reader;
+    generation = reader->generation;
+    if(generation == NULL || q_useful_buf_c_is_null(kid)) {
+        return T_COSE_ERR_UNKNOWN_KEY;
+    }
+
+    low  = 0;
+    high = generation->count;
+    while(low < high) {
+        middle  = low + (high - low) / 2;
+        compare = q_useful_buf_compare(generation->entries[middle].kid, kid);
+        if(compare == 0) {
+            *key = generation->entries[middle].key;
+            return T_COSE_SUCCESS;
+        }
+        if(compare < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return T_COSE_ERR_UNKNOWN_KEY;
+}
+
+#endif /* T_COSE_ENABLE_KEY_SET */
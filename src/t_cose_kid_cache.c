@@ -0,0 +1,406 @@
+/*
+ *  t_cose_kid_cache.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include "t_cose/t_cose_kid_cache.h"
+#include <string.h>
+
+
+/**
+ * \file t_cose_kid_cache.c
+ *
+ * \brief Remember the verification keys found for recently seen kids.
+ *
+ * The table uses linear probing. Removal shifts later entries of the
+ * probe sequence back rather than leaving tombstones so look ups
+ * never get slower as keys come and go.
+ *
+ * A pinned entry that is removed stays in its slot, marked removed so
+ * look ups skip it, until its last pin is released. It still counts
+ * towards \ref T_COSE_KID_CACHE_SIZE so the table never fills up.
+ */
+
+
+#define SLOT_COUNT (T_COSE_KID_CACHE_SIZE * 2)
+#define SLOT_MASK  (SLOT_COUNT - 1)
+
+#if (T_COSE_KID_CACHE_SIZE & (T_COSE_KID_CACHE_SIZE - 1)) != 0
+#error T_COSE_KID_CACHE_SIZE must be a power of two
+#endif
+
+#if T_COSE_KID_CACHE_MAX_KID_SIZE > UINT8_MAX
+#error T_COSE_KID_CACHE_MAX_KID_SIZE must fit in a uint8_t
+#endif
+
+
+/*
+ * FNV-1a. kids are short and usually random already so nothing
+ * stronger is needed.
+ */
+static uint32_t
+kid_hash(struct q_useful_buf_c kid)
+{
+    const uint8_t *bytes = (const uint8_t *)kid.ptr;
+    uint32_t       hash  = 2166136261u;
+    size_t         i;
+
+    for(i = 0; i < kid.len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+/*
+ * Returns the slot holding kid or SLOT_COUNT if it is not cached. The
+ * table is never full so the probe always ends at an empty slot.
+ */
+static size_t
+find_slot(const struct t_cose_kid_cache *cache,
+          struct q_useful_buf_c          kid,
+          uint32_t                       hash)
+{
+    const struct t_cose_kid_cache_entry *entry;
+    size_t                               i;
+
+    for(i = hash & SLOT_MASK; ; i = (i + 1) & SLOT_MASK) {
+        entry = &cache->slots[i];
+        if(entry->last_use == 0) {
+            return SLOT_COUNT;
+        }
+        if(!entry->is_removed &&
+           entry->hash == hash &&
+           entry->kid_len == kid.len &&
+           !memcmp(entry->kid, kid.ptr, kid.len)) {
+            return i;
+        }
+    }
+}
+
+
+/*
+ * Empties a slot and moves entries after it in the probe sequence
+ * back so none of them become unreachable.
+ */
+static void
+free_slot(struct t_cose_kid_cache *cache, size_t i)
+{
+    size_t j;
+    size_t home;
+
+    if(cache->evicted != NULL) {
+        (cache->evicted)(cache->cb_context, cache->slots[i].key);
+    }
+    cache->count--;
+
+    j = i;
+    while(1) {
+        cache->slots[i].last_use = 0;
+        do {
+            j = (j + 1) & SLOT_MASK;
+            if(cache->slots[j].last_use == 0) {
+                return;
+            }
+            home = cache->slots[j].hash & SLOT_MASK;
+            /* The entry at j stays if its home is cyclically in (i, j] */
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+        cache->slots[i] = cache->slots[j];
+        i = j;
+    }
+}
+
+
+/*
+ * Takes an entry out of the cache. A pinned one is only marked
+ * removed and is freed when its last pin is released.
+ */
+static void
+remove_slot(struct t_cose_kid_cache *cache, size_t i)
+{
+    if(cache->slots[i].pins != 0) {
+        cache->slots[i].is_removed = true;
+    } else {
+        free_slot(cache, i);
+    }
+}
+
+
+/*
+ * Evicts the least recently used entry that isn't pinned. This scans
+ * the whole table, but it is only done on a miss when the resolver
+ * has been called, which is much slower. Returns false if every entry
+ * is pinned.
+ */
+static bool
+evict_lru(struct t_cose_kid_cache *cache)
+{
+    size_t   i;
+    size_t   lru;
+    uint64_t oldest;
+
+    lru    = SLOT_COUNT;
+    oldest = UINT64_MAX;
+    for(i = 0; i < SLOT_COUNT; i++) {
+        if(cache->slots[i].last_use != 0 &&
+           cache->slots[i].pins == 0 &&
+           cache->slots[i].last_use < oldest) {
+            oldest = cache->slots[i].last_use;
+            lru    = i;
+        }
+    }
+
+    if(lru == SLOT_COUNT) {
+        return false;
+    }
+    free_slot(cache, lru);
+    return true;
+}
+
+
+/*
+ * Gives the key for the last kid that wasn't cached to the evicted
+ * callback. It is held until now so a resolver that makes a new key
+ * for each look up doesn't leak it.
+ */
+static void
+release_uncached(struct t_cose_kid_cache *cache)
+{
+    if(cache->has_uncached_key) {
+        cache->has_uncached_key = false;
+        (cache->evicted)(cache->cb_context, cache->uncached_key);
+    }
+}
+
+
+/*
+ * Returns the slot the key was put in or SLOT_COUNT if it wasn't
+ * cached because every entry is pinned.
+ */
+static size_t
+insert(struct t_cose_kid_cache *cache,
+       struct q_useful_buf_c    kid,
+       uint32_t                 hash,
+       struct t_cose_key        key)
+{
+    struct t_cose_kid_cache_entry *entry;
+    size_t                         i;
+
+    if(cache->count == T_COSE_KID_CACHE_SIZE && !evict_lru(cache)) {
+        return SLOT_COUNT;
+    }
+
+    for(i = hash & SLOT_MASK; cache->slots[i].last_use != 0; i = (i + 1) & SLOT_MASK);
+
+    entry = &cache->slots[i];
+    entry->key      = key;
+    entry->last_use = ++cache->use_clock;
+    entry->hash       = hash;
+    entry->pins       = 0;
+    entry->is_removed = false;
+    entry->kid_len    = (uint8_t)kid.len;
+    memcpy(entry->kid, kid.ptr, kid.len);
+    cache->count++;
+
+    return i;
+}
+
+
+/*
+ * Keys are copied in and out of the cache whole so comparing the
+ * bytes of the union finds the same key whichever member is used.
+ */
+static inline bool
+is_same_key(struct t_cose_key key1, struct t_cose_key key2)
+{
+    return key1.crypto_lib == key2.crypto_lib &&
+           !memcmp(&key1.k, &key2.k, sizeof(key1.k));
+}
+
+
+/*
+ * Does the work for t_cose_kid_cache_resolve() and
+ * t_cose_kid_cache_resolve_pinned(). A key that isn't cached is held
+ * for release on the next look up if it isn't pinned. If it is
+ * pinned, it goes to the evicted callback when it is released.
+ */
+static enum t_cose_err_t
+resolve(struct t_cose_kid_cache *cache,
+        int32_t                  cose_algorithm_id,
+        struct q_useful_buf_c    kid,
+        bool                     pin,
+        struct t_cose_key       *key)
+{
+    enum t_cose_err_t return_value;
+    uint32_t          hash;
+    size_t            i;
+
+    release_uncached(cache);
+
+    if(q_useful_buf_c_is_null(kid) || kid.len > T_COSE_KID_CACHE_MAX_KID_SIZE) {
+        /* Not cacheable */
+        i = SLOT_COUNT;
+        return_value = (cache->resolver)(cache->cb_context, cose_algorithm_id, kid, key);
+        goto Done;
+    }
+
+    hash = kid_hash(kid);
+    i = find_slot(cache, kid, hash);
+    if(i != SLOT_COUNT) {
+        cache->slots[i].last_use = ++cache->use_clock;
+        *key = cache->slots[i].key;
+        return_value = T_COSE_SUCCESS;
+        goto Done;
+    }
+
+    return_value = (cache->resolver)(cache->cb_context, cose_algorithm_id, kid, key);
+    if(return_value == T_COSE_SUCCESS) {
+        i = insert(cache, kid, hash, *key);
+    }
+
+Done:
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+    if(i != SLOT_COUNT) {
+        if(pin) {
+            cache->slots[i].pins++;
+        }
+    } else if(!pin && cache->evicted != NULL) {
+        cache->uncached_key     = *key;
+        cache->has_uncached_key = true;
+    }
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+void
+t_cose_kid_cache_init(struct t_cose_kid_cache *cache,
+                      t_cose_key_resolver_cb  *resolver,
+                      t_cose_key_evicted_cb   *evicted,
+                      void                    *cb_context)
+{
+    size_t i;
+
+    cache->resolver         = resolver;
+    cache->evicted          = evicted;
+    cache->cb_context       = cb_context;
+    cache->use_clock        = 0;
+    cache->count            = 0;
+    cache->has_uncached_key = false;
+    for(i = 0; i < SLOT_COUNT; i++) {
+        cache->slots[i].last_use = 0;
+    }
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+enum t_cose_err_t
+t_cose_kid_cache_resolve(void                  *cache,
+                         int32_t                cose_algorithm_id,
+                         struct q_useful_buf_c  kid,
+                         struct t_cose_key     *key)
+{
+    return resolve((struct t_cose_kid_cache *)cache, cose_algorithm_id, kid, false, key);
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+enum t_cose_err_t
+t_cose_kid_cache_resolve_pinned(void                  *cache,
+                                int32_t                cose_algorithm_id,
+                                struct q_useful_buf_c  kid,
+                                struct t_cose_key     *key)
+{
+    return resolve((struct t_cose_kid_cache *)cache, cose_algorithm_id, kid, true, key);
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+void
+t_cose_kid_cache_release(void *kid_cache, struct t_cose_key key)
+{
+    struct t_cose_kid_cache *cache = (struct t_cose_kid_cache *)kid_cache;
+    size_t                   i;
+
+    for(i = 0; i < SLOT_COUNT; i++) {
+        if(cache->slots[i].last_use != 0 &&
+           cache->slots[i].pins != 0 &&
+           is_same_key(cache->slots[i].key, key)) {
+            cache->slots[i].pins--;
+            if(cache->slots[i].pins == 0 && cache->slots[i].is_removed) {
+                free_slot(cache, i);
+            }
+            return;
+        }
+    }
+
+    /* Never cached because every entry was pinned or the kid was too long */
+    if(cache->evicted != NULL) {
+        (cache->evicted)(cache->cb_context, key);
+    }
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+void
+t_cose_kid_cache_remove(struct t_cose_kid_cache *cache,
+                        struct q_useful_buf_c    kid)
+{
+    size_t i;
+
+    if(q_useful_buf_c_is_null(kid) || kid.len > T_COSE_KID_CACHE_MAX_KID_SIZE) {
+        return;
+    }
+
+    i = find_slot(cache, kid, kid_hash(kid));
+    if(i != SLOT_COUNT) {
+        remove_slot(cache, i);
+    }
+}
+
+
+/*
+ * Public function. See t_cose_kid_cache.h
+ */
+void
+t_cose_kid_cache_clear(struct t_cose_kid_cache *cache)
+{
+    size_t i;
+
+    release_uncached(cache);
+    for(i = 0; i < SLOT_COUNT; i++) {
+        if(cache->slots[i].last_use == 0) {
+            continue;
+        }
+        if(cache->slots[i].pins != 0) {
+            /* Freed when released. Not found by look ups meanwhile. */
+            cache->slots[i].is_removed = true;
+            continue;
+        }
+        if(cache->evicted != NULL) {
+            (cache->evicted)(cache->cb_context, cache->slots[i].key);
+        }
+        cache->slots[i].last_use = 0;
+        cache->count--;
+    }
+}
@@ -0,0 +1,364 @@
+/*
+ *  t_cose_kid_filter.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+/* For mmap(), posix_madvise() and friends when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "t_cose/t_cose_kid_filter.h"
+#include <string.h>
+
+#ifdef T_COSE_ENABLE_FILE_IO
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * \file t_cose_kid_filter.c
+ *
+ * \brief Blocked Bloom filter of kids checked before verifying.
+ *
+ * All the bits for a kid are in one 64-byte block so a check reads
+ * one cache line and, for a mapped filter, one page. This costs a
+ * little in false positive rate over a plain Bloom filter of the
+ * same size.
+ */
+
+
+#define FILTER_MAGIC       "TCKF"
+#define FILTER_HEADER_SIZE 24
+#define FILTER_BLOCK_SIZE  64
+#define FILTER_BLOCK_BITS  (FILTER_BLOCK_SIZE * 8)
+#define FILTER_MAX_HASHES  16
+
+
+static void
+put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void
+put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, (uint16_t)v);
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void
+put_u64(uint8_t *p, uint64_t v)
+{
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t
+get_u16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t
+get_u64(const uint8_t *p)
+{
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+
+/*
+ * MurmurHash3 fmix64. Spreads the FNV-1a hash, which is weak in its
+ * high bits for short kids.
+ */
+static uint64_t
+mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+/*
+ * This is part of the filter format so it must not change.
+ */
+static uint64_t
+kid_hash(struct q_useful_buf_c kid)
+{
+    const uint8_t *bytes = (const uint8_t *)kid.ptr;
+    uint64_t       hash  = 14695981039346656037ULL;
+    size_t         i;
+
+    for(i = 0; i < kid.len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return mix64(hash);
+}
+
+
+/*
+ * The block a kid's bits are in. Multiply and shift rather than
+ * modulo to avoid a division.
+ */
+static size_t
+block_of(uint64_t hash, uint32_t block_count)
+{
+    return (size_t)(((hash >> 32) * block_count) >> 32);
+}
+
+
+/*
+ * The jth bit to set in the block, for j counting up from 0. Each
+ * mix of the hash gives seven 9-bit bit numbers.
+ */
+static uint32_t
+bit_of(uint64_t *bits, unsigned j)
+{
+    if(j % 7 == 0) {
+        *bits = mix64(*bits + j);
+    }
+    return (uint32_t)(*bits >> (9 * (j % 7))) % FILTER_BLOCK_BITS;
+}
+
+
+/*
+ * Public function. See t_cose_kid_filter.h
+ */
+enum t_cose_err_t
+t_cose_kid_filter_encode(enum t_cose_kid_filter_mode  mode,
+                         const struct q_useful_buf_c *kids,
+                         size_t                       count,
+                         unsigned                     bits_per_kid,
+                         struct q_useful_buf          buffer,
+                         struct q_useful_buf_c       *filter)
+{
+    uint64_t       block_count;
+    size_t         total_size;
+    unsigned       hash_count;
+    size_t         i;
+    unsigned       j;
+    uint8_t       *out;
+    uint8_t       *block;
+    uint64_t       hash;
+    uint64_t       bits;
+    uint32_t       bit;
+
+    if((mode != T_COSE_KID_FILTER_ALLOW && mode != T_COSE_KID_FILTER_DENY) ||
+       bits_per_kid < 4 || bits_per_kid > 64 ||
+       count > UINT32_MAX) {
+        return T_COSE_ERR_INVALID_ARGUMENT;
+    }
+
+    block_count = ((uint64_t)count * bits_per_kid + FILTER_BLOCK_BITS - 1) / FILTER_BLOCK_BITS;
+    if(block_count == 0) {
+        block_count = 1;
+    }
+    if(block_count > UINT32_MAX ||
+       block_count > (SIZE_MAX - FILTER_HEADER_SIZE) / FILTER_BLOCK_SIZE) {
+        return T_COSE_ERR_INVALID_ARGUMENT;
+    }
+    total_size = FILTER_HEADER_SIZE + (size_t)block_count * FILTER_BLOCK_SIZE;
+
+    /* bits_per_kid * ln(2) is the best number of bits to set */
+    hash_count = (bits_per_kid * 69 + 50) / 100;
+    if(hash_count > FILTER_MAX_HASHES) {
+        hash_count = FILTER_MAX_HASHES;
+    }
+
+    if(buffer.ptr == NULL) {
+        /* Just computing the size */
+        *filter = (struct q_useful_buf_c){NULL, total_size};
+        return T_COSE_SUCCESS;
+    }
+    if(buffer.len < total_size) {
+        return T_COSE_ERR_TOO_SMALL;
+    }
+
+    out = buffer.ptr;
+    memset(out, 0, total_size);
+    memcpy(out, FILTER_MAGIC, 4);
+    put_u16(out + 4, T_COSE_KID_FILTER_VERSION);
+    out[6] = (uint8_t)mode;
+    out[7] = (uint8_t)hash_count;
+    put_u32(out + 8, (uint32_t)block_count);
+    put_u32(out + 12, (uint32_t)count);
+    put_u64(out + 16, total_size);
+
+    for(i = 0; i < count; i++) {
+        hash  = kid_hash(kids[i]);
+        block = out + FILTER_HEADER_SIZE + block_of(hash, (uint32_t)block_count) * FILTER_BLOCK_SIZE;
+        bits  = hash;
+        for(j = 0; j < hash_count; j++) {
+            bit = bit_of(&bits, j);
+            block[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+    }
+
+    *filter = (struct q_useful_buf_c){out, total_size};
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function. See t_cose_kid_filter.h
+ */
+enum t_cose_err_t
+t_cose_kid_filter_init_buffer(struct t_cose_kid_filter *filter,
+                              struct q_useful_buf_c     bytes)
+{
+    const uint8_t *header = bytes.ptr;
+    uint32_t       block_count;
+
+    if(bytes.len < FILTER_HEADER_SIZE ||
+       memcmp(header, FILTER_MAGIC, 4) ||
+       get_u16(header + 4) != T_COSE_KID_FILTER_VERSION) {
+        return T_COSE_ERR_KID_FILTER_FORMAT;
+    }
+
+    block_count = get_u32(header + 8);
+    if((header[6] != T_COSE_KID_FILTER_ALLOW && header[6] != T_COSE_KID_FILTER_DENY) ||
+       header[7] < 1 || header[7] > FILTER_MAX_HASHES ||
+       block_count == 0 ||
+       get_u64(header + 16) != bytes.len ||
+       (bytes.len - FILTER_HEADER_SIZE) / FILTER_BLOCK_SIZE != block_count ||
+       (bytes.len - FILTER_HEADER_SIZE) % FILTER_BLOCK_SIZE != 0) {
+        return T_COSE_ERR_KID_FILTER_FORMAT;
+    }
+
+    filter->bytes       = bytes.ptr;
+    filter->len         = bytes.len;
+    filter->blocks      = header + FILTER_HEADER_SIZE;
+    filter->block_count = block_count;
+    filter->hash_count  = header[7];
+    filter->mode        = header[6];
+    filter->is_mapped   = 0;
+
+    return T_COSE_SUCCESS;
+}
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+/*
+ * Public function. See t_cose_kid_filter.h
+ */
+enum t_cose_err_t
+t_cose_kid_filter_open(struct t_cose_kid_filter *filter,
+                       const char               *path)
+{
+    enum t_cose_err_t return_value;
+    struct stat       file_stat;
+    void             *map;
+    size_t            map_len;
+    int               fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+    if(fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+        return_value = T_COSE_ERR_FILE_IO;
+        goto Done;
+    }
+    if((uintmax_t)file_stat.st_size < FILTER_HEADER_SIZE ||
+       (uintmax_t)file_stat.st_size > SIZE_MAX) {
+        return_value = T_COSE_ERR_KID_FILTER_FORMAT;
+        goto Done;
+    }
+    map_len = (size_t)file_stat.st_size;
+
+    map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        return_value = T_COSE_ERR_FILE_IO;
+        goto Done;
+    }
+    /* Each check touches one block somewhere so read-ahead is wasted */
+    (void)posix_madvise(map, map_len, POSIX_MADV_RANDOM);
+
+    return_value = t_cose_kid_filter_init_buffer(filter, (struct q_useful_buf_c){map, map_len});
+    if(return_value != T_COSE_SUCCESS) {
+        munmap(map, map_len);
+        goto Done;
+    }
+    filter->is_mapped = 1;
+
+Done:
+    /* The mapping stays valid after the file is closed */
+    close(fd);
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_kid_filter.h
+ */
+void
+t_cose_kid_filter_close(struct t_cose_kid_filter *filter)
+{
+    if(filter->is_mapped) {
+        munmap((void *)filter->bytes, filter->len);
+    }
+    filter->bytes       = NULL;
+    filter->len         = 0;
+    filter->blocks      = NULL;
+    filter->block_count = 0;
+    filter->is_mapped   = 0;
+}
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+
+/*
+ * Public function. See t_cose_kid_filter.h
+ */
+enum t_cose_err_t
+t_cose_kid_filter_check(const struct t_cose_kid_filter *filter,
+                        struct q_useful_buf_c           kid)
+{
+    const uint8_t *block;
+    uint64_t       hash;
+    uint64_t       bits;
+    uint32_t       bit;
+    unsigned       j;
+    int            in_filter;
+
+    hash  = kid_hash(kid);
+    block = filter->blocks + block_of(hash, filter->block_count) * FILTER_BLOCK_SIZE;
+    bits  = hash;
+
+    in_filter = 1;
+    for(j = 0; j < filter->hash_count; j++) {
+        bit = bit_of(&bits, j);
+        if(!(block[bit / 8] & (1 << (bit % 8)))) {
+            in_filter = 0;
+            break;
+        }
+    }
+
+    if(in_filter == (filter->mode == T_COSE_KID_FILTER_DENY)) {
+        return T_COSE_ERR_KID_REJECTED;
+    }
+    return T_COSE_SUCCESS;
+}
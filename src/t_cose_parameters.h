@@ -70,6 +70,21 @@ inline static void clear_label_list(struct t_cose_label_list *list)
 }
 
 
+/**
+ * \brief Indicate whether label list is clear or not.
+ *
+ * \param[in,out] list  The list to check.
+ *
+ * \return true if the list is clear.
+ */
+inline static bool
+is_label_list_clear(const struct t_cose_label_list *list)
+{
+    return list->int_labels[0] == 0 &&
+               q_useful_buf_c_is_null_or_empty(list->tstr_labels[0]);
+}
+
+
 
 
 enum t_cose_err_t
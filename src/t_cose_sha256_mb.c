@@ -0,0 +1,310 @@
+/*
+ *  t_cose_sha256_mb.c
+ *
+ * Copyright 2019-2022, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include "t_cose_sha256_mb.h"
+
+#ifdef T_COSE_ENABLE_MULTI_BUFFER_SHA256
+
+#include <stdint.h>
+#include <string.h>
+
+
+/**
+ * \file t_cose_sha256_mb.c
+ *
+ * \brief Multi-buffer SHA-256.
+ *
+ * The SHA-256 compression function is written once in
+ * SHA256_MB_KERNEL() for a vector type with a given number of
+ * lanes. Each lane is an independent input. Blocks of the inputs
+ * are transposed so that word \c j of the blocks of all the lanes is
+ * in one vector.
+ *
+ * Inputs don't all have the same number of blocks. A lane whose input
+ * is finished is fed zero blocks and its hash is taken when its last
+ * real block is done.
+ *
+ * The vectors never go in or out of a function as parameters or
+ * return values so the kernels compiled for AVX2 and AVX-512 can be
+ * called from code compiled without them.
+ */
+
+
+#define SHA256_BLOCK_SIZE 64
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_MB_X86
+#endif
+
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+
+/*
+ * Reads the blocks of one input, including the padding, from its
+ * pieces.
+ */
+struct lane_input {
+    const struct q_useful_buf_c *pieces;
+    size_t                       piece_count;
+    size_t                       piece;       /* The piece being read */
+    size_t                       offset;      /* Offset in that piece */
+    uint64_t                     len;         /* Of the whole input */
+    size_t                       block_count; /* Including the padding */
+};
+
+
+static void
+lane_input_init(struct lane_input           *input,
+                const struct q_useful_buf_c *pieces,
+                size_t                       piece_count)
+{
+    size_t i;
+
+    input->pieces      = pieces;
+    input->piece_count = piece_count;
+    input->piece       = 0;
+    input->offset      = 0;
+    input->len         = 0;
+    for(i = 0; i < piece_count; i++) {
+        if(pieces[i].ptr != NULL) {
+            input->len += pieces[i].len;
+        }
+    }
+    /* At least one byte of 0x80 and 8 of length are added */
+    input->block_count = (size_t)((input->len + 8) / SHA256_BLOCK_SIZE + 1);
+}
+
+
+/*
+ * Gets the next block. Blocks must be read in order and only
+ * block_count of them.
+ */
+static void
+lane_input_block(struct lane_input *input,
+                 size_t             block_index,
+                 uint8_t           *block)
+{
+    struct q_useful_buf_c piece;
+    uint64_t              block_start;
+    uint64_t              bit_len;
+    size_t                filled;
+    size_t                n;
+    int                   i;
+
+    filled = 0;
+    while(filled < SHA256_BLOCK_SIZE && input->piece < input->piece_count) {
+        piece = input->pieces[input->piece];
+        if(piece.ptr == NULL || input->offset >= piece.len) {
+            input->piece++;
+            input->offset = 0;
+            continue;
+        }
+        n = piece.len - input->offset;
+        if(n > SHA256_BLOCK_SIZE - filled) {
+            n = SHA256_BLOCK_SIZE - filled;
+        }
+        memcpy(block + filled, (const uint8_t *)piece.ptr + input->offset, n);
+        filled        += n;
+        input->offset += n;
+    }
+    memset(block + filled, 0, SHA256_BLOCK_SIZE - filled);
+
+    block_start = (uint64_t)block_index * SHA256_BLOCK_SIZE;
+    if(input->len >= block_start && input->len < block_start + SHA256_BLOCK_SIZE) {
+        block[input->len - block_start] = 0x80;
+    }
+
+    if(block_index == input->block_count - 1) {
+        bit_len = input->len * 8;
+        for(i = 0; i < 8; i++) {
+            block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bit_len >> (8 * i));
+        }
+    }
+}
+
+
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+
+#define ROTR(x, n)  ((x) >> (n) | (x) << (32 - (n)))
+#define BSIG0(x)    (ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define BSIG1(x)    (ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define SSIG0(x)    (ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)    (ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+
+/*
+ * Defines the function name() that hashes up to lanes inputs with
+ * vectors of lanes 32-bit words. The function attributes, for
+ * example the instruction set, are in attrs.
+ */
+#define SHA256_MB_KERNEL(name, lanes, attrs)                                   \
+typedef uint32_t name##_vec __attribute__((vector_size((lanes) * 4)));        \
+                                                                               \
+static attrs void                                                              \
+name(const struct q_useful_buf_c * const *inputs,                              \
+     size_t                               piece_count,                         \
+     const struct q_useful_buf           *hash_buffers,                        \
+     size_t                               count)                               \
+{                                                                              \
+    struct lane_input in[lanes];                                               \
+    uint8_t           blocks[lanes][SHA256_BLOCK_SIZE];                        \
+    uint32_t          words[16][lanes];                                        \
+    uint32_t          hashes[lanes][8];                                        \
+    name##_vec        state[8];                                                \
+    name##_vec        w[16];                                                   \
+    name##_vec        a, b, c, d, e, f, g, h, t1, t2;                          \
+    size_t            max_blocks;                                              \
+    size_t            block;                                                   \
+    size_t            lane;                                                    \
+    int               i;                                                       \
+    int               t;                                                       \
+                                                                               \
+    max_blocks = 0;                                                            \
+    for(lane = 0; lane < count; lane++) {                                      \
+        lane_input_init(&in[lane], inputs[lane], piece_count);                 \
+        if(in[lane].block_count > max_blocks) {                                \
+            max_blocks = in[lane].block_count;                                 \
+        }                                                                      \
+    }                                                                          \
+    for(i = 0; i < 8; i++) {                                                   \
+        state[i] = (name##_vec){0} + sha256_initial_state[i];                  \
+    }                                                                          \
+                                                                               \
+    for(block = 0; block < max_blocks; block++) {                              \
+        for(lane = 0; lane < (lanes); lane++) {                                \
+            if(lane < count && block < in[lane].block_count) {                 \
+                lane_input_block(&in[lane], block, blocks[lane]);              \
+            } else {                                                           \
+                memset(blocks[lane], 0, SHA256_BLOCK_SIZE);                    \
+            }                                                                  \
+        }                                                                      \
+        for(i = 0; i < 16; i++) {                                              \
+            for(lane = 0; lane < (lanes); lane++) {                            \
+                words[i][lane] = load_be32(&blocks[lane][4 * i]);              \
+            }                                                                  \
+        }                                                                      \
+        memcpy(w, words, sizeof(w));                                           \
+                                                                               \
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];                \
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];                \
+        for(t = 0; t < 64; t++) {                                              \
+            if(t >= 16) {                                                      \
+                w[t & 15] += SSIG1(w[(t - 2) & 15]) + w[(t - 7) & 15] +        \
+                             SSIG0(w[(t - 15) & 15]);                          \
+            }                                                                  \
+            t1 = h + BSIG1(e) + CH(e, f, g) + sha256_k[t] + w[t & 15];         \
+            t2 = BSIG0(a) + MAJ(a, b, c);                                      \
+            h = g; g = f; f = e; e = d + t1;                                   \
+            d = c; c = b; b = a; a = t1 + t2;                                  \
+        }                                                                      \
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;            \
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;            \
+                                                                               \
+        for(lane = 0; lane < count; lane++) {                                  \
+            if(block == in[lane].block_count - 1) {                            \
+                for(i = 0; i < 8; i++) {                                       \
+                    hashes[lane][i] = state[i][lane];                          \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    for(lane = 0; lane < count; lane++) {                                      \
+        for(i = 0; i < 32; i++) {                                              \
+            ((uint8_t *)hash_buffers[lane].ptr)[i] =                           \
+                (uint8_t)(hashes[lane][i / 4] >> (24 - 8 * (i % 4)));          \
+        }                                                                      \
+    }                                                                          \
+}
+
+
+SHA256_MB_KERNEL(sha256_mb_4, 4, )
+
+#ifdef SHA256_MB_X86
+SHA256_MB_KERNEL(sha256_mb_8, 8, __attribute__((target("avx2"))))
+SHA256_MB_KERNEL(sha256_mb_16, 16, __attribute__((target("avx512f"))))
+#endif /* SHA256_MB_X86 */
+
+
+/*
+ * Public function. See t_cose_sha256_mb.h
+ */
+size_t t_cose_sha256_mb_lanes(void)
+{
+#ifdef SHA256_MB_X86
+    /* This may run before the constructor that fills in what
+     * __builtin_cpu_supports() checks. */
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        return 16;
+    }
+    if(__builtin_cpu_supports("avx2")) {
+        return 8;
+    }
+#endif /* SHA256_MB_X86 */
+    return 4;
+}
+
+
+/*
+ * Public function. See t_cose_sha256_mb.h
+ */
+void t_cose_sha256_mb(const struct q_useful_buf_c * const *inputs,
+                      size_t                               piece_count,
+                      const struct q_useful_buf           *hash_buffers,
+                      size_t                               count)
+{
+    size_t lanes;
+    size_t n;
+
+    lanes = t_cose_sha256_mb_lanes();
+
+    while(count > 0) {
+        n = count < lanes ? count : lanes;
+
+        /* The narrowest kernel that takes all of them so that few
+         * lanes are idle at the end */
+#ifdef SHA256_MB_X86
+        if(n > 8) {
+            sha256_mb_16(inputs, piece_count, hash_buffers, n);
+        } else if(n > 4) {
+            sha256_mb_8(inputs, piece_count, hash_buffers, n);
+        } else
+#endif /* SHA256_MB_X86 */
+        {
+            sha256_mb_4(inputs, piece_count, hash_buffers, n);
+        }
+
+        inputs       += n;
+        hash_buffers += n;
+        count        -= n;
+    }
+}
+
+#endif /* T_COSE_ENABLE_MULTI_BUFFER_SHA256 */
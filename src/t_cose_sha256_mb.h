@@ -0,0 +1,80 @@
+/*
+ *  t_cose_sha256_mb.h
+ *
+ * Copyright 2019-2022, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+
+#ifndef __T_COSE_SHA256_MB_H__
+#define __T_COSE_SHA256_MB_H__
+
+#include <stddef.h>
+#include "t_cose/q_useful_buf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \file t_cose_sha256_mb.h
+ *
+ * \brief Multi-buffer SHA-256 for the crypto adapters.
+ *
+ * This hashes several independent inputs at once, one in each lane
+ * of a vector register, for crypto adapters to use in
+ * t_cose_crypto_hash_batch(). SHA-256 of one input is a long chain
+ * of dependent operations so it can't use the width of the CPU. Many
+ * inputs side by side can.
+ *
+ * It has no dependency on any crypto library. It is written with the
+ * GCC vector extensions, which GCC and clang support, so it is only
+ * built when \c T_COSE_ENABLE_MULTI_BUFFER_SHA256 is defined. The
+ * widest lanes the CPU has are picked at run time: 16 with AVX-512, 8
+ * with AVX2 and otherwise 4, which is SSE2 on x86-64 and NEON on
+ * 64-bit ARM.
+ */
+
+
+/**
+ * \brief Number of inputs hashed at once.
+ *
+ * \return 16, 8 or 4 depending on the CPU.
+ *
+ * A crypto adapter can use this to decide whether a batch is big
+ * enough to be worth hashing with t_cose_sha256_mb() rather than a
+ * single-stream hash.
+ */
+size_t t_cose_sha256_mb_lanes(void);
+
+
+/**
+ * \brief Hash several inputs with SHA-256.
+ *
+ * \param[in] inputs       Array of \c count inputs, each an array of
+ *                         \c piece_count pieces that are hashed as
+ *                         if concatenated.
+ * \param[in] piece_count  The number of pieces in each input.
+ * \param[in] hash_buffers Array of \c count buffers into which the
+ *                         hashes are put. Each must be at least
+ *                         \ref T_COSE_CRYPTO_SHA256_SIZE bytes.
+ * \param[in] count        The number of inputs, which may be more
+ *                         than the number of lanes.
+ *
+ * A piece with a \c NULL pointer is hashed as empty. The buffer sizes
+ * are not checked.
+ */
+void t_cose_sha256_mb(const struct q_useful_buf_c * const *inputs,
+                      size_t                               piece_count,
+                      const struct q_useful_buf           *hash_buffers,
+                      size_t                               count);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __T_COSE_SHA256_MB_H__ */
@@ -0,0 +1,411 @@
+/*
+ *  t_cose_sign1_file.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+/* For mmap(), posix_madvise() and friends when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "t_cose/t_cose_sign1_file.h"
+
+#ifdef T_COSE_ENABLE_FILE_IO
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+/**
+ * \file t_cose_sign1_file.c
+ *
+ * \brief Sign and verify \c COSE_Sign1 with a detached payload in a file.
+ *
+ * The payload is fed to the streaming sign and verify a piece at a
+ * time, either straight out of a memory map or through the caller's
+ * read buffer.
+ */
+
+
+/*
+ * Where the payload is in the file and how to get at it.
+ */
+struct payload_file {
+    int    fd;
+    int    is_mappable;
+    off_t  start;
+    size_t len;
+};
+
+
+/*
+ * Feeds a piece of the payload to a streaming sign or verify.
+ */
+typedef void (*payload_update_fn)(void *stream, struct q_useful_buf_c payload_chunk);
+
+
+static void
+sign_update(void *stream, struct q_useful_buf_c payload_chunk)
+{
+    t_cose_sign1_sign_detached_update((struct t_cose_sign1_sign_stream *)stream,
+                                      payload_chunk);
+}
+
+
+static void
+verify_update(void *stream, struct q_useful_buf_c payload_chunk)
+{
+    t_cose_sign1_verify_detached_update((struct t_cose_sign1_verify_stream *)stream,
+                                        payload_chunk);
+}
+
+
+/**
+ * \brief Work out where the payload is in a file.
+ *
+ * \param[in] fd            The file descriptor.
+ * \param[in] payload_len   Length given by the caller or
+ *                          \ref T_COSE_PAYLOAD_LEN_FROM_FILE.
+ * \param[out] payload_file Where the payload is.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * Only regular files are memory mapped. Everything else is read.
+ */
+static enum t_cose_err_t
+find_payload(int fd, size_t payload_len, struct payload_file *payload_file)
+{
+    struct stat file_stat;
+    off_t       position;
+
+    payload_file->fd          = fd;
+    payload_file->is_mappable = 0;
+    payload_file->start       = 0;
+    payload_file->len         = payload_len;
+
+    if(fstat(fd, &file_stat) != 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    if(!S_ISREG(file_stat.st_mode)) {
+        if(payload_len == T_COSE_PAYLOAD_LEN_FROM_FILE) {
+            /* A pipe or such has no size to get the length from */
+            return T_COSE_ERR_PAYLOAD_LENGTH;
+        }
+        return T_COSE_SUCCESS;
+    }
+
+    position = lseek(fd, 0, SEEK_CUR);
+    if(position < 0 || position > file_stat.st_size) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    if(payload_len == T_COSE_PAYLOAD_LEN_FROM_FILE) {
+        if((uintmax_t)(file_stat.st_size - position) >= SIZE_MAX) {
+            return T_COSE_ERR_PAYLOAD_LENGTH;
+        }
+        payload_file->len = (size_t)(file_stat.st_size - position);
+    } else if((uintmax_t)payload_len > (uintmax_t)(file_stat.st_size - position)) {
+        return T_COSE_ERR_PAYLOAD_LENGTH;
+    }
+
+    payload_file->is_mappable = 1;
+    payload_file->start       = position;
+
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Hash a payload in a regular file out of a memory map.
+ *
+ * \param[in] payload_file  Where the payload is.
+ * \param[in] update        Function to feed the payload to.
+ * \param[in] stream        The streaming sign or verify.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * The file is mapped \ref T_COSE_FILE_MMAP_WINDOW bytes at a time. The
+ * sequential access advice lets the OS read ahead and drop pages
+ * that have been hashed.
+ */
+static enum t_cose_err_t
+hash_mapped_payload(const struct payload_file *payload_file,
+                    payload_update_fn          update,
+                    void                      *stream)
+{
+    long    page_size;
+    off_t   offset;
+    off_t   map_offset;
+    size_t  skip;
+    size_t  map_len;
+    size_t  remaining;
+    void   *map;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if(page_size <= 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    offset    = payload_file->start;
+    remaining = payload_file->len;
+    while(remaining > 0) {
+        /* mmap() offsets have to be page aligned */
+        map_offset = offset - (offset % page_size);
+        skip       = (size_t)(offset - map_offset);
+        map_len    = skip + remaining;
+        if(map_len > T_COSE_FILE_MMAP_WINDOW || map_len < remaining) {
+            map_len = T_COSE_FILE_MMAP_WINDOW;
+        }
+
+        map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, payload_file->fd, map_offset);
+        if(map == MAP_FAILED) {
+            return T_COSE_ERR_FILE_IO;
+        }
+        /* Only advice. Hashing works the same if it is ignored. */
+        (void)posix_madvise(map, map_len, POSIX_MADV_SEQUENTIAL);
+
+        (*update)(stream, (struct q_useful_buf_c){(uint8_t *)map + skip,
+                                                  map_len - skip});
+        munmap(map, map_len);
+
+        offset    += (off_t)(map_len - skip);
+        remaining -= map_len - skip;
+    }
+
+    /* Leave the file position after the payload as reading would */
+    if(lseek(payload_file->fd, offset, SEEK_SET) < 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Hash a payload by reading it into a buffer.
+ *
+ * \param[in] payload_file  Where the payload is.
+ * \param[in] read_buffer   Buffer to read into.
+ * \param[in] update        Function to feed the payload to.
+ * \param[in] stream        The streaming sign or verify.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * Exactly the length of the payload is read so nothing after it is
+ * consumed from a pipe.
+ */
+static enum t_cose_err_t
+hash_read_payload(const struct payload_file *payload_file,
+                  struct q_useful_buf        read_buffer,
+                  payload_update_fn          update,
+                  void                      *stream)
+{
+    size_t  remaining;
+    size_t  read_len;
+    ssize_t bytes_read;
+
+    if(read_buffer.ptr == NULL || read_buffer.len == 0) {
+        return T_COSE_ERR_TOO_SMALL;
+    }
+
+    remaining = payload_file->len;
+    while(remaining > 0) {
+        read_len = remaining < read_buffer.len ? remaining : read_buffer.len;
+        bytes_read = read(payload_file->fd, read_buffer.ptr, read_len);
+        if(bytes_read < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return T_COSE_ERR_FILE_IO;
+        }
+        if(bytes_read == 0) {
+            /* End of file before the end of the payload */
+            return T_COSE_ERR_PAYLOAD_LENGTH;
+        }
+
+        (*update)(stream, (struct q_useful_buf_c){read_buffer.ptr,
+                                                  (size_t)bytes_read});
+        remaining -= (size_t)bytes_read;
+    }
+
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Hash a payload from a file whichever way suits the file.
+ */
+static inline enum t_cose_err_t
+hash_payload(const struct payload_file *payload_file,
+             struct q_useful_buf        read_buffer,
+             payload_update_fn          update,
+             void                      *stream)
+{
+    if(payload_file->is_mappable) {
+        return hash_mapped_payload(payload_file, update, stream);
+    } else {
+        return hash_read_payload(payload_file, read_buffer, update, stream);
+    }
+}
+
+
+/*
+ * Public function. See t_cose_sign1_file.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_fd(struct t_cose_sign1_sign_ctx *me,
+                              struct q_useful_buf_c         aad,
+                              int                           fd,
+                              size_t                        payload_len,
+                              struct q_useful_buf           read_buffer,
+                              struct q_useful_buf           out_buf,
+                              struct q_useful_buf_c        *result)
+{
+    struct t_cose_sign1_sign_stream stream;
+    struct payload_file             payload_file;
+    enum t_cose_err_t               return_value;
+
+    return_value = find_payload(fd, payload_len, &payload_file);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = t_cose_sign1_sign_detached_begin(me,
+                                                    &stream,
+                                                    aad,
+                                                    payload_file.len);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = hash_payload(&payload_file, read_buffer, sign_update, &stream);
+    if(return_value != T_COSE_SUCCESS) {
+        t_cose_sign1_sign_detached_abort(&stream);
+        goto Done;
+    }
+
+    return_value = t_cose_sign1_sign_detached_finish(me, &stream, out_buf, result);
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_file.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_file(struct t_cose_sign1_sign_ctx *me,
+                                struct q_useful_buf_c         aad,
+                                const char                   *path,
+                                struct q_useful_buf           read_buffer,
+                                struct q_useful_buf           out_buf,
+                                struct q_useful_buf_c        *result)
+{
+    enum t_cose_err_t return_value;
+    int               fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    return_value = t_cose_sign1_sign_detached_fd(me,
+                                                 aad,
+                                                 fd,
+                                                 T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                                 read_buffer,
+                                                 out_buf,
+                                                 result);
+    close(fd);
+
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_file.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_fd(struct t_cose_sign1_verify_ctx *me,
+                                struct q_useful_buf_c           cose_sign1,
+                                struct q_useful_buf_c           aad,
+                                int                             fd,
+                                size_t                          payload_len,
+                                struct q_useful_buf             read_buffer,
+                                struct t_cose_parameters       *parameters)
+{
+    struct t_cose_sign1_verify_stream stream;
+    struct payload_file               payload_file;
+    enum t_cose_err_t                 return_value;
+
+    return_value = find_payload(fd, payload_len, &payload_file);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = t_cose_sign1_verify_detached_begin(me,
+                                                      &stream,
+                                                      cose_sign1,
+                                                      aad,
+                                                      payload_file.len,
+                                                      parameters);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    return_value = hash_payload(&payload_file, read_buffer, verify_update, &stream);
+    if(return_value != T_COSE_SUCCESS) {
+        t_cose_sign1_verify_detached_abort(&stream);
+        goto Done;
+    }
+
+    return_value = t_cose_sign1_verify_detached_finish(me, &stream);
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_file.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_file(struct t_cose_sign1_verify_ctx *me,
+                                  struct q_useful_buf_c           cose_sign1,
+                                  struct q_useful_buf_c           aad,
+                                  const char                     *path,
+                                  struct q_useful_buf             read_buffer,
+                                  struct t_cose_parameters       *parameters)
+{
+    enum t_cose_err_t return_value;
+    int               fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return T_COSE_ERR_FILE_IO;
+    }
+
+    return_value = t_cose_sign1_verify_detached_fd(me,
+                                                   cose_sign1,
+                                                   aad,
+                                                   fd,
+                                                   T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                                   read_buffer,
+                                                   parameters);
+    close(fd);
+
+    return return_value;
+}
+
+#endif /* T_COSE_ENABLE_FILE_IO */
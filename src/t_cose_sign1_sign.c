@@ -44,20 +44,98 @@
 #endif
 
 
-#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+/**
+ * \brief Get the midstate to use for a signing context.
+ *
+ * \param[in] me  The t_cose signing context.
+ *
+ * \return The hash context with the fixed part of the to-be-signed
+ *         bytes hashed or \c NULL if there isn't one.
+ *
+ * The midstate is not used if the algorithm ID in the context is not
+ * the one it was made for since the protected parameters would be
+ * different.
+ */
+static inline const struct t_cose_crypto_hash *
+get_tbs_midstate(const struct t_cose_sign1_sign_ctx *me)
+{
+    if(me->midstate == NULL ||
+       me->midstate->cose_algorithm_id != me->cose_algorithm_id) {
+        return NULL;
+    }
+    return hash_from_storage_const(&(me->midstate->hash_ctx));
+}
+
+
+/**
+ * \brief Create the hash of the to-be-signed bytes for a signing context.
+ *
+ * \param[in] me               The t_cose signing context.
+ * \param[in] aad              The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload          The payload.
+ * \param[in] buffer_for_hash  Buffer into which the hash is put.
+ * \param[out] hash            The resulting hash.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * If there is a midstate, the protected parameters are already
+ * hashed into it and it is used.
+ */
+static enum t_cose_err_t
+create_tbs_hash_for_ctx(const struct t_cose_sign1_sign_ctx *me,
+                        struct q_useful_buf_c               aad,
+                        struct q_useful_buf_c               payload,
+                        struct q_useful_buf                 buffer_for_hash,
+                        struct q_useful_buf_c              *hash)
+{
+    const struct t_cose_crypto_hash *tbs_midstate;
+
+    tbs_midstate = get_tbs_midstate(me);
+    if(tbs_midstate != NULL) {
+        return create_tbs_hash_from_midstate(tbs_midstate,
+                                             aad,
+                                             payload,
+                                             buffer_for_hash,
+                                             hash);
+    }
+
+    return create_tbs_hash(me->cose_algorithm_id,
+                           me->protected_parameters,
+                           aad,
+                           payload,
+                           buffer_for_hash,
+                           hash);
+}
+
+
+/**
+ * \brief Get the size of a signature from the algorithm ID alone.
+ *
+ * \param[in] cose_algorithm_id  Algorithm ID.
+ * \param[out] sig_size          The size of the signature.
+ *
+ * \return \ref T_COSE_SUCCESS or \ref T_COSE_ERR_UNSUPPORTED_SIGNING_ALG.
+ *
+ * This is the size for the curve that goes with the algorithm. It is
+ * used for short-circuit signatures and by t_cose_sign1_sign_size()
+ * which don't look at the key.
+ */
 static inline enum t_cose_err_t
-short_circuit_sig_size(int32_t            cose_algorithm_id,
-                       size_t            *sig_size)
+sig_size_from_alg_id(int32_t            cose_algorithm_id,
+                     size_t            *sig_size)
 {
     *sig_size = cose_algorithm_id == COSE_ALGORITHM_ES256 ? T_COSE_EC_P256_SIG_SIZE :
                 cose_algorithm_id == COSE_ALGORITHM_ES384 ? T_COSE_EC_P384_SIG_SIZE :
                 cose_algorithm_id == COSE_ALGORITHM_ES512 ? T_COSE_EC_P512_SIG_SIZE :
                 0;
 
-    return sig_size == 0 ? T_COSE_ERR_UNSUPPORTED_SIGNING_ALG : T_COSE_SUCCESS;
+    return *sig_size == 0 ? T_COSE_ERR_UNSUPPORTED_SIGNING_ALG : T_COSE_SUCCESS;
 }
 
 
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+
+
 
 
 /**
@@ -95,7 +173,7 @@ short_circuit_sign(int32_t               cose_algorithm_id,
     size_t            amount_to_copy;
     size_t            sig_size;
 
-    return_value = short_circuit_sig_size(cose_algorithm_id, &sig_size);
+    return_value = sig_size_from_alg_id(cose_algorithm_id, &sig_size);
 
     /* Check the signature length against buffer size */
     if(return_value != T_COSE_SUCCESS) {
@@ -181,6 +259,10 @@ encode_protected_parameters(int32_t             cose_algorithm_id,
  *
  * The unprotected parameters added by this are the kid and content type.
  *
+ * If the caller gave encoded unprotected parameters or they were
+ * encoded in the header template, those are added instead with no
+ * encoding.
+ *
  * In the case of a QCBOR encoding error, T_COSE_SUCCESS will be returned
  * and the error will be caught when \c QCBOR_Finish() is called on \c
  * cbor_encode_ctx.
@@ -196,6 +278,11 @@ add_unprotected_parameters(const struct t_cose_sign1_sign_ctx *me,
      *   TOTAL                                         32          24
      */
 
+    if(!q_useful_buf_c_is_null(me->encoded_unprotected_parameters)) {
+        QCBOREncode_AddEncoded(cbor_encode_ctx, me->encoded_unprotected_parameters);
+        return T_COSE_SUCCESS;
+    }
+
     QCBOREncode_OpenMap(cbor_encode_ctx);
 
     if(!q_useful_buf_c_is_null_or_empty(kid)) {
@@ -233,6 +320,52 @@ add_unprotected_parameters(const struct t_cose_sign1_sign_ctx *me,
 }
 
 
+/**
+ * \brief Encode the protected and unprotected header parameters.
+ *
+ * \param[in] me               The t_cose signing context.
+ * \param[in] cbor_encode_ctx  Encoding context to output to.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This outputs the protected parameters bstr and the unprotected
+ * parameters map, the first two items of the \c COSE_Sign1 array.
+ */
+static enum t_cose_err_t
+encode_header_parameters(struct t_cose_sign1_sign_ctx *me,
+                         QCBOREncodeContext           *cbor_encode_ctx)
+{
+    struct q_useful_buf_c  kid;
+
+    /* The protected parameters, which are added as a wrapped bstr  */
+    if(!q_useful_buf_c_is_null(me->encoded_protected_parameters)) {
+        /* Already encoded in the header template.
+         * me->protected_parameters was set when it was made. */
+        QCBOREncode_AddEncoded(cbor_encode_ctx, me->encoded_protected_parameters);
+    } else {
+        me->protected_parameters = encode_protected_parameters(me->cose_algorithm_id, cbor_encode_ctx);
+    }
+
+    /* The Unprotected parameters */
+    /* Get the kid because it goes into the parameters that are about
+     * to be made. */
+    kid = me->kid;
+
+    if(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) {
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+        if(q_useful_buf_c_is_null_or_empty(kid)) {
+            /* No kid passed in, Use the short-circuit kid */
+            kid = get_short_circuit_kid();
+        }
+#else
+        return T_COSE_ERR_SHORT_CIRCUIT_SIG_DISABLED;
+#endif
+    }
+
+    return add_unprotected_parameters(me, kid, cbor_encode_ctx);
+}
+
+
 /*
  * Semi-private function. See t_cose_sign1_sign.h
  */
@@ -242,7 +375,6 @@ t_cose_sign1_encode_parameters_internal(struct t_cose_sign1_sign_ctx *me,
                                         QCBOREncodeContext           *cbor_encode_ctx)
 {
     enum t_cose_err_t      return_value;
-    struct q_useful_buf_c  kid;
     int32_t                hash_alg_id;
 
     /* Check the cose_algorithm_id now by getting the hash alg as an
@@ -262,27 +394,7 @@ t_cose_sign1_encode_parameters_internal(struct t_cose_sign1_sign_ctx *me,
      * a cose single signed message */
     QCBOREncode_OpenArray(cbor_encode_ctx);
 
-    /* The protected parameters, which are added as a wrapped bstr  */
-    me->protected_parameters = encode_protected_parameters(me->cose_algorithm_id, cbor_encode_ctx);
-
-    /* The Unprotected parameters */
-    /* Get the kid because it goes into the parameters that are about
-     * to be made. */
-    kid = me->kid;
-
-    if(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) {
-#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
-        if(q_useful_buf_c_is_null_or_empty(kid)) {
-            /* No kid passed in, Use the short-circuit kid */
-            kid = get_short_circuit_kid();
-        }
-#else
-        return_value = T_COSE_ERR_SHORT_CIRCUIT_SIG_DISABLED;
-        goto Done;
-#endif
-    }
-
-    return_value = add_unprotected_parameters(me, kid, cbor_encode_ctx);
+    return_value = encode_header_parameters(me, cbor_encode_ctx);
     if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
@@ -301,64 +413,28 @@ Done:
 }
 
 
-/*
- * Semi-private function. See t_cose_sign1_sign.h
+/**
+ * \brief Sign a to-be-signed hash.
+ *
+ * \param[in] me                    The t_cose signing context.
+ * \param[in] tbs_hash              The hash of the to-be-signed bytes.
+ * \param[in] size_only             Only compute the size of the signature.
+ * \param[in] buffer_for_signature  Buffer for the signature.
+ * \param[out] signature            The signature, or just its length
+ *                                  with a \c NULL pointer if \c size_only.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This signs or short-circuit signs according to the options in \c me.
  */
-enum t_cose_err_t
-t_cose_sign1_encode_signature_aad_internal(struct t_cose_sign1_sign_ctx *me,
-                                           struct q_useful_buf_c         aad,
-                                           struct q_useful_buf_c         detached_payload,
-                                           QCBOREncodeContext           *cbor_encode_ctx)
+static enum t_cose_err_t
+create_signature(struct t_cose_sign1_sign_ctx *me,
+                 struct q_useful_buf_c         tbs_hash,
+                 bool                          size_only,
+                 struct q_useful_buf           buffer_for_signature,
+                 struct q_useful_buf_c        *signature)
 {
-    enum t_cose_err_t            return_value;
-    QCBORError                   cbor_err;
-    /* pointer and length of the completed tbs hash */
-    struct q_useful_buf_c        tbs_hash;
-    /* Pointer and length of the completed signature */
-    struct q_useful_buf_c        signature;
-    /* Buffer for the actual signature */
-    Q_USEFUL_BUF_MAKE_STACK_UB(  buffer_for_signature, T_COSE_MAX_SIG_SIZE);
-    /* Buffer for the tbs hash. */
-    Q_USEFUL_BUF_MAKE_STACK_UB(  buffer_for_tbs_hash, T_COSE_CRYPTO_MAX_HASH_SIZE);
-    struct q_useful_buf_c        signed_payload;
-
-
-    if(q_useful_buf_c_is_null(detached_payload)) {
-        QCBOREncode_CloseBstrWrap2(cbor_encode_ctx, false, &signed_payload);
-    } else {
-        signed_payload = detached_payload;
-    }
-
-    /* Check that there are no CBOR encoding errors before proceeding
-     * with hashing and signing. This is not actually necessary as the
-     * errors will be caught correctly later, but it does make it a
-     * bit easier for the caller to debug problems.
-     */
-    cbor_err = QCBOREncode_GetErrorState(cbor_encode_ctx);
-    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
-        return_value = T_COSE_ERR_TOO_SMALL;
-        goto Done;
-    } else if(cbor_err != QCBOR_SUCCESS) {
-        return_value = T_COSE_ERR_CBOR_FORMATTING;
-        goto Done;
-    }
-
-    /* Create the hash of the to-be-signed bytes. Inputs to the
-     * hash are the protected parameters, the payload that is
-     * getting signed, the cose signature alg from which the hash
-     * alg is determined. The cose_algorithm_id was checked in
-     * t_cose_sign1_init() so it doesn't need to be checked here.
-     */
-    return_value = create_tbs_hash(me->cose_algorithm_id,
-                                   me->protected_parameters,
-                                   aad,
-                                   signed_payload,
-                                   buffer_for_tbs_hash,
-                                   &tbs_hash);
-    if(return_value) {
-        goto Done;
-    }
-
+    enum t_cose_err_t return_value;
 
     /* Compute the signature using public key crypto. The key and
      * algorithm ID are passed in to know how and what to sign
@@ -370,38 +446,143 @@ t_cose_sign1_encode_signature_aad_internal(struct t_cose_sign1_sign_ctx *me,
      * is only an output length computation.
      */
     if(!(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG)) {
-        if (QCBOREncode_IsBufferNULL(cbor_encode_ctx)) {
+        if (size_only) {
             /* Output size calculation. Only need signature size. */
-            signature.ptr = NULL;
-            return_value  = t_cose_crypto_sig_size(me->cose_algorithm_id,
-                                                   me->signing_key,
-                                                  &signature.len);
+            signature->ptr = NULL;
+            return_value   = t_cose_crypto_sig_size(me->cose_algorithm_id,
+                                                    me->signing_key,
+                                                   &signature->len);
         } else {
             /* Perform the public key signing */
              return_value = t_cose_crypto_sign(me->cose_algorithm_id,
                                                me->signing_key,
                                                tbs_hash,
                                                buffer_for_signature,
-                                              &signature);
+                                               signature);
         }
 
 #ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
     } else {
-        if (QCBOREncode_IsBufferNULL(cbor_encode_ctx)) {
+        if (size_only) {
             /* Output size calculation. Only need signature size. */
-            signature.ptr = NULL;
-            return_value = short_circuit_sig_size(me->cose_algorithm_id,
-                                                  &signature.len);
+            signature->ptr = NULL;
+            return_value = sig_size_from_alg_id(me->cose_algorithm_id,
+                                                &signature->len);
         } else {
             /* Perform the a short circuit signing */
             return_value = short_circuit_sign(me->cose_algorithm_id,
                                               tbs_hash,
                                               buffer_for_signature,
-                                              &signature);
+                                              signature);
         }
+#else
+    } else {
+        return_value = T_COSE_ERR_SHORT_CIRCUIT_SIG_DISABLED;
 #endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
     }
 
+    return return_value;
+}
+
+
+/**
+ * \brief Sign the to-be-signed bytes for a signing context.
+ *
+ * \param[in] me                    The t_cose signing context.
+ * \param[in] aad                   The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload               The payload.
+ * \param[in] size_only             Only compute the size of the signature.
+ * \param[in] buffer_for_signature  Buffer for the signature.
+ * \param[out] signature            The signature, or just its length
+ *                                  with a \c NULL pointer if \c size_only.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * If the crypto adapter can sign a message directly the TBS bytes
+ * are given to it in pieces and not hashed here. That isn't done
+ * with a midstate because most of the hashing is already done or for
+ * short-circuit signatures which are made from the hash.
+ */
+static enum t_cose_err_t
+sign_tbs(struct t_cose_sign1_sign_ctx *me,
+         struct q_useful_buf_c         aad,
+         struct q_useful_buf_c         payload,
+         bool                          size_only,
+         struct q_useful_buf           buffer_for_signature,
+         struct q_useful_buf_c        *signature)
+{
+    enum t_cose_err_t           return_value;
+    struct q_useful_buf_c       tbs_hash;
+    Q_USEFUL_BUF_MAKE_STACK_UB( buffer_for_tbs_hash, T_COSE_CRYPTO_MAX_HASH_SIZE);
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+    struct tbs_pieces           tbs;
+
+    if(!size_only &&
+       !(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) &&
+       get_tbs_midstate(me) == NULL) {
+        create_tbs_pieces(me->protected_parameters, aad, payload, &tbs);
+        return t_cose_crypto_sign_message(me->cose_algorithm_id,
+                                          me->signing_key,
+                                          tbs.pieces,
+                                          TBS_PIECE_COUNT,
+                                          buffer_for_signature,
+                                          signature);
+    }
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+    /* Create the hash of the to-be-signed bytes. Inputs to the
+     * hash are the protected parameters, the payload that is
+     * getting signed, the cose signature alg from which the hash
+     * alg is determined. The cose_algorithm_id was checked in
+     * t_cose_sign1_init() so it doesn't need to be checked here.
+     */
+    return_value = create_tbs_hash_for_ctx(me,
+                                           aad,
+                                           payload,
+                                           buffer_for_tbs_hash,
+                                           &tbs_hash);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+
+    return create_signature(me,
+                            tbs_hash,
+                            size_only,
+                            buffer_for_signature,
+                            signature);
+}
+
+
+/**
+ * \brief Sign a to-be-signed hash and output the signature.
+ *
+ * \param[in] me               The t_cose signing context.
+ * \param[in] tbs_hash         The hash of the to-be-signed bytes.
+ * \param[in] cbor_encode_ctx  The CBOR encoder context to output to.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This signs (or short-circuit signs) \c tbs_hash, adds the signature
+ * to \c cbor_encode_ctx and closes the \c COSE_Sign1 array. If the
+ * output buffer of \c cbor_encode_ctx is \c NULL this only computes
+ * the size of the signature.
+ */
+static enum t_cose_err_t
+encode_signature_of_hash(struct t_cose_sign1_sign_ctx *me,
+                         struct q_useful_buf_c         tbs_hash,
+                         QCBOREncodeContext           *cbor_encode_ctx)
+{
+    enum t_cose_err_t            return_value;
+    /* Pointer and length of the completed signature */
+    struct q_useful_buf_c        signature;
+    /* Buffer for the actual signature */
+    Q_USEFUL_BUF_MAKE_STACK_UB(  buffer_for_signature, T_COSE_MAX_SIG_SIZE);
+
+    return_value = create_signature(me,
+                                    tbs_hash,
+                                    QCBOREncode_IsBufferNULL(cbor_encode_ctx),
+                                    buffer_for_signature,
+                                   &signature);
     if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
@@ -417,7 +598,66 @@ t_cose_sign1_encode_signature_aad_internal(struct t_cose_sign1_sign_ctx *me,
      */
 Done:
     return return_value;
+}
+
+
+/*
+ * Semi-private function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_encode_signature_aad_internal(struct t_cose_sign1_sign_ctx *me,
+                                           struct q_useful_buf_c         aad,
+                                           struct q_useful_buf_c         detached_payload,
+                                           QCBOREncodeContext           *cbor_encode_ctx)
+{
+    enum t_cose_err_t            return_value;
+    QCBORError                   cbor_err;
+    /* Pointer and length of the completed signature */
+    struct q_useful_buf_c        signature;
+    /* Buffer for the actual signature */
+    Q_USEFUL_BUF_MAKE_STACK_UB(  buffer_for_signature, T_COSE_MAX_SIG_SIZE);
+    struct q_useful_buf_c        signed_payload;
+
+    if(q_useful_buf_c_is_null(detached_payload)) {
+        QCBOREncode_CloseBstrWrap2(cbor_encode_ctx, false, &signed_payload);
+    } else {
+        signed_payload = detached_payload;
+    }
+
+    /* Check that there are no CBOR encoding errors before proceeding
+     * with hashing and signing. This is not actually necessary as the
+     * errors will be caught correctly later, but it does make it a
+     * bit easier for the caller to debug problems.
+     */
+    cbor_err = QCBOREncode_GetErrorState(cbor_encode_ctx);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* Hash and sign the to-be-signed bytes, or just compute the
+     * length of the signature if this is only an output length
+     * computation.
+     */
+    return_value = sign_tbs(me,
+                            aad,
+                            signed_payload,
+                            QCBOREncode_IsBufferNULL(cbor_encode_ctx),
+                            buffer_for_signature,
+                           &signature);
+    if(return_value) {
+        goto Done;
+    }
+
+    /* Add signature to CBOR and close out the array */
+    QCBOREncode_AddBytes(cbor_encode_ctx, signature);
+    QCBOREncode_CloseArray(cbor_encode_ctx);
 
+Done:
+    return return_value;
 }
 
 
@@ -492,3 +732,1103 @@ Done:
     return return_value;
 }
 
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_size(struct t_cose_sign1_sign_ctx *me,
+                       size_t                        payload_len,
+                       bool                          payload_is_detached,
+                       size_t                       *cose_sign1_size)
+{
+    QCBOREncodeContext          encode_context;
+    enum t_cose_err_t           return_value;
+    Q_USEFUL_BUF_MAKE_STACK_UB( buffer_for_head, QCBOR_HEAD_BUFFER_SIZE);
+    struct q_useful_buf_c       saved_protected_parameters;
+    size_t                      headers_size;
+    size_t                      sig_size;
+    size_t                      size;
+
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    return_value = sig_size_from_alg_id(me->cose_algorithm_id, &sig_size);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- The tag, array head and header parameters -- */
+    /* These are small so QCBOR's size calculation mode is used to get
+     * them exactly right for the kid, content type and such. This
+     * writes the protected parameters pointer so it is put back. */
+    saved_protected_parameters = me->protected_parameters;
+    QCBOREncode_Init(&encode_context, (struct q_useful_buf){NULL, INT32_MAX});
+    if(!(me->option_flags & T_COSE_OPT_OMIT_CBOR_TAG)) {
+        QCBOREncode_AddTag(&encode_context, CBOR_TAG_COSE_SIGN1);
+    }
+    QCBOREncode_AddEncoded(&encode_context,
+                           QCBOREncode_EncodeHead(buffer_for_head,
+                                                  CBOR_MAJOR_TYPE_ARRAY,
+                                                  0,
+                                                  4));
+    return_value = encode_header_parameters(me, &encode_context);
+    me->protected_parameters = saved_protected_parameters;
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    if(QCBOREncode_FinishGetSize(&encode_context, &headers_size)) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* -- The signature -- */
+    size = headers_size;
+    size += QCBOREncode_EncodeHead(buffer_for_head,
+                                   CBOR_MAJOR_TYPE_BYTE_STRING,
+                                   0,
+                                   sig_size).len;
+    size += sig_size;
+
+    /* -- The payload -- */
+    if(payload_is_detached) {
+        /* The payload is replaced by a one-byte CBOR null */
+        size += 1;
+    } else {
+        size += QCBOREncode_EncodeHead(buffer_for_head,
+                                       CBOR_MAJOR_TYPE_BYTE_STRING,
+                                       0,
+                                       payload_len).len;
+        if(payload_len > SIZE_MAX - size) {
+            return_value = T_COSE_ERR_PAYLOAD_LENGTH;
+            goto Done;
+        }
+        size += payload_len;
+    }
+
+    *cose_sign1_size = size;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_encode_payload(struct t_cose_sign1_sign_ctx *me,
+                                 struct q_useful_buf_c         aad,
+                                 t_cose_payload_encode_cb     *encode_cb,
+                                 void                         *payload_ctx,
+                                 struct q_useful_buf           out_buf,
+                                 struct q_useful_buf_c        *result)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                     8           4
+     *   encode context                               168         148
+     *   QCBOR   (guess)                               32          24
+     *   max(encode_param, encode_signature)     224-1316    216-1024
+     *   TOTAL                                   432-1524    392-1300
+     *   plus whatever encode_cb uses
+     */
+    QCBOREncodeContext  encode_context;
+    enum t_cose_err_t   return_value;
+    QCBORError          cbor_err;
+
+    QCBOREncode_Init(&encode_context, out_buf);
+
+    /* -- Output the header parameters and open the payload bstr -- */
+    return_value = t_cose_sign1_encode_parameters_internal(me,
+                                                           false,
+                                                           &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- Have the caller output the payload right into out_buf -- */
+    return_value = (*encode_cb)(payload_ctx, &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- Close the payload bstr, hash it in place and sign -- */
+    return_value = t_cose_sign1_encode_signature_aad_internal(me,
+                                                              aad,
+                                                              NULL_Q_USEFUL_BUF_C,
+                                                              &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    cbor_err = QCBOREncode_Finish(&encode_context, result);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_NOT_WELL_FORMED;
+    }
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_in_place(struct t_cose_sign1_sign_ctx *me,
+                           struct q_useful_buf_c         aad,
+                           struct q_useful_buf           buffer,
+                           size_t                        payload_offset,
+                           size_t                        payload_len,
+                           struct q_useful_buf_c        *result)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    88          44
+     *   encode context                               168         148
+     *   buffer_for_head                               10          10
+     *   buffer_for_signature                         132         132
+     *   QCBOR   (guess)                               32          24
+     *   max(encode_param, sign_tbs)              224-1380    216-1088
+     *   TOTAL                                    654-1810    574-1446
+     */
+    QCBOREncodeContext          encode_context;
+    enum t_cose_err_t           return_value;
+    QCBORError                  cbor_err;
+    Q_USEFUL_BUF_MAKE_STACK_UB( buffer_for_head, QCBOR_HEAD_BUFFER_SIZE);
+    Q_USEFUL_BUF_MAKE_STACK_UB( buffer_for_signature, T_COSE_MAX_SIG_SIZE);
+    struct q_useful_buf_c       before_payload;
+    struct q_useful_buf_c       payload;
+    struct q_useful_buf_c       signature;
+    struct q_useful_buf_c       encoded_signature;
+    uint8_t                    *payload_start;
+    bool                        protected_in_buffer;
+
+    if(buffer.ptr == NULL ||
+       payload_offset > buffer.len ||
+       payload_len > buffer.len - payload_offset) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    }
+
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    payload_start = (uint8_t *)buffer.ptr + payload_offset;
+    payload = (struct q_useful_buf_c){payload_start, payload_len};
+
+    /* -- Output everything before the payload at the start of the headroom -- */
+    QCBOREncode_Init(&encode_context, (struct q_useful_buf){buffer.ptr, payload_offset});
+
+    if(!(me->option_flags & T_COSE_OPT_OMIT_CBOR_TAG)) {
+        QCBOREncode_AddTag(&encode_context, CBOR_TAG_COSE_SIGN1);
+    }
+
+    /* The array always has four items so its head can be output
+     * before them rather than filled in when it is closed. */
+    QCBOREncode_AddEncoded(&encode_context,
+                           QCBOREncode_EncodeHead(buffer_for_head,
+                                                  CBOR_MAJOR_TYPE_ARRAY,
+                                                  0,
+                                                  4));
+
+    /* Without a header template the protected parameters are encoded
+     * here and me->protected_parameters points into the headroom. */
+    protected_in_buffer = q_useful_buf_c_is_null(me->encoded_protected_parameters);
+    return_value = encode_header_parameters(me, &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* Just the head of the payload bstr. Its contents are in place. */
+    QCBOREncode_AddEncoded(&encode_context,
+                           QCBOREncode_EncodeHead(buffer_for_head,
+                                                  CBOR_MAJOR_TYPE_BYTE_STRING,
+                                                  0,
+                                                  payload_len));
+
+    cbor_err = QCBOREncode_Finish(&encode_context, &before_payload);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* -- Move it up against the payload -- */
+    /* This is only the header bytes. The payload doesn't move. */
+    memmove(payload_start - before_payload.len, before_payload.ptr, before_payload.len);
+    if(protected_in_buffer) {
+        me->protected_parameters.ptr = payload_start - before_payload.len +
+            ((const uint8_t *)me->protected_parameters.ptr - (const uint8_t *)before_payload.ptr);
+    }
+
+    /* -- Hash and sign -- */
+    return_value = sign_tbs(me,
+                            aad,
+                            payload,
+                            false,
+                            buffer_for_signature,
+                           &signature);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- Output the signature into the tailroom -- */
+    QCBOREncode_Init(&encode_context,
+                     (struct q_useful_buf){payload_start + payload_len,
+                                           buffer.len - payload_offset - payload_len});
+    QCBOREncode_AddBytes(&encode_context, signature);
+    cbor_err = QCBOREncode_Finish(&encode_context, &encoded_signature);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    result->ptr = payload_start - before_payload.len;
+    result->len = before_payload.len + payload_len + encoded_signature.len;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Semi-private function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_begin_internal(struct t_cose_sign1_sign_ctx     *me,
+                                          bool                              payload_is_detached,
+                                          struct q_useful_buf_c             payload,
+                                          struct q_useful_buf_c             aad,
+                                          struct q_useful_buf               out_buf,
+                                          struct t_cose_sign1_sign_pending *pending,
+                                          struct q_useful_buf_c            *tbs_hash)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    56          28
+     *   encode context                               168         148
+     *   buffer_for_head                               10          10
+     *   QCBOR   (guess)                               32          24
+     *   max(encode_param, create_tbs_hash)       224-360     216-360
+     *   TOTAL                                    490-626     426-570
+     */
+    QCBOREncodeContext          encode_context;
+    enum t_cose_err_t           return_value;
+    QCBORError                  cbor_err;
+    Q_USEFUL_BUF_MAKE_STACK_UB( buffer_for_head, QCBOR_HEAD_BUFFER_SIZE);
+    struct q_useful_buf_c       before_signature;
+    struct q_useful_buf_c       hash;
+    size_t                      sig_size;
+
+    if(out_buf.ptr == NULL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    }
+
+    /* Also checks the algorithm is one that a signature can be
+     * accepted for in t_cose_sign1_sign_external_finish(). */
+    return_value = sig_size_from_alg_id(me->cose_algorithm_id, &sig_size);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- Output everything before the signature -- */
+    QCBOREncode_Init(&encode_context, out_buf);
+
+    if(!(me->option_flags & T_COSE_OPT_OMIT_CBOR_TAG)) {
+        QCBOREncode_AddTag(&encode_context, CBOR_TAG_COSE_SIGN1);
+    }
+
+    /* As in t_cose_sign1_sign_in_place() the array head is output up
+     * front so there is nothing left open to close when the signature
+     * comes. That is what lets the encoder context go away. */
+    QCBOREncode_AddEncoded(&encode_context,
+                           QCBOREncode_EncodeHead(buffer_for_head,
+                                                  CBOR_MAJOR_TYPE_ARRAY,
+                                                  0,
+                                                  4));
+
+    return_value = encode_header_parameters(me, &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    if(payload_is_detached) {
+        QCBOREncode_AddNULL(&encode_context);
+    } else {
+        QCBOREncode_AddBytes(&encode_context, payload);
+    }
+
+    cbor_err = QCBOREncode_Finish(&encode_context, &before_signature);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* -- Hash the to-be-signed bytes into the pending state -- */
+    return_value = create_tbs_hash_for_ctx(me,
+                                           aad,
+                                           payload,
+                                           (struct q_useful_buf){pending->tbs_hash,
+                                                                 sizeof(pending->tbs_hash)},
+                                           &hash);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    pending->out_buf           = out_buf;
+    pending->encoded_len       = before_signature.len;
+    pending->cose_algorithm_id = me->cose_algorithm_id;
+    pending->tbs_hash_len      = (uint8_t)hash.len;
+
+    *tbs_hash = hash;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_finish(struct t_cose_sign1_sign_pending *pending,
+                                  struct q_useful_buf_c             signature,
+                                  struct q_useful_buf_c            *result)
+{
+    QCBOREncodeContext          encode_context;
+    enum t_cose_err_t           return_value;
+    QCBORError                  cbor_err;
+    struct q_useful_buf_c       encoded_signature;
+    size_t                      sig_size;
+
+    return_value = sig_size_from_alg_id(pending->cose_algorithm_id, &sig_size);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    if(signature.len != sig_size) {
+        return_value = T_COSE_ERR_SIG_FAIL;
+        goto Done;
+    }
+
+    /* -- Output the signature after the rest -- */
+    QCBOREncode_Init(&encode_context,
+                     (struct q_useful_buf){(uint8_t *)pending->out_buf.ptr + pending->encoded_len,
+                                           pending->out_buf.len - pending->encoded_len});
+    QCBOREncode_AddBytes(&encode_context, signature);
+    cbor_err = QCBOREncode_Finish(&encode_context, &encoded_signature);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    result->ptr = pending->out_buf.ptr;
+    result->len = pending->encoded_len + encoded_signature.len;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_external_local(struct t_cose_sign1_sign_ctx *me,
+                                 struct q_useful_buf_c         tbs_hash,
+                                 struct q_useful_buf           buffer,
+                                 struct q_useful_buf_c        *signature)
+{
+    return create_signature(me, tbs_hash, false, buffer, signature);
+}
+
+
+/**
+ * The number of messages handed to the crypto adaptation layer at
+ * once by t_cose_sign1_sign_batch() to hash and to sign. The hashes
+ * for this many messages are held on the stack, so this governs the
+ * stack use of batch signing. It can be overridden at compile time.
+ */
+#ifndef T_COSE_SIGN1_BATCH_CHUNK_SIZE
+#define T_COSE_SIGN1_BATCH_CHUNK_SIZE 8
+#endif
+
+
+/*
+ * Place holder for the signature while a message in a batch is
+ * encoded. It is overwritten by the signature.
+ */
+static const uint8_t batch_signature_place_holder[T_COSE_MAX_SIG_SIZE];
+
+
+/**
+ * \brief Encode one message of a batch.
+ *
+ * \param[in] me                    The t_cose signing context.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] kid                   The kid to put in the message.
+ * \param[in] sig_size              The size of the signature.
+ * \param[in] payload               The payload to sign.
+ * \param[in] out_buf               Buffer to output the message to.
+ * \param[out] result               The encoded message. Its pointer is
+ *                                  \c NULL if only the size is being
+ *                                  calculated.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * The message is fully encoded with a place holder of \c sig_size
+ * bytes for the signature. Because the signature is the last item in
+ * the message, it is the last \c sig_size bytes of \c result.
+ */
+static enum t_cose_err_t
+encode_batch_item(const struct t_cose_sign1_sign_ctx *me,
+                  struct q_useful_buf_c               protected_parameters,
+                  struct q_useful_buf_c               kid,
+                  size_t                              sig_size,
+                  struct q_useful_buf_c               payload,
+                  struct q_useful_buf                 out_buf,
+                  struct q_useful_buf_c              *result)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    16           8
+     *   encode context                               168         148
+     *   QCBOR   (guess)                               32          24
+     *   add_unprotected                               32          24
+     *   TOTAL                                        248         204
+     */
+    QCBOREncodeContext encode_context;
+    enum t_cose_err_t  return_value;
+    QCBORError         cbor_err;
+
+    QCBOREncode_Init(&encode_context, out_buf);
+
+    if(!(me->option_flags & T_COSE_OPT_OMIT_CBOR_TAG)) {
+        QCBOREncode_AddTag(&encode_context, CBOR_TAG_COSE_SIGN1);
+    }
+    QCBOREncode_OpenArray(&encode_context);
+    QCBOREncode_AddBytes(&encode_context, protected_parameters);
+    return_value = add_unprotected_parameters(me, kid, &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    QCBOREncode_BstrWrap(&encode_context);
+    QCBOREncode_AddEncoded(&encode_context, payload);
+    QCBOREncode_CloseBstrWrap2(&encode_context, false, NULL);
+    QCBOREncode_AddBytes(&encode_context,
+                         (struct q_useful_buf_c){batch_signature_place_holder,
+                                                 sig_size});
+    QCBOREncode_CloseArray(&encode_context);
+
+    cbor_err = QCBOREncode_Finish(&encode_context, result);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+Done:
+    return return_value;
+}
+
+
+/**
+ * \brief Hash and sign a chunk of messages for t_cose_sign1_sign_batch().
+ *
+ * \param[in] me                    The t_cose signing context.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] sig_size              The expected size of each signature.
+ * \param[in] payloads              The payloads of the batch.
+ * \param[in] signature_buffers     Where to put each signature.
+ * \param[in] indexes               Index in the batch of each message.
+ * \param[in] count                 The number of messages.
+ * \param[out] item_errors          The per-message errors for the batch.
+ * \param[in,out] results           The messages of the batch.
+ *
+ * The to-be-signed bytes of all the messages are hashed with one
+ * call to t_cose_crypto_hash_batch() so they can be hashed side by
+ * side. The payload bytes hashed are the same as those copied into
+ * the output so the caller's copy is hashed.
+ *
+ * The signatures are written directly into \c signature_buffers
+ * which are the place holders in the encoded messages. The error
+ * for each message is written into \c item_errors at its index in
+ * the batch and the message is removed from \c results if it
+ * failed.
+ */
+static void
+sign_batch_chunk(const struct t_cose_sign1_sign_ctx *me,
+                 struct q_useful_buf_c               protected_parameters,
+                 size_t                              sig_size,
+                 const struct q_useful_buf_c        *payloads,
+                 const struct q_useful_buf          *signature_buffers,
+                 const size_t                       *indexes,
+                 size_t                              count,
+                 enum t_cose_err_t                  *item_errors,
+                 struct q_useful_buf_c              *results)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                   304         168
+     *   tbs pieces                                  1152         672
+     *   inputs, hash storage and buffers             704         608
+     *   MAX(hash batch (a guess)    288      288
+     *       crypto lib sign     64-1024  64-1024)   288-1024    288-1024
+     *   TOTAL                                  2448-3184   1736-2472
+     */
+    struct tbs_pieces            tbs[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    const struct q_useful_buf_c *inputs[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    uint8_t                      hash_storage[T_COSE_SIGN1_BATCH_CHUNK_SIZE][T_COSE_CRYPTO_MAX_HASH_SIZE];
+    struct q_useful_buf          buffers_for_hash[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c        hashes[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c        signatures[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    enum t_cose_err_t            errors[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    enum t_cose_err_t            return_value;
+    size_t                       i;
+
+    for(i = 0; i < count; i++) {
+        create_tbs_pieces(protected_parameters,
+                          NULL_Q_USEFUL_BUF_C,
+                          payloads[indexes[i]],
+                          &tbs[i]);
+        inputs[i]           = tbs[i].pieces;
+        buffers_for_hash[i] = Q_USEFUL_BUF_FROM_BYTE_ARRAY(hash_storage[i]);
+    }
+    return_value = t_cose_crypto_hash_batch(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id),
+                                            inputs,
+                                            TBS_PIECE_COUNT,
+                                            buffers_for_hash,
+                                            hashes,
+                                            count);
+    if(return_value != T_COSE_SUCCESS) {
+        for(i = 0; i < count; i++) {
+            errors[i] = return_value;
+        }
+    } else if(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) {
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+        for(i = 0; i < count; i++) {
+            errors[i] = short_circuit_sign(me->cose_algorithm_id,
+                                           hashes[i],
+                                           signature_buffers[i],
+                                          &signatures[i]);
+        }
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+    } else {
+        return_value = t_cose_crypto_sign_batch(me->cose_algorithm_id,
+                                                me->signing_key,
+                                                hashes,
+                                                signature_buffers,
+                                                signatures,
+                                                errors,
+                                                count);
+        if(return_value != T_COSE_SUCCESS) {
+            for(i = 0; i < count; i++) {
+                errors[i] = return_value;
+            }
+        }
+    }
+
+    for(i = 0; i < count; i++) {
+        /* The size of the place holder was fixed before signing so a
+         * signature of any other size can't be used. */
+        if(errors[i] == T_COSE_SUCCESS && signatures[i].len != sig_size) {
+            errors[i] = T_COSE_ERR_SIG_FAIL;
+        }
+        item_errors[indexes[i]] = errors[i];
+        if(errors[i] != T_COSE_SUCCESS) {
+            results[indexes[i]] = NULL_Q_USEFUL_BUF_C;
+        }
+    }
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_batch(struct t_cose_sign1_sign_ctx *me,
+                        const struct q_useful_buf_c  *payloads,
+                        const struct q_useful_buf    *out_bufs,
+                        struct q_useful_buf_c        *results,
+                        enum t_cose_err_t            *item_errors,
+                        size_t                        count)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    80          40
+     *   encode context                               168         148
+     *   protected parameters buffer                   24          24
+     *   signature buffers, indexes                   192          96
+     *   max(encode_batch_item, sign_batch_chunk) 2448-3184   1736-2472
+     *   TOTAL                                   2912-3648   2044-2780
+     */
+    QCBOREncodeContext    encode_context;
+    Q_USEFUL_BUF_MAKE_STACK_UB(buffer_for_protected, T_COSE_SIGN1_MAX_SIZE_PROTECTED_PARAMETERS);
+    struct q_useful_buf_c protected_parameters;
+    struct q_useful_buf_c encoded_protected_parameters;
+    struct q_useful_buf_c kid;
+    size_t                sig_size;
+    enum t_cose_err_t     return_value;
+    size_t                i;
+    size_t                num_in_chunk;
+    struct q_useful_buf   signature_buffers[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+    size_t                chunk_indexes[T_COSE_SIGN1_BATCH_CHUNK_SIZE];
+
+    /* --- Work that depends only on the context, done once --- */
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Fail;
+    }
+
+    kid = me->kid;
+    if(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) {
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+        if(q_useful_buf_c_is_null_or_empty(kid)) {
+            kid = get_short_circuit_kid();
+        }
+        return_value = sig_size_from_alg_id(me->cose_algorithm_id, &sig_size);
+#else
+        return_value = T_COSE_ERR_SHORT_CIRCUIT_SIG_DISABLED;
+#endif
+    } else {
+        return_value = t_cose_crypto_sig_size(me->cose_algorithm_id,
+                                              me->signing_key,
+                                             &sig_size);
+    }
+    if(return_value != T_COSE_SUCCESS) {
+        goto Fail;
+    }
+    if(sig_size > T_COSE_MAX_SIG_SIZE) {
+        return_value = T_COSE_ERR_SIG_BUFFER_SIZE;
+        goto Fail;
+    }
+
+    QCBOREncode_Init(&encode_context, buffer_for_protected);
+    protected_parameters = encode_protected_parameters(me->cose_algorithm_id,
+                                                       &encode_context);
+    if(QCBOREncode_Finish(&encode_context, &encoded_protected_parameters)) {
+        return_value = T_COSE_ERR_MAKING_PROTECTED;
+        goto Fail;
+    }
+
+    /* --- Per-message work --- */
+    num_in_chunk = 0;
+    for(i = 0; i < count; i++) {
+        item_errors[i] = encode_batch_item(me,
+                                           protected_parameters,
+                                           kid,
+                                           sig_size,
+                                           payloads[i],
+                                           out_bufs[i],
+                                          &results[i]);
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            results[i] = NULL_Q_USEFUL_BUF_C;
+            continue;
+        }
+        if(results[i].ptr == NULL) {
+            /* Size calculation only. Nothing to hash or sign. */
+            continue;
+        }
+
+        signature_buffers[num_in_chunk].ptr = (uint8_t *)q_useful_buf_unconst(results[i]).ptr +
+                                                  results[i].len - sig_size;
+        signature_buffers[num_in_chunk].len = sig_size;
+        chunk_indexes[num_in_chunk] = i;
+        num_in_chunk++;
+
+        if(num_in_chunk == T_COSE_SIGN1_BATCH_CHUNK_SIZE) {
+            sign_batch_chunk(me, protected_parameters, sig_size, payloads, signature_buffers,
+                             chunk_indexes, num_in_chunk, item_errors, results);
+            num_in_chunk = 0;
+        }
+    }
+    if(num_in_chunk) {
+        sign_batch_chunk(me, protected_parameters, sig_size, payloads, signature_buffers,
+                         chunk_indexes, num_in_chunk, item_errors, results);
+    }
+
+    /* --- Overall result is that of the first failure --- */
+    for(i = 0; i < count; i++) {
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            return item_errors[i];
+        }
+    }
+    return T_COSE_SUCCESS;
+
+Fail:
+    /* An error common to all messages */
+    for(i = 0; i < count; i++) {
+        item_errors[i] = return_value;
+        results[i]     = NULL_Q_USEFUL_BUF_C;
+    }
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_set_midstate(struct t_cose_sign1_sign_ctx *me,
+                               struct t_cose_sign1_midstate *midstate)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    40          20
+     *   encode context                               168         148
+     *   protected parameters buffer                   24          24
+     *   create_tbs_hash_start                     24-520      22-518
+     *   TOTAL                                    256-752     214-710
+     */
+    QCBOREncodeContext    encode_context;
+    Q_USEFUL_BUF_MAKE_STACK_UB(buffer_for_protected, T_COSE_SIGN1_MAX_SIZE_PROTECTED_PARAMETERS);
+    struct q_useful_buf_c protected_parameters;
+    struct q_useful_buf_c encoded_protected_parameters;
+    enum t_cose_err_t     return_value;
+
+    me->midstate = NULL;
+
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    /* The protected parameters depend only on the algorithm ID so
+     * they are the same for every message signed with this context. */
+    QCBOREncode_Init(&encode_context, buffer_for_protected);
+    protected_parameters = encode_protected_parameters(me->cose_algorithm_id,
+                                                       &encode_context);
+    if(QCBOREncode_Finish(&encode_context, &encoded_protected_parameters)) {
+        return_value = T_COSE_ERR_MAKING_PROTECTED;
+        goto Done;
+    }
+
+    return_value = create_tbs_hash_start(me->cose_algorithm_id,
+                                         protected_parameters,
+                                         hash_from_storage(&(midstate->hash_ctx)));
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    midstate->cose_algorithm_id = me->cose_algorithm_id;
+    me->midstate = midstate;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+void
+t_cose_sign1_midstate_free(struct t_cose_sign1_midstate *midstate)
+{
+    t_cose_crypto_hash_abort(hash_from_storage(&(midstate->hash_ctx)));
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_set_header_template(struct t_cose_sign1_sign_ctx *me,
+                                      struct q_useful_buf           template_buffer)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    64          32
+     *   encode context                               168         148
+     *   QCBOR   (guess)                               32          24
+     *   TOTAL                                        264         204
+     */
+    QCBOREncodeContext    encode_context;
+    struct q_useful_buf_c protected_parameters;
+    struct q_useful_buf_c encoded_template;
+    struct q_useful_buf_c kid;
+    size_t                protected_len;
+    QCBORError            cbor_err;
+    enum t_cose_err_t     return_value;
+
+    /* Discard any previous template as it might be in
+     * template_buffer. If its unprotected parameters came from the
+     * template, they immediately follow its protected parameters. */
+    if(!q_useful_buf_c_is_null(me->encoded_protected_parameters)) {
+        if(me->encoded_unprotected_parameters.ptr ==
+           (const uint8_t *)me->encoded_protected_parameters.ptr +
+               me->encoded_protected_parameters.len) {
+            me->encoded_unprotected_parameters = NULL_Q_USEFUL_BUF_C;
+        }
+        me->encoded_protected_parameters = NULL_Q_USEFUL_BUF_C;
+    }
+
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    if(template_buffer.ptr == NULL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    }
+
+    kid = me->kid;
+    if(me->option_flags & T_COSE_OPT_SHORT_CIRCUIT_SIG) {
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+        if(q_useful_buf_c_is_null_or_empty(kid)) {
+            kid = get_short_circuit_kid();
+        }
+#else
+        return_value = T_COSE_ERR_SHORT_CIRCUIT_SIG_DISABLED;
+        goto Done;
+#endif
+    }
+
+    /* The template is the protected parameters bstr followed by the
+     * unprotected parameters map as a CBOR sequence. */
+    QCBOREncode_Init(&encode_context, template_buffer);
+    protected_parameters = encode_protected_parameters(me->cose_algorithm_id,
+                                                       &encode_context);
+    return_value = add_unprotected_parameters(me, kid, &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    cbor_err = QCBOREncode_Finish(&encode_context, &encoded_template);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* The bstr is at the start of the template and
+     * protected_parameters is its content, so it ends where
+     * protected_parameters ends. */
+    protected_len = (size_t)((const uint8_t *)protected_parameters.ptr -
+                             (const uint8_t *)encoded_template.ptr) +
+                    protected_parameters.len;
+
+    if(q_useful_buf_c_is_null(me->encoded_unprotected_parameters)) {
+        me->encoded_unprotected_parameters = q_useful_buf_tail(encoded_template,
+                                                               protected_len);
+    }
+    me->encoded_protected_parameters = q_useful_buf_head(encoded_template,
+                                                         protected_len);
+    me->protected_parameters = protected_parameters;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_begin(struct t_cose_sign1_sign_ctx    *me,
+                                 struct t_cose_sign1_sign_stream *stream,
+                                 struct q_useful_buf_c            aad,
+                                 size_t                           payload_len)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    40          20
+     *   encode context                               168         148
+     *   protected parameters buffer                   24          24
+     *   hash function (a guess! variable!)        16-512      16-512
+     *   TOTAL                                    248-744     208-704
+     */
+    QCBOREncodeContext               encode_context;
+    Q_USEFUL_BUF_MAKE_STACK_UB(      buffer_for_protected, T_COSE_SIGN1_MAX_SIZE_PROTECTED_PARAMETERS);
+    struct q_useful_buf_c            protected_parameters;
+    struct q_useful_buf_c            encoded_protected_parameters;
+    const struct t_cose_crypto_hash *tbs_midstate;
+    struct t_cose_crypto_hash       *hash_ctx;
+    enum t_cose_err_t                return_value;
+
+    stream->hash_started      = false;
+    stream->payload_remaining = payload_len;
+
+    hash_ctx = hash_from_storage(&(stream->hash_ctx));
+
+    if(hash_alg_id_from_sig_alg_id(me->cose_algorithm_id) == T_COSE_INVALID_ALGORITHM_ID) {
+        return_value = T_COSE_ERR_UNSUPPORTED_SIGNING_ALG;
+        goto Done;
+    }
+
+    tbs_midstate = get_tbs_midstate(me);
+    if(tbs_midstate != NULL) {
+        return_value = t_cose_crypto_hash_clone(hash_ctx, tbs_midstate);
+    } else {
+        if(!q_useful_buf_c_is_null(me->encoded_protected_parameters)) {
+            protected_parameters = me->protected_parameters;
+        } else {
+            /* These are the same bytes that
+             * t_cose_sign1_sign_detached_finish() will output */
+            QCBOREncode_Init(&encode_context, buffer_for_protected);
+            protected_parameters = encode_protected_parameters(me->cose_algorithm_id,
+                                                               &encode_context);
+            if(QCBOREncode_Finish(&encode_context, &encoded_protected_parameters)) {
+                return_value = T_COSE_ERR_MAKING_PROTECTED;
+                goto Done;
+            }
+        }
+        return_value = create_tbs_hash_start(me->cose_algorithm_id,
+                                             protected_parameters,
+                                             hash_ctx);
+    }
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* The length of the payload is needed now because it is in the
+     * CBOR head of the payload bstr that comes before the payload in
+     * the to-be-signed bytes. */
+    create_tbs_hash_payload_head(hash_ctx, aad, payload_len);
+    stream->hash_started = true;
+
+Done:
+    /* So a finish called anyway fails rather than signs */
+    stream->error = return_value;
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+void
+t_cose_sign1_sign_detached_update(struct t_cose_sign1_sign_stream *stream,
+                                  struct q_useful_buf_c            payload_chunk)
+{
+    if(stream->error != T_COSE_SUCCESS) {
+        return;
+    }
+
+    if(payload_chunk.len > stream->payload_remaining) {
+        stream->error = T_COSE_ERR_PAYLOAD_LENGTH;
+        return;
+    }
+    stream->payload_remaining -= payload_chunk.len;
+
+    t_cose_crypto_hash_update(hash_from_storage(&(stream->hash_ctx)),
+                              payload_chunk);
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+enum t_cose_err_t
+t_cose_sign1_sign_detached_finish(struct t_cose_sign1_sign_ctx    *me,
+                                  struct t_cose_sign1_sign_stream *stream,
+                                  struct q_useful_buf              out_buf,
+                                  struct q_useful_buf_c           *result)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    24          12
+     *   encode context                               168         148
+     *   hash buffer                                32-64       32-64
+     *   max(encode_param, encode_signature)     224-1316    216-1024
+     *   TOTAL                                   448-1572    408-1248
+     */
+    QCBOREncodeContext    encode_context;
+    Q_USEFUL_BUF_MAKE_STACK_UB(buffer_for_tbs_hash, T_COSE_CRYPTO_MAX_HASH_SIZE);
+    struct q_useful_buf_c tbs_hash;
+    QCBORError            cbor_err;
+    enum t_cose_err_t     return_value;
+
+    /* -- Complete the hash first so it is always finished -- */
+    if(stream->error == T_COSE_SUCCESS && stream->payload_remaining != 0) {
+        stream->error = T_COSE_ERR_PAYLOAD_LENGTH;
+    }
+    if(!stream->hash_started) {
+        /* The begin failed */
+        return_value = stream->error;
+        goto Done;
+    }
+    stream->hash_started = false;
+    if(stream->error != T_COSE_SUCCESS) {
+        t_cose_crypto_hash_abort(hash_from_storage(&(stream->hash_ctx)));
+        return_value = stream->error;
+        goto Done;
+    }
+    return_value = t_cose_crypto_hash_finish(hash_from_storage(&(stream->hash_ctx)),
+                                             buffer_for_tbs_hash,
+                                             &tbs_hash);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* -- Output the header parameters and the NULL payload -- */
+    QCBOREncode_Init(&encode_context, out_buf);
+    return_value = t_cose_sign1_encode_parameters_internal(me,
+                                                           true,
+                                                           &encode_context);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    QCBOREncode_AddNULL(&encode_context);
+
+    cbor_err = QCBOREncode_GetErrorState(&encode_context);
+    if(cbor_err == QCBOR_ERR_BUFFER_TOO_SMALL) {
+        return_value = T_COSE_ERR_TOO_SMALL;
+        goto Done;
+    } else if(cbor_err != QCBOR_SUCCESS) {
+        return_value = T_COSE_ERR_CBOR_FORMATTING;
+        goto Done;
+    }
+
+    /* -- Sign and put signature in the encoder context -- */
+    return_value = encode_signature_of_hash(me, tbs_hash, &encode_context);
+    if(return_value) {
+        goto Done;
+    }
+
+    /* -- Close off and get the resulting encoded CBOR -- */
+    if(QCBOREncode_Finish(&encode_context, result)) {
+        return_value = T_COSE_ERR_CBOR_NOT_WELL_FORMED;
+        goto Done;
+    }
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_sign.h
+ */
+void
+t_cose_sign1_sign_detached_abort(struct t_cose_sign1_sign_stream *stream)
+{
+    if(stream->hash_started) {
+        t_cose_crypto_hash_abort(hash_from_storage(&(stream->hash_ctx)));
+        stream->hash_started = false;
+    }
+}
@@ -15,10 +15,14 @@
 #endif
 #include "qcbor/qcbor_spiffy_decode.h"
 #include "t_cose/t_cose_sign1_verify.h"
+#include "t_cose/t_cose_kid_filter.h"
+#include "t_cose/t_cose_verify_cache.h"
+#include "t_cose/t_cose_header_cache.h"
 #include "t_cose/q_useful_buf.h"
 #include "t_cose_crypto.h"
 #include "t_cose_util.h"
 #include "t_cose_parameters.h"
+#include "t_cose_standard_constants.h"
 
 
 
@@ -187,44 +191,52 @@ qcbor_decode_error_to_t_cose_error(QCBORError qcbor_error)
 }
 
 
-enum t_cose_err_t
-t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
-                             struct q_useful_buf_c           cose_sign1,
-                             struct q_useful_buf_c           aad,
-                             struct q_useful_buf_c          *payload,
-                             struct t_cose_parameters       *returned_parameters,
-                             bool                            is_dc)
+/**
+ * \brief Decode a \c COSE_Sign1 and check its header parameters.
+ *
+ * \param[in] me                     The verification context.
+ * \param[in] cose_sign1             The \c COSE_Sign1 to decode.
+ * \param[in] is_dc                  The payload is detached.
+ * \param[out] protected_parameters  The encoded protected parameters.
+ * \param[out] payload               The payload if not detached.
+ * \param[out] signature             The signature.
+ * \param[out] parameters            The decoded header parameters.
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * This is all the work of verification except the hashing and the
+ * signature check. \c parameters is filled in as far as decoding got
+ * even if there is an error.
+ */
+static enum t_cose_err_t
+decode_cose_sign1(struct t_cose_sign1_verify_ctx *me,
+                  struct q_useful_buf_c           cose_sign1,
+                  bool                            is_dc,
+                  struct q_useful_buf_c          *protected_parameters,
+                  struct q_useful_buf_c          *payload,
+                  struct q_useful_buf_c          *signature,
+                  struct t_cose_parameters       *parameters)
 {
     /* Aproximate stack usage
      *                                             64-bit      32-bit
-     *   local vars                                    80          40
+     *   local vars                                    24          12
      *   Decode context                               312         256
-     *   Hash output                                32-64       32-64
      *   header parameter lists                       244         176
      *   MAX(parse_headers         768     628
      *       process tags           20      16
-     *       check crit             24      12
-     *       create_tbs_hash     32-748  30-746
-     *       crypto lib verify  64-1024 64-1024) 768-1024    768-1024
-     *   TOTAL                                  1724-1436   1560-1272
+     *       check crit             24      12)       768         628
+     *   TOTAL                                       1348        1072
      */
     QCBORDecodeContext            decode_context;
-    struct q_useful_buf_c         protected_parameters;
     enum t_cose_err_t             return_value;
-    Q_USEFUL_BUF_MAKE_STACK_UB(   buffer_for_tbs_hash, T_COSE_CRYPTO_MAX_HASH_SIZE);
-    struct q_useful_buf_c         tbs_hash;
-    struct q_useful_buf_c         signature;
     struct t_cose_label_list      critical_parameter_labels;
     struct t_cose_label_list      unknown_parameter_labels;
-    struct t_cose_parameters      parameters;
     QCBORError                    qcbor_error;
-#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
-    struct q_useful_buf_c         short_circuit_kid;
-#endif
 
     clear_label_list(&unknown_parameter_labels);
     clear_label_list(&critical_parameter_labels);
-    clear_cose_parameters(&parameters);
+    clear_cose_parameters(parameters);
 
 
     /* === Decoding of the array of four starts here === */
@@ -242,27 +254,46 @@ t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
     }
 
     /* --- The protected parameters --- */
-    QCBORDecode_EnterBstrWrapped(&decode_context, QCBOR_TAG_REQUIREMENT_NOT_A_TAG, &protected_parameters);
-    if(protected_parameters.len) {
+    QCBORDecode_EnterBstrWrapped(&decode_context, QCBOR_TAG_REQUIREMENT_NOT_A_TAG, protected_parameters);
+    if(protected_parameters->len &&
+       (me->header_cache == NULL ||
+        !t_cose_header_cache_find(me->header_cache, *protected_parameters, parameters))) {
         return_value = parse_cose_header_parameters(&decode_context,
-                                                    &parameters,
+                                                    parameters,
                                                     &critical_parameter_labels,
                                                     &unknown_parameter_labels);
         if(return_value != T_COSE_SUCCESS) {
             goto Done;
         }
+        /* Unknown parameters are left to be checked against the
+         * critical list with the unprotected ones every time. */
+        if(me->header_cache != NULL &&
+           is_label_list_clear(&critical_parameter_labels) &&
+           is_label_list_clear(&unknown_parameter_labels)) {
+            t_cose_header_cache_add(me->header_cache, *protected_parameters, parameters);
+        }
     }
+    /* On a cache hit this skips over the unparsed map */
     QCBORDecode_ExitBstrWrapped(&decode_context);
 
     /* ---  The unprotected parameters --- */
     return_value = parse_cose_header_parameters(&decode_context,
-                                                &parameters,
+                                                parameters,
                                                  NULL,
                                                 &unknown_parameter_labels);
     if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
 
+    /* The kid is known now so unknown and revoked ones can be
+     * rejected before the payload and signature are even decoded. */
+    if(me->kid_filter != NULL && !q_useful_buf_c_is_null(parameters->kid)) {
+        return_value = t_cose_kid_filter_check(me->kid_filter, parameters->kid);
+        if(return_value != T_COSE_SUCCESS) {
+            goto Done;
+        }
+    }
+
     /* --- The payload --- */
     if(is_dc) {
         QCBORItem tmp;
@@ -279,7 +310,7 @@ t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
     }
 
     /* --- The signature --- */
-    QCBORDecode_GetByteString(&decode_context, &signature);
+    QCBORDecode_GetByteString(&decode_context, signature);
 
     /* --- Finish up the CBOR decode --- */
     QCBORDecode_ExitArray(&decode_context);
@@ -297,13 +328,544 @@ t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
     /* === End of the decoding of the array of four === */
 
 
-    if((me->option_flags & T_COSE_OPT_REQUIRE_KID) && q_useful_buf_c_is_null(parameters.kid)) {
+    if((me->option_flags & T_COSE_OPT_REQUIRE_KID) && q_useful_buf_c_is_null(parameters->kid)) {
         return_value = T_COSE_ERR_NO_KID;
         goto Done;
     }
 
     return_value = check_critical_labels(&critical_parameter_labels,
                                          &unknown_parameter_labels);
+
+Done:
+    return return_value;
+}
+
+
+/**
+ * \brief Check that short-circuit signatures are allowed if used.
+ *
+ * \param[in] me          The verification context.
+ * \param[in] parameters  The decoded header parameters.
+ * \param[out] is_short_circuit  Set if the short-circuit kid is present.
+ *
+ * \return \ref T_COSE_ERR_SHORT_CIRCUIT_SIG if the \c COSE_Sign1 is
+ *         short-circuit signed and that isn't allowed.
+ */
+static inline enum t_cose_err_t
+check_short_circuit(const struct t_cose_sign1_verify_ctx *me,
+                    const struct t_cose_parameters       *parameters,
+                    bool                                 *is_short_circuit)
+{
+    *is_short_circuit = false;
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    if(!q_useful_buf_compare(parameters->kid, get_short_circuit_kid())) {
+        if(!(me->option_flags & T_COSE_OPT_ALLOW_SHORT_CIRCUIT)) {
+            return T_COSE_ERR_SHORT_CIRCUIT_SIG;
+        }
+        *is_short_circuit = true;
+    }
+#else
+    (void)me;
+    (void)parameters;
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Get the key to verify with.
+ *
+ * \param[in] me                 The verification context.
+ * \param[in] parameters         The decoded header parameters.
+ * \param[out] is_short_circuit  Set if the short-circuit kid is present.
+ * \param[out] key               The verification key.
+ *
+ * \return An error from the short-circuit check or the key resolver
+ *         or \ref T_COSE_SUCCESS.
+ *
+ * This is the key from the resolver if there is one, otherwise the
+ * key set with t_cose_sign1_set_verification_key(). The resolver is
+ * not called for short-circuit signatures. Except in batch
+ * verification, this is done before hashing so an unknown kid fails
+ * without the work of hashing.
+ */
+static inline enum t_cose_err_t
+get_verification_key(const struct t_cose_sign1_verify_ctx *me,
+                     const struct t_cose_parameters       *parameters,
+                     bool                                 *is_short_circuit,
+                     struct t_cose_key                    *key)
+{
+    enum t_cose_err_t return_value;
+
+    *key = me->verification_key;
+
+    return_value = check_short_circuit(me, parameters, is_short_circuit);
+    if(return_value != T_COSE_SUCCESS || *is_short_circuit) {
+        return return_value;
+    }
+
+    if(me->key_resolver == NULL) {
+        return T_COSE_SUCCESS;
+    }
+
+    return (me->key_resolver)(me->key_resolver_context,
+                              parameters->cose_algorithm_id,
+                              parameters->kid,
+                              key);
+}
+
+
+/**
+ * \brief Get the callback to release a key from get_verification_key().
+ *
+ * \param[in] me                The verification context.
+ * \param[in] is_short_circuit  From get_verification_key().
+ *
+ * \return The release callback or \c NULL if the key needs no
+ *         release, because it didn't come from the resolver or there
+ *         is no release callback.
+ *
+ * Only call this if get_verification_key() succeeded.
+ */
+static inline t_cose_key_release_cb *
+key_release_for(const struct t_cose_sign1_verify_ctx *me, bool is_short_circuit)
+{
+    if(me->key_resolver == NULL || is_short_circuit) {
+        return NULL;
+    }
+    return me->key_release;
+}
+
+
+/**
+ * \brief Release a key from get_verification_key().
+ *
+ * \param[in,out] release  From key_release_for(). Set to \c NULL so
+ *                         the key is only released once.
+ * \param[in] cb_context   The key resolver context.
+ * \param[in] key          The key to release.
+ */
+static inline void
+release_verification_key(t_cose_key_release_cb **release,
+                         void                   *cb_context,
+                         struct t_cose_key       key)
+{
+    if(*release != NULL) {
+        (*release)(cb_context, key);
+        *release = NULL;
+    }
+}
+
+
+/**
+ * \brief Verify the signature over a to-be-signed hash.
+ *
+ * \param[in] parameters        The decoded header parameters.
+ * \param[in] is_short_circuit  Whether it is short-circuit signed.
+ * \param[in] verification_key  The key from get_verification_key().
+ * \param[in] tbs_hash          The hash of the to-be-signed bytes.
+ * \param[in] signature         The signature from the \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ */
+static enum t_cose_err_t
+verify_tbs_hash(const struct t_cose_parameters *parameters,
+                bool                            is_short_circuit,
+                struct t_cose_key               verification_key,
+                struct q_useful_buf_c           tbs_hash,
+                struct q_useful_buf_c           signature)
+{
+    /* -- Verify short-circuit signature if it is one -- */
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    if(is_short_circuit) {
+        return t_cose_crypto_short_circuit_verify(tbs_hash, signature);
+    }
+#else
+    (void)is_short_circuit;
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+    /* -- Verify the signature (if it wasn't short-circuit) -- */
+    return t_cose_crypto_verify(parameters->cose_algorithm_id,
+                                verification_key,
+                                parameters->kid,
+                                tbs_hash,
+                                signature);
+}
+
+
+#if T_COSE_CRYPTO_MAX_HASH_SIZE > T_COSE_SIGN1_MAX_TBS_HASH_SIZE
+#error T_COSE_SIGN1_MAX_TBS_HASH_SIZE is too small for the hashes supported
+#endif
+
+
+/**
+ * \brief Hash the to-be-signed bytes.
+ *
+ * \param[in] me                    The verification context.
+ * \param[in] parameters            The decoded header parameters.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] aad                   The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload               The payload.
+ * \param[in] buffer_for_hash       Where to put the hash.
+ * \param[out] tbs_hash             The hash.
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * This starts from the hash midstate in the header cache if there is
+ * one for \c protected_parameters.
+ */
+static enum t_cose_err_t
+hash_tbs(const struct t_cose_sign1_verify_ctx *me,
+         const struct t_cose_parameters       *parameters,
+         struct q_useful_buf_c                 protected_parameters,
+         struct q_useful_buf_c                 aad,
+         struct q_useful_buf_c                 payload,
+         struct q_useful_buf                   buffer_for_hash,
+         struct q_useful_buf_c                *tbs_hash)
+{
+    const struct t_cose_hash_storage *tbs_midstate;
+
+    tbs_midstate = NULL;
+    if(me->header_cache != NULL) {
+        tbs_midstate = t_cose_header_cache_midstate(me->header_cache, protected_parameters);
+    }
+    if(tbs_midstate != NULL) {
+        return create_tbs_hash_from_midstate(hash_from_storage_const(tbs_midstate),
+                                             aad,
+                                             payload,
+                                             buffer_for_hash,
+                                             tbs_hash);
+    }
+
+    return create_tbs_hash(parameters->cose_algorithm_id,
+                           protected_parameters,
+                           aad,
+                           payload,
+                           buffer_for_hash,
+                           tbs_hash);
+}
+
+
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+/**
+ * \brief Verify the signature over the to-be-signed bytes in pieces.
+ *
+ * \param[in] parameters            The decoded header parameters.
+ * \param[in] verification_key      The key from get_verification_key().
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] aad                   The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload               The payload.
+ * \param[in] signature             The signature from the \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * This is for crypto adapters that hash and verify in one operation.
+ */
+static enum t_cose_err_t
+verify_tbs_message(const struct t_cose_parameters *parameters,
+                   struct t_cose_key               verification_key,
+                   struct q_useful_buf_c           protected_parameters,
+                   struct q_useful_buf_c           aad,
+                   struct q_useful_buf_c           payload,
+                   struct q_useful_buf_c           signature)
+{
+    struct tbs_pieces tbs;
+
+    create_tbs_pieces(protected_parameters, aad, payload, &tbs);
+    return t_cose_crypto_verify_message(parameters->cose_algorithm_id,
+                                        verification_key,
+                                        parameters->kid,
+                                        tbs.pieces,
+                                        TBS_PIECE_COUNT,
+                                        signature);
+}
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+
+/**
+ * \brief Find the key and hash the to-be-signed bytes.
+ *
+ * \param[in] me                    The verification context.
+ * \param[in] parameters            The decoded header parameters.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] aad                   The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload               The payload.
+ * \param[in] signature             The signature from the \c COSE_Sign1.
+ * \param[out] prepared             Everything but the parameters
+ *                                  needed by complete_tbs().
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * If the crypto adapter can verify a message directly the TBS bytes
+ * are not hashed here, except for short-circuit signatures which are
+ * checked against the hash.
+ */
+static enum t_cose_err_t
+prepare_tbs(const struct t_cose_sign1_verify_ctx *me,
+            const struct t_cose_parameters       *parameters,
+            struct q_useful_buf_c                 protected_parameters,
+            struct q_useful_buf_c                 aad,
+            struct q_useful_buf_c                 payload,
+            struct q_useful_buf_c                 signature,
+            struct t_cose_sign1_verify_prepared  *prepared)
+{
+    enum t_cose_err_t     return_value;
+    struct q_useful_buf_c tbs_hash;
+
+    prepared->protected_parameters = protected_parameters;
+    prepared->aad                  = aad;
+    prepared->payload              = payload;
+    prepared->signature            = signature;
+    prepared->is_decode_only       = false;
+    prepared->tbs_hash_len         = 0;
+    prepared->key_release          = NULL;
+
+    return_value = get_verification_key(me,
+                                        parameters,
+                                        &prepared->is_short_circuit,
+                                        &prepared->verification_key);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+    prepared->key_release         = key_release_for(me, prepared->is_short_circuit);
+    prepared->key_release_context = me->key_resolver_context;
+
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+    if(!prepared->is_short_circuit) {
+        return T_COSE_SUCCESS;
+    }
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+    return_value = hash_tbs(me,
+                            parameters,
+                            protected_parameters,
+                            aad,
+                            payload,
+                            Q_USEFUL_BUF_FROM_BYTE_ARRAY(prepared->tbs_hash),
+                            &tbs_hash);
+    if(return_value != T_COSE_SUCCESS) {
+        /* Nothing to release when prepare fails */
+        t_cose_sign1_verify_prepared_release(prepared);
+        return return_value;
+    }
+    prepared->tbs_hash_len = tbs_hash.len;
+
+    return T_COSE_SUCCESS;
+}
+
+
+/**
+ * \brief Check the signature of a message from prepare_tbs().
+ *
+ * \param[in] parameters  The decoded header parameters.
+ * \param[in] prepared    The output of prepare_tbs().
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * If the crypto adapter can verify a message directly the TBS bytes
+ * are given to it in pieces.
+ */
+static enum t_cose_err_t
+complete_tbs(const struct t_cose_parameters            *parameters,
+             const struct t_cose_sign1_verify_prepared *prepared)
+{
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+    if(!prepared->is_short_circuit) {
+        return verify_tbs_message(parameters,
+                                  prepared->verification_key,
+                                  prepared->protected_parameters,
+                                  prepared->aad,
+                                  prepared->payload,
+                                  prepared->signature);
+    }
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+
+    return verify_tbs_hash(parameters,
+                           prepared->is_short_circuit,
+                           prepared->verification_key,
+                           (struct q_useful_buf_c){prepared->tbs_hash, prepared->tbs_hash_len},
+                           prepared->signature);
+}
+
+
+/**
+ * \brief Verify the signature over the to-be-signed bytes.
+ *
+ * \param[in] me                    The verification context.
+ * \param[in] parameters            The decoded header parameters.
+ * \param[in] protected_parameters  The encoded protected parameters.
+ * \param[in] aad                   The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload               The payload.
+ * \param[in] signature             The signature from the \c COSE_Sign1.
+ *
+ * \return This returns one of the error codes defined by \ref
+ *         t_cose_err_t.
+ *
+ * This is prepare_tbs() and complete_tbs() back to back, then the
+ * key is released.
+ */
+static enum t_cose_err_t
+verify_tbs(const struct t_cose_sign1_verify_ctx *me,
+           const struct t_cose_parameters       *parameters,
+           struct q_useful_buf_c                 protected_parameters,
+           struct q_useful_buf_c                 aad,
+           struct q_useful_buf_c                 payload,
+           struct q_useful_buf_c                 signature)
+{
+    enum t_cose_err_t                   return_value;
+    struct t_cose_sign1_verify_prepared prepared;
+
+    return_value = prepare_tbs(me,
+                               parameters,
+                               protected_parameters,
+                               aad,
+                               payload,
+                               signature,
+                               &prepared);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+
+    return_value = complete_tbs(parameters, &prepared);
+    t_cose_sign1_verify_prepared_release(&prepared);
+
+    return return_value;
+}
+
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+/**
+ * \brief Hash a message and how it is to be verified for the cache.
+ *
+ * \param[in] me          The verification context.
+ * \param[in] cose_sign1  The \c COSE_Sign1.
+ * \param[in] aad         The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] detached    The detached payload or \c NULL_Q_USEFUL_BUF_C.
+ * \param[out] digest     \ref T_COSE_VERIFY_CACHE_DIGEST_SIZE bytes.
+ *
+ * \return An error if SHA-256 is not available or the public key
+ *         can't be exported.
+ *
+ * Everything that decides whether a message verifies goes in. The
+ * kid filter doesn't because it is checked on a hit too. The
+ * variable length inputs are preceded by their lengths so they can't
+ * run into each other.
+ *
+ * A key set with t_cose_sign1_set_verification_key() goes in as its
+ * public key bytes. Its handle or pointer would not do; once the key
+ * is freed the same value can be given to a different key.
+ */
+static enum t_cose_err_t
+verify_cache_digest(const struct t_cose_sign1_verify_ctx *me,
+                    struct q_useful_buf_c                 cose_sign1,
+                    struct q_useful_buf_c                 aad,
+                    struct q_useful_buf_c                 detached,
+                    uint8_t                              *digest)
+{
+    struct t_cose_crypto_hash hash_ctx;
+    struct q_useful_buf_c     digest_result;
+    enum t_cose_err_t         return_value;
+    Q_USEFUL_BUF_MAKE_STACK_UB( public_key_buffer, T_COSE_CRYPTO_MAX_PUBLIC_KEY_SIZE);
+    struct q_useful_buf_c     public_key;
+    uint64_t                  lengths[4];
+
+    public_key = NULL_Q_USEFUL_BUF_C;
+    if(me->verification_key.crypto_lib != T_COSE_CRYPTO_LIB_UNIDENTIFIED) {
+        return_value = t_cose_crypto_export_public_key(me->verification_key,
+                                                       public_key_buffer,
+                                                      &public_key);
+        if(return_value != T_COSE_SUCCESS) {
+            return return_value;
+        }
+    }
+
+    return_value = t_cose_crypto_hash_start(&hash_ctx, COSE_ALGORITHM_SHA_256);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+
+    /* Only ever compared with digests made by this process so native
+     * byte order and pointer values are fine */
+    lengths[0] = public_key.len;
+    lengths[1] = cose_sign1.len;
+    lengths[2] = aad.len;
+    lengths[3] = detached.len;
+    t_cose_crypto_hash_update(&hash_ctx, (struct q_useful_buf_c){&me->key_resolver, sizeof(me->key_resolver)});
+    t_cose_crypto_hash_update(&hash_ctx, (struct q_useful_buf_c){&me->key_resolver_context, sizeof(me->key_resolver_context)});
+    t_cose_crypto_hash_update(&hash_ctx, (struct q_useful_buf_c){&me->option_flags, sizeof(me->option_flags)});
+    t_cose_crypto_hash_update(&hash_ctx, (struct q_useful_buf_c){lengths, sizeof(lengths)});
+    t_cose_crypto_hash_update(&hash_ctx, public_key);
+    t_cose_crypto_hash_update(&hash_ctx, cose_sign1);
+    t_cose_crypto_hash_update(&hash_ctx, aad);
+    t_cose_crypto_hash_update(&hash_ctx, detached);
+
+    return t_cose_crypto_hash_finish(&hash_ctx,
+                                     (struct q_useful_buf){digest, T_COSE_VERIFY_CACHE_DIGEST_SIZE},
+                                     &digest_result);
+}
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+
+/*
+ * Semi-private function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
+                             struct q_useful_buf_c           cose_sign1,
+                             struct q_useful_buf_c           aad,
+                             struct q_useful_buf_c          *payload,
+                             struct t_cose_parameters       *returned_parameters,
+                             bool                            is_dc)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    64          32
+     *   parameters                                    80          40
+     *   MAX(decode_cose_sign1    1348    1072
+     *       verify_tbs        160-1236 150-1226)   1348       1072
+     *   TOTAL                                      1492       1144
+     */
+    struct q_useful_buf_c         protected_parameters;
+    enum t_cose_err_t             return_value;
+    struct q_useful_buf_c         signature;
+    struct t_cose_parameters      parameters;
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+    uint8_t                       digest[T_COSE_VERIFY_CACHE_DIGEST_SIZE];
+    bool                          use_cache;
+
+    /* -- A message verified before needs no decoding or crypto -- */
+    use_cache = me->verify_cache != NULL && !(me->option_flags & T_COSE_OPT_DECODE_ONLY);
+    if(use_cache) {
+        use_cache = verify_cache_digest(me,
+                                        cose_sign1,
+                                        aad,
+                                        is_dc ? *payload : NULL_Q_USEFUL_BUF_C,
+                                        digest) == T_COSE_SUCCESS;
+    }
+    if(use_cache) {
+        clear_cose_parameters(&parameters);
+        if(t_cose_verify_cache_find(me->verify_cache, digest, cose_sign1, payload, &parameters, me->auTags)) {
+            return_value = T_COSE_SUCCESS;
+            if(me->kid_filter != NULL && !q_useful_buf_c_is_null(parameters.kid)) {
+                return_value = t_cose_kid_filter_check(me->kid_filter, parameters.kid);
+            }
+            goto Done;
+        }
+    }
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+    return_value = decode_cose_sign1(me,
+                                     cose_sign1,
+                                     is_dc,
+                                     &protected_parameters,
+                                     payload,
+                                     &signature,
+                                     &parameters);
     if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
@@ -316,46 +878,598 @@ t_cose_sign1_verify_internal(struct t_cose_sign1_verify_ctx *me,
     }
 
 
-    /* -- Compute the TBS bytes -- */
-    return_value = create_tbs_hash(parameters.cose_algorithm_id,
-                                   protected_parameters,
-                                   aad,
-                                   *payload,
-                                   buffer_for_tbs_hash,
-                                   &tbs_hash);
-    if(return_value) {
+    /* -- Hash the TBS bytes and verify the signature -- */
+    return_value = verify_tbs(me,
+                              &parameters,
+                              protected_parameters,
+                              aad,
+                              *payload,
+                              signature);
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+    if(use_cache && return_value == T_COSE_SUCCESS) {
+        t_cose_verify_cache_add(me->verify_cache, digest, cose_sign1, *payload, &parameters, me->auTags);
+    }
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+Done:
+    if(returned_parameters != NULL) {
+        *returned_parameters = parameters;
+    }
+
+    return return_value;
+
+}
+
+
+/*
+ * Semi-private function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_prepare_internal(struct t_cose_sign1_verify_ctx      *me,
+                                     struct q_useful_buf_c                cose_sign1,
+                                     struct q_useful_buf_c                aad,
+                                     struct q_useful_buf_c               *payload,
+                                     struct t_cose_parameters            *returned_parameters,
+                                     bool                                 is_dc,
+                                     struct t_cose_sign1_verify_prepared *prepared)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    40          20
+     *   MAX(decode_cose_sign1    1348    1072
+     *       prepare_tbs        80-820  60-800)     1348       1072
+     *   TOTAL                                       1388       1092
+     */
+    struct q_useful_buf_c protected_parameters;
+    struct q_useful_buf_c signature;
+    enum t_cose_err_t     return_value;
+
+    prepared->key_release = NULL;
+
+    return_value = decode_cose_sign1(me,
+                                     cose_sign1,
+                                     is_dc,
+                                     &protected_parameters,
+                                     payload,
+                                     &signature,
+                                     &prepared->parameters);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    if(me->option_flags & T_COSE_OPT_DECODE_ONLY) {
+        prepared->is_decode_only = true;
         goto Done;
     }
 
+    return_value = prepare_tbs(me,
+                               &prepared->parameters,
+                               protected_parameters,
+                               aad,
+                               *payload,
+                               signature,
+                               prepared);
 
-    /* -- Check for short-circuit signature and verify if it exists -- */
-#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
-    short_circuit_kid = get_short_circuit_kid();
-    if(!q_useful_buf_compare(parameters.kid, short_circuit_kid)) {
-        if(!(me->option_flags & T_COSE_OPT_ALLOW_SHORT_CIRCUIT)) {
-            return_value = T_COSE_ERR_SHORT_CIRCUIT_SIG;
-            goto Done;
+Done:
+    if(returned_parameters != NULL) {
+        *returned_parameters = prepared->parameters;
+    }
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_complete(struct t_cose_sign1_verify_prepared *prepared)
+{
+    enum t_cose_err_t return_value;
+
+    if(prepared->is_decode_only) {
+        return T_COSE_SUCCESS;
+    }
+    return_value = complete_tbs(&prepared->parameters, prepared);
+    t_cose_sign1_verify_prepared_release(prepared);
+
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+void
+t_cose_sign1_verify_prepared_release(struct t_cose_sign1_verify_prepared *prepared)
+{
+    release_verification_key(&prepared->key_release,
+                             prepared->key_release_context,
+                             prepared->verification_key);
+}
+
+
+/**
+ * The number of messages t_cose_sign1_verify_batch() works on at
+ * once. The state for this many messages is held on the stack, about
+ * 190 bytes each, so this governs the stack use of batch
+ * verification. It can be overridden at compile time.
+ */
+#ifndef T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE
+#define T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE 8
+#endif
+
+
+/* The state of a chunk of a batch verification, an array for each
+ * field. */
+struct verify_batch_chunk {
+    struct t_cose_parameters parameters[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c    protected_parameters[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c    signatures[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    bool                     is_short_circuit[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    uint8_t                  tbs_hash_lens[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    uint8_t                  tbs_hashes[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE][T_COSE_CRYPTO_MAX_HASH_SIZE];
+};
+
+
+/**
+ * \brief Hash the to-be-signed bytes of a chunk of messages.
+ *
+ * \param[in] me              The verification context.
+ * \param[in] aads            The AADs or \c NULL.
+ * \param[in] payloads        The payloads.
+ * \param[in,out] item_errors The error for each message.
+ * \param[in] count           The number of messages.
+ * \param[in,out] chunk       The state. The hashes are put in it.
+ *
+ * Only messages without an error so far are hashed. Those with a
+ * midstate in the header cache are hashed from it one at a time. The
+ * rest are given to t_cose_crypto_hash_batch(), one call for each
+ * hash algorithm, so that they can be hashed side by side.
+ */
+static void
+hash_batch_chunk(const struct t_cose_sign1_verify_ctx *me,
+                 const struct q_useful_buf_c          *aads,
+                 const struct q_useful_buf_c          *payloads,
+                 enum t_cose_err_t                    *item_errors,
+                 size_t                                count,
+                 struct verify_batch_chunk            *chunk)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    64          32
+     *   tbs pieces                                  1152         672
+     *   inputs, buffers, hashes, indexes             320         160
+     *   MAX(hash_tbs              744     740
+     *       hash batch (a guess)  288     288)       744         740
+     *   TOTAL                                       2280        1604
+     */
+    struct tbs_pieces            tbs[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    const struct q_useful_buf_c *inputs[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    struct q_useful_buf          buffers_for_hash[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c        hashes[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    size_t                       indexes[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    bool                         to_batch[T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE];
+    struct q_useful_buf_c        tbs_hash;
+    struct q_useful_buf_c        aad;
+    int32_t                      hash_alg_id;
+    enum t_cose_err_t            return_value;
+    size_t                       num_in_batch;
+    size_t                       i;
+    size_t                       j;
+
+    for(i = 0; i < count; i++) {
+        to_batch[i] = false;
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            continue;
         }
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+        if(!chunk->is_short_circuit[i]) {
+            continue;
+        }
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+        if(me->header_cache != NULL &&
+           t_cose_header_cache_midstate(me->header_cache,
+                                        chunk->protected_parameters[i]) != NULL) {
+            item_errors[i] = hash_tbs(me,
+                                      &chunk->parameters[i],
+                                      chunk->protected_parameters[i],
+                                      aads != NULL ? aads[i] : NULL_Q_USEFUL_BUF_C,
+                                      payloads[i],
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(chunk->tbs_hashes[i]),
+                                      &tbs_hash);
+            if(item_errors[i] == T_COSE_SUCCESS) {
+                chunk->tbs_hash_lens[i] = (uint8_t)tbs_hash.len;
+            }
+            continue;
+        }
+        to_batch[i] = true;
+    }
+
+    for(i = 0; i < count; i++) {
+        if(!to_batch[i]) {
+            continue;
+        }
+
+        /* This and all the later ones with the same hash */
+        hash_alg_id  = hash_alg_id_from_sig_alg_id(chunk->parameters[i].cose_algorithm_id);
+        num_in_batch = 0;
+        for(j = i; j < count; j++) {
+            if(!to_batch[j] ||
+               hash_alg_id_from_sig_alg_id(chunk->parameters[j].cose_algorithm_id) != hash_alg_id) {
+                continue;
+            }
+            aad = aads != NULL ? aads[j] : NULL_Q_USEFUL_BUF_C;
+            create_tbs_pieces(chunk->protected_parameters[j], aad, payloads[j], &tbs[num_in_batch]);
+            inputs[num_in_batch]           = tbs[num_in_batch].pieces;
+            buffers_for_hash[num_in_batch] = Q_USEFUL_BUF_FROM_BYTE_ARRAY(chunk->tbs_hashes[j]);
+            indexes[num_in_batch]          = j;
+            to_batch[j]                    = false;
+            num_in_batch++;
+        }
+
+        /* An unknown algorithm gets the same error as from
+         * create_tbs_hash() because the hash of
+         * T_COSE_INVALID_ALGORITHM_ID is not supported. */
+        return_value = t_cose_crypto_hash_batch(hash_alg_id,
+                                                inputs,
+                                                TBS_PIECE_COUNT,
+                                                buffers_for_hash,
+                                                hashes,
+                                                num_in_batch);
+        for(j = 0; j < num_in_batch; j++) {
+            item_errors[indexes[j]] = return_value;
+            if(return_value == T_COSE_SUCCESS) {
+                chunk->tbs_hash_lens[indexes[j]] = (uint8_t)hashes[j].len;
+            }
+        }
+    }
+}
+
+
+/**
+ * \brief Verify a chunk of messages for t_cose_sign1_verify_batch().
+ *
+ * \param[in] me            The verification context.
+ * \param[in] cose_sign1s   The messages.
+ * \param[in] aads          The AADs or \c NULL.
+ * \param[out] payloads     The payloads.
+ * \param[out] item_errors  The error for each message.
+ * \param[in] count         The number of messages, at most
+ *                          \ref T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE.
+ * \param[out] chunk        The state, including the parameters.
+ *
+ * Each step is done for every message before the next step. A
+ * message that fails a step is left out of the steps after it.
+ *
+ * The key for a message is found right before its signature is
+ * checked, not for the whole chunk up front. A resolver such as
+ * t_cose_kid_cache_resolve() may free the key it returned last time
+ * when it is called again, so a key is only good until the next call.
+ * It is released right after the check.
+ */
+static void
+verify_batch_chunk(struct t_cose_sign1_verify_ctx *me,
+                   const struct q_useful_buf_c    *cose_sign1s,
+                   const struct q_useful_buf_c    *aads,
+                   struct q_useful_buf_c          *payloads,
+                   enum t_cose_err_t              *item_errors,
+                   size_t                          count,
+                   struct verify_batch_chunk      *chunk)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    32          20
+     *   MAX(decode_cose_sign1    1348    1072
+     *       hash_batch_chunk     2280    1604
+     *       verify_tbs_hash     1024     1024)      2280        1604
+     *   TOTAL                                       2312        1624
+     */
+    struct t_cose_key      key;
+    t_cose_key_release_cb *key_release;
+    size_t                 i;
+
+    /* -- Decode and check for short-circuit -- */
+    for(i = 0; i < count; i++) {
+        item_errors[i] = decode_cose_sign1(me,
+                                           cose_sign1s[i],
+                                           false,
+                                           &chunk->protected_parameters[i],
+                                           &payloads[i],
+                                           &chunk->signatures[i],
+                                           &chunk->parameters[i]);
+        if(item_errors[i] != T_COSE_SUCCESS || (me->option_flags & T_COSE_OPT_DECODE_ONLY)) {
+            continue;
+        }
+        item_errors[i] = check_short_circuit(me,
+                                             &chunk->parameters[i],
+                                             &chunk->is_short_circuit[i]);
+    }
 
-        return_value = t_cose_crypto_short_circuit_verify(tbs_hash, signature);
+    if(me->option_flags & T_COSE_OPT_DECODE_ONLY) {
+        return;
+    }
+
+    /* -- Hash the TBS bytes -- */
+    hash_batch_chunk(me, aads, payloads, item_errors, count, chunk);
+
+    /* -- Find the keys and check the signatures -- */
+    for(i = 0; i < count; i++) {
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            continue;
+        }
+        item_errors[i] = get_verification_key(me,
+                                              &chunk->parameters[i],
+                                              &chunk->is_short_circuit[i],
+                                              &key);
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            continue;
+        }
+        key_release = key_release_for(me, chunk->is_short_circuit[i]);
+#ifdef T_COSE_CRYPTO_HAS_SIGN_MESSAGE
+        if(!chunk->is_short_circuit[i]) {
+            item_errors[i] = verify_tbs_message(&chunk->parameters[i],
+                                                key,
+                                                chunk->protected_parameters[i],
+                                                aads != NULL ? aads[i] : NULL_Q_USEFUL_BUF_C,
+                                                payloads[i],
+                                                chunk->signatures[i]);
+            release_verification_key(&key_release, me->key_resolver_context, key);
+            continue;
+        }
+#endif /* T_COSE_CRYPTO_HAS_SIGN_MESSAGE */
+        item_errors[i] = verify_tbs_hash(&chunk->parameters[i],
+                                         chunk->is_short_circuit[i],
+                                         key,
+                                         (struct q_useful_buf_c){chunk->tbs_hashes[i],
+                                                                 chunk->tbs_hash_lens[i]},
+                                         chunk->signatures[i]);
+        release_verification_key(&key_release, me->key_resolver_context, key);
+    }
+}
+
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_batch(struct t_cose_sign1_verify_ctx *me,
+                          const struct q_useful_buf_c    *cose_sign1s,
+                          const struct q_useful_buf_c    *aads,
+                          struct q_useful_buf_c          *payloads,
+                          struct t_cose_parameters       *parameters,
+                          enum t_cose_err_t              *item_errors,
+                          size_t                          count)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    24          12
+     *   chunk                                       1472        1004
+     *   verify_batch_chunk                          2312        1624
+     *   TOTAL                                       3808        2640
+     */
+    struct verify_batch_chunk chunk;
+    size_t                    start;
+    size_t                    num_in_chunk;
+    size_t                    i;
+
+    for(start = 0; start < count; start += num_in_chunk) {
+        num_in_chunk = count - start;
+        if(num_in_chunk > T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE) {
+            num_in_chunk = T_COSE_SIGN1_VERIFY_BATCH_CHUNK_SIZE;
+        }
+
+        verify_batch_chunk(me,
+                           cose_sign1s + start,
+                           aads != NULL ? aads + start : NULL,
+                           payloads + start,
+                           item_errors + start,
+                           num_in_chunk,
+                           &chunk);
+
+        if(parameters != NULL) {
+            for(i = 0; i < num_in_chunk; i++) {
+                parameters[start + i] = chunk.parameters[i];
+            }
+        }
+    }
+
+    /* --- Overall result is that of the first failure --- */
+    for(i = 0; i < count; i++) {
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            return item_errors[i];
+        }
+    }
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_begin(struct t_cose_sign1_verify_ctx    *me,
+                                   struct t_cose_sign1_verify_stream *stream,
+                                   struct q_useful_buf_c              cose_sign1,
+                                   struct q_useful_buf_c              aad,
+                                   size_t                             payload_len,
+                                   struct t_cose_parameters          *returned_parameters)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    40          20
+     *   MAX(decode_cose_sign1    1348    1072
+     *       hash function      16-512  16-512)     1348       1072
+     *   TOTAL                                       1388       1092
+     */
+    struct q_useful_buf_c             protected_parameters;
+    struct t_cose_crypto_hash        *hash_ctx;
+    const struct t_cose_hash_storage *tbs_midstate;
+    enum t_cose_err_t                 return_value;
+
+    stream->hash_started      = false;
+    stream->payload_remaining = payload_len;
+    stream->error             = T_COSE_SUCCESS;
+    stream->key_release       = NULL;
+
+    return_value = decode_cose_sign1(me,
+                                     cose_sign1,
+                                     true,
+                                     &protected_parameters,
+                                     NULL,
+                                     &stream->signature,
+                                     &stream->parameters);
+    if(return_value != T_COSE_SUCCESS) {
         goto Done;
     }
-#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
 
+    if(me->option_flags & T_COSE_OPT_DECODE_ONLY) {
+        /* Nothing to hash */
+        goto Done;
+    }
 
-    /* -- Verify the signature (if it wasn't short-circuit) -- */
-    return_value = t_cose_crypto_verify(parameters.cose_algorithm_id,
-                                        me->verification_key,
-                                        parameters.kid,
-                                        tbs_hash,
-                                        signature);
+    /* Fail now rather than after the whole payload is hashed. This
+     * includes finding the key for the kid. */
+    return_value = get_verification_key(me,
+                                        &stream->parameters,
+                                        &stream->is_short_circuit,
+                                        &stream->verification_key);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    stream->key_release         = key_release_for(me, stream->is_short_circuit);
+    stream->key_release_context = me->key_resolver_context;
+
+    hash_ctx = hash_from_storage(&(stream->hash_ctx));
+    tbs_midstate = NULL;
+    if(me->header_cache != NULL) {
+        tbs_midstate = t_cose_header_cache_midstate(me->header_cache, protected_parameters);
+    }
+    if(tbs_midstate != NULL) {
+        return_value = t_cose_crypto_hash_clone(hash_ctx, hash_from_storage_const(tbs_midstate));
+    } else {
+        return_value = create_tbs_hash_start(stream->parameters.cose_algorithm_id,
+                                             protected_parameters,
+                                             hash_ctx);
+    }
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+    create_tbs_hash_payload_head(hash_ctx, aad, payload_len);
+    stream->hash_started = true;
 
 Done:
+    /* So a finish called anyway fails rather than succeeds */
+    stream->error = return_value;
+    if(return_value != T_COSE_SUCCESS) {
+        /* Nothing to release when begin fails */
+        release_verification_key(&stream->key_release,
+                                 stream->key_release_context,
+                                 stream->verification_key);
+    }
     if(returned_parameters != NULL) {
-        *returned_parameters = parameters;
+        *returned_parameters = stream->parameters;
     }
-
     return return_value;
+}
 
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+void
+t_cose_sign1_verify_detached_update(struct t_cose_sign1_verify_stream *stream,
+                                    struct q_useful_buf_c              payload_chunk)
+{
+    if(stream->error != T_COSE_SUCCESS) {
+        return;
+    }
+
+    if(payload_chunk.len > stream->payload_remaining) {
+        stream->error = T_COSE_ERR_PAYLOAD_LENGTH;
+        return;
+    }
+    stream->payload_remaining -= payload_chunk.len;
+
+    if(stream->hash_started) {
+        t_cose_crypto_hash_update(hash_from_storage(&(stream->hash_ctx)),
+                                  payload_chunk);
+    }
 }
 
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+enum t_cose_err_t
+t_cose_sign1_verify_detached_finish(struct t_cose_sign1_verify_ctx    *me,
+                                    struct t_cose_sign1_verify_stream *stream)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                    24          12
+     *   Hash output                                32-64       32-64
+     *   crypto lib verify                        64-1024     64-1024
+     *   TOTAL                                   120-1112    108-1100
+     */
+    Q_USEFUL_BUF_MAKE_STACK_UB(buffer_for_tbs_hash, T_COSE_CRYPTO_MAX_HASH_SIZE);
+    struct q_useful_buf_c      tbs_hash;
+    enum t_cose_err_t          return_value;
+
+    if(stream->error == T_COSE_SUCCESS && stream->payload_remaining != 0) {
+        stream->error = T_COSE_ERR_PAYLOAD_LENGTH;
+    }
+
+    if(!stream->hash_started) {
+        /* Decode only or the begin failed. No key is held. */
+        return stream->error;
+    }
+    stream->hash_started = false;
+
+    if(stream->error != T_COSE_SUCCESS) {
+        t_cose_crypto_hash_abort(hash_from_storage(&(stream->hash_ctx)));
+        return_value = stream->error;
+        goto Done;
+    }
+
+    return_value = t_cose_crypto_hash_finish(hash_from_storage(&(stream->hash_ctx)),
+                                             buffer_for_tbs_hash,
+                                             &tbs_hash);
+    if(return_value != T_COSE_SUCCESS) {
+        goto Done;
+    }
+
+    /* A key set with t_cose_sign1_set_verification_key() may have
+     * been set after the begin. A resolved key was found then. */
+    if(me->key_resolver == NULL) {
+        stream->verification_key = me->verification_key;
+    }
+
+    return_value = verify_tbs_hash(&stream->parameters,
+                                   stream->is_short_circuit,
+                                   stream->verification_key,
+                                   tbs_hash,
+                                   stream->signature);
+
+Done:
+    release_verification_key(&stream->key_release,
+                             stream->key_release_context,
+                             stream->verification_key);
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_sign1_verify.h
+ */
+void
+t_cose_sign1_verify_detached_abort(struct t_cose_sign1_verify_stream *stream)
+{
+    if(stream->hash_started) {
+        t_cose_crypto_hash_abort(hash_from_storage(&(stream->hash_ctx)));
+        stream->hash_started = false;
+        release_verification_key(&stream->key_release,
+                                 stream->key_release_context,
+                                 stream->verification_key);
+    }
+}
@@ -51,17 +51,23 @@ int32_t hash_alg_id_from_sig_alg_id(int32_t cose_algorithm_id)
 
 
 
+/*
+ * Compile-time check that struct t_cose_hash_storage is big enough
+ * for the hash context of the crypto library in use. If this fails,
+ * increase T_COSE_HASH_STORAGE_SIZE.
+ */
+typedef char t_cose_hash_storage_size_check[
+    sizeof(struct t_cose_crypto_hash) <= T_COSE_HASH_STORAGE_SIZE ? 1 : -1];
+
+
 /**
- * \brief Hash an encoded bstr without actually encoding it in memory
+ * \brief Hash the CBOR head of a bstr without encoding it in memory
  *
  * @param hash_ctx  Hash context to hash it into
- * @param bstr      Bytes of the bstr
- *
- * If \c bstr is \c NULL_Q_USEFUL_BUF_C, a zero-length bstr will be
- * hashed into the output.
+ * @param bstr_len  Length of the bstr
  */
-static void hash_bstr(struct t_cose_crypto_hash *hash_ctx,
-                      struct q_useful_buf_c      bstr)
+static void hash_bstr_head(struct t_cose_crypto_hash *hash_ctx,
+                           size_t                     bstr_len)
 {
     /* Aproximate stack usage
      *                                             64-bit      32-bit
@@ -78,10 +84,26 @@ static void hash_bstr(struct t_cose_crypto_hash *hash_ctx,
     encoded_head = QCBOREncode_EncodeHead(buffer_for_encoded_head,
                                           CBOR_MAJOR_TYPE_BYTE_STRING,
                                           0,
-                                          bstr.len);
+                                          bstr_len);
 
-    /* An encoded bstr is the CBOR head with its length followed by the bytes */
     t_cose_crypto_hash_update(hash_ctx, encoded_head);
+}
+
+
+/**
+ * \brief Hash an encoded bstr without actually encoding it in memory
+ *
+ * @param hash_ctx  Hash context to hash it into
+ * @param bstr      Bytes of the bstr
+ *
+ * If \c bstr is \c NULL_Q_USEFUL_BUF_C, a zero-length bstr will be
+ * hashed into the output.
+ */
+static void hash_bstr(struct t_cose_crypto_hash *hash_ctx,
+                      struct q_useful_buf_c      bstr)
+{
+    /* An encoded bstr is the CBOR head with its length followed by the bytes */
+    hash_bstr_head(hash_ctx, bstr.len);
     t_cose_crypto_hash_update(hash_ctx, bstr);
 }
 
@@ -106,22 +128,17 @@ static void hash_bstr(struct t_cose_crypto_hash *hash_ctx,
  * COSE_Sign1 structure. This is a little hard to to understand in the
  * spec.
  */
-enum t_cose_err_t create_tbs_hash(int32_t                cose_algorithm_id,
-                                  struct q_useful_buf_c  protected_parameters,
-                                  struct q_useful_buf_c  aad,
-                                  struct q_useful_buf_c  payload,
-                                  struct q_useful_buf    buffer_for_hash,
-                                  struct q_useful_buf_c *hash)
+enum t_cose_err_t create_tbs_hash_start(int32_t                    cose_algorithm_id,
+                                        struct q_useful_buf_c      protected_parameters,
+                                        struct t_cose_crypto_hash *hash_ctx)
 {
     /* Aproximate stack usage
      *                                             64-bit      32-bit
      *   local vars                                     8           6
-     *   hash_ctx                                   8-224       8-224
      *   hash function (a guess! variable!)        16-512      16-512
-     *   TOTAL                                     32-748      30-746
+     *   TOTAL                                     24-520      22-518
      */
     enum t_cose_err_t           return_value;
-    struct t_cose_crypto_hash   hash_ctx;
     int32_t                     hash_alg_id;
 
     /* Start the hashing */
@@ -129,7 +146,7 @@ enum t_cose_err_t create_tbs_hash(int32_t                cose_algorithm_id,
     /* Don't check hash_alg_id for failure. t_cose_crypto_hash_start()
      * will handle error properly. It was also checked earlier.
      */
-    return_value = t_cose_crypto_hash_start(&hash_ctx, hash_alg_id);
+    return_value = t_cose_crypto_hash_start(hash_ctx, hash_alg_id);
     if(return_value) {
         goto Done;
     }
@@ -149,38 +166,162 @@ enum t_cose_err_t create_tbs_hash(int32_t                cose_algorithm_id,
      * sign_protected is not used with COSE_Sign1 since there is no
      * signer chunk.
      *
-     * external_aad allows external data to be covered by the
-     * signature, but may be a NULL_Q_USEFUL_BUF_C in which case a
-     * zero-length bstr will be correctly hashed into the result.
-     *
      * Instead of formatting the TBS bytes in one buffer, they are
      * formatted in chunks and fed into the hash. If actually
      * formatted, the TBS bytes are slightly larger than the payload,
      * so this saves a lot of memory.
+     *
+     * Everything up to external_aad is hashed here. It is the same
+     * for every message with the same protected parameters.
      */
 
     /* Hand-constructed CBOR for the array of 4 and the context string.
      * \x84 is an array of 4. \x6A is a text string of 10 bytes. */
-    t_cose_crypto_hash_update(&hash_ctx, Q_USEFUL_BUF_FROM_SZ_LITERAL("\x84\x6A" COSE_SIG_CONTEXT_STRING_SIGNATURE1));
+    t_cose_crypto_hash_update(hash_ctx, Q_USEFUL_BUF_FROM_SZ_LITERAL("\x84\x6A" COSE_SIG_CONTEXT_STRING_SIGNATURE1));
 
     /* body_protected */
-    hash_bstr(&hash_ctx, protected_parameters);
+    hash_bstr(hash_ctx, protected_parameters);
 
-    /* external_aad */
-    hash_bstr(&hash_ctx, aad);
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function. See t_cose_util.h
+ */
+enum t_cose_err_t create_tbs_hash_finish(struct t_cose_crypto_hash *hash_ctx,
+                                         struct q_useful_buf_c      aad,
+                                         struct q_useful_buf_c      payload,
+                                         struct q_useful_buf        buffer_for_hash,
+                                         struct q_useful_buf_c     *hash)
+{
+    /* external_aad allows external data to be covered by the
+     * signature, but may be a NULL_Q_USEFUL_BUF_C in which case a
+     * zero-length bstr will be correctly hashed into the result.
+     */
+    hash_bstr(hash_ctx, aad);
 
     /* payload */
-    hash_bstr(&hash_ctx, payload);
+    hash_bstr(hash_ctx, payload);
 
     /* Finish the hash and set up to return it */
-    return_value = t_cose_crypto_hash_finish(&hash_ctx,
-                                             buffer_for_hash,
-                                             hash);
+    return t_cose_crypto_hash_finish(hash_ctx, buffer_for_hash, hash);
+}
+
+
+/*
+ * Public function. See t_cose_util.h
+ */
+enum t_cose_err_t create_tbs_hash_from_midstate(const struct t_cose_crypto_hash *tbs_midstate,
+                                                struct q_useful_buf_c            aad,
+                                                struct q_useful_buf_c            payload,
+                                                struct q_useful_buf              buffer_for_hash,
+                                                struct q_useful_buf_c           *hash)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                     8           4
+     *   hash_ctx                                   8-224       8-224
+     *   hash function (a guess! variable!)        16-512      16-512
+     *   TOTAL                                     32-744      28-740
+     */
+    struct t_cose_crypto_hash hash_ctx;
+    enum t_cose_err_t         return_value;
+
+    return_value = t_cose_crypto_hash_clone(&hash_ctx, tbs_midstate);
+    if(return_value != T_COSE_SUCCESS) {
+        return return_value;
+    }
+
+    return create_tbs_hash_finish(&hash_ctx, aad, payload, buffer_for_hash, hash);
+}
+
+
+/*
+ * Public function. See t_cose_util.h
+ */
+void create_tbs_hash_payload_head(struct t_cose_crypto_hash *hash_ctx,
+                                  struct q_useful_buf_c      aad,
+                                  size_t                     payload_len)
+{
+    /* external_aad */
+    hash_bstr(hash_ctx, aad);
+
+    /* Only the head of the payload bstr */
+    hash_bstr_head(hash_ctx, payload_len);
+}
+
+
+/*
+ * Public function. See t_cose_util.h
+ */
+enum t_cose_err_t create_tbs_hash(int32_t                cose_algorithm_id,
+                                  struct q_useful_buf_c  protected_parameters,
+                                  struct q_useful_buf_c  aad,
+                                  struct q_useful_buf_c  payload,
+                                  struct q_useful_buf    buffer_for_hash,
+                                  struct q_useful_buf_c *hash)
+{
+    /* Aproximate stack usage
+     *                                             64-bit      32-bit
+     *   local vars                                     8           6
+     *   hash_ctx                                   8-224       8-224
+     *   hash function (a guess! variable!)        16-512      16-512
+     *   TOTAL                                     32-748      30-746
+     */
+    enum t_cose_err_t           return_value;
+    struct t_cose_crypto_hash   hash_ctx;
+
+    return_value = create_tbs_hash_start(cose_algorithm_id,
+                                         protected_parameters,
+                                         &hash_ctx);
+    if(return_value) {
+        goto Done;
+    }
+
+    return_value = create_tbs_hash_finish(&hash_ctx,
+                                          aad,
+                                          payload,
+                                          buffer_for_hash,
+                                          hash);
 Done:
     return return_value;
 }
 
 
+/*
+ * Public function. See t_cose_util.h
+ */
+void create_tbs_pieces(struct q_useful_buf_c  protected_parameters,
+                       struct q_useful_buf_c  aad,
+                       struct q_useful_buf_c  payload,
+                       struct tbs_pieces     *tbs)
+{
+    /* The same Sig_structure as create_tbs_hash_start() and
+     * create_tbs_hash_finish() hash */
+    tbs->pieces[0] = Q_USEFUL_BUF_FROM_SZ_LITERAL("\x84\x6A" COSE_SIG_CONTEXT_STRING_SIGNATURE1);
+
+    tbs->pieces[1] = QCBOREncode_EncodeHead(Q_USEFUL_BUF_FROM_BYTE_ARRAY(tbs->heads[0]),
+                                            CBOR_MAJOR_TYPE_BYTE_STRING,
+                                            0,
+                                            protected_parameters.len);
+    tbs->pieces[2] = protected_parameters;
+
+    tbs->pieces[3] = QCBOREncode_EncodeHead(Q_USEFUL_BUF_FROM_BYTE_ARRAY(tbs->heads[1]),
+                                            CBOR_MAJOR_TYPE_BYTE_STRING,
+                                            0,
+                                            aad.len);
+    tbs->pieces[4] = aad;
+
+    tbs->pieces[5] = QCBOREncode_EncodeHead(Q_USEFUL_BUF_FROM_BYTE_ARRAY(tbs->heads[2]),
+                                            CBOR_MAJOR_TYPE_BYTE_STRING,
+                                            0,
+                                            payload.len);
+    tbs->pieces[6] = payload;
+}
+
+
 #ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
 /* This is a random hard coded kid (key ID) that is used to indicate
  * short-circuit signing. It is OK to hard code this as the
@@ -207,3 +348,24 @@ struct q_useful_buf_c get_short_circuit_kid(void)
     return short_circuit_kid;
 }
 #endif
+
+
+/*
+ * Public function. See t_cose_common.h
+ */
+void
+t_cose_key_release_cached(struct t_cose_key key)
+{
+    t_cose_crypto_release_key_cache(key);
+}
+
+
+/*
+ * Public function. See t_cose_common.h
+ */
+enum t_cose_err_t
+t_cose_key_prepare(struct t_cose_key           key,
+                   struct t_cose_prepared_key *prepared)
+{
+    return t_cose_crypto_prepare_key(key, prepared);
+}
@@ -13,6 +13,7 @@
 #define __T_COSE_UTIL_H__
 
 #include <stdint.h>
+#include "qcbor/qcbor.h"
 #include "t_cose/q_useful_buf.h"
 #include "t_cose/t_cose_common.h"
 
@@ -106,6 +107,153 @@ enum t_cose_err_t create_tbs_hash(int32_t                     cose_algorithm_id,
                                   struct q_useful_buf_c      *hash);
 
 
+struct t_cose_crypto_hash;
+
+/**
+ * \brief Start the hash of the to-be-signed (TBS) bytes for COSE.
+ *
+ * \param[in] cose_algorithm_id     The COSE signing algorithm ID. Used to
+ *                                  determine which hash function to use.
+ * \param[in] protected_parameters  Full, CBOR encoded, protected parameters.
+ * \param[out] hash_ctx             The hash context to start.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the first half of create_tbs_hash(). It hashes the part of
+ * the TBS bytes that comes before the AAD. This part is the same for
+ * every message with the same protected parameters so \c hash_ctx
+ * may be copied with t_cose_crypto_hash_clone() and used as the
+ * starting point for many messages.
+ *
+ * On success, \c hash_ctx must be completed with
+ * create_tbs_hash_finish() or t_cose_crypto_hash_abort().
+ */
+enum t_cose_err_t create_tbs_hash_start(int32_t                    cose_algorithm_id,
+                                        struct q_useful_buf_c      protected_parameters,
+                                        struct t_cose_crypto_hash *hash_ctx);
+
+
+/**
+ * \brief Finish the hash of the to-be-signed (TBS) bytes for COSE.
+ *
+ * \param[in] hash_ctx         Hash context from create_tbs_hash_start().
+ * \param[in] aad              Additional Authenitcated Data to be
+ *                             included in TBS.
+ * \param[in] payload          The CBOR-encoded payload.
+ * \param[in] buffer_for_hash  Pointer and length of buffer into which
+ *                             the resulting hash is put.
+ * \param[out] hash            Pointer and length of the
+ *                             resulting hash.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This is the second half of create_tbs_hash(). \c hash_ctx is
+ * finished by this.
+ */
+enum t_cose_err_t create_tbs_hash_finish(struct t_cose_crypto_hash *hash_ctx,
+                                         struct q_useful_buf_c      aad,
+                                         struct q_useful_buf_c      payload,
+                                         struct q_useful_buf        buffer_for_hash,
+                                         struct q_useful_buf_c     *hash);
+
+
+/**
+ * \brief Create the hash of the to-be-signed bytes from a midstate.
+ *
+ * \param[in] tbs_midstate     Hash context from create_tbs_hash_start().
+ * \param[in] aad              The AAD or \c NULL_Q_USEFUL_BUF_C.
+ * \param[in] payload          The payload.
+ * \param[in] buffer_for_hash  Buffer into which the hash is put.
+ * \param[out] hash            The resulting hash.
+ *
+ * \return This returns one of the error codes defined by \ref t_cose_err_t.
+ *
+ * This gives the same result as create_tbs_hash(), but starts from a
+ * copy of \c tbs_midstate instead of hashing the context string and
+ * protected parameters. \c tbs_midstate is not modified.
+ */
+enum t_cose_err_t create_tbs_hash_from_midstate(const struct t_cose_crypto_hash *tbs_midstate,
+                                                struct q_useful_buf_c            aad,
+                                                struct q_useful_buf_c            payload,
+                                                struct q_useful_buf              buffer_for_hash,
+                                                struct q_useful_buf_c           *hash);
+
+
+/* The number of pieces the TBS bytes are split into by create_tbs_pieces() */
+#define TBS_PIECE_COUNT 7
+
+/**
+ * The to-be-signed bytes as pieces in place in memory. The CBOR heads
+ * of the bstrs are encoded into \c heads and the rest of the pieces
+ * point to the caller's protected parameters, AAD and payload.
+ */
+struct tbs_pieces {
+    uint8_t               heads[3][QCBOR_HEAD_BUFFER_SIZE];
+    struct q_useful_buf_c pieces[TBS_PIECE_COUNT];
+};
+
+
+/**
+ * \brief Make the to-be-signed (TBS) bytes as pieces without copying.
+ *
+ * \param[in] protected_parameters  Full, CBOR encoded, protected parameters.
+ * \param[in] aad                   Additional Authenitcated Data to be
+ *                                  included in TBS.
+ * \param[in] payload               The CBOR-encoded payload.
+ * \param[out] tbs                  The pieces.
+ *
+ * The pieces in order are the same bytes that create_tbs_hash()
+ * hashes. This is for t_cose_crypto_sign_message() and
+ * t_cose_crypto_verify_message().
+ */
+void create_tbs_pieces(struct q_useful_buf_c  protected_parameters,
+                       struct q_useful_buf_c  aad,
+                       struct q_useful_buf_c  payload,
+                       struct tbs_pieces     *tbs);
+
+
+/**
+ * \brief Hash the AAD and the start of the payload of the TBS bytes.
+ *
+ * \param[in] hash_ctx     Hash context from create_tbs_hash_start().
+ * \param[in] aad          Additional Authenitcated Data to be
+ *                         included in TBS.
+ * \param[in] payload_len  The length of the payload.
+ *
+ * This is for hashing a payload that is not all in memory at
+ * once. It hashes the AAD and the CBOR head of the payload bstr,
+ * which only needs the length of the payload. The payload itself is
+ * then hashed with t_cose_crypto_hash_update() as it becomes
+ * available and the hash finished with t_cose_crypto_hash_finish().
+ */
+void create_tbs_hash_payload_head(struct t_cose_crypto_hash *hash_ctx,
+                                  struct q_useful_buf_c      aad,
+                                  size_t                     payload_len);
+
+
+/**
+ * \brief Get the hash context kept in a \ref t_cose_hash_storage.
+ *
+ * \param[in] storage  The storage.
+ *
+ * \return The hash context.
+ *
+ * The size of \ref t_cose_hash_storage is checked against the hash
+ * context at compile time in t_cose_util.c.
+ */
+static inline struct t_cose_crypto_hash *
+hash_from_storage(struct t_cose_hash_storage *storage)
+{
+    return (struct t_cose_crypto_hash *)storage->u.bytes;
+}
+
+static inline const struct t_cose_crypto_hash *
+hash_from_storage_const(const struct t_cose_hash_storage *storage)
+{
+    return (const struct t_cose_crypto_hash *)storage->u.bytes;
+}
+
+
 
 
 #ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
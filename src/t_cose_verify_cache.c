@@ -0,0 +1,269 @@
+/*
+ *  t_cose_verify_cache.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+
+/* For clock_gettime() when compiling strict C99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "t_cose/t_cose_verify_cache.h"
+#include <string.h>
+#include <time.h>
+
+
+/**
+ * \file t_cose_verify_cache.c
+ *
+ * \brief Set-associative cache of successful verifications.
+ *
+ * Buffers returned by a hit have to point into the \c COSE_Sign1
+ * passed in for that verification, not the one that was cached, so
+ * entries hold offsets into the message rather than pointers.
+ */
+
+
+#define NO_SPAN UINT32_MAX
+
+#define SET_COUNT (T_COSE_VERIFY_CACHE_SIZE / T_COSE_VERIFY_CACHE_WAYS)
+
+
+static void
+lock_set(struct t_cose_verify_cache_set *set)
+{
+    while(__atomic_test_and_set(&set->lock, __ATOMIC_ACQUIRE)) {
+        /* Spin without the atomic so waiters don't fight over the line */
+        while(__atomic_load_n(&set->lock, __ATOMIC_RELAXED));
+    }
+}
+
+
+static void
+unlock_set(struct t_cose_verify_cache_set *set)
+{
+    __atomic_clear(&set->lock, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Seconds from the monotonic clock so setting the wall clock back
+ * can't make entries live longer than their time to live.
+ */
+static uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec;
+}
+
+
+static struct t_cose_verify_cache_set *
+set_of(struct t_cose_verify_cache *cache, const uint8_t *digest)
+{
+    uint32_t n;
+
+    /* The digest is SHA-256 so any of its bits will do */
+    n = (uint32_t)digest[0] | (uint32_t)digest[1] << 8 | (uint32_t)digest[2] << 16;
+
+    return &cache->sets[n & (SET_COUNT - 1)];
+}
+
+
+/*
+ * Makes the span of buf in message. Returns false if buf is not in
+ * message.
+ */
+static bool
+make_span(struct q_useful_buf_c            message,
+          struct q_useful_buf_c            buf,
+          struct t_cose_verify_cache_span *span)
+{
+    uintptr_t start = (uintptr_t)message.ptr;
+    uintptr_t p     = (uintptr_t)buf.ptr;
+
+    if(buf.ptr == NULL) {
+        span->offset = NO_SPAN;
+        span->len    = 0;
+        return true;
+    }
+    if(p < start || p - start > message.len || message.len - (p - start) < buf.len) {
+        return false;
+    }
+    span->offset = (uint32_t)(p - start);
+    span->len    = (uint32_t)buf.len;
+    return true;
+}
+
+
+static struct q_useful_buf_c
+from_span(struct q_useful_buf_c message, struct t_cose_verify_cache_span span)
+{
+    if(span.offset == NO_SPAN) {
+        return NULL_Q_USEFUL_BUF_C;
+    }
+    return (struct q_useful_buf_c){(const uint8_t *)message.ptr + span.offset, span.len};
+}
+
+
+/*
+ * Public function. See t_cose_verify_cache.h
+ */
+void
+t_cose_verify_cache_init(struct t_cose_verify_cache *cache,
+                         uint32_t                    ttl_seconds)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->ttl_seconds = ttl_seconds;
+}
+
+
+/*
+ * Public function. See t_cose_verify_cache.h
+ */
+void
+t_cose_verify_cache_clear(struct t_cose_verify_cache *cache)
+{
+    size_t i;
+    size_t j;
+
+    for(i = 0; i < SET_COUNT; i++) {
+        lock_set(&cache->sets[i]);
+        for(j = 0; j < T_COSE_VERIFY_CACHE_WAYS; j++) {
+            cache->sets[i].ways[j].expires = 0;
+        }
+        unlock_set(&cache->sets[i]);
+    }
+}
+
+
+/*
+ * Semi-private function. See t_cose_verify_cache.h
+ */
+bool
+t_cose_verify_cache_find(struct t_cose_verify_cache *cache,
+                         const uint8_t              *digest,
+                         struct q_useful_buf_c       cose_sign1,
+                         struct q_useful_buf_c      *payload,
+                         struct t_cose_parameters   *parameters,
+                         uint64_t                   *tags)
+{
+    struct t_cose_verify_cache_set   *set;
+    struct t_cose_verify_cache_entry  entry;
+    uint64_t                          time_now;
+    size_t                            i;
+    bool                              found;
+
+    if(cache->ttl_seconds == 0) {
+        return false;
+    }
+
+    set      = set_of(cache, digest);
+    time_now = now();
+    found    = false;
+
+    lock_set(set);
+    for(i = 0; i < T_COSE_VERIFY_CACHE_WAYS; i++) {
+        if(set->ways[i].expires > time_now &&
+           !memcmp(set->ways[i].digest, digest, T_COSE_VERIFY_CACHE_DIGEST_SIZE)) {
+            entry = set->ways[i];
+            found = true;
+            break;
+        }
+    }
+    unlock_set(set);
+
+    if(!found) {
+        return false;
+    }
+
+    /* The digest covers the message so the spans are in it */
+    if(entry.payload.offset != NO_SPAN) {
+        *payload = from_span(cose_sign1, entry.payload);
+    }
+    parameters->cose_algorithm_id = entry.cose_algorithm_id;
+    parameters->kid               = from_span(cose_sign1, entry.kid);
+    parameters->iv                = from_span(cose_sign1, entry.iv);
+    parameters->partial_iv        = from_span(cose_sign1, entry.partial_iv);
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    parameters->content_type_tstr = from_span(cose_sign1, entry.content_type_tstr);
+    parameters->content_type_uint = entry.content_type_uint;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+    memcpy(tags, entry.tags, sizeof(entry.tags));
+
+    return true;
+}
+
+
+/*
+ * Semi-private function. See t_cose_verify_cache.h
+ */
+void
+t_cose_verify_cache_add(struct t_cose_verify_cache     *cache,
+                        const uint8_t                  *digest,
+                        struct q_useful_buf_c           cose_sign1,
+                        struct q_useful_buf_c           payload,
+                        const struct t_cose_parameters *parameters,
+                        const uint64_t                 *tags)
+{
+    struct t_cose_verify_cache_set   *set;
+    struct t_cose_verify_cache_entry  entry;
+    size_t                            i;
+    size_t                            victim;
+
+    if(cache->ttl_seconds == 0 || cose_sign1.len >= NO_SPAN) {
+        return;
+    }
+
+    /* Made outside the lock. A detached payload isn't in the message
+     * and isn't returned by a hit. */
+    if(!make_span(cose_sign1, payload, &entry.payload)) {
+        entry.payload.offset = NO_SPAN;
+        entry.payload.len    = 0;
+    }
+    if(!make_span(cose_sign1, parameters->kid, &entry.kid) ||
+       !make_span(cose_sign1, parameters->iv, &entry.iv) ||
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+       !make_span(cose_sign1, parameters->content_type_tstr, &entry.content_type_tstr) ||
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+       !make_span(cose_sign1, parameters->partial_iv, &entry.partial_iv)) {
+        return;
+    }
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    entry.content_type_uint = parameters->content_type_uint;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+    entry.cose_algorithm_id = parameters->cose_algorithm_id;
+    memcpy(entry.tags, tags, sizeof(entry.tags));
+    memcpy(entry.digest, digest, T_COSE_VERIFY_CACHE_DIGEST_SIZE);
+    entry.expires = now() + cache->ttl_seconds;
+
+    set = set_of(cache, digest);
+
+    lock_set(set);
+    /* The same digest, else an empty or expired entry, else the
+     * one added longest ago which expires first */
+    victim = 0;
+    for(i = 0; i < T_COSE_VERIFY_CACHE_WAYS; i++) {
+        if(!memcmp(set->ways[i].digest, digest, T_COSE_VERIFY_CACHE_DIGEST_SIZE)) {
+            victim = i;
+            break;
+        }
+        if(set->ways[i].expires < set->ways[victim].expires) {
+            victim = i;
+        }
+    }
+    set->ways[victim] = entry;
+    unlock_set(set);
+}
+
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
@@ -51,6 +51,26 @@ static test_entry2 s_tests2[] = {
 static test_entry s_tests[] = {
     TEST_ENTRY(sign1_structure_decode_test),
 
+    TEST_ENTRY(key_resolver_test),
+    TEST_ENTRY(key_index_test),
+    TEST_ENTRY(kid_filter_test),
+#if defined(T_COSE_ENABLE_VERIFY_CACHE) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+    TEST_ENTRY(verify_cache_test),
+#endif
+#ifdef T_COSE_ENABLE_KEY_SET
+    TEST_ENTRY(key_set_test),
+#endif
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    TEST_ENTRY(header_cache_test),
+#endif
+#if defined(T_COSE_ENABLE_ASYNC) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+    TEST_ENTRY(async_test),
+#endif
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    TEST_ENTRY(verify_batch_test),
+#endif
+    TEST_ENTRY(hash_batch_test),
+
 #ifndef T_COSE_DISABLE_SIGN_VERIFY_TESTS
     /* Many tests can be run without a crypto library integration and
      * provide good test coverage of everything but the signing and
@@ -62,6 +82,24 @@ static test_entry s_tests[] = {
     TEST_ENTRY(sign_verify_sig_fail_test),
     TEST_ENTRY(sign_verify_get_size_test),
     TEST_ENTRY(known_good_test),
+    TEST_ENTRY(sign_verify_batch_test),
+    TEST_ENTRY(sign_verify_verify_batch_test),
+    TEST_ENTRY(sign_verify_repeat_test),
+    TEST_ENTRY(sign_verify_key_change_test),
+    TEST_ENTRY(sign_verify_prepared_key_test),
+    TEST_ENTRY(sign_verify_key_resolver_test),
+    TEST_ENTRY(sign_verify_key_index_test),
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+    TEST_ENTRY(sign_verify_verify_cache_test),
+    TEST_ENTRY(sign_verify_verify_cache_key_test),
+#endif
+    TEST_ENTRY(sign_verify_prepare_test),
+    TEST_ENTRY(sign_verify_prepare_pinned_test),
+    TEST_ENTRY(sign_verify_external_sign_test),
+    TEST_ENTRY(sign_verify_sign_message_test),
+#ifdef T_COSE_ENABLE_ASYNC
+    TEST_ENTRY(sign_verify_async_test),
+#endif
 #endif /* T_COSE_DISABLE_SIGN_VERIFY_TESTS */
 
 #ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
@@ -87,6 +125,18 @@ static test_entry s_tests[] = {
     TEST_ENTRY(tags_test),
     TEST_ENTRY(get_size_test),
     TEST_ENTRY(indef_array_and_map_test),
+    TEST_ENTRY(short_circuit_batch_test),
+    TEST_ENTRY(short_circuit_midstate_test),
+    TEST_ENTRY(short_circuit_header_template_test),
+    TEST_ENTRY(short_circuit_sign_stream_test),
+    TEST_ENTRY(short_circuit_verify_stream_test),
+    TEST_ENTRY(short_circuit_verify_prepare_test),
+    TEST_ENTRY(short_circuit_in_place_test),
+    TEST_ENTRY(short_circuit_encode_payload_test),
+    TEST_ENTRY(short_circuit_external_sign_test),
+#ifdef T_COSE_ENABLE_FILE_IO
+    TEST_ENTRY(short_circuit_file_test),
+#endif
 
 #ifdef T_COSE_ENABLE_HASH_FAIL_TEST
     TEST_ENTRY(short_circuit_hash_fail_test),
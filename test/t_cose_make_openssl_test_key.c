@@ -153,6 +153,34 @@ void free_ecdsa_key_pair(struct t_cose_key key_pair)
 }
 
 
+/*
+ * Public function, see t_cose_make_test_pub_key.h
+ */
+enum t_cose_err_t get_ecdsa_public_key(struct t_cose_key      key_pair,
+                                       struct q_useful_buf    buffer,
+                                       struct q_useful_buf_c *public_key)
+{
+    uint8_t  spki[200];
+    uint8_t *spki_ptr;
+    int      spki_len;
+    size_t   point_len;
+
+    /* The point is at the end of the SubjectPublicKeyInfo */
+    point_len = 1 + 2 * (((size_t)EVP_PKEY_bits(key_pair.k.key_ptr) + 7) / 8);
+    if(i2d_PUBKEY(key_pair.k.key_ptr, NULL) > (int)sizeof(spki)) {
+        return T_COSE_ERR_FAIL;
+    }
+    spki_ptr = spki;
+    spki_len = i2d_PUBKEY(key_pair.k.key_ptr, &spki_ptr);
+    if(spki_len < (int)point_len) {
+        return T_COSE_ERR_FAIL;
+    }
+
+    *public_key = q_useful_buf_copy_ptr(buffer, spki + spki_len - point_len, point_len);
+
+    return q_useful_buf_c_is_null(*public_key) ? T_COSE_ERR_TOO_SMALL : T_COSE_SUCCESS;
+}
+
 /*
  * Public function, see t_cose_make_test_pub_key.h
  */
@@ -168,6 +168,29 @@ void free_ecdsa_key_pair(struct t_cose_key key_pair)
 }
 
 
+/*
+ * Public function, see t_cose_make_test_pub_key.h
+ */
+enum t_cose_err_t get_ecdsa_public_key(struct t_cose_key      key_pair,
+                                       struct q_useful_buf    buffer,
+                                       struct q_useful_buf_c *public_key)
+{
+    psa_status_t crypto_result;
+    size_t       point_len;
+
+    crypto_result = psa_export_public_key((mbedtls_svc_key_id_t)key_pair.k.key_handle,
+                                          buffer.ptr,
+                                          buffer.len,
+                                          &point_len);
+    if(crypto_result != PSA_SUCCESS) {
+        return T_COSE_ERR_FAIL;
+    }
+
+    *public_key = (struct q_useful_buf_c){buffer.ptr, point_len};
+
+    return T_COSE_SUCCESS;
+}
+
 /*
  * Public function, see t_cose_make_test_pub_key.h
  */
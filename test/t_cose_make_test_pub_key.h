@@ -9,6 +9,7 @@
  */
 
 #include "t_cose/t_cose_common.h"
+#include "t_cose/q_useful_buf.h"
 #include <stdint.h>
 
 /**
@@ -30,6 +31,14 @@ enum t_cose_err_t make_ecdsa_key_pair(int32_t            cose_algorithm_id,
 void free_ecdsa_key_pair(struct t_cose_key key_pair);
 
 
+/**
+ * \brief Get the public key of a test key pair as an uncompressed EC point.
+ */
+enum t_cose_err_t get_ecdsa_public_key(struct t_cose_key      key_pair,
+                                       struct q_useful_buf    buffer,
+                                       struct q_useful_buf_c *public_key);
+
+
 /**
  \brief Called by test frame work to see if there were key pair or mem leaks.
 
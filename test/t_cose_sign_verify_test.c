@@ -11,6 +11,10 @@
 #include "t_cose/t_cose_sign1_sign.h"
 #include "t_cose/t_cose_sign1_verify.h"
 #include "t_cose/q_useful_buf.h"
+#include "t_cose/t_cose_kid_cache.h"
+#include "t_cose/t_cose_key_index.h"
+#include "t_cose/t_cose_verify_cache.h"
+#include "t_cose/t_cose_async.h"
 #include "t_cose_make_test_pub_key.h"
 
 #include "t_cose_crypto.h" /* Just for t_cose_crypto_sig_size() */
@@ -114,225 +118,289 @@ int_fast32_t sign_verify_basic_test()
 
 
 /*
- * Public function, see t_cose_sign_verify_test.h
+ * Sign and verify many different payloads with one key. ECDSA r and s
+ * are random so this covers signatures where they have leading zero
+ * bytes or the top bit set, which change the DER encoding used with
+ * some crypto libraries.
  */
-int_fast32_t sign_verify_sig_fail_test()
+static int_fast32_t sign_verify_repeat_alg(int32_t cose_alg, uint32_t count)
 {
     struct t_cose_sign1_sign_ctx   sign_ctx;
-    QCBOREncodeContext             cbor_encode;
-    int32_t                        return_value;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    int_fast32_t                   return_value;
     enum t_cose_err_t              result;
     Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
     struct q_useful_buf_c          signed_cose;
     struct t_cose_key              key_pair;
     struct q_useful_buf_c          payload;
-    QCBORError                     cbor_error;
-    struct t_cose_sign1_verify_ctx verify_ctx;
-    size_t                         tamper_offset;
+    uint32_t                       i;
 
-
-    /* Make an ECDSA key pair that will be used for both signing and
-     * verification.
-     */
-    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    result = make_ecdsa_key_pair(cose_alg, &key_pair);
     if(result) {
         return 1000 + (int32_t)result;
     }
-
-    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
-
-    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_alg);
     t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
 
-    result = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
-    if(result) {
-        return_value = 2000 + (int32_t)result;
-        goto Done;
+    for(i = 0; i < count; i++) {
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   (struct q_useful_buf_c){&i, sizeof(i)},
+                                   signed_cose_buffer,
+                                   &signed_cose);
+        if(result) {
+            return_value = 2000 + (int32_t)result;
+            goto Done;
+        }
+
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+        if(result) {
+            return_value = 3000 + (int32_t)result;
+            goto Done;
+        }
     }
 
-    QCBOREncode_AddSZString(&cbor_encode, "payload");
+    return_value = 0;
 
+Done:
+    free_ecdsa_key_pair(key_pair);
 
-    result = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
-    if(result) {
-        return_value = 3000 + (int32_t)result;
-        goto Done;
-    }
+    return return_value;
+}
 
-    cbor_error = QCBOREncode_Finish(&cbor_encode, &signed_cose);
-    if(cbor_error) {
-        return_value = 4000 + (int32_t)cbor_error;
-        goto Done;
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_repeat_test()
+{
+    int_fast32_t return_value;
+
+    return_value = sign_verify_repeat_alg(T_COSE_ALGORITHM_ES256, 500);
+    if(return_value) {
+        return 20000 + return_value;
     }
 
-    /* tamper with the pay load to see that the signature verification fails */
-    tamper_offset = q_useful_buf_find_bytes(signed_cose, Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"));
-    if(tamper_offset == SIZE_MAX) {
-        return_value = 99;
-        goto Done;
+#ifndef T_COSE_DISABLE_ES512
+    /* The 521-bit r and s often have a leading zero byte */
+    return_value = sign_verify_repeat_alg(T_COSE_ALGORITHM_ES512, 50);
+    if(return_value) {
+        return 50000 + return_value;
     }
-    /* Change "payload" to "hayload" */
-    struct q_useful_buf temp_unconst = q_useful_buf_unconst(signed_cose);
-    ((char *)temp_unconst.ptr)[tamper_offset] = 'h';
+#endif
 
-    t_cose_sign1_verify_init(&verify_ctx, 0);
+    return 0;
+}
 
-    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
 
-    result = t_cose_sign1_verify(&verify_ctx,
-                                 signed_cose,   /* COSE to verify */
-                                &payload,       /* Payload from signed_cose */
-                                 NULL);         /* Don't return parameters */
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_key_change_test()
+{
+#define KEY_CHANGE_KEY_COUNT 6
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct t_cose_key              keys[KEY_CHANGE_KEY_COUNT];
+    struct q_useful_buf_c          payload;
+    size_t                         made;
+    size_t                         i;
+    size_t                         round;
+
+    /* The test keys all have the same value, but each is a separate
+     * key object to the crypto library. There are more than crypto
+     * adapters are likely to cache so some are evicted and made
+     * again. */
+    for(made = 0; made < KEY_CHANGE_KEY_COUNT; made++) {
+        result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &keys[made]);
+        if(result) {
+            return_value = 1000 + (int32_t)result;
+            goto Done;
+        }
+    }
 
-    if(result != T_COSE_ERR_SIG_VERIFY) {
-        return_value = 5000 + (int32_t)result;
+    for(round = 0; round < 3; round++) {
+        for(i = 0; i < KEY_CHANGE_KEY_COUNT; i++) {
+            t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+            t_cose_sign1_set_signing_key(&sign_ctx, keys[i], NULL_Q_USEFUL_BUF_C);
+            result = t_cose_sign1_sign(&sign_ctx,
+                                       Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                       signed_cose_buffer,
+                                       &signed_cose);
+            if(result) {
+                return_value = 2000 + (int32_t)result;
+                goto Done;
+            }
+
+            t_cose_sign1_verify_init(&verify_ctx, 0);
+            t_cose_sign1_set_verification_key(&verify_ctx, keys[i]);
+            result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+            if(result) {
+                return_value = 3000 + (int32_t)result;
+                goto Done;
+            }
+        }
+    }
+
+    /* Free the keys and make new ones that may be at the same
+     * addresses. Nothing cached for the old keys may be used. */
+    for(i = 0; i < KEY_CHANGE_KEY_COUNT; i++) {
+        t_cose_key_release_cached(keys[i]);
+        free_ecdsa_key_pair(keys[i]);
+    }
+    for(made = 0; made < KEY_CHANGE_KEY_COUNT; made++) {
+        result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &keys[made]);
+        if(result) {
+            return_value = 4000 + (int32_t)result;
+            goto Done;
+        }
+    }
+
+    for(i = 0; i < KEY_CHANGE_KEY_COUNT; i++) {
+        t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+        t_cose_sign1_set_signing_key(&sign_ctx, keys[i], NULL_Q_USEFUL_BUF_C);
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                   signed_cose_buffer,
+                                   &signed_cose);
+        if(result) {
+            return_value = 5000 + (int32_t)result;
+            goto Done;
+        }
+
+        t_cose_sign1_verify_init(&verify_ctx, 0);
+        t_cose_sign1_set_verification_key(&verify_ctx, keys[i]);
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+        if(result) {
+            return_value = 6000 + (int32_t)result;
+            goto Done;
+        }
     }
 
     return_value = 0;
 
 Done:
-    free_ecdsa_key_pair(key_pair);
+    for(i = 0; i < made; i++) {
+        t_cose_key_release_cached(keys[i]);
+        free_ecdsa_key_pair(keys[i]);
+    }
 
     return return_value;
 }
 
 
 /*
- * Public function, see t_cose_sign_verify_test.h
+ * Prepare a key for one algorithm and use it for signing, verification
+ * and signature size, checking it against the same key unprepared.
  */
-int_fast32_t sign_verify_make_cwt_test()
+static int_fast32_t sign_verify_prepared_key_test_alg(int32_t cose_alg,
+                                                      int32_t other_alg)
 {
     struct t_cose_sign1_sign_ctx   sign_ctx;
-    QCBOREncodeContext             cbor_encode;
-    int32_t                        return_value;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    int_fast32_t                   return_value;
     enum t_cose_err_t              result;
     Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
     struct q_useful_buf_c          signed_cose;
-    struct t_cose_key              key_pair;
     struct q_useful_buf_c          payload;
-    QCBORError                     cbor_error;
-    struct t_cose_sign1_verify_ctx verify_ctx;
-    struct q_useful_buf_c          expected_rfc8392_first_part;
-    struct q_useful_buf_c          expected_payload;
-    struct q_useful_buf_c          actual_rfc8392_first_part;
-
-    /* -- initialize for signing --
-     *  No special options selected
-     */
-    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
-
+    struct t_cose_key              key_pair;
+    struct t_cose_prepared_key     prepared;
+    struct t_cose_key              prepared_key;
+    size_t                         sig_size;
+    size_t                         prepared_sig_size;
 
-    /* -- Key and kid --
-     * The ECDSA key pair made is both for signing and verification.
-     * The kid comes from RFC 8932
-     */
-    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    result = make_ecdsa_key_pair(cose_alg, &key_pair);
     if(result) {
         return 1000 + (int32_t)result;
     }
-    t_cose_sign1_set_signing_key(&sign_ctx,
-                                  key_pair,
-                                  Q_USEFUL_BUF_FROM_SZ_LITERAL("AsymmetricECDSA256"));
-
 
-    /* -- Encoding context and output of parameters -- */
-    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
-    result = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    result = t_cose_key_prepare(key_pair, &prepared);
     if(result) {
         return_value = 2000 + (int32_t)result;
         goto Done;
     }
+    if(prepared.cose_algorithm_id != cose_alg) {
+        return_value = 2100;
+        goto Done;
+    }
+    prepared_key = t_cose_key_from_prepared(&prepared);
 
-
-    /* -- The payload as from RFC 8932 -- */
-    QCBOREncode_OpenMap(&cbor_encode);
-    QCBOREncode_AddSZStringToMapN(&cbor_encode, 1, "coap://as.example.com");
-    QCBOREncode_AddSZStringToMapN(&cbor_encode, 2, "erikw");
-    QCBOREncode_AddSZStringToMapN(&cbor_encode, 3, "coap://light.example.com");
-    QCBOREncode_AddInt64ToMapN(&cbor_encode, 4, 1444064944);
-    QCBOREncode_AddInt64ToMapN(&cbor_encode, 5, 1443944944);
-    QCBOREncode_AddInt64ToMapN(&cbor_encode, 6, 1443944944);
-    const uint8_t xx[] = {0x0b, 0x71};
-    QCBOREncode_AddBytesToMapN(&cbor_encode, 7,
-                               Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(xx));
-    QCBOREncode_CloseMap(&cbor_encode);
-
-
-    /* -- Finish up the COSE_Sign1. This is where the signing happens -- */
-    result = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+    /* The cached size must be what is worked out for the plain key */
+    result = t_cose_crypto_sig_size(cose_alg, key_pair, &sig_size);
     if(result) {
         return_value = 3000 + (int32_t)result;
         goto Done;
     }
-
-    /* Finally close off the CBOR formatting and get the pointer and length
-     * of the resulting COSE_Sign1
-     */
-    cbor_error = QCBOREncode_Finish(&cbor_encode, &signed_cose);
-    if(cbor_error) {
-        return_value = (int32_t)cbor_error + 4000;
+    result = t_cose_crypto_sig_size(cose_alg, prepared_key, &prepared_sig_size);
+    if(result) {
+        return_value = 3100 + (int32_t)result;
+        goto Done;
+    }
+    if(sig_size != prepared_sig_size || sig_size != prepared.sig_size) {
+        return_value = 3200;
         goto Done;
     }
-    /* --- Done making COSE Sign1 object  --- */
-
 
-    /* Compare to expected from CWT RFC */
-    /* The first part, the intro and protected parameters must be the same */
-    const uint8_t rfc8392_first_part_bytes[] = {
-        0xd2, 0x84, 0x43, 0xa1, 0x01, 0x26, 0xa1, 0x04, 0x52, 0x41, 0x73, 0x79,
-        0x6d, 0x6d, 0x65, 0x74, 0x72, 0x69, 0x63, 0x45, 0x43, 0x44, 0x53, 0x41,
-        0x32, 0x35, 0x36, 0x58, 0x50, 0xa7, 0x01, 0x75, 0x63, 0x6f, 0x61, 0x70,
-        0x3a, 0x2f, 0x2f, 0x61, 0x73, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c,
-        0x65, 0x2e, 0x63, 0x6f, 0x6d, 0x02, 0x65, 0x65, 0x72, 0x69, 0x6b, 0x77,
-        0x03, 0x78, 0x18, 0x63, 0x6f, 0x61, 0x70, 0x3a, 0x2f, 0x2f, 0x6c, 0x69,
-        0x67, 0x68, 0x74, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e,
-        0x63, 0x6f, 0x6d, 0x04, 0x1a, 0x56, 0x12, 0xae, 0xb0, 0x05, 0x1a, 0x56,
-        0x10, 0xd9, 0xf0, 0x06, 0x1a, 0x56, 0x10, 0xd9, 0xf0, 0x07, 0x42, 0x0b,
-        0x71};
-    expected_rfc8392_first_part = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(rfc8392_first_part_bytes);
-    actual_rfc8392_first_part = q_useful_buf_head(signed_cose, sizeof(rfc8392_first_part_bytes));
-    if(q_useful_buf_compare(actual_rfc8392_first_part, expected_rfc8392_first_part)) {
-        return_value = -1;
+    /* Sign with the prepared key, verify with the plain key */
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_alg);
+    t_cose_sign1_set_signing_key(&sign_ctx, prepared_key, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                               signed_cose_buffer,
+                               &signed_cose);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
         goto Done;
     }
 
-    /* --- Start verifying the COSE Sign1 object  --- */
-    /* Run the signature verification */
     t_cose_sign1_verify_init(&verify_ctx, 0);
-
     t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
-
-    result =  t_cose_sign1_verify(&verify_ctx,
-                                        signed_cose, /* COSE to verify */
-                                       &payload, /* Payload from signed_cose */
-                                        NULL);  /* Don't return parameters */
-
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
     if(result) {
         return_value = 5000 + (int32_t)result;
         goto Done;
     }
 
-    /* Format the expected payload CBOR fragment */
-
-    /* Skip the key id, because this has the short-circuit key id */
-    const size_t kid_encoded_len =
-      1 +
-      1 +
-      1 +
-      strlen("AsymmetricECDSA256"); // length of short-circuit key id
+    /* Sign with the plain key, verify with the prepared key */
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_alg);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                               signed_cose_buffer,
+                               &signed_cose);
+    if(result) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
 
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, prepared_key);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result) {
+        return_value = 7000 + (int32_t)result;
+        goto Done;
+    }
 
-    /* compare payload output to the one expected */
-    expected_payload = q_useful_buf_tail(expected_rfc8392_first_part, kid_encoded_len + 8);
-    if(q_useful_buf_compare(payload, expected_payload)) {
-        return_value = 6000;
+    /* A prepared key can't be used with another algorithm */
+    t_cose_sign1_sign_init(&sign_ctx, 0, other_alg);
+    t_cose_sign1_set_signing_key(&sign_ctx, prepared_key, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                               signed_cose_buffer,
+                               &signed_cose);
+    if(result != T_COSE_ERR_WRONG_TYPE_OF_KEY) {
+        return_value = 8000 + (int32_t)result;
+        goto Done;
     }
-    /* --- Done verifying the COSE Sign1 object  --- */
 
     return_value = 0;
 
 Done:
-    /* Many crypto libraries allocate memory, slots, etc for keys */
     free_ecdsa_key_pair(key_pair);
 
     return return_value;
@@ -342,325 +410,2034 @@ Done:
 /*
  * Public function, see t_cose_sign_verify_test.h
  */
-static int size_test(int32_t               cose_algorithm_id,
-                     struct q_useful_buf_c kid,
-                     struct t_cose_key     key_pair)
+int_fast32_t sign_verify_prepared_key_test()
 {
-    struct t_cose_sign1_sign_ctx   sign_ctx;
-    QCBOREncodeContext             cbor_encode;
-    enum t_cose_err_t              return_value;
-    struct q_useful_buf            nil_buf;
-    size_t                         calculated_size;
-    QCBORError                     cbor_error;
-    struct q_useful_buf_c          actual_signed_cose;
-    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
-    struct q_useful_buf_c          payload;
-    size_t                         sig_size;
-
-    /* ---- Common Set up ---- */
-    payload = Q_USEFUL_BUF_FROM_SZ_LITERAL("payload");
-    return_value = t_cose_crypto_sig_size(cose_algorithm_id, key_pair, &sig_size);
-
-    /* ---- First calculate the size ----- */
-    nil_buf = (struct q_useful_buf) {NULL, INT32_MAX};
-    QCBOREncode_Init(&cbor_encode, nil_buf);
-
-    t_cose_sign1_sign_init(&sign_ctx,  0,  cose_algorithm_id);
-    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
+    int_fast32_t                return_value;
+    enum t_cose_err_t           result;
+    struct t_cose_prepared_key  prepared;
+    struct t_cose_key           null_key = T_COSE_NULL_KEY;
+
+    result = t_cose_key_prepare(null_key, &prepared);
+    if(result != T_COSE_ERR_INCORRECT_KEY_FOR_LIB) {
+        return 10000 + (int32_t)result;
+    }
 
-    return_value = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    return_value = sign_verify_prepared_key_test_alg(T_COSE_ALGORITHM_ES256,
+                                                     T_COSE_ALGORITHM_ES512);
     if(return_value) {
-        return 2000 + (int32_t)return_value;
+        return 20000 + return_value;
     }
 
-    QCBOREncode_AddEncoded(&cbor_encode, payload);
-
-    return_value = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+#ifndef T_COSE_DISABLE_ES384
+    return_value = sign_verify_prepared_key_test_alg(T_COSE_ALGORITHM_ES384,
+                                                     T_COSE_ALGORITHM_ES256);
     if(return_value) {
-        return 3000 + (int32_t)return_value;
+        return 30000 + return_value;
     }
+#endif
 
-    cbor_error = QCBOREncode_FinishGetSize(&cbor_encode, &calculated_size);
-    if(cbor_error) {
-        return 4000 + (int32_t)cbor_error;
+#ifndef T_COSE_DISABLE_ES512
+    return_value = sign_verify_prepared_key_test_alg(T_COSE_ALGORITHM_ES512,
+                                                     T_COSE_ALGORITHM_ES256);
+    if(return_value) {
+        return 50000 + return_value;
     }
+#endif
 
-    /* ---- General sanity check ---- */
-    size_t expected_min = sig_size + payload.len + kid.len;
+    return 0;
+}
 
-    if(calculated_size < expected_min || calculated_size > expected_min + 30) {
-        return -1;
-    }
 
+/* The keys that test_key_table_resolver() looks up by kid */
+struct test_key_table {
+    struct t_cose_key key_1;
+    struct t_cose_key key_2;
+    int               resolved;
+};
 
 
-    /* ---- Now make a real COSE_Sign1 and compare the size ---- */
-    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
-
-    t_cose_sign1_sign_init(&sign_ctx,  0,  cose_algorithm_id);
-    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
-
-    return_value = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
-    if(return_value) {
-        return 2000 + (int32_t)return_value;
-    }
-
-    QCBOREncode_AddEncoded(&cbor_encode, payload);
+static enum t_cose_err_t
+test_key_table_resolver(void                  *cb_context,
+                        int32_t                cose_algorithm_id,
+                        struct q_useful_buf_c  kid,
+                        struct t_cose_key     *key)
+{
+    struct test_key_table *table = (struct test_key_table *)cb_context;
 
-    return_value = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
-    if(return_value) {
-        return 3000 + (int32_t)return_value;
-    }
+    (void)cose_algorithm_id;
 
-    cbor_error = QCBOREncode_Finish(&cbor_encode, &actual_signed_cose);
-    if(actual_signed_cose.len != calculated_size) {
-        return -2;
+    table->resolved++;
+    if(!q_useful_buf_compare(kid, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"))) {
+        *key = table->key_1;
+    } else if(!q_useful_buf_compare(kid, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-2"))) {
+        *key = table->key_2;
+    } else {
+        return T_COSE_ERR_UNKNOWN_KEY;
     }
+    return T_COSE_SUCCESS;
+}
 
-    /* ---- Again with one-call API to make COSE_Sign1 ---- */\
-    t_cose_sign1_sign_init(&sign_ctx, 0, cose_algorithm_id);
-    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
-    return_value = t_cose_sign1_sign(&sign_ctx,
-                                     payload,
-                                     signed_cose_buffer,
-                                     &actual_signed_cose);
-    if(return_value) {
-        return 7000 + (int32_t)return_value;
-    }
 
-    if(actual_signed_cose.len != calculated_size) {
-        return -3;
-    }
+static enum t_cose_err_t
+sign_with_kid(struct t_cose_key      key,
+              const char            *kid,
+              struct q_useful_buf    buffer,
+              struct q_useful_buf_c *signed_cose)
+{
+    struct t_cose_sign1_sign_ctx sign_ctx;
 
-    return 0;
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key, q_useful_buf_from_sz(kid));
+    return t_cose_sign1_sign(&sign_ctx,
+                             Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                             buffer,
+                             signed_cose);
 }
 
 
 /*
  * Public function, see t_cose_sign_verify_test.h
  */
-int_fast32_t sign_verify_get_size_test()
+int_fast32_t sign_verify_key_resolver_test()
 {
-    enum t_cose_err_t   return_value;
-    struct t_cose_key   key_pair;
-    int32_t             result;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_kid_cache        cache;
+    struct test_key_table          table;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          payload;
+    int                            i;
 
-    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
-    if(return_value) {
-        return 1000 + (int32_t)return_value;
+    table.resolved = 0;
+    t_cose_kid_cache_init(&cache, test_key_table_resolver, NULL, &table);
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
     }
-
-    result = size_test(T_COSE_ALGORITHM_ES256, NULL_Q_USEFUL_BUF_C, key_pair);
-    free_ecdsa_key_pair(key_pair);
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_2);
     if(result) {
-        return 2000 + result;
+        free_ecdsa_key_pair(table.key_1);
+        return 1100 + (int32_t)result;
     }
 
-
-#ifndef T_COSE_DISABLE_ES384
-
-    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES384, &key_pair);
-    if(return_value) {
-        return 3000 + (int32_t)return_value;
+    /* --- The resolver finds the key by kid in one pass --- */
+    result = sign_with_kid(table.key_2, "key-2", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
     }
-
-    result = size_test(T_COSE_ALGORITHM_ES384, NULL_Q_USEFUL_BUF_C, key_pair);
-    free_ecdsa_key_pair(key_pair);
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
     if(result) {
-        return 4000 + result;
+        return_value = 2100 + (int32_t)result;
+        goto Done;
+    }
+    if(table.resolved != 1) {
+        return_value = 2200;
+        goto Done;
     }
 
-#endif /* T_COSE_DISABLE_ES384 */
-
-
-#ifndef T_COSE_DISABLE_ES512
-
-    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES512, &key_pair);
-    if(return_value) {
-        return 5000 + (int32_t)return_value;
+    /* --- Through the kid cache the resolver is called once --- */
+    t_cose_sign1_set_key_resolver(&verify_ctx, t_cose_kid_cache_resolve, &cache);
+    table.resolved = 0;
+    for(i = 0; i < 3; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+        if(result) {
+            return_value = 3000 + (int32_t)result;
+            goto Done;
+        }
+    }
+    if(table.resolved != 1) {
+        return_value = 3100;
+        goto Done;
     }
 
-    result = size_test(T_COSE_ALGORITHM_ES512, NULL_Q_USEFUL_BUF_C, key_pair);
+    /* --- An unknown kid fails without a verification key --- */
+    result = sign_with_kid(table.key_1, "key-9", signed_cose_buffer, &signed_cose);
     if(result) {
-        free_ecdsa_key_pair(key_pair);
-        return 6000 + result;
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result != T_COSE_ERR_UNKNOWN_KEY) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
     }
 
-    result = size_test(T_COSE_ALGORITHM_ES512,
-                       Q_USEFUL_BUF_FROM_SZ_LITERAL("greasy kid stuff"),
-                       key_pair);
-    free_ecdsa_key_pair(key_pair);
-    if(result) {
-        return 7000 + result;
+    /* --- The resolver takes precedence over a set key --- */
+    t_cose_sign1_set_verification_key(&verify_ctx, table.key_1);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result != T_COSE_ERR_UNKNOWN_KEY) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
     }
 
-#endif /* T_COSE_DISABLE_ES512 */
+    return_value = 0;
 
+Done:
+    t_cose_kid_cache_clear(&cache);
+    free_ecdsa_key_pair(table.key_1);
+    free_ecdsa_key_pair(table.key_2);
 
-    return 0;
+    return return_value;
 }
 
 
-/* These are complete known-good COSE messages for a verification
- * test. The key used to verify them is made by make_ecdsa_key_pair().
- * It always makes the same key for both MbedTLS and OpenSSL.
- *
- * These were made by setting a break point in sign_verify_basic_test()
- * and copying the output of the signing.
+/*
+ * Public function, see t_cose_sign_verify_test.h
  */
-static const uint8_t signed_cose_made_by_ossl_crypto_256[] = {
-    0xD2, 0x84, 0x43, 0xA1, 0x01, 0x26, 0xA0, 0x47,
-    0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64, 0x58,
-    0x40, 0xF2, 0x2B, 0xAE, 0x15, 0xA8, 0xA6, 0x7A,
-    0x60, 0x6B, 0x0B, 0xEA, 0xCB, 0xB6, 0x21, 0xD0,
-    0xA0, 0xAC, 0x99, 0xCE, 0x2A, 0xD3, 0xD8, 0x1F,
-    0xA5, 0x25, 0x77, 0x04, 0x8C, 0x27, 0xF8, 0x7F,
-    0xF2, 0x25, 0x78, 0xFA, 0xDE, 0xED, 0xB0, 0xFB,
-    0xC7, 0xB3, 0x31, 0xCF, 0x4F, 0x5C, 0xC8, 0x25,
-    0xDE, 0xFD, 0x2D, 0xB9, 0xF3, 0x6C, 0xD7, 0xCB,
-    0x69, 0x53, 0xCB, 0x05, 0xE3, 0x60, 0xAC, 0x98,
-    0xE6};
-
-#ifndef T_COSE_DISABLE_ES384
-static const uint8_t signed_cose_made_by_psa_crypto_384[] = {
-    0xD2, 0x84, 0x44, 0xA1, 0x01, 0x38, 0x22, 0xA0,
-    0x47, 0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64,
-    0x58, 0x60, 0x2C, 0x6C, 0x08, 0xF3, 0x36, 0x9E,
-    0x35, 0x7A, 0x6B, 0xE5, 0xD6, 0x6E, 0xF9, 0x30,
-    0x06, 0x2B, 0xD8, 0x73, 0xAB, 0x7E, 0x9B, 0x9D,
-    0x4A, 0x30, 0xDD, 0x62, 0x75, 0xE5, 0xD6, 0x61,
-    0x39, 0xF7, 0x4D, 0xC3, 0x7C, 0xF0, 0xEB, 0x58,
-    0x9D, 0x78, 0xCA, 0x70, 0xD3, 0xA2, 0xF9, 0x23,
-    0x85, 0xE6, 0x45, 0x18, 0x04, 0xBE, 0x9F, 0xA0,
-    0xE3, 0x97, 0x4A, 0x12, 0x82, 0xF2, 0x87, 0x4F,
-    0x3B, 0xF6, 0x9D, 0xC3, 0xE2, 0x99, 0xCC, 0x67,
-    0x69, 0x34, 0xDB, 0x1C, 0xF4, 0xAF, 0x95, 0x83,
-    0x74, 0x1B, 0x5C, 0xCD, 0xD5, 0x11, 0xC1, 0x07,
-    0xE2, 0xD9, 0x3B, 0x16, 0x31, 0x5A, 0x55, 0x58,
-    0x6C, 0xC9};
-#endif /* T_COSE_DISABLE_ES384 */
-
-
-#ifndef T_COSE_DISABLE_ES512
-static const uint8_t signed_cose_made_by_openssl_crypto_521[] = {
-    0xD2, 0x84, 0x44, 0xA1, 0x01, 0x38, 0x23, 0xA0,
-    0x47, 0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64,
-    0x58, 0x84, 0x01, 0x54, 0x10, 0x66, 0x49, 0x6B,
-    0x8B, 0xDC, 0xB0, 0xCE, 0x03, 0x73, 0x30, 0x01,
-    0x92, 0xF1, 0xE3, 0x18, 0x37, 0xF1, 0x91, 0xC1,
-    0x57, 0xB5, 0x13, 0xB8, 0x30, 0x10, 0xA6, 0xA6,
-    0x29, 0xDC, 0x74, 0xA0, 0x5E, 0x39, 0xC8, 0x2F,
-    0x2B, 0x5D, 0x1C, 0xDB, 0x90, 0x47, 0x50, 0xA0,
-    0x97, 0x47, 0x0E, 0x99, 0x66, 0x6F, 0xC4, 0xA5,
-    0xBB, 0xD7, 0xF7, 0x99, 0xD3, 0x87, 0x7A, 0x1B,
-    0x03, 0xCA, 0x6A, 0xDB, 0x01, 0x04, 0xB5, 0x9D,
-    0xB6, 0x18, 0xE9, 0x2A, 0xD2, 0x0A, 0x32, 0x05,
-    0x88, 0xDA, 0x7D, 0xB8, 0xAD, 0x7A, 0xCE, 0x5F,
-    0x49, 0x1F, 0xBD, 0xF3, 0x98, 0xDE, 0x44, 0x05,
-    0x38, 0xD0, 0x2C, 0x12, 0x83, 0x09, 0x7A, 0xF8,
-    0xE8, 0x5F, 0xA7, 0x33, 0xA3, 0xE3, 0xE9, 0x35,
-    0x11, 0x22, 0x48, 0x09, 0xA2, 0x95, 0x6C, 0x9B,
-    0x97, 0xA9, 0xE9, 0xBF, 0xA8, 0x63, 0x73, 0x88,
-    0x24, 0xB0, 0x84, 0x46, 0xA8, 0x90};
-#endif /* T_COSE_DISABLE_ES512 */
-
-
-int_fast32_t known_good_test(void)
+int_fast32_t sign_verify_key_index_test()
 {
-    int32_t                        return_value;
-    enum t_cose_err_t              result;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_kid_cache        cache;
+    struct t_cose_key_index        index;
+    struct t_cose_key_index_entry  entries[2];
     struct t_cose_key              key_pair;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    public_key_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(    index_buffer, 500);
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          public_key;
+    struct q_useful_buf_c          encoded;
+    struct q_useful_buf_c          signed_cose;
     struct q_useful_buf_c          payload;
-    struct t_cose_sign1_verify_ctx verify_ctx;
-    struct q_useful_buf_c          valid_message;
-
-    /* Improvement: rewrite this to fetch the algorithm header and
-     * look up the key from it, so the generalizes to all sorts of
-     * good known inputs for all sorts of algorithms. (Could do key id
-     * too...) But for now this accomplishes what is needed.
-     */
 
     result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
     if(result) {
-        return_value = 1000 + (int32_t)result;
-        goto Done;
+        return 1000 + (int32_t)result;
     }
+    t_cose_kid_cache_init(&cache, t_cose_key_index_resolve, t_cose_key_index_free_key, &index);
 
-    t_cose_sign1_verify_init(&verify_ctx, 0);
-
-    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
-
-    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_ossl_crypto_256);
-    result = t_cose_sign1_verify(&verify_ctx,
-                                  valid_message, /* COSE to verify */
-                                 &payload,       /* Payload from signed_cose */
-                                  NULL);         /* Don't return parameters */
-     if(result) {
-         return_value = 5000 + (int32_t)result;
-         goto Done;
-     }
-
-    free_ecdsa_key_pair(key_pair);
-
-#ifndef T_COSE_DISABLE_ES384
-    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES384, &key_pair);
+    /* The second entry claims the same point is for another algorithm */
+    result = get_ecdsa_public_key(key_pair, public_key_buffer, &public_key);
     if(result) {
         return_value = 1100 + (int32_t)result;
         goto Done;
     }
-
-    t_cose_sign1_verify_init(&verify_ctx, 0);
-
-    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
-
-    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_psa_crypto_384);
-
-    result = t_cose_sign1_verify(&verify_ctx,
-                                 valid_message, /* COSE to verify */
-                                &payload,       /* Payload from signed_cose */
-                                 NULL);         /* Don't return parameters */
+    entries[0].kid               = Q_USEFUL_BUF_FROM_SZ_LITERAL("dev-1");
+    entries[0].cose_algorithm_id = T_COSE_ALGORITHM_ES256;
+    entries[0].public_key        = public_key;
+    entries[1].kid               = Q_USEFUL_BUF_FROM_SZ_LITERAL("dev-2");
+    entries[1].cose_algorithm_id = T_COSE_ALGORITHM_ES384;
+    entries[1].public_key        = public_key;
+    result = t_cose_key_index_encode(entries, 2, index_buffer, &encoded);
     if(result) {
-        return_value = 5100 + (int32_t)result;
+        return_value = 1200 + (int32_t)result;
         goto Done;
     }
-
-    free_ecdsa_key_pair(key_pair);
-#endif /* T_COSE_DISABLE_ES384 */
-
-
-#ifndef T_COSE_DISABLE_ES512
-    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES512, &key_pair);
+    result = t_cose_key_index_init_buffer(&index, encoded);
     if(result) {
-        return_value = 1200 + (int32_t)result;
+        return_value = 1300 + (int32_t)result;
         goto Done;
     }
 
+    /* --- The key is imported from the index and verifies --- */
+    result = sign_with_kid(key_pair, "dev-1", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
     t_cose_sign1_verify_init(&verify_ctx, 0);
-
-    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
-
-    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_openssl_crypto_521);
-
-    result = t_cose_sign1_verify(&verify_ctx,
-                                 valid_message, /* COSE to verify */
-                                &payload,       /* Payload from signed_cose */
-                                 NULL);         /* Don't return parameters */
+    t_cose_sign1_set_key_resolver(&verify_ctx, t_cose_kid_cache_resolve, &cache);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
     if(result) {
-        return_value = 5200 + (int32_t)result;
+        return_value = 2100 + (int32_t)result;
         goto Done;
     }
 
-    free_ecdsa_key_pair(key_pair);
-#endif /* T_COSE_DISABLE_ES512 */
+    /* --- A key for another algorithm is not imported --- */
+    result = sign_with_kid(key_pair, "dev-2", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result != T_COSE_ERR_WRONG_TYPE_OF_KEY) {
+        return_value = 3100 + (int32_t)result;
+        goto Done;
+    }
 
-    /* Can't make signed messages and compare them to a known good
-     * value because ECDSA signature have a random component. They are
-     * never the same. There are other tests here that evaluate the
-     * structure of the signed messages and there tests that verify
-     * messages made by the signing function. */
+    /* --- A kid not in the index is unknown --- */
+    result = sign_with_kid(key_pair, "dev-3", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result != T_COSE_ERR_UNKNOWN_KEY) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
 
     return_value = 0;
 
 Done:
+    /* Frees the imported keys */
+    t_cose_kid_cache_clear(&cache);
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_verify_cache_test()
+{
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    static struct t_cose_verify_cache verify_cache;
+    struct test_key_table          table;
+    struct test_key_table          other_table;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    Q_USEFUL_BUF_MAKE_STACK_UB(    copy_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          copy;
+    struct q_useful_buf_c          payload;
+    struct t_cose_parameters       parameters;
+    int                            i;
+
+    table.resolved = 0;
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    table.key_2 = table.key_1;
+    other_table = table;
+
+    result = sign_with_kid(table.key_1, "key-1", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Only the first verification finds the key --- */
+    t_cose_verify_cache_init(&verify_cache, 300);
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    for(i = 0; i < 3; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result) {
+            return_value = 2000 + (int32_t)result;
+            goto Done;
+        }
+        if(q_useful_buf_compare(payload, Q_USEFUL_BUF_FROM_SZ_LITERAL("payload")) ||
+           q_useful_buf_compare(parameters.kid, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1")) ||
+           parameters.cose_algorithm_id != T_COSE_ALGORITHM_ES256) {
+            return_value = 2100;
+            goto Done;
+        }
+    }
+    if(table.resolved != 1) {
+        return_value = 2200;
+        goto Done;
+    }
+
+    /* --- A hit returns pointers into the message passed in --- */
+    copy = q_useful_buf_copy(copy_buffer, signed_cose);
+    result = t_cose_sign1_verify(&verify_ctx, copy, &payload, &parameters);
+    if(result || table.resolved != 1) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    if((const uint8_t *)payload.ptr < (const uint8_t *)copy.ptr ||
+       (const uint8_t *)payload.ptr >= (const uint8_t *)copy.ptr + copy.len ||
+       (const uint8_t *)parameters.kid.ptr < (const uint8_t *)copy.ptr ||
+       (const uint8_t *)parameters.kid.ptr >= (const uint8_t *)copy.ptr + copy.len) {
+        return_value = 3100;
+        goto Done;
+    }
+
+    /* --- Failures aren't cached --- */
+    ((uint8_t *)copy_buffer.ptr)[copy.len - 1] ^= 0x01;
+    for(i = 0; i < 2; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, copy, &payload, &parameters);
+        if(result != T_COSE_ERR_SIG_VERIFY) {
+            return_value = 4000 + (int32_t)result;
+            goto Done;
+        }
+    }
+    if(table.resolved != 3) {
+        return_value = 4100;
+        goto Done;
+    }
+
+    /* --- Another resolver context, AAD or options is a miss --- */
+    table.resolved = 0;
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &other_table);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result || other_table.resolved != 1) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    result = t_cose_sign1_verify_aad(&verify_ctx,
+                                     signed_cose,
+                                     Q_USEFUL_BUF_FROM_SZ_LITERAL("aad"),
+                                     &payload,
+                                     &parameters);
+    if(result != T_COSE_ERR_SIG_VERIFY || table.resolved != 1) {
+        return_value = 5100 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_REQUIRE_KID);
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result || table.resolved != 2) {
+        return_value = 5200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Clearing empties the cache --- */
+    t_cose_verify_cache_clear(&verify_cache);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result || table.resolved != 3) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- A time to live of 0 caches nothing --- */
+    t_cose_verify_cache_init(&verify_cache, 0);
+    for(i = 0; i < 2; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result) {
+            return_value = 7000 + (int32_t)result;
+            goto Done;
+        }
+    }
+    if(table.resolved != 5) {
+        return_value = 7100;
+        goto Done;
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(table.key_1);
+
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_verify_cache_key_test()
+{
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    static struct t_cose_verify_cache verify_cache;
+    struct t_cose_key              key_1;
+    struct t_cose_key              key_2;
+    struct t_cose_prepared_key     prepared;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          payload;
+    struct t_cose_parameters       parameters;
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_2);
+    if(result) {
+        free_ecdsa_key_pair(key_1);
+        return 1100 + (int32_t)result;
+    }
+    result = sign_with_kid(key_1, "key-1", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 1200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Verifying through a prepared key caches the message --- */
+    t_cose_verify_cache_init(&verify_cache, 300);
+    result = t_cose_key_prepare(key_1, &prepared);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, t_cose_key_from_prepared(&prepared));
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result) {
+        return_value = 2100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Another key at the same address is a miss --- */
+    result = t_cose_key_prepare(key_2, &prepared);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 3100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- So is a key made after freeing the one that verified,
+     * which the crypto library may well put at the same address --- */
+    t_cose_sign1_set_verification_key(&verify_ctx, key_1);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    free_ecdsa_key_pair(key_1);
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_1);
+    if(result) {
+        key_1 = T_COSE_NULL_KEY;
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_set_verification_key(&verify_ctx, key_1);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 4200 + (int32_t)result;
+        goto Done;
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(key_1);
+    free_ecdsa_key_pair(key_2);
+
+    return return_value;
+}
+#endif /* T_COSE_ENABLE_VERIFY_CACHE */
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_batch_test()
+{
+#define SIGN_VERIFY_BATCH_COUNT 10
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    int32_t                        return_value;
+    enum t_cose_err_t              result;
+    struct t_cose_key              key_pair;
+    struct q_useful_buf_c          payloads[SIGN_VERIFY_BATCH_COUNT];
+    struct q_useful_buf            out_bufs[SIGN_VERIFY_BATCH_COUNT];
+    struct q_useful_buf_c          results[SIGN_VERIFY_BATCH_COUNT];
+    enum t_cose_err_t              item_errors[SIGN_VERIFY_BATCH_COUNT];
+    uint8_t                        out_storage[SIGN_VERIFY_BATCH_COUNT][150];
+    struct q_useful_buf_c          payload;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    size_t                         i;
+    struct q_useful_buf_c          all_payloads =
+                      Q_USEFUL_BUF_FROM_SZ_LITERAL("payload payload payload");
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    for(i = 0; i < SIGN_VERIFY_BATCH_COUNT; i++) {
+        payloads[i] = q_useful_buf_head(all_payloads, 7 + i);
+        out_bufs[i] = (struct q_useful_buf){out_storage[i], sizeof(out_storage[i])};
+    }
+
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+
+    result = t_cose_sign1_sign_batch(&sign_ctx,
+                                     payloads,
+                                     out_bufs,
+                                     results,
+                                     item_errors,
+                                     SIGN_VERIFY_BATCH_COUNT);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    for(i = 0; i < SIGN_VERIFY_BATCH_COUNT; i++) {
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            return_value = 3000 + (int32_t)item_errors[i];
+            goto Done;
+        }
+
+        result = t_cose_sign1_verify(&verify_ctx,
+                                     results[i],
+                                    &payload,
+                                     NULL);
+        if(result) {
+            return_value = 4000 + (int32_t)result;
+            goto Done;
+        }
+
+        if(q_useful_buf_compare(payload, payloads[i])) {
+            return_value = 5000 + (int32_t)i;
+            goto Done;
+        }
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+#define VERIFY_BATCH_COUNT 12
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_verify_batch_test()
+{
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct test_key_table          table;
+    int_fast32_t                   return_value;
+    enum t_cose_err_t              result;
+    static uint8_t                 cose_buffers[VERIFY_BATCH_COUNT][300];
+    struct q_useful_buf_c          cose_sign1s[VERIFY_BATCH_COUNT];
+    struct q_useful_buf_c          payloads[VERIFY_BATCH_COUNT];
+    struct t_cose_parameters       parameters[VERIFY_BATCH_COUNT];
+    enum t_cose_err_t              item_errors[VERIFY_BATCH_COUNT];
+    static const char             *kids[3] = {"key-1", "key-2", "key-3"};
+    int                            i;
+
+    table.resolved = 0;
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_2);
+    if(result) {
+        free_ecdsa_key_pair(table.key_1);
+        return 1100 + (int32_t)result;
+    }
+
+    /* Every third message has a kid the resolver doesn't know */
+    for(i = 0; i < VERIFY_BATCH_COUNT; i++) {
+        result = sign_with_kid(i % 3 == 1 ? table.key_2 : table.key_1,
+                               kids[i % 3],
+                               Q_USEFUL_BUF_FROM_BYTE_ARRAY(cose_buffers[i]),
+                               &cose_sign1s[i]);
+        if(result) {
+            return_value = 1200 + (int32_t)result;
+            goto Done;
+        }
+    }
+    cose_buffers[4][cose_sign1s[4].len - 1] ^= 0x01;
+
+    /* --- Each message gets the key for its kid --- */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    result = t_cose_sign1_verify_batch(&verify_ctx,
+                                       cose_sign1s,
+                                       NULL,
+                                       payloads,
+                                       parameters,
+                                       item_errors,
+                                       VERIFY_BATCH_COUNT);
+    if(result != T_COSE_ERR_UNKNOWN_KEY) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    if(table.resolved != VERIFY_BATCH_COUNT) {
+        return_value = 2100 + table.resolved;
+        goto Done;
+    }
+    for(i = 0; i < VERIFY_BATCH_COUNT; i++) {
+        if(i % 3 == 2) {
+            result = item_errors[i] == T_COSE_ERR_UNKNOWN_KEY ? T_COSE_SUCCESS : item_errors[i];
+        } else if(i == 4) {
+            result = item_errors[i] == T_COSE_ERR_SIG_VERIFY ? T_COSE_SUCCESS : item_errors[i];
+        } else {
+            result = item_errors[i];
+            if(result == T_COSE_SUCCESS &&
+               (q_useful_buf_compare(payloads[i], Q_USEFUL_BUF_FROM_SZ_LITERAL("payload")) ||
+                q_useful_buf_compare(parameters[i].kid, q_useful_buf_from_sz(kids[i % 3])))) {
+                result = T_COSE_ERR_FAIL;
+            }
+        }
+        if(result) {
+            return_value = 3000 + i * 100 + (int32_t)result;
+            goto Done;
+        }
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(table.key_1);
+    free_ecdsa_key_pair(table.key_2);
+
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_sig_fail_test()
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    QCBOREncodeContext             cbor_encode;
+    int32_t                        return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct t_cose_key              key_pair;
+    struct q_useful_buf_c          payload;
+    QCBORError                     cbor_error;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    size_t                         tamper_offset;
+
+
+    /* Make an ECDSA key pair that will be used for both signing and
+     * verification.
+     */
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
+
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+
+    result = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+
+    QCBOREncode_AddSZString(&cbor_encode, "payload");
+
+
+    result = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+
+    cbor_error = QCBOREncode_Finish(&cbor_encode, &signed_cose);
+    if(cbor_error) {
+        return_value = 4000 + (int32_t)cbor_error;
+        goto Done;
+    }
+
+    /* tamper with the pay load to see that the signature verification fails */
+    tamper_offset = q_useful_buf_find_bytes(signed_cose, Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"));
+    if(tamper_offset == SIZE_MAX) {
+        return_value = 99;
+        goto Done;
+    }
+    /* Change "payload" to "hayload" */
+    struct q_useful_buf temp_unconst = q_useful_buf_unconst(signed_cose);
+    ((char *)temp_unconst.ptr)[tamper_offset] = 'h';
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    result = t_cose_sign1_verify(&verify_ctx,
+                                 signed_cose,   /* COSE to verify */
+                                &payload,       /* Payload from signed_cose */
+                                 NULL);         /* Don't return parameters */
+
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 5000 + (int32_t)result;
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_make_cwt_test()
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    QCBOREncodeContext             cbor_encode;
+    int32_t                        return_value;
+    enum t_cose_err_t              result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          signed_cose;
+    struct t_cose_key              key_pair;
+    struct q_useful_buf_c          payload;
+    QCBORError                     cbor_error;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct q_useful_buf_c          expected_rfc8392_first_part;
+    struct q_useful_buf_c          expected_payload;
+    struct q_useful_buf_c          actual_rfc8392_first_part;
+
+    /* -- initialize for signing --
+     *  No special options selected
+     */
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+
+
+    /* -- Key and kid --
+     * The ECDSA key pair made is both for signing and verification.
+     * The kid comes from RFC 8932
+     */
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    t_cose_sign1_set_signing_key(&sign_ctx,
+                                  key_pair,
+                                  Q_USEFUL_BUF_FROM_SZ_LITERAL("AsymmetricECDSA256"));
+
+
+    /* -- Encoding context and output of parameters -- */
+    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
+    result = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+
+
+    /* -- The payload as from RFC 8932 -- */
+    QCBOREncode_OpenMap(&cbor_encode);
+    QCBOREncode_AddSZStringToMapN(&cbor_encode, 1, "coap://as.example.com");
+    QCBOREncode_AddSZStringToMapN(&cbor_encode, 2, "erikw");
+    QCBOREncode_AddSZStringToMapN(&cbor_encode, 3, "coap://light.example.com");
+    QCBOREncode_AddInt64ToMapN(&cbor_encode, 4, 1444064944);
+    QCBOREncode_AddInt64ToMapN(&cbor_encode, 5, 1443944944);
+    QCBOREncode_AddInt64ToMapN(&cbor_encode, 6, 1443944944);
+    const uint8_t xx[] = {0x0b, 0x71};
+    QCBOREncode_AddBytesToMapN(&cbor_encode, 7,
+                               Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(xx));
+    QCBOREncode_CloseMap(&cbor_encode);
+
+
+    /* -- Finish up the COSE_Sign1. This is where the signing happens -- */
+    result = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* Finally close off the CBOR formatting and get the pointer and length
+     * of the resulting COSE_Sign1
+     */
+    cbor_error = QCBOREncode_Finish(&cbor_encode, &signed_cose);
+    if(cbor_error) {
+        return_value = (int32_t)cbor_error + 4000;
+        goto Done;
+    }
+    /* --- Done making COSE Sign1 object  --- */
+
+
+    /* Compare to expected from CWT RFC */
+    /* The first part, the intro and protected parameters must be the same */
+    const uint8_t rfc8392_first_part_bytes[] = {
+        0xd2, 0x84, 0x43, 0xa1, 0x01, 0x26, 0xa1, 0x04, 0x52, 0x41, 0x73, 0x79,
+        0x6d, 0x6d, 0x65, 0x74, 0x72, 0x69, 0x63, 0x45, 0x43, 0x44, 0x53, 0x41,
+        0x32, 0x35, 0x36, 0x58, 0x50, 0xa7, 0x01, 0x75, 0x63, 0x6f, 0x61, 0x70,
+        0x3a, 0x2f, 0x2f, 0x61, 0x73, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c,
+        0x65, 0x2e, 0x63, 0x6f, 0x6d, 0x02, 0x65, 0x65, 0x72, 0x69, 0x6b, 0x77,
+        0x03, 0x78, 0x18, 0x63, 0x6f, 0x61, 0x70, 0x3a, 0x2f, 0x2f, 0x6c, 0x69,
+        0x67, 0x68, 0x74, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e,
+        0x63, 0x6f, 0x6d, 0x04, 0x1a, 0x56, 0x12, 0xae, 0xb0, 0x05, 0x1a, 0x56,
+        0x10, 0xd9, 0xf0, 0x06, 0x1a, 0x56, 0x10, 0xd9, 0xf0, 0x07, 0x42, 0x0b,
+        0x71};
+    expected_rfc8392_first_part = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(rfc8392_first_part_bytes);
+    actual_rfc8392_first_part = q_useful_buf_head(signed_cose, sizeof(rfc8392_first_part_bytes));
+    if(q_useful_buf_compare(actual_rfc8392_first_part, expected_rfc8392_first_part)) {
+        return_value = -1;
+        goto Done;
+    }
+
+    /* --- Start verifying the COSE Sign1 object  --- */
+    /* Run the signature verification */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    result =  t_cose_sign1_verify(&verify_ctx,
+                                        signed_cose, /* COSE to verify */
+                                       &payload, /* Payload from signed_cose */
+                                        NULL);  /* Don't return parameters */
+
+    if(result) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* Format the expected payload CBOR fragment */
+
+    /* Skip the key id, because this has the short-circuit key id */
+    const size_t kid_encoded_len =
+      1 +
+      1 +
+      1 +
+      strlen("AsymmetricECDSA256"); // length of short-circuit key id
+
+
+    /* compare payload output to the one expected */
+    expected_payload = q_useful_buf_tail(expected_rfc8392_first_part, kid_encoded_len + 8);
+    if(q_useful_buf_compare(payload, expected_payload)) {
+        return_value = 6000;
+    }
+    /* --- Done verifying the COSE Sign1 object  --- */
+
+    return_value = 0;
+
+Done:
+    /* Many crypto libraries allocate memory, slots, etc for keys */
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+static int size_test(int32_t               cose_algorithm_id,
+                     struct q_useful_buf_c kid,
+                     struct t_cose_key     key_pair)
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    QCBOREncodeContext             cbor_encode;
+    enum t_cose_err_t              return_value;
+    struct q_useful_buf            nil_buf;
+    size_t                         calculated_size;
+    QCBORError                     cbor_error;
+    struct q_useful_buf_c          actual_signed_cose;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 300);
+    struct q_useful_buf_c          payload;
+    size_t                         sig_size;
+
+    /* ---- Common Set up ---- */
+    payload = Q_USEFUL_BUF_FROM_SZ_LITERAL("payload");
+    return_value = t_cose_crypto_sig_size(cose_algorithm_id, key_pair, &sig_size);
+
+    /* ---- First calculate the size ----- */
+    nil_buf = (struct q_useful_buf) {NULL, INT32_MAX};
+    QCBOREncode_Init(&cbor_encode, nil_buf);
+
+    t_cose_sign1_sign_init(&sign_ctx,  0,  cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
+
+    return_value = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    if(return_value) {
+        return 2000 + (int32_t)return_value;
+    }
+
+    QCBOREncode_AddEncoded(&cbor_encode, payload);
+
+    return_value = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+    if(return_value) {
+        return 3000 + (int32_t)return_value;
+    }
+
+    cbor_error = QCBOREncode_FinishGetSize(&cbor_encode, &calculated_size);
+    if(cbor_error) {
+        return 4000 + (int32_t)cbor_error;
+    }
+
+    /* ---- General sanity check ---- */
+    size_t expected_min = sig_size + payload.len + kid.len;
+
+    if(calculated_size < expected_min || calculated_size > expected_min + 30) {
+        return -1;
+    }
+
+
+
+    /* ---- Now make a real COSE_Sign1 and compare the size ---- */
+    QCBOREncode_Init(&cbor_encode, signed_cose_buffer);
+
+    t_cose_sign1_sign_init(&sign_ctx,  0,  cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
+
+    return_value = t_cose_sign1_encode_parameters(&sign_ctx, &cbor_encode);
+    if(return_value) {
+        return 2000 + (int32_t)return_value;
+    }
+
+    QCBOREncode_AddEncoded(&cbor_encode, payload);
+
+    return_value = t_cose_sign1_encode_signature(&sign_ctx, &cbor_encode);
+    if(return_value) {
+        return 3000 + (int32_t)return_value;
+    }
+
+    cbor_error = QCBOREncode_Finish(&cbor_encode, &actual_signed_cose);
+    if(actual_signed_cose.len != calculated_size) {
+        return -2;
+    }
+
+    /* ---- Again with one-call API to make COSE_Sign1 ---- */\
+    t_cose_sign1_sign_init(&sign_ctx, 0, cose_algorithm_id);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, kid);
+    return_value = t_cose_sign1_sign(&sign_ctx,
+                                     payload,
+                                     signed_cose_buffer,
+                                     &actual_signed_cose);
+    if(return_value) {
+        return 7000 + (int32_t)return_value;
+    }
+
+    if(actual_signed_cose.len != calculated_size) {
+        return -3;
+    }
+
+    /* ---- Size without hashing or signing ---- */
+    return_value = t_cose_sign1_sign_size(&sign_ctx,
+                                          payload.len,
+                                          false,
+                                          &calculated_size);
+    if(return_value) {
+        return 8000 + (int32_t)return_value;
+    }
+    if(actual_signed_cose.len != calculated_size) {
+        return -4;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_get_size_test()
+{
+    enum t_cose_err_t   return_value;
+    struct t_cose_key   key_pair;
+    int32_t             result;
+
+    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(return_value) {
+        return 1000 + (int32_t)return_value;
+    }
+
+    result = size_test(T_COSE_ALGORITHM_ES256, NULL_Q_USEFUL_BUF_C, key_pair);
+    free_ecdsa_key_pair(key_pair);
+    if(result) {
+        return 2000 + result;
+    }
+
+
+#ifndef T_COSE_DISABLE_ES384
+
+    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES384, &key_pair);
+    if(return_value) {
+        return 3000 + (int32_t)return_value;
+    }
+
+    result = size_test(T_COSE_ALGORITHM_ES384, NULL_Q_USEFUL_BUF_C, key_pair);
+    free_ecdsa_key_pair(key_pair);
+    if(result) {
+        return 4000 + result;
+    }
+
+#endif /* T_COSE_DISABLE_ES384 */
+
+
+#ifndef T_COSE_DISABLE_ES512
+
+    return_value = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES512, &key_pair);
+    if(return_value) {
+        return 5000 + (int32_t)return_value;
+    }
+
+    result = size_test(T_COSE_ALGORITHM_ES512, NULL_Q_USEFUL_BUF_C, key_pair);
+    if(result) {
+        free_ecdsa_key_pair(key_pair);
+        return 6000 + result;
+    }
+
+    result = size_test(T_COSE_ALGORITHM_ES512,
+                       Q_USEFUL_BUF_FROM_SZ_LITERAL("greasy kid stuff"),
+                       key_pair);
+    free_ecdsa_key_pair(key_pair);
+    if(result) {
+        return 7000 + result;
+    }
+
+#endif /* T_COSE_DISABLE_ES512 */
+
+
+    return 0;
+}
+
+
+/* These are complete known-good COSE messages for a verification
+ * test. The key used to verify them is made by make_ecdsa_key_pair().
+ * It always makes the same key for both MbedTLS and OpenSSL.
+ *
+ * These were made by setting a break point in sign_verify_basic_test()
+ * and copying the output of the signing.
+ */
+static const uint8_t signed_cose_made_by_ossl_crypto_256[] = {
+    0xD2, 0x84, 0x43, 0xA1, 0x01, 0x26, 0xA0, 0x47,
+    0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64, 0x58,
+    0x40, 0xF2, 0x2B, 0xAE, 0x15, 0xA8, 0xA6, 0x7A,
+    0x60, 0x6B, 0x0B, 0xEA, 0xCB, 0xB6, 0x21, 0xD0,
+    0xA0, 0xAC, 0x99, 0xCE, 0x2A, 0xD3, 0xD8, 0x1F,
+    0xA5, 0x25, 0x77, 0x04, 0x8C, 0x27, 0xF8, 0x7F,
+    0xF2, 0x25, 0x78, 0xFA, 0xDE, 0xED, 0xB0, 0xFB,
+    0xC7, 0xB3, 0x31, 0xCF, 0x4F, 0x5C, 0xC8, 0x25,
+    0xDE, 0xFD, 0x2D, 0xB9, 0xF3, 0x6C, 0xD7, 0xCB,
+    0x69, 0x53, 0xCB, 0x05, 0xE3, 0x60, 0xAC, 0x98,
+    0xE6};
+
+#ifndef T_COSE_DISABLE_ES384
+static const uint8_t signed_cose_made_by_psa_crypto_384[] = {
+    0xD2, 0x84, 0x44, 0xA1, 0x01, 0x38, 0x22, 0xA0,
+    0x47, 0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64,
+    0x58, 0x60, 0x2C, 0x6C, 0x08, 0xF3, 0x36, 0x9E,
+    0x35, 0x7A, 0x6B, 0xE5, 0xD6, 0x6E, 0xF9, 0x30,
+    0x06, 0x2B, 0xD8, 0x73, 0xAB, 0x7E, 0x9B, 0x9D,
+    0x4A, 0x30, 0xDD, 0x62, 0x75, 0xE5, 0xD6, 0x61,
+    0x39, 0xF7, 0x4D, 0xC3, 0x7C, 0xF0, 0xEB, 0x58,
+    0x9D, 0x78, 0xCA, 0x70, 0xD3, 0xA2, 0xF9, 0x23,
+    0x85, 0xE6, 0x45, 0x18, 0x04, 0xBE, 0x9F, 0xA0,
+    0xE3, 0x97, 0x4A, 0x12, 0x82, 0xF2, 0x87, 0x4F,
+    0x3B, 0xF6, 0x9D, 0xC3, 0xE2, 0x99, 0xCC, 0x67,
+    0x69, 0x34, 0xDB, 0x1C, 0xF4, 0xAF, 0x95, 0x83,
+    0x74, 0x1B, 0x5C, 0xCD, 0xD5, 0x11, 0xC1, 0x07,
+    0xE2, 0xD9, 0x3B, 0x16, 0x31, 0x5A, 0x55, 0x58,
+    0x6C, 0xC9};
+#endif /* T_COSE_DISABLE_ES384 */
+
+
+#ifndef T_COSE_DISABLE_ES512
+static const uint8_t signed_cose_made_by_openssl_crypto_521[] = {
+    0xD2, 0x84, 0x44, 0xA1, 0x01, 0x38, 0x23, 0xA0,
+    0x47, 0x70, 0x61, 0x79, 0x6C, 0x6F, 0x61, 0x64,
+    0x58, 0x84, 0x01, 0x54, 0x10, 0x66, 0x49, 0x6B,
+    0x8B, 0xDC, 0xB0, 0xCE, 0x03, 0x73, 0x30, 0x01,
+    0x92, 0xF1, 0xE3, 0x18, 0x37, 0xF1, 0x91, 0xC1,
+    0x57, 0xB5, 0x13, 0xB8, 0x30, 0x10, 0xA6, 0xA6,
+    0x29, 0xDC, 0x74, 0xA0, 0x5E, 0x39, 0xC8, 0x2F,
+    0x2B, 0x5D, 0x1C, 0xDB, 0x90, 0x47, 0x50, 0xA0,
+    0x97, 0x47, 0x0E, 0x99, 0x66, 0x6F, 0xC4, 0xA5,
+    0xBB, 0xD7, 0xF7, 0x99, 0xD3, 0x87, 0x7A, 0x1B,
+    0x03, 0xCA, 0x6A, 0xDB, 0x01, 0x04, 0xB5, 0x9D,
+    0xB6, 0x18, 0xE9, 0x2A, 0xD2, 0x0A, 0x32, 0x05,
+    0x88, 0xDA, 0x7D, 0xB8, 0xAD, 0x7A, 0xCE, 0x5F,
+    0x49, 0x1F, 0xBD, 0xF3, 0x98, 0xDE, 0x44, 0x05,
+    0x38, 0xD0, 0x2C, 0x12, 0x83, 0x09, 0x7A, 0xF8,
+    0xE8, 0x5F, 0xA7, 0x33, 0xA3, 0xE3, 0xE9, 0x35,
+    0x11, 0x22, 0x48, 0x09, 0xA2, 0x95, 0x6C, 0x9B,
+    0x97, 0xA9, 0xE9, 0xBF, 0xA8, 0x63, 0x73, 0x88,
+    0x24, 0xB0, 0x84, 0x46, 0xA8, 0x90};
+#endif /* T_COSE_DISABLE_ES512 */
+
+
+int_fast32_t known_good_test(void)
+{
+    int32_t                        return_value;
+    enum t_cose_err_t              result;
+    struct t_cose_key              key_pair;
+    struct q_useful_buf_c          payload;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct q_useful_buf_c          valid_message;
+
+    /* Improvement: rewrite this to fetch the algorithm header and
+     * look up the key from it, so the generalizes to all sorts of
+     * good known inputs for all sorts of algorithms. (Could do key id
+     * too...) But for now this accomplishes what is needed.
+     */
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return_value = 1000 + (int32_t)result;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_ossl_crypto_256);
+    result = t_cose_sign1_verify(&verify_ctx,
+                                  valid_message, /* COSE to verify */
+                                 &payload,       /* Payload from signed_cose */
+                                  NULL);         /* Don't return parameters */
+     if(result) {
+         return_value = 5000 + (int32_t)result;
+         goto Done;
+     }
+
+    free_ecdsa_key_pair(key_pair);
+
+#ifndef T_COSE_DISABLE_ES384
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES384, &key_pair);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_psa_crypto_384);
+
+    result = t_cose_sign1_verify(&verify_ctx,
+                                 valid_message, /* COSE to verify */
+                                &payload,       /* Payload from signed_cose */
+                                 NULL);         /* Don't return parameters */
+    if(result) {
+        return_value = 5100 + (int32_t)result;
+        goto Done;
+    }
+
+    free_ecdsa_key_pair(key_pair);
+#endif /* T_COSE_DISABLE_ES384 */
+
+
+#ifndef T_COSE_DISABLE_ES512
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES512, &key_pair);
+    if(result) {
+        return_value = 1200 + (int32_t)result;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    valid_message = Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(signed_cose_made_by_openssl_crypto_521);
+
+    result = t_cose_sign1_verify(&verify_ctx,
+                                 valid_message, /* COSE to verify */
+                                &payload,       /* Payload from signed_cose */
+                                 NULL);         /* Don't return parameters */
+    if(result) {
+        return_value = 5200 + (int32_t)result;
+        goto Done;
+    }
+
+    free_ecdsa_key_pair(key_pair);
+#endif /* T_COSE_DISABLE_ES512 */
+
+    /* Can't make signed messages and compare them to a known good
+     * value because ECDSA signature have a random component. They are
+     * never the same. There are other tests here that evaluate the
+     * structure of the signed messages and there tests that verify
+     * messages made by the signing function. */
+
+    return_value = 0;
+
+Done:
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_prepare_test()
+{
+    struct t_cose_sign1_sign_ctx        sign_ctx;
+    struct t_cose_sign1_verify_ctx      verify_ctx;
+    struct t_cose_sign1_verify_prepared prepared;
+    struct t_cose_sign1_verify_prepared prepared_copy;
+    struct test_key_table               table;
+    int_fast32_t                        return_value;
+    enum t_cose_err_t                   result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(         signed_cose_buffer, 300);
+    struct q_useful_buf_c               signed_cose;
+    struct q_useful_buf_c               payload;
+    struct t_cose_parameters            parameters;
+
+    table.resolved = 0;
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &table.key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    table.key_2 = table.key_1;
+
+    result = sign_with_kid(table.key_1, "key-1", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- The key is found and the payload returned by the prepare --- */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         &parameters,
+                                         &prepared);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    if(table.resolved != 1 ||
+       q_useful_buf_compare(payload, Q_USEFUL_BUF_FROM_SZ_LITERAL("payload")) ||
+       q_useful_buf_compare(parameters.kid, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1")) ||
+       parameters.cose_algorithm_id != T_COSE_ALGORITHM_ES256) {
+        return_value = 2100;
+        goto Done;
+    }
+
+    /* --- A copy completes without the context --- */
+    prepared_copy = prepared;
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    result = t_cose_sign1_verify_complete(&prepared_copy);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- A bad signature is only found by the complete --- */
+    t_cose_sign1_set_key_resolver(&verify_ctx, test_key_table_resolver, &table);
+    ((uint8_t *)signed_cose_buffer.ptr)[signed_cose.len - 1] ^= 0x01;
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- A message that doesn't decode never gets to the key --- */
+    table.resolved = 0;
+    signed_cose.len -= 10;
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result == T_COSE_SUCCESS || table.resolved != 0) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Detached payload and AAD --- */
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, table.key_1, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        Q_USEFUL_BUF_FROM_SZ_LITERAL("aad"),
+                                        Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                        signed_cose_buffer,
+                                        &signed_cose);
+    if(result) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, table.key_1);
+    result = t_cose_sign1_verify_prepare_detached(&verify_ctx,
+                                                  signed_cose,
+                                                  Q_USEFUL_BUF_FROM_SZ_LITERAL("aad"),
+                                                  Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                                  NULL,
+                                                  &prepared);
+    if(result) {
+        return_value = 6100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result) {
+        return_value = 6200 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_prepare_detached(&verify_ctx,
+                                                  signed_cose,
+                                                  NULL_Q_USEFUL_BUF_C,
+                                                  Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                                  NULL,
+                                                  &prepared);
+    if(result) {
+        return_value = 6300 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 6400 + (int32_t)result;
+        goto Done;
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(table.key_1);
+
+    return return_value;
+}
+
+
+/* The keys that test_pin_resolver() hands out and how often the kid
+ * cache let go of them */
+struct test_pin_keys {
+    struct t_cose_key key_1;
+    struct t_cose_key other;
+    int               key_1_evicted;
+    int               other_evicted;
+};
+
+
+static enum t_cose_err_t
+test_pin_resolver(void                  *cb_context,
+                  int32_t                cose_algorithm_id,
+                  struct q_useful_buf_c  kid,
+                  struct t_cose_key     *key)
+{
+    struct test_pin_keys *keys = (struct test_pin_keys *)cb_context;
+
+    (void)cose_algorithm_id;
+
+    if(!q_useful_buf_compare(kid, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"))) {
+        *key = keys->key_1;
+    } else {
+        *key = keys->other;
+    }
+    return T_COSE_SUCCESS;
+}
+
+
+static void
+test_pin_evicted(void *cb_context, struct t_cose_key key)
+{
+    struct test_pin_keys *keys = (struct test_pin_keys *)cb_context;
+
+    if(key.k.key_ptr == keys->key_1.k.key_ptr) {
+        keys->key_1_evicted++;
+    } else {
+        keys->other_evicted++;
+    }
+}
+
+
+/* Looks up enough other kids to evict every unpinned key in the cache */
+static void
+fill_kid_cache(struct t_cose_kid_cache *cache)
+{
+    uint8_t           other_kid[2] = {'k', 0};
+    struct t_cose_key key;
+
+    for(other_kid[1] = 0; other_kid[1] <= T_COSE_KID_CACHE_SIZE; other_kid[1]++) {
+        (void)t_cose_kid_cache_resolve(cache,
+                                       T_COSE_ALGORITHM_ES256,
+                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(other_kid),
+                                       &key);
+    }
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_prepare_pinned_test()
+{
+    struct t_cose_sign1_verify_ctx      verify_ctx;
+    struct t_cose_sign1_verify_prepared prepared;
+    struct t_cose_kid_cache             cache;
+    struct test_pin_keys                keys;
+    int_fast32_t                        return_value;
+    enum t_cose_err_t                   result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(         signed_cose_buffer, 300);
+    struct q_useful_buf_c               signed_cose;
+    struct q_useful_buf_c               payload;
+
+    keys.key_1_evicted = 0;
+    keys.other_evicted = 0;
+    keys.other         = T_COSE_NULL_KEY;
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &keys.key_1);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    t_cose_kid_cache_init(&cache, test_pin_resolver, test_pin_evicted, &keys);
+
+    result = sign_with_kid(keys.key_1, "key-1", signed_cose_buffer, &signed_cose);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_key_resolver(&verify_ctx, t_cose_kid_cache_resolve_pinned, &cache);
+    t_cose_sign1_set_key_release(&verify_ctx, t_cose_kid_cache_release);
+
+    /* --- A prepared key is not evicted by later look ups --- */
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    fill_kid_cache(&cache);
+    if(keys.key_1_evicted != 0 || keys.other_evicted == 0) {
+        return_value = 2100;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result) {
+        return_value = 2200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Once completed it can be evicted --- */
+    fill_kid_cache(&cache);
+    if(keys.key_1_evicted != 1) {
+        return_value = 3000;
+        goto Done;
+    }
+
+    /* --- A prepared key that is removed is kept until completed --- */
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_kid_cache_remove(&cache, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"));
+    if(keys.key_1_evicted != 1) {
+        return_value = 4100;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result) {
+        return_value = 4200 + (int32_t)result;
+        goto Done;
+    }
+    if(keys.key_1_evicted != 2) {
+        return_value = 4300;
+        goto Done;
+    }
+    /* Releasing again does nothing */
+    t_cose_sign1_verify_prepared_release(&prepared);
+    if(keys.key_1_evicted != 2) {
+        return_value = 4400;
+        goto Done;
+    }
+
+    /* --- A prepared message that won't be completed is released --- */
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_verify_prepared_release(&prepared);
+    fill_kid_cache(&cache);
+    if(keys.key_1_evicted != 3) {
+        return_value = 5100;
+        goto Done;
+    }
+
+    /* --- A one-pass verify releases the key too --- */
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
+    fill_kid_cache(&cache);
+    if(keys.key_1_evicted != 4) {
+        return_value = 6100;
+        goto Done;
+    }
+
+    return_value = 0;
+
+Done:
+    t_cose_kid_cache_clear(&cache);
+    free_ecdsa_key_pair(keys.key_1);
+
+    return return_value;
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_external_sign_test()
+{
+    struct t_cose_sign1_sign_ctx     sign_ctx;
+    struct t_cose_sign1_verify_ctx   verify_ctx;
+    struct t_cose_sign1_sign_pending pending;
+    struct t_cose_key                key_pair;
+    int_fast32_t                     return_value;
+    enum t_cose_err_t                result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(      expected_buffer, 300);
+    Q_USEFUL_BUF_MAKE_STACK_UB(      signed_cose_buffer, 300);
+    Q_USEFUL_BUF_MAKE_STACK_UB(      signature_buffer, T_COSE_MAX_SIG_SIZE);
+    Q_USEFUL_BUF_MAKE_STACK_UB(      other_hash_buffer, T_COSE_SIGN1_MAX_TBS_HASH_SIZE);
+    struct q_useful_buf_c            expected;
+    struct q_useful_buf_c            signed_cose;
+    struct q_useful_buf_c            tbs_hash;
+    struct q_useful_buf_c            signature;
+    struct q_useful_buf_c            payload;
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"));
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                               expected_buffer,
+                               &expected);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Sign with the stand-in signer --- */
+    result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                              NULL_Q_USEFUL_BUF_C,
+                                              Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                              signed_cose_buffer,
+                                              &pending,
+                                              &tbs_hash);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_sign_external_local(&sign_ctx,
+                                              tbs_hash,
+                                              signature_buffer,
+                                              &signature);
+    if(result) {
+        return_value = 2100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_sign_external_finish(&pending, signature, &signed_cose);
+    if(result) {
+        return_value = 2200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* ECDSA signatures differ every time, but nothing else does */
+    if(signed_cose.len != expected.len ||
+       q_useful_buf_compare(q_useful_buf_head(signed_cose, expected.len - T_COSE_EC_P256_SIG_SIZE),
+                            q_useful_buf_head(expected, expected.len - T_COSE_EC_P256_SIG_SIZE))) {
+        return_value = 2300;
+        goto Done;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    if(q_useful_buf_compare(payload, Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"))) {
+        return_value = 3100;
+        goto Done;
+    }
+
+    /* --- A signature of some other hash doesn't verify --- */
+    result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                              NULL_Q_USEFUL_BUF_C,
+                                              Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                              signed_cose_buffer,
+                                              &pending,
+                                              &tbs_hash);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    tbs_hash = q_useful_buf_copy(other_hash_buffer, tbs_hash);
+    ((uint8_t *)other_hash_buffer.ptr)[0] ^= 0x01;
+    result = t_cose_sign1_sign_external_local(&sign_ctx,
+                                              tbs_hash,
+                                              signature_buffer,
+                                              &signature);
+    if(result) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_sign_external_finish(&pending, signature, &signed_cose);
+    if(result) {
+        return_value = 4200 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 4300 + (int32_t)result;
+        goto Done;
+    }
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+/*
+ * Verify a detached payload by hashing it in a stream, which never
+ * uses t_cose_crypto_verify_message().
+ */
+static enum t_cose_err_t
+verify_detached_hashed(struct t_cose_sign1_verify_ctx *verify_ctx,
+                       struct q_useful_buf_c           signed_cose,
+                       struct q_useful_buf_c           aad,
+                       struct q_useful_buf_c           payload)
+{
+    struct t_cose_sign1_verify_stream stream;
+    enum t_cose_err_t                 result;
+
+    result = t_cose_sign1_verify_detached_begin(verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                payload.len,
+                                                NULL);
+    if(result) {
+        return result;
+    }
+    t_cose_sign1_verify_detached_update(&stream, payload);
+    return t_cose_sign1_verify_detached_finish(verify_ctx, &stream);
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_sign_message_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    struct t_cose_sign1_sign_stream sign_stream;
+    struct t_cose_sign1_midstate    midstate;
+    struct t_cose_key               key_pair;
+    int_fast32_t                    return_value;
+    enum t_cose_err_t               result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 300);
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           aad;
+    struct q_useful_buf_c           payload;
+
+    aad     = Q_USEFUL_BUF_FROM_SZ_LITERAL("aad");
+    payload = Q_USEFUL_BUF_FROM_SZ_LITERAL("payload");
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+
+    /* --- Signed in one operation, verified from a hash --- */
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        payload,
+                                        signed_cose_buffer,
+                                        &signed_cose);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    result = verify_detached_hashed(&verify_ctx, signed_cose, aad, payload);
+    if(result) {
+        return_value = 2100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx, signed_cose, aad, payload, NULL);
+    if(result) {
+        return_value = 2200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Verified in one operation, tampered payload and AAD --- */
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          aad,
+                                          Q_USEFUL_BUF_FROM_SZ_LITERAL("paylaod"),
+                                          NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          Q_USEFUL_BUF_FROM_SZ_LITERAL("aae"),
+                                          payload,
+                                          NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 3100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          NULL_Q_USEFUL_BUF_C,
+                                          payload,
+                                          NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 3200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Signed from a hash, verified in one operation --- */
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx, &sign_stream, aad, payload.len);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_sign_detached_update(&sign_stream, payload);
+    result = t_cose_sign1_sign_detached_finish(&sign_ctx,
+                                               &sign_stream,
+                                               signed_cose_buffer,
+                                               &signed_cose);
+    if(result) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx, signed_cose, aad, payload, NULL);
+    if(result) {
+        return_value = 4200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Signed from a midstate, verified both ways --- */
+    result = t_cose_sign1_sign_set_midstate(&sign_ctx, &midstate);
+    if(result) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        payload,
+                                        signed_cose_buffer,
+                                        &signed_cose);
+    t_cose_sign1_midstate_free(&midstate);
+    if(result) {
+        return_value = 5100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx, signed_cose, aad, payload, NULL);
+    if(result) {
+        return_value = 5200 + (int32_t)result;
+        goto Done;
+    }
+    result = verify_detached_hashed(&verify_ctx, signed_cose, aad, payload);
+    if(result) {
+        return_value = 5300 + (int32_t)result;
+        goto Done;
+    }
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    /* --- Short-circuit signatures are made and checked from the
+     * hash even with a real key set. One signed in one operation
+     * would not verify as short-circuit. --- */
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, NULL_Q_USEFUL_BUF_C);
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        payload,
+                                        signed_cose_buffer,
+                                        &signed_cose);
+    if(result) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+    result = t_cose_sign1_verify_detached(&verify_ctx, signed_cose, aad, payload, NULL);
+    if(result) {
+        return_value = 6100 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          aad,
+                                          Q_USEFUL_BUF_FROM_SZ_LITERAL("paylaod"),
+                                          NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 6200 + (int32_t)result;
+        goto Done;
+    }
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+    return_value = 0;
+
+Done:
+    free_ecdsa_key_pair(key_pair);
+
+    return return_value;
+}
+
+
+#ifdef T_COSE_ENABLE_ASYNC
+
+#define ASYNC_SIGN_VERIFY_COUNT 16
+
+static void
+async_done_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    (void)request;
+    __atomic_add_fetch((int *)done_ctx, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ * Public function, see t_cose_sign_verify_test.h
+ */
+int_fast32_t sign_verify_async_test()
+{
+    struct t_cose_sign1_sign_ctx        sign_ctx;
+    struct t_cose_sign1_verify_ctx      verify_ctx;
+    static struct t_cose_async_pool     pool;
+    static struct t_cose_async_request  requests[ASYNC_SIGN_VERIFY_COUNT];
+    static uint8_t                      cose_buffers[ASYNC_SIGN_VERIFY_COUNT][300];
+    struct t_cose_async_executor        executor;
+    struct t_cose_key                   key_pair;
+    struct q_useful_buf_c               signed_cose[ASYNC_SIGN_VERIFY_COUNT];
+    int_fast32_t                        return_value;
+    enum t_cose_err_t                   result;
+    int                                 done_count;
+    int                                 i;
+
+    result = make_ecdsa_key_pair(T_COSE_ALGORITHM_ES256, &key_pair);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    result = t_cose_async_pool_start(&pool, 2);
+    if(result) {
+        return_value = 1100 + (int32_t)result;
+        goto Done2;
+    }
+    executor = t_cose_async_pool_executor(&pool);
+
+    /* --- Sign on the pool --- */
+    t_cose_sign1_sign_init(&sign_ctx, 0, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx, key_pair, Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"));
+    done_count = 0;
+    for(i = 0; i < ASYNC_SIGN_VERIFY_COUNT; i++) {
+        t_cose_async_sign_request_init(&requests[i],
+                                       &sign_ctx,
+                                       NULL_Q_USEFUL_BUF_C,
+                                       Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                       (struct q_useful_buf){cose_buffers[i], sizeof(cose_buffers[i])},
+                                       async_done_cb,
+                                       &done_count);
+        result = t_cose_async_submit(&executor, &requests[i]);
+        if(result) {
+            return_value = 2000 + (int32_t)result;
+            goto Done;
+        }
+    }
+    t_cose_async_pool_wait(&pool);
+    if(done_count != ASYNC_SIGN_VERIFY_COUNT) {
+        return_value = 2100 + done_count;
+        goto Done;
+    }
+    for(i = 0; i < ASYNC_SIGN_VERIFY_COUNT; i++) {
+        result = t_cose_async_request_error(&requests[i]);
+        if(result) {
+            return_value = 2200 + (int32_t)result;
+            goto Done;
+        }
+        signed_cose[i] = t_cose_async_request_output(&requests[i]);
+    }
+
+    /* --- Verify on the pool, one of them tampered with --- */
+    cose_buffers[0][signed_cose[0].len - 1] ^= 0x01;
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verification_key(&verify_ctx, key_pair);
+    done_count = 0;
+    for(i = 0; i < ASYNC_SIGN_VERIFY_COUNT; i++) {
+        t_cose_async_verify_request_init(&requests[i],
+                                         &verify_ctx,
+                                         signed_cose[i],
+                                         NULL_Q_USEFUL_BUF_C,
+                                         async_done_cb,
+                                         &done_count);
+        result = t_cose_async_submit(&executor, &requests[i]);
+        if(result) {
+            return_value = 3000 + (int32_t)result;
+            goto Done;
+        }
+    }
+    t_cose_async_pool_wait(&pool);
+    if(done_count != ASYNC_SIGN_VERIFY_COUNT) {
+        return_value = 3100 + done_count;
+        goto Done;
+    }
+    result = t_cose_async_request_error(&requests[0]);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return_value = 3200 + (int32_t)result;
+        goto Done;
+    }
+    for(i = 1; i < ASYNC_SIGN_VERIFY_COUNT; i++) {
+        result = t_cose_async_request_error(&requests[i]);
+        if(result) {
+            return_value = 3300 + (int32_t)result;
+            goto Done;
+        }
+        if(q_useful_buf_compare(t_cose_async_request_output(&requests[i]),
+                                Q_USEFUL_BUF_FROM_SZ_LITERAL("payload")) ||
+           q_useful_buf_compare(t_cose_async_request_parameters(&requests[i])->kid,
+                                Q_USEFUL_BUF_FROM_SZ_LITERAL("key-1"))) {
+            return_value = 3400 + i;
+            goto Done;
+        }
+    }
+
+    return_value = 0;
+
+Done:
+    t_cose_async_pool_stop(&pool);
+Done2:
+    free_ecdsa_key_pair(key_pair);
+
     return return_value;
 }
+#endif /* T_COSE_ENABLE_ASYNC */
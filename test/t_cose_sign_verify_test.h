@@ -52,4 +52,106 @@ int_fast32_t sign_verify_get_size_test(void);
  */
 int_fast32_t known_good_test(void);
 
+
+/*
+ * Sign many payloads with t_cose_sign1_sign_batch() and verify them.
+ */
+int_fast32_t sign_verify_batch_test(void);
+
+
+/*
+ * Verify many messages with t_cose_sign1_verify_batch() and a key
+ * resolver, some of which fail.
+ */
+int_fast32_t sign_verify_verify_batch_test(void);
+
+
+/*
+ * Sign and verify many times to cover the variations in signature
+ * encoding.
+ */
+int_fast32_t sign_verify_repeat_test(void);
+
+
+/*
+ * Sign and verify with several keys in turn, then free them and make
+ * new ones, to check per-key state cached by the crypto adapter.
+ */
+int_fast32_t sign_verify_key_change_test(void);
+
+
+/*
+ * Sign and verify with a prepared key and check it is rejected for
+ * another algorithm.
+ */
+int_fast32_t sign_verify_prepared_key_test(void);
+
+
+/*
+ * Verify with the key found by kid by a resolver, directly and
+ * through the kid cache.
+ */
+int_fast32_t sign_verify_key_resolver_test(void);
+
+
+/*
+ * Verify with keys imported from a key index through the kid cache.
+ */
+int_fast32_t sign_verify_key_index_test(void);
+
+
+#ifdef T_COSE_ENABLE_VERIFY_CACHE
+/*
+ * Verify repeated messages through the verification cache and check
+ * only the first one needs the key.
+ */
+int_fast32_t sign_verify_verify_cache_test(void);
+
+
+/*
+ * Check the verification cache misses when a different key is at the
+ * same address as the one that verified.
+ */
+int_fast32_t sign_verify_verify_cache_key_test(void);
+#endif
+
+
+/*
+ * Verify in two steps, decoding and hashing first and checking the
+ * signature later from a copy of the prepared message.
+ */
+int_fast32_t sign_verify_prepare_test(void);
+
+
+/*
+ * Check that a key looked up by a prepare is pinned in the kid cache
+ * until it is completed or released, whatever look ups or removals
+ * happen in between.
+ */
+int_fast32_t sign_verify_prepare_pinned_test(void);
+
+
+/*
+ * Test signing split around an external signer with real keys and
+ * that the signer's signature is what gets verified.
+ */
+int_fast32_t sign_verify_external_sign_test(void);
+
+
+/*
+ * Mix signing and verifying in one operation, as done with
+ * T_COSE_ENABLE_SIGN_MESSAGE, with signing and verifying a hash, and
+ * check midstates and short-circuit signatures are still hashed.
+ */
+int_fast32_t sign_verify_sign_message_test(void);
+
+
+#ifdef T_COSE_ENABLE_ASYNC
+/*
+ * Test signing and verifying on a thread pool with real keys,
+ * including a verification that fails.
+ */
+int_fast32_t sign_verify_async_test(void);
+#endif
+
 #endif /* t_cose_sign_verify_test_h */
@@ -9,6 +9,13 @@
  * See BSD-3-Clause license in README.md
  */
 
+#ifdef T_COSE_ENABLE_FILE_IO
+/* For mkstemp(), pipe() and such used by short_circuit_file_test() */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#endif
+
 #include "t_cose_test.h"
 #include "t_cose/t_cose_sign1_sign.h"
 #include "t_cose/t_cose_sign1_verify.h"
@@ -16,6 +23,19 @@
 #include "t_cose/q_useful_buf.h"
 #include "t_cose_crypto.h" /* For signature size constant */
 #include "t_cose_util.h" /* for get_short_circuit_kid */
+#include "t_cose/t_cose_kid_cache.h"
+#include "t_cose/t_cose_key_set.h"
+#include "t_cose/t_cose_key_index.h"
+#include "t_cose/t_cose_kid_filter.h"
+#include "t_cose/t_cose_verify_cache.h"
+#include "t_cose/t_cose_header_cache.h"
+#include "t_cose/t_cose_async.h"
+
+#ifdef T_COSE_ENABLE_FILE_IO
+#include <stdlib.h> /* for mkstemp */
+#include <unistd.h>
+#include "t_cose/t_cose_sign1_file.h"
+#endif
 
 
 /* String used by RFC 8152 and C-COSE tests and examples for payload */
@@ -1523,6 +1543,85 @@ int_fast32_t tags_test()
 }
 
 
+/*
+ * Check t_cose_sign1_sign_size() against the real size for payload
+ * lengths at CBOR head size boundaries and for various parameters.
+ */
+static int32_t get_size_no_hash_test(void)
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    enum t_cose_err_t              return_value;
+    size_t                         calculated_size;
+    struct q_useful_buf_c          actual_signed_cose;
+    static uint8_t                 payload_bytes[65536];
+    static uint8_t                 signed_cose_bytes[65536 + 200];
+    struct q_useful_buf            signed_cose_buffer;
+    struct q_useful_buf_c          payload;
+    static const size_t            payload_lens[] = {0, 23, 24, 255, 256, 65535, 65536};
+    int                            config;
+    size_t                         i;
+    bool                           detached;
+
+    signed_cose_buffer = (struct q_useful_buf){signed_cose_bytes,
+                                               sizeof(signed_cose_bytes)};
+
+    for(config = 0; config < 4; config++) {
+        t_cose_sign1_sign_init(&sign_ctx,
+                               T_COSE_OPT_SHORT_CIRCUIT_SIG |
+                                   (config == 1 ? T_COSE_OPT_OMIT_CBOR_TAG : 0),
+                               T_COSE_ALGORITHM_ES256);
+        if(config == 2) {
+            t_cose_sign1_set_signing_key(&sign_ctx,
+                                         T_COSE_NULL_KEY,
+                                         Q_USEFUL_BUF_FROM_SZ_LITERAL("a kid of some length"));
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+            t_cose_sign1_set_content_type_uint(&sign_ctx, 1000);
+#endif
+        }
+        detached = config == 3;
+
+        for(i = 0; i < sizeof(payload_lens)/sizeof(payload_lens[0]); i++) {
+            payload = (struct q_useful_buf_c){payload_bytes, payload_lens[i]};
+            if(detached) {
+                return_value = t_cose_sign1_sign_detached(&sign_ctx,
+                                                          NULL_Q_USEFUL_BUF_C,
+                                                          payload,
+                                                          signed_cose_buffer,
+                                                         &actual_signed_cose);
+            } else {
+                return_value = t_cose_sign1_sign(&sign_ctx,
+                                                 payload,
+                                                 signed_cose_buffer,
+                                                &actual_signed_cose);
+            }
+            if(return_value) {
+                return 1000 + config * 100 + (int32_t)return_value;
+            }
+
+            return_value = t_cose_sign1_sign_size(&sign_ctx,
+                                                  payload.len,
+                                                  detached,
+                                                  &calculated_size);
+            if(return_value) {
+                return 2000 + config * 100 + (int32_t)return_value;
+            }
+            if(calculated_size != actual_signed_cose.len) {
+                return 3000 + config * 100 + (int32_t)i;
+            }
+        }
+    }
+
+    /* ---- Unsupported algorithm ---- */
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, 0);
+    return_value = t_cose_sign1_sign_size(&sign_ctx, 10, false, &calculated_size);
+    if(return_value != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+        return 4000 + (int32_t)return_value;
+    }
+
+    return 0;
+}
+
+
 int32_t get_size_test()
 {
     struct t_cose_sign1_sign_ctx   sign_ctx;
@@ -1612,8 +1711,19 @@ int32_t get_size_test()
         return -3;
     }
 
+    /* ---- Size without hashing or signing ---- */
+    return_value = t_cose_sign1_sign_size(&sign_ctx,
+                                          payload.len,
+                                          false,
+                                          &calculated_size);
+    if(return_value) {
+        return 8000 + (int32_t)return_value;
+    }
+    if(actual_signed_cose.len != calculated_size) {
+        return -4;
+    }
 
-    return 0;
+    return get_size_no_hash_test();
 }
 
 
@@ -1656,3 +1766,2927 @@ int32_t indef_array_and_map_test()
 
     return 0;
 }
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_batch_test()
+{
+#define BATCH_TEST_COUNT 11
+#define BATCH_TEST_SHORT_BUF_INDEX 3
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    enum t_cose_err_t               result;
+    struct q_useful_buf_c           payloads[BATCH_TEST_COUNT];
+    struct q_useful_buf             out_bufs[BATCH_TEST_COUNT];
+    struct q_useful_buf_c           results[BATCH_TEST_COUNT];
+    enum t_cose_err_t               item_errors[BATCH_TEST_COUNT];
+    uint8_t                         out_storage[BATCH_TEST_COUNT][150];
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 150);
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           payload;
+    size_t                          i;
+
+    /* More than T_COSE_SIGN1_BATCH_CHUNK_SIZE messages so more
+     * than one chunk is signed. Payloads vary in length. */
+    for(i = 0; i < BATCH_TEST_COUNT; i++) {
+        payloads[i] = q_useful_buf_head(s_input_payload, 10 + i);
+        out_bufs[i] = (struct q_useful_buf){out_storage[i], sizeof(out_storage[i])};
+    }
+    /* One message won't fit, but shouldn't affect the others */
+    out_bufs[BATCH_TEST_SHORT_BUF_INDEX].len = 20;
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+
+    result = t_cose_sign1_sign_batch(&sign_ctx,
+                                     payloads,
+                                     out_bufs,
+                                     results,
+                                     item_errors,
+                                     BATCH_TEST_COUNT);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 1000 + (int32_t)result;
+    }
+
+    for(i = 0; i < BATCH_TEST_COUNT; i++) {
+        if(i == BATCH_TEST_SHORT_BUF_INDEX) {
+            if(item_errors[i] != T_COSE_ERR_TOO_SMALL ||
+               !q_useful_buf_c_is_null(results[i])) {
+                return 2000 + (int32_t)item_errors[i];
+            }
+            continue;
+        }
+        if(item_errors[i] != T_COSE_SUCCESS) {
+            return 3000 + (int32_t)item_errors[i];
+        }
+
+        /* Short-circuit signatures are deterministic so the output
+         * must be exactly that of the non-batch API. */
+        t_cose_sign1_sign_init(&sign_ctx,
+                               T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                               T_COSE_ALGORITHM_ES256);
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   payloads[i],
+                                   signed_cose_buffer,
+                                  &signed_cose);
+        if(result) {
+            return 4000 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(signed_cose, results[i])) {
+            return 5000 + (int32_t)i;
+        }
+
+        t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+        result = t_cose_sign1_verify(&verify_ctx, results[i], &payload, NULL);
+        if(result) {
+            return 6000 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(payload, payloads[i])) {
+            return 7000 + (int32_t)i;
+        }
+    }
+
+    /* --- Size calculation --- */
+    for(i = 0; i < BATCH_TEST_COUNT; i++) {
+        out_bufs[i] = (struct q_useful_buf){NULL, SIZE_MAX};
+    }
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_batch(&sign_ctx,
+                                     payloads,
+                                     out_bufs,
+                                     results,
+                                     item_errors,
+                                     BATCH_TEST_COUNT);
+    if(result) {
+        return 8000 + (int32_t)result;
+    }
+    /* Each payload is one byte longer than the previous */
+    for(i = 1; i < BATCH_TEST_COUNT; i++) {
+        if(results[i].len != results[i-1].len + 1) {
+            return 8100 + (int32_t)i;
+        }
+    }
+
+    /* --- An error common to all messages --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           0xffff);
+    result = t_cose_sign1_sign_batch(&sign_ctx,
+                                     payloads,
+                                     out_bufs,
+                                     results,
+                                     item_errors,
+                                     BATCH_TEST_COUNT);
+    if(result != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+        return 9000 + (int32_t)result;
+    }
+    for(i = 0; i < BATCH_TEST_COUNT; i++) {
+        if(item_errors[i] != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+            return 9100 + (int32_t)i;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_midstate_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    struct t_cose_sign1_midstate    midstate;
+    enum t_cose_err_t               result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     midstate_cose_buffer, 200);
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           midstate_cose;
+    struct q_useful_buf_c           payload;
+    struct q_useful_buf_c           payloads[3];
+    struct q_useful_buf             out_bufs[3];
+    struct q_useful_buf_c           results[3];
+    enum t_cose_err_t               item_errors[3];
+    uint8_t                         out_storage[3][150];
+    size_t                          i;
+
+    /* --- Sign without and then with a midstate --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_aad(&sign_ctx,
+                                    s_input_payload,
+                                    Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad"),
+                                    signed_cose_buffer,
+                                   &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    result = t_cose_sign1_sign_set_midstate(&sign_ctx, &midstate);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+
+    /* Twice to show the midstate is not used up by signing */
+    for(i = 0; i < 2; i++) {
+        result = t_cose_sign1_sign_aad(&sign_ctx,
+                                        s_input_payload,
+                                        Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad"),
+                                        midstate_cose_buffer,
+                                       &midstate_cose);
+        if(result) {
+            t_cose_sign1_midstate_free(&midstate);
+            return 3000 + (int32_t)result;
+        }
+
+        /* Short-circuit signatures are deterministic so the output
+         * must be exactly the same. */
+        if(q_useful_buf_compare(signed_cose, midstate_cose)) {
+            t_cose_sign1_midstate_free(&midstate);
+            return 4000 + (int32_t)i;
+        }
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_aad(&verify_ctx,
+                                     midstate_cose,
+                                     Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad"),
+                                     &payload,
+                                     NULL);
+    if(result) {
+        t_cose_sign1_midstate_free(&midstate);
+        return 5000 + (int32_t)result;
+    }
+
+    /* --- Batch signing with a midstate --- */
+    for(i = 0; i < 3; i++) {
+        payloads[i] = q_useful_buf_head(s_input_payload, 10 + i);
+        out_bufs[i] = (struct q_useful_buf){out_storage[i], sizeof(out_storage[i])};
+    }
+    result = t_cose_sign1_sign_batch(&sign_ctx,
+                                     payloads,
+                                     out_bufs,
+                                     results,
+                                     item_errors,
+                                     3);
+    t_cose_sign1_midstate_free(&midstate);
+    if(result) {
+        return 6000 + (int32_t)result;
+    }
+    for(i = 0; i < 3; i++) {
+        t_cose_sign1_sign_init(&sign_ctx,
+                               T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                               T_COSE_ALGORITHM_ES256);
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   payloads[i],
+                                   signed_cose_buffer,
+                                  &signed_cose);
+        if(result) {
+            return 7000 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(signed_cose, results[i])) {
+            return 7100 + (int32_t)i;
+        }
+    }
+
+    /* --- Unsupported algorithm --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           0xffff);
+    result = t_cose_sign1_sign_set_midstate(&sign_ctx, &midstate);
+    if(result != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+        return 8000 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_header_template_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    enum t_cose_err_t               result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     template_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     template_buffer, 80);
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           template_cose;
+    struct q_useful_buf_c           payload;
+    struct t_cose_parameters        parameters;
+    int                             i;
+    /* {4: h'0102', 3: 42} which is what t_cose outputs for a kid
+     * of 0x01 0x02 and CoAP content type 42. */
+    static const uint8_t            unprotected_map[] = {
+        0xa2, 0x04, 0x42, 0x01, 0x02, 0x03, 0x18, 0x2a};
+    static const uint8_t            kid_bytes[] = {0x01, 0x02};
+
+    /* --- Sign without and then with a header template --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               s_input_payload,
+                               signed_cose_buffer,
+                              &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    result = t_cose_sign1_sign_set_header_template(&sign_ctx, template_buffer);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+
+    /* Twice, including making the template twice */
+    for(i = 0; i < 2; i++) {
+        if(i == 1) {
+            result = t_cose_sign1_sign_set_header_template(&sign_ctx,
+                                                           template_buffer);
+            if(result) {
+                return 2100 + (int32_t)result;
+            }
+        }
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   s_input_payload,
+                                   template_cose_buffer,
+                                  &template_cose);
+        if(result) {
+            return 3000 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(signed_cose, template_cose)) {
+            return 3100 + i;
+        }
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify(&verify_ctx, template_cose, &payload, NULL);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+
+    /* --- Template buffer too small --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_set_header_template(&sign_ctx,
+                                                   (struct q_useful_buf){template_buffer.ptr, 10});
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 5000 + (int32_t)result;
+    }
+
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    /* --- Caller-encoded unprotected parameters --- */
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_signing_key(&sign_ctx,
+                                 T_COSE_NULL_KEY,
+                                 Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(kid_bytes));
+    t_cose_sign1_set_content_type_uint(&sign_ctx, 42);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               s_input_payload,
+                               signed_cose_buffer,
+                              &signed_cose);
+    if(result) {
+        return 6000 + (int32_t)result;
+    }
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_set_encoded_unprotected_parameters(&sign_ctx,
+                                                    Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(unprotected_map));
+    for(i = 0; i < 2; i++) {
+        if(i == 1) {
+            /* Also with the protected parameters in a template */
+            result = t_cose_sign1_sign_set_header_template(&sign_ctx,
+                                                           template_buffer);
+            if(result) {
+                return 7000 + (int32_t)result;
+            }
+        }
+        result = t_cose_sign1_sign(&sign_ctx,
+                                   s_input_payload,
+                                   template_cose_buffer,
+                                  &template_cose);
+        if(result) {
+            return 7100 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(signed_cose, template_cose)) {
+            return 7200 + i;
+        }
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
+    result = t_cose_sign1_verify(&verify_ctx,
+                                 template_cose,
+                                 &payload,
+                                 &parameters);
+    if(result) {
+        return 8000 + (int32_t)result;
+    }
+    if(q_useful_buf_compare(parameters.kid,
+                            Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(kid_bytes))) {
+        return 8100;
+    }
+    if(parameters.content_type_uint != 42) {
+        return 8200;
+    }
+#else
+    (void)parameters;
+    (void)unprotected_map;
+    (void)kid_bytes;
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_sign_stream_test()
+{
+    struct t_cose_sign1_sign_ctx     sign_ctx;
+    struct t_cose_sign1_verify_ctx   verify_ctx;
+    struct t_cose_sign1_sign_stream  stream;
+    enum t_cose_err_t                result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(      signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(      stream_cose_buffer, 200);
+    struct q_useful_buf_c            signed_cose;
+    struct q_useful_buf_c            stream_cose;
+    struct q_useful_buf_c            aad;
+    size_t                           offset;
+    size_t                           chunk_len;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        s_input_payload,
+                                        signed_cose_buffer,
+                                       &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- Same payload in uneven chunks including an empty one --- */
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx,
+                                              &stream,
+                                              aad,
+                                              s_input_payload.len);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_update(&stream, NULL_Q_USEFUL_BUF_C);
+    for(offset = 0; offset < s_input_payload.len; offset += chunk_len) {
+        chunk_len = s_input_payload.len - offset;
+        if(chunk_len > 7) {
+            chunk_len = 7;
+        }
+        t_cose_sign1_sign_detached_update(&stream,
+                                          (struct q_useful_buf_c){
+                                              (const uint8_t *)s_input_payload.ptr + offset,
+                                              chunk_len});
+    }
+    result = t_cose_sign1_sign_detached_finish(&sign_ctx,
+                                               &stream,
+                                               stream_cose_buffer,
+                                               &stream_cose);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+
+    /* Short-circuit signatures are deterministic so the output must
+     * be exactly the same. */
+    if(q_useful_buf_compare(signed_cose, stream_cose)) {
+        return 4000;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          stream_cose,
+                                          aad,
+                                          s_input_payload,
+                                          NULL);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+
+    /* --- Less payload than declared --- */
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx,
+                                              &stream,
+                                              aad,
+                                              s_input_payload.len + 1);
+    if(result) {
+        return 6000 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_update(&stream, s_input_payload);
+    result = t_cose_sign1_sign_detached_finish(&sign_ctx,
+                                               &stream,
+                                               stream_cose_buffer,
+                                               &stream_cose);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return 6100 + (int32_t)result;
+    }
+
+    /* --- More payload than declared --- */
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx,
+                                              &stream,
+                                              aad,
+                                              s_input_payload.len - 1);
+    if(result) {
+        return 7000 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_update(&stream, s_input_payload);
+    result = t_cose_sign1_sign_detached_finish(&sign_ctx,
+                                               &stream,
+                                               stream_cose_buffer,
+                                               &stream_cose);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return 7100 + (int32_t)result;
+    }
+
+    /* --- Abandoned stream --- */
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx,
+                                              &stream,
+                                              aad,
+                                              s_input_payload.len);
+    if(result) {
+        return 8000 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_abort(&stream);
+
+    /* --- A failed begin followed by a finish anyway --- */
+    /* Zero is what a successful begin leaves in the stream */
+    memset(&stream, 0, sizeof(stream));
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, 0);
+    result = t_cose_sign1_sign_detached_begin(&sign_ctx,
+                                              &stream,
+                                              aad,
+                                              s_input_payload.len);
+    if(result != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+        return 9000 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_update(&stream, s_input_payload);
+    result = t_cose_sign1_sign_detached_finish(&sign_ctx,
+                                               &stream,
+                                               stream_cose_buffer,
+                                               &stream_cose);
+    if(result != T_COSE_ERR_UNSUPPORTED_SIGNING_ALG) {
+        return 9100 + (int32_t)result;
+    }
+    t_cose_sign1_sign_detached_abort(&stream);
+
+    return 0;
+}
+
+
+/*
+ * Feed a payload in uneven chunks to a streaming verify.
+ */
+static void verify_stream_in_chunks(struct t_cose_sign1_verify_stream *stream,
+                                    struct q_useful_buf_c              payload)
+{
+    size_t offset;
+    size_t chunk_len;
+
+    for(offset = 0; offset < payload.len; offset += chunk_len) {
+        chunk_len = payload.len - offset;
+        if(chunk_len > 5) {
+            chunk_len = 5;
+        }
+        t_cose_sign1_verify_detached_update(stream,
+                                            (struct q_useful_buf_c){
+                                                (const uint8_t *)payload.ptr + offset,
+                                                chunk_len});
+    }
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_verify_stream_test()
+{
+    struct t_cose_sign1_sign_ctx       sign_ctx;
+    struct t_cose_sign1_verify_ctx     verify_ctx;
+    struct t_cose_sign1_verify_stream  stream;
+    struct t_cose_parameters           parameters;
+    enum t_cose_err_t                  result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(        signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(        payload_copy_buffer, 100);
+    struct q_useful_buf_c              signed_cose;
+    struct q_useful_buf_c              payload_copy;
+    struct q_useful_buf_c              aad;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        s_input_payload,
+                                        signed_cose_buffer,
+                                       &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- Successful verification --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                s_input_payload.len,
+                                                &parameters);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    if(parameters.cose_algorithm_id != T_COSE_ALGORITHM_ES256) {
+        return 2100;
+    }
+    verify_stream_in_chunks(&stream, s_input_payload);
+    result = t_cose_sign1_verify_detached_finish(&verify_ctx, &stream);
+    if(result) {
+        return 2200 + (int32_t)result;
+    }
+
+    /* --- Modified payload --- */
+    payload_copy = q_useful_buf_copy(payload_copy_buffer, s_input_payload);
+    ((uint8_t *)payload_copy_buffer.ptr)[payload_copy.len - 1] ^= 0x01;
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                payload_copy.len,
+                                                NULL);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+    verify_stream_in_chunks(&stream, payload_copy);
+    result = t_cose_sign1_verify_detached_finish(&verify_ctx, &stream);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 3100 + (int32_t)result;
+    }
+
+    /* --- Payload length different from declared --- */
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                s_input_payload.len + 1,
+                                                NULL);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    verify_stream_in_chunks(&stream, s_input_payload);
+    result = t_cose_sign1_verify_detached_finish(&verify_ctx, &stream);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return 4100 + (int32_t)result;
+    }
+
+    /* --- Abandoned verification --- */
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                s_input_payload.len,
+                                                NULL);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+    t_cose_sign1_verify_detached_abort(&stream);
+
+    /* --- Short-circuit not allowed is caught before the payload --- */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                s_input_payload.len,
+                                                NULL);
+    if(result != T_COSE_ERR_SHORT_CIRCUIT_SIG) {
+        return 6000 + (int32_t)result;
+    }
+    /* Going on anyway still fails */
+    verify_stream_in_chunks(&stream, s_input_payload);
+    result = t_cose_sign1_verify_detached_finish(&verify_ctx, &stream);
+    if(result != T_COSE_ERR_SHORT_CIRCUIT_SIG) {
+        return 6100 + (int32_t)result;
+    }
+
+    /* --- Decode only --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
+    result = t_cose_sign1_verify_detached_begin(&verify_ctx,
+                                                &stream,
+                                                signed_cose,
+                                                aad,
+                                                s_input_payload.len,
+                                                NULL);
+    if(result) {
+        return 7000 + (int32_t)result;
+    }
+    verify_stream_in_chunks(&stream, s_input_payload);
+    result = t_cose_sign1_verify_detached_finish(&verify_ctx, &stream);
+    if(result) {
+        return 7100 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_verify_prepare_test()
+{
+    struct t_cose_sign1_sign_ctx        sign_ctx;
+    struct t_cose_sign1_verify_ctx      verify_ctx;
+    struct t_cose_sign1_verify_prepared prepared;
+    enum t_cose_err_t                   result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(         signed_cose_buffer, 200);
+    struct q_useful_buf_c               signed_cose;
+    struct q_useful_buf_c               payload;
+    size_t                              offset;
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign(&sign_ctx, s_input_payload, signed_cose_buffer, &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- Header parameter checks are done by the prepare --- */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result != T_COSE_ERR_SHORT_CIRCUIT_SIG) {
+        return 2000 + (int32_t)result;
+    }
+
+    /* --- Good message --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+    if(q_useful_buf_compare(payload, s_input_payload)) {
+        return 3100;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result) {
+        return 3200 + (int32_t)result;
+    }
+
+    /* --- The hash made by the prepare covers the payload --- */
+    offset = (size_t)((const uint8_t *)payload.ptr - (const uint8_t *)signed_cose.ptr);
+    ((uint8_t *)signed_cose_buffer.ptr)[offset]++;
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 4100 + (int32_t)result;
+    }
+
+    /* --- Decode only leaves nothing to complete --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
+    result = t_cose_sign1_verify_prepare(&verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         &payload,
+                                         NULL,
+                                         &prepared);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+    result = t_cose_sign1_verify_complete(&prepared);
+    if(result) {
+        return 5100 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_in_place_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    enum t_cose_err_t               result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     expected_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     packet_buffer, 300);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     template_buffer, 80);
+    struct q_useful_buf_c           expected;
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           payload;
+    struct q_useful_buf_c           aad;
+    const size_t                    payload_offset = 100;
+    int                             i;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_aad(&sign_ctx,
+                                   s_input_payload,
+                                   aad,
+                                   expected_buffer,
+                                  &expected);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* Without and then with a header template */
+    for(i = 0; i < 2; i++) {
+        if(i == 1) {
+            result = t_cose_sign1_sign_set_header_template(&sign_ctx,
+                                                           template_buffer);
+            if(result) {
+                return 2000 + (int32_t)result;
+            }
+        }
+
+        q_useful_buf_set(packet_buffer, 0xff);
+        memcpy((uint8_t *)packet_buffer.ptr + payload_offset,
+               s_input_payload.ptr,
+               s_input_payload.len);
+        result = t_cose_sign1_sign_in_place(&sign_ctx,
+                                            aad,
+                                            packet_buffer,
+                                            payload_offset,
+                                            s_input_payload.len,
+                                           &signed_cose);
+        if(result) {
+            return 3000 + i * 100 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(signed_cose, expected)) {
+            return 3010 + i * 100;
+        }
+
+        t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+        result = t_cose_sign1_verify_aad(&verify_ctx,
+                                         signed_cose,
+                                         aad,
+                                         &payload,
+                                         NULL);
+        if(result) {
+            return 4000 + i * 100 + (int32_t)result;
+        }
+        /* The payload must be where it was put */
+        if(payload.ptr != (uint8_t *)packet_buffer.ptr + payload_offset ||
+           q_useful_buf_compare(payload, s_input_payload)) {
+            return 4010 + i * 100;
+        }
+    }
+
+    /* --- Not enough headroom --- */
+    result = t_cose_sign1_sign_in_place(&sign_ctx,
+                                        aad,
+                                        packet_buffer,
+                                        10,
+                                        s_input_payload.len,
+                                       &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 5000 + (int32_t)result;
+    }
+
+    /* --- Not enough tailroom --- */
+    /* One short of the 66 bytes for an encoded ES256 signature */
+    result = t_cose_sign1_sign_in_place(&sign_ctx,
+                                        aad,
+                                        (struct q_useful_buf){packet_buffer.ptr,
+                                            payload_offset + s_input_payload.len + 65},
+                                        payload_offset,
+                                        s_input_payload.len,
+                                       &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 6000 + (int32_t)result;
+    }
+
+    /* --- Payload not in the buffer --- */
+    result = t_cose_sign1_sign_in_place(&sign_ctx,
+                                        aad,
+                                        packet_buffer,
+                                        payload_offset,
+                                        packet_buffer.len,
+                                       &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 7000 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Payload encoder for short_circuit_encode_payload_test(). The
+ * context is the value for claim 2 or NULL to fail.
+ */
+static enum t_cose_err_t encode_test_claims(void               *payload_ctx,
+                                            QCBOREncodeContext *cbor_encode_ctx)
+{
+    if(payload_ctx == NULL) {
+        return T_COSE_ERR_FAIL;
+    }
+    QCBOREncode_OpenMap(cbor_encode_ctx);
+    QCBOREncode_AddSZStringToMapN(cbor_encode_ctx, 1, "issuer");
+    QCBOREncode_AddInt64ToMapN(cbor_encode_ctx, 2, *(int64_t *)payload_ctx);
+    QCBOREncode_CloseMap(cbor_encode_ctx);
+
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_encode_payload_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    enum t_cose_err_t               result;
+    QCBOREncodeContext              cbor_encode;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     payload_buffer, 50);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     expected_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+    struct q_useful_buf_c           payload;
+    struct q_useful_buf_c           expected;
+    struct q_useful_buf_c           signed_cose;
+    struct q_useful_buf_c           verified_payload;
+    struct q_useful_buf_c           aad;
+    int64_t                         claim_value = 42;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+
+    /* --- The old way with an intermediate payload buffer --- */
+    QCBOREncode_Init(&cbor_encode, payload_buffer);
+    encode_test_claims(&claim_value, &cbor_encode);
+    if(QCBOREncode_Finish(&cbor_encode, &payload)) {
+        return 1000;
+    }
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_aad(&sign_ctx,
+                                   payload,
+                                   aad,
+                                   expected_buffer,
+                                  &expected);
+    if(result) {
+        return 1100 + (int32_t)result;
+    }
+
+    /* --- Encoded straight into the output --- */
+    result = t_cose_sign1_sign_encode_payload(&sign_ctx,
+                                              aad,
+                                              encode_test_claims,
+                                              &claim_value,
+                                              signed_cose_buffer,
+                                             &signed_cose);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    if(q_useful_buf_compare(signed_cose, expected)) {
+        return 2100;
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_aad(&verify_ctx,
+                                     signed_cose,
+                                     aad,
+                                     &verified_payload,
+                                     NULL);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+    if(q_useful_buf_compare(verified_payload, payload)) {
+        return 3100;
+    }
+
+    /* --- Size calculation --- */
+    result = t_cose_sign1_sign_encode_payload(&sign_ctx,
+                                              aad,
+                                              encode_test_claims,
+                                              &claim_value,
+                                              (struct q_useful_buf){NULL, INT32_MAX},
+                                             &signed_cose);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    if(signed_cose.len != expected.len) {
+        return 4100;
+    }
+
+    /* --- Error from the payload encoder --- */
+    result = t_cose_sign1_sign_encode_payload(&sign_ctx,
+                                              aad,
+                                              encode_test_claims,
+                                              NULL,
+                                              signed_cose_buffer,
+                                             &signed_cose);
+    if(result != T_COSE_ERR_FAIL) {
+        return 5000 + (int32_t)result;
+    }
+
+    /* --- Output buffer too small --- */
+    result = t_cose_sign1_sign_encode_payload(&sign_ctx,
+                                              aad,
+                                              encode_test_claims,
+                                              &claim_value,
+                                              (struct q_useful_buf){signed_cose_buffer.ptr,
+                                                                    expected.len - 1},
+                                             &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 6000 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_external_sign_test()
+{
+    struct t_cose_sign1_sign_ctx      sign_ctx;
+    struct t_cose_sign1_verify_ctx    verify_ctx;
+    struct t_cose_sign1_sign_pending  pending[3];
+    enum t_cose_err_t                 result;
+    Q_USEFUL_BUF_MAKE_STACK_UB(       expected_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(       signature_buffer, T_COSE_EC_P256_SIG_SIZE);
+    uint8_t                           out_bytes[3][200];
+    struct q_useful_buf_c             expected;
+    struct q_useful_buf_c             tbs_hash[3];
+    struct q_useful_buf_c             signature;
+    struct q_useful_buf_c             signed_cose;
+    struct q_useful_buf_c             payload;
+    struct q_useful_buf_c             aad;
+    int                               i;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign_aad(&sign_ctx,
+                                   s_input_payload,
+                                   aad,
+                                   expected_buffer,
+                                  &expected);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- Several waiting on the signer at once --- */
+    for(i = 0; i < 3; i++) {
+        result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                                  aad,
+                                                  s_input_payload,
+                                                  Q_USEFUL_BUF_FROM_BYTE_ARRAY(out_bytes[i]),
+                                                  &pending[i],
+                                                  &tbs_hash[i]);
+        if(result) {
+            return 2000 + i * 100 + (int32_t)result;
+        }
+    }
+
+    /* The signatures come back in a different order */
+    for(i = 2; i >= 0; i--) {
+        result = t_cose_sign1_sign_external_local(&sign_ctx,
+                                                  tbs_hash[i],
+                                                  signature_buffer,
+                                                  &signature);
+        if(result) {
+            return 3000 + i * 100 + (int32_t)result;
+        }
+        result = t_cose_sign1_sign_external_finish(&pending[i],
+                                                   signature,
+                                                   &signed_cose);
+        if(result) {
+            return 3010 + i * 100 + (int32_t)result;
+        }
+        if(signed_cose.ptr != out_bytes[i] ||
+           q_useful_buf_compare(signed_cose, expected)) {
+            return 3020 + i * 100;
+        }
+    }
+
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_aad(&verify_ctx,
+                                     signed_cose,
+                                     aad,
+                                     &payload,
+                                     NULL);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+
+    /* --- Detached payload --- */
+    result = t_cose_sign1_sign_external_begin_detached(&sign_ctx,
+                                                       aad,
+                                                       s_input_payload,
+                                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY(out_bytes[0]),
+                                                       &pending[0],
+                                                       &tbs_hash[0]);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign_external_local(&sign_ctx,
+                                              tbs_hash[0],
+                                              signature_buffer,
+                                              &signature);
+    if(result) {
+        return 5010 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign_external_finish(&pending[0],
+                                               signature,
+                                               &signed_cose);
+    if(result) {
+        return 5020 + (int32_t)result;
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          aad,
+                                          s_input_payload,
+                                          NULL);
+    if(result) {
+        return 5030 + (int32_t)result;
+    }
+
+    /* --- Signature the wrong size --- */
+    result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                              aad,
+                                              s_input_payload,
+                                              Q_USEFUL_BUF_FROM_BYTE_ARRAY(out_bytes[0]),
+                                              &pending[0],
+                                              &tbs_hash[0]);
+    if(result) {
+        return 6000 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign_external_finish(&pending[0],
+                                               (struct q_useful_buf_c){signature.ptr,
+                                                                       signature.len - 1},
+                                               &signed_cose);
+    if(result != T_COSE_ERR_SIG_FAIL) {
+        return 6010 + (int32_t)result;
+    }
+
+    /* --- Room for all but the signature --- */
+    /* The 66 bytes for an encoded ES256 signature are missing */
+    result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                              aad,
+                                              s_input_payload,
+                                              (struct q_useful_buf){out_bytes[0],
+                                                                    expected.len - 66},
+                                              &pending[0],
+                                              &tbs_hash[0]);
+    if(result) {
+        return 7000 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign_external_finish(&pending[0],
+                                               signature,
+                                               &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 7010 + (int32_t)result;
+    }
+
+    /* --- No room for the payload --- */
+    result = t_cose_sign1_sign_external_begin(&sign_ctx,
+                                              aad,
+                                              s_input_payload,
+                                              (struct q_useful_buf){out_bytes[0], 20},
+                                              &pending[0],
+                                              &tbs_hash[0]);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 8000 + (int32_t)result;
+    }
+
+    return 0;
+}
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+
+/*
+ * Write all of a buffer to a file descriptor. Returns 0 on success.
+ */
+static int write_all(int fd, struct q_useful_buf_c buf)
+{
+    size_t  offset;
+    ssize_t written;
+
+    for(offset = 0; offset < buf.len; offset += (size_t)written) {
+        written = write(fd, (const uint8_t *)buf.ptr + offset, buf.len - offset);
+        if(written <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t short_circuit_file_test()
+{
+    struct t_cose_sign1_sign_ctx   sign_ctx;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    enum t_cose_err_t              result;
+    int_fast32_t                   return_value;
+    Q_USEFUL_BUF_MAKE_STACK_UB(    expected_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(    signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(    read_buffer, 1000);
+    struct q_useful_buf_c          expected;
+    struct q_useful_buf_c          signed_cose;
+    struct q_useful_buf_c          aad;
+    struct q_useful_buf_c          payload;
+    static uint8_t                 payload_bytes[100000];
+    char                           path[] = "/tmp/t_cose_file_test_XXXXXX";
+    int                            fd;
+    int                            pipe_fds[2];
+    size_t                         i;
+
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+    for(i = 0; i < sizeof(payload_bytes); i++) {
+        payload_bytes[i] = (uint8_t)(i * 7);
+    }
+    payload = (struct q_useful_buf_c){payload_bytes, sizeof(payload_bytes)};
+
+    fd = mkstemp(path);
+    if(fd < 0) {
+        return 1000;
+    }
+    if(write_all(fd, payload)) {
+        return_value = 1100;
+        goto Done;
+    }
+
+    t_cose_sign1_sign_init(&sign_ctx,
+                           T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                           T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        payload,
+                                        expected_buffer,
+                                       &expected);
+    if(result) {
+        return_value = 1200 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Sign from a file descriptor using the file size --- */
+    lseek(fd, 0, SEEK_SET);
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           fd,
+                                           T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                           NULL_Q_USEFUL_BUF,
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result) {
+        return_value = 2000 + (int32_t)result;
+        goto Done;
+    }
+    if(q_useful_buf_compare(signed_cose, expected)) {
+        return_value = 2100;
+        goto Done;
+    }
+    if(lseek(fd, 0, SEEK_CUR) != (off_t)payload.len) {
+        return_value = 2200;
+        goto Done;
+    }
+
+    /* --- Sign from a path --- */
+    result = t_cose_sign1_sign_detached_file(&sign_ctx,
+                                             aad,
+                                             path,
+                                             NULL_Q_USEFUL_BUF,
+                                             signed_cose_buffer,
+                                            &signed_cose);
+    if(result) {
+        return_value = 3000 + (int32_t)result;
+        goto Done;
+    }
+    if(q_useful_buf_compare(signed_cose, expected)) {
+        return_value = 3100;
+        goto Done;
+    }
+
+    /* --- Verify from a file descriptor and a path --- */
+    lseek(fd, 0, SEEK_SET);
+    result = t_cose_sign1_verify_detached_fd(&verify_ctx,
+                                             expected,
+                                             aad,
+                                             fd,
+                                             T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                             NULL_Q_USEFUL_BUF,
+                                             NULL);
+    if(result) {
+        return_value = 4000 + (int32_t)result;
+        goto Done;
+    }
+    result = t_cose_sign1_verify_detached_file(&verify_ctx,
+                                               expected,
+                                               aad,
+                                               path,
+                                               NULL_Q_USEFUL_BUF,
+                                               NULL);
+    if(result) {
+        return_value = 4100 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Payload starting part way into the file, not page aligned --- */
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        q_useful_buf_tail(payload, 5001),
+                                        expected_buffer,
+                                       &expected);
+    if(result) {
+        return_value = 5000 + (int32_t)result;
+        goto Done;
+    }
+    lseek(fd, 5001, SEEK_SET);
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           fd,
+                                           T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                           NULL_Q_USEFUL_BUF,
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result) {
+        return_value = 5100 + (int32_t)result;
+        goto Done;
+    }
+    if(q_useful_buf_compare(signed_cose, expected)) {
+        return_value = 5200;
+        goto Done;
+    }
+
+    /* --- Payload length longer than the file --- */
+    lseek(fd, 0, SEEK_SET);
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           fd,
+                                           payload.len + 1,
+                                           NULL_Q_USEFUL_BUF,
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return_value = 6000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Nonexistent file --- */
+    result = t_cose_sign1_sign_detached_file(&sign_ctx,
+                                             aad,
+                                             "/nonexistent/t_cose_payload",
+                                             NULL_Q_USEFUL_BUF,
+                                             signed_cose_buffer,
+                                            &signed_cose);
+    if(result != T_COSE_ERR_FILE_IO) {
+        return_value = 7000 + (int32_t)result;
+        goto Done;
+    }
+
+    /* --- Read from a pipe through the read buffer --- */
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        s_input_payload,
+                                        expected_buffer,
+                                       &expected);
+    if(result) {
+        return_value = 8000 + (int32_t)result;
+        goto Done;
+    }
+    if(pipe(pipe_fds)) {
+        return_value = 8100;
+        goto Done;
+    }
+    /* Small enough to not block on the pipe */
+    write_all(pipe_fds[1], s_input_payload);
+    write_all(pipe_fds[1], s_input_payload);
+    close(pipe_fds[1]);
+
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           pipe_fds[0],
+                                           T_COSE_PAYLOAD_LEN_FROM_FILE,
+                                           read_buffer,
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return_value = 8200 + (int32_t)result;
+        goto ClosePipe;
+    }
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           pipe_fds[0],
+                                           s_input_payload.len,
+                                           NULL_Q_USEFUL_BUF,
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return_value = 8300 + (int32_t)result;
+        goto ClosePipe;
+    }
+    /* The first copy of the payload, in small reads */
+    result = t_cose_sign1_sign_detached_fd(&sign_ctx,
+                                           aad,
+                                           pipe_fds[0],
+                                           s_input_payload.len,
+                                           (struct q_useful_buf){read_buffer.ptr, 3},
+                                           signed_cose_buffer,
+                                          &signed_cose);
+    if(result) {
+        return_value = 8400 + (int32_t)result;
+        goto ClosePipe;
+    }
+    if(q_useful_buf_compare(signed_cose, expected)) {
+        return_value = 8500;
+        goto ClosePipe;
+    }
+    /* The second copy, but the pipe ends before the length given */
+    result = t_cose_sign1_verify_detached_fd(&verify_ctx,
+                                             expected,
+                                             aad,
+                                             pipe_fds[0],
+                                             s_input_payload.len + 1,
+                                             read_buffer,
+                                             NULL);
+    if(result != T_COSE_ERR_PAYLOAD_LENGTH) {
+        return_value = 8600 + (int32_t)result;
+        goto ClosePipe;
+    }
+
+    return_value = 0;
+
+ClosePipe:
+    close(pipe_fds[0]);
+Done:
+    close(fd);
+    unlink(path);
+    return return_value;
+}
+
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+
+/* Counts calls from the kid cache in key_resolver_test() */
+struct test_resolver_counts {
+    int      resolved;
+    int      evicted;
+    uint64_t last_evicted;
+};
+
+
+/*
+ * The key for a two byte kid is a handle with the value of the kid.
+ * kids starting with 0xff are unknown. Longer kids get handle 9999.
+ */
+static enum t_cose_err_t
+test_kid_resolver(void                  *cb_context,
+                  int32_t                cose_algorithm_id,
+                  struct q_useful_buf_c  kid,
+                  struct t_cose_key     *key)
+{
+    struct test_resolver_counts *counts = (struct test_resolver_counts *)cb_context;
+    const uint8_t               *kid_bytes = (const uint8_t *)kid.ptr;
+
+    (void)cose_algorithm_id;
+
+    counts->resolved++;
+    if(kid.len < 2 || kid_bytes[0] == 0xff) {
+        return T_COSE_ERR_UNKNOWN_KEY;
+    }
+    key->crypto_lib   = T_COSE_CRYPTO_LIB_UNIDENTIFIED;
+    key->k.key_handle = kid.len == 2 ? (uint64_t)((kid_bytes[0] << 8) + kid_bytes[1]) : 9999;
+
+    return T_COSE_SUCCESS;
+}
+
+
+static void
+test_key_evicted(void *cb_context, struct t_cose_key key)
+{
+    struct test_resolver_counts *counts = (struct test_resolver_counts *)cb_context;
+
+    counts->evicted++;
+    counts->last_evicted = key.k.key_handle;
+}
+
+
+/*
+ * Look up kid number n in the cache and check the key is right.
+ */
+static enum t_cose_err_t
+resolve_test_kid(struct t_cose_kid_cache *cache, unsigned n)
+{
+    uint8_t           kid_bytes[2];
+    struct t_cose_key key;
+    enum t_cose_err_t result;
+
+    kid_bytes[0] = (uint8_t)(n >> 8);
+    kid_bytes[1] = (uint8_t)n;
+
+    result = t_cose_kid_cache_resolve(cache,
+                                      T_COSE_ALGORITHM_ES256,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(kid_bytes),
+                                     &key);
+    if(result == T_COSE_SUCCESS && key.k.key_handle != n) {
+        result = T_COSE_ERR_FAIL;
+    }
+    return result;
+}
+
+
+static enum t_cose_err_t
+always_unknown_resolver(void                  *cb_context,
+                        int32_t                cose_algorithm_id,
+                        struct q_useful_buf_c  kid,
+                        struct t_cose_key     *key)
+{
+    (void)cb_context;
+    (void)cose_algorithm_id;
+    (void)kid;
+    (void)key;
+
+    return T_COSE_ERR_UNKNOWN_KEY;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t key_resolver_test()
+{
+    struct t_cose_kid_cache     cache;
+    struct test_resolver_counts counts = {0, 0, 0};
+    enum t_cose_err_t           result;
+    struct t_cose_key           key;
+    unsigned                    i;
+    unsigned                    n;
+    static const uint8_t        unknown_kid[] = {0xff, 0x00};
+    static const uint8_t        kid_5[] = {0x00, 0x05};
+    static const uint8_t        long_kid[T_COSE_KID_CACHE_MAX_KID_SIZE + 1] = {1};
+
+    t_cose_kid_cache_init(&cache, test_kid_resolver, test_key_evicted, &counts);
+
+    /* --- Fill the cache, then everything is a hit --- */
+    for(i = 0; i < T_COSE_KID_CACHE_SIZE; i++) {
+        result = resolve_test_kid(&cache, i);
+        if(result) {
+            return 1000 + (int32_t)result;
+        }
+    }
+    for(i = 0; i < T_COSE_KID_CACHE_SIZE; i++) {
+        result = resolve_test_kid(&cache, i);
+        if(result) {
+            return 1100 + (int32_t)result;
+        }
+    }
+    if(counts.resolved != T_COSE_KID_CACHE_SIZE || counts.evicted != 0) {
+        return 1200;
+    }
+
+    /* --- The least recently used is evicted --- */
+    /* Using 0 makes 1 the least recently used */
+    resolve_test_kid(&cache, 0);
+    result = resolve_test_kid(&cache, T_COSE_KID_CACHE_SIZE);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    if(counts.evicted != 1 || counts.last_evicted != 1) {
+        return 2100;
+    }
+    resolve_test_kid(&cache, 0);
+    if(counts.resolved != T_COSE_KID_CACHE_SIZE + 1) {
+        return 2200;
+    }
+    resolve_test_kid(&cache, 1);
+    if(counts.resolved != T_COSE_KID_CACHE_SIZE + 2 || counts.last_evicted != 2) {
+        return 2300;
+    }
+
+    /* --- Lots of evictions and collisions still find the right key --- */
+    n = 7;
+    for(i = 0; i < 2000; i++) {
+        n = (n * 1103515245 + 12345) & 0x7fffffff;
+        result = resolve_test_kid(&cache, (n >> 8) % (T_COSE_KID_CACHE_SIZE * 3));
+        if(result) {
+            return 3000 + (int32_t)result;
+        }
+    }
+    if(counts.resolved - counts.evicted != T_COSE_KID_CACHE_SIZE) {
+        return 3100;
+    }
+
+    /* --- Failed look ups and long kids aren't cached --- */
+    counts.resolved = 0;
+    for(i = 0; i < 2; i++) {
+        result = t_cose_kid_cache_resolve(&cache,
+                                          T_COSE_ALGORITHM_ES256,
+                                          Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(unknown_kid),
+                                         &key);
+        if(result != T_COSE_ERR_UNKNOWN_KEY) {
+            return 4000 + (int32_t)result;
+        }
+        result = t_cose_kid_cache_resolve(&cache,
+                                          T_COSE_ALGORITHM_ES256,
+                                          Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(long_kid),
+                                         &key);
+        if(result || key.k.key_handle != 9999) {
+            return 4100 + (int32_t)result;
+        }
+    }
+    if(counts.resolved != 4) {
+        return 4200;
+    }
+
+    /* --- Removal and clearing --- */
+    resolve_test_kid(&cache, 5);
+    counts.resolved = 0;
+    counts.evicted  = 0;
+    t_cose_kid_cache_remove(&cache, Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(unknown_kid));
+    if(counts.evicted != 0) {
+        return 5000;
+    }
+    t_cose_kid_cache_remove(&cache, Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(kid_5));
+    if(counts.evicted != 1 || counts.last_evicted != 5) {
+        return 5100;
+    }
+    resolve_test_kid(&cache, 5);
+    if(counts.resolved != 1) {
+        return 5200;
+    }
+    counts.evicted = 0;
+    t_cose_kid_cache_clear(&cache);
+    if(counts.evicted != T_COSE_KID_CACHE_SIZE) {
+        return 5300;
+    }
+    counts.resolved = 0;
+    resolve_test_kid(&cache, 5);
+    if(counts.resolved != 1) {
+        return 5400;
+    }
+
+    /* --- Keys for long kids are given back rather than leaked --- */
+    t_cose_kid_cache_init(&cache, test_kid_resolver, test_key_evicted, &counts);
+    counts.evicted = 0;
+    for(i = 0; i < 3; i++) {
+        result = t_cose_kid_cache_resolve(&cache,
+                                          T_COSE_ALGORITHM_ES256,
+                                          Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(long_kid),
+                                         &key);
+        if(result || counts.evicted != (int)i) {
+            return 6000 + (int32_t)result;
+        }
+    }
+    t_cose_kid_cache_clear(&cache);
+    if(counts.evicted != 3 || counts.last_evicted != 9999) {
+        return 6100;
+    }
+    t_cose_kid_cache_clear(&cache);
+    if(counts.evicted != 3) {
+        return 6200;
+    }
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    /* --- The resolver isn't used for short-circuit signatures --- */
+    {
+        struct t_cose_sign1_sign_ctx    sign_ctx;
+        struct t_cose_sign1_verify_ctx  verify_ctx;
+        Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+        struct q_useful_buf_c           signed_cose;
+        struct q_useful_buf_c           payload;
+
+        t_cose_sign1_sign_init(&sign_ctx,
+                               T_COSE_OPT_SHORT_CIRCUIT_SIG,
+                               T_COSE_ALGORITHM_ES256);
+        result = t_cose_sign1_sign(&sign_ctx,
+                                    s_input_payload,
+                                    signed_cose_buffer,
+                                   &signed_cose);
+        if(result) {
+            return 6000 + (int32_t)result;
+        }
+
+        t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+        t_cose_sign1_set_key_resolver(&verify_ctx, always_unknown_resolver, NULL);
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+        if(result) {
+            return 6100 + (int32_t)result;
+        }
+    }
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+    return 0;
+}
+
+
+#ifdef T_COSE_ENABLE_KEY_SET
+
+static void
+test_free_generation(void *cb_context, struct t_cose_key_set_generation *generation)
+{
+    *(struct t_cose_key_set_generation **)cb_context = generation;
+}
+
+
+/*
+ * Look up kid in a key set reader and return the handle of the key
+ * or 0 if it isn't found.
+ */
+static uint64_t
+key_set_lookup(struct t_cose_key_set_reader *reader, const char *kid)
+{
+    struct t_cose_key key;
+
+    if(t_cose_key_set_resolve(reader, T_COSE_ALGORITHM_ES256, q_useful_buf_from_sz(kid), &key)) {
+        return 0;
+    }
+    return key.k.key_handle;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t key_set_test()
+{
+    struct t_cose_key_set             set;
+    struct t_cose_key_set_reader      reader;
+    struct t_cose_key_set_reader      readers[T_COSE_KEY_SET_MAX_READERS];
+    struct t_cose_key_set_generation  generation_1;
+    struct t_cose_key_set_generation  generation_2;
+    struct t_cose_key_set_generation *freed;
+    struct t_cose_key_set_entry       entries_1[3];
+    struct t_cose_key_set_entry       entries_2[1];
+    enum t_cose_err_t                 result;
+    size_t                            i;
+
+    /* Out of order so the sort is exercised */
+    entries_1[0].kid = Q_USEFUL_BUF_FROM_SZ_LITERAL("c");
+    entries_1[1].kid = Q_USEFUL_BUF_FROM_SZ_LITERAL("a");
+    entries_1[2].kid = Q_USEFUL_BUF_FROM_SZ_LITERAL("b");
+    for(i = 0; i < 3; i++) {
+        entries_1[i].key.crypto_lib   = T_COSE_CRYPTO_LIB_UNIDENTIFIED;
+        entries_1[i].key.k.key_handle = 100 + ((const uint8_t *)entries_1[i].kid.ptr)[0];
+    }
+    entries_2[0].kid = Q_USEFUL_BUF_FROM_SZ_LITERAL("a");
+    entries_2[0].key.crypto_lib   = T_COSE_CRYPTO_LIB_UNIDENTIFIED;
+    entries_2[0].key.k.key_handle = 2;
+
+    freed = NULL;
+    t_cose_key_set_init(&set, test_free_generation, &freed);
+    t_cose_key_set_generation_init(&generation_1, entries_1, 3);
+    t_cose_key_set_generation_init(&generation_2, entries_2, 1);
+
+    result = t_cose_key_set_reader_register(&set, &reader);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- No keys before the first publish --- */
+    t_cose_key_set_read_begin(&reader);
+    if(key_set_lookup(&reader, "a") != 0) {
+        return 1100;
+    }
+    t_cose_key_set_read_end(&reader);
+
+    t_cose_key_set_publish(&set, &generation_1);
+    t_cose_key_set_read_begin(&reader);
+    if(key_set_lookup(&reader, "a") != 100 + 'a' ||
+       key_set_lookup(&reader, "b") != 100 + 'b' ||
+       key_set_lookup(&reader, "c") != 100 + 'c' ||
+       key_set_lookup(&reader, "d") != 0) {
+        return 2000;
+    }
+
+    /* --- A read in progress keeps its generation --- */
+    t_cose_key_set_publish(&set, &generation_2);
+    if(key_set_lookup(&reader, "b") != 100 + 'b') {
+        return 3000;
+    }
+    if(t_cose_key_set_reclaim(&set) != 1 || freed != NULL) {
+        return 3100;
+    }
+    t_cose_key_set_read_end(&reader);
+    if(t_cose_key_set_reclaim(&set) != 0 || freed != &generation_1) {
+        return 3200;
+    }
+
+    t_cose_key_set_read_begin(&reader);
+    if(key_set_lookup(&reader, "a") != 2 || key_set_lookup(&reader, "b") != 0) {
+        return 4000;
+    }
+    t_cose_key_set_read_end(&reader);
+
+    /* --- The number of readers is limited --- */
+    for(i = 0; i < T_COSE_KEY_SET_MAX_READERS - 1; i++) {
+        result = t_cose_key_set_reader_register(&set, &readers[i]);
+        if(result) {
+            return 5000 + (int32_t)result;
+        }
+    }
+    result = t_cose_key_set_reader_register(&set, &readers[i]);
+    if(result != T_COSE_ERR_TOO_MANY_READERS) {
+        return 5100 + (int32_t)result;
+    }
+    t_cose_key_set_reader_unregister(&readers[0]);
+    result = t_cose_key_set_reader_register(&set, &readers[0]);
+    if(result) {
+        return 5200 + (int32_t)result;
+    }
+    for(i = 0; i < T_COSE_KEY_SET_MAX_READERS - 1; i++) {
+        t_cose_key_set_reader_unregister(&readers[i]);
+    }
+    t_cose_key_set_reader_unregister(&reader);
+
+    freed = NULL;
+    t_cose_key_set_destroy(&set);
+    if(freed != &generation_2) {
+        return 6000;
+    }
+
+    return 0;
+}
+
+#endif /* T_COSE_ENABLE_KEY_SET */
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t key_index_test()
+{
+#define KEY_INDEX_TEST_COUNT 100
+    struct t_cose_key_index_entry entries[KEY_INDEX_TEST_COUNT];
+    char                          kids[KEY_INDEX_TEST_COUNT][8];
+    uint8_t                       points[KEY_INDEX_TEST_COUNT][65];
+    static uint8_t                index_bytes[10000];
+    struct q_useful_buf_c         encoded;
+    struct q_useful_buf_c         size_only;
+    struct q_useful_buf_c         public_key;
+    struct q_useful_buf_c         kid;
+    struct t_cose_key_index       index;
+    enum t_cose_err_t             result;
+    int32_t                       cose_algorithm_id;
+    size_t                        i;
+#ifdef T_COSE_ENABLE_FILE_IO
+    char                          path[] = "/tmp/t_cose_key_index_test_XXXXXX";
+    int                           fd;
+#endif
+
+    for(i = 0; i < KEY_INDEX_TEST_COUNT; i++) {
+        kids[i][0] = 'k';
+        kids[i][1] = (char)('0' + i / 10);
+        kids[i][2] = (char)('0' + i % 10);
+        memset(points[i], (int)i, sizeof(points[i]));
+        points[i][0] = 0x04;
+        entries[i].kid               = (struct q_useful_buf_c){kids[i], 3};
+        entries[i].cose_algorithm_id = i % 2 ? T_COSE_ALGORITHM_ES256 : T_COSE_ALGORITHM_ES384;
+        entries[i].public_key        = (struct q_useful_buf_c){points[i], sizeof(points[i])};
+    }
+
+    /* --- Size calculation agrees with the index made --- */
+    result = t_cose_key_index_encode(entries,
+                                     KEY_INDEX_TEST_COUNT,
+                                     (struct q_useful_buf){NULL, 0},
+                                     &size_only);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    result = t_cose_key_index_encode(entries,
+                                     KEY_INDEX_TEST_COUNT,
+                                     (struct q_useful_buf){index_bytes, size_only.len - 1},
+                                     &encoded);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 1100 + (int32_t)result;
+    }
+    result = t_cose_key_index_encode(entries,
+                                     KEY_INDEX_TEST_COUNT,
+                                     Q_USEFUL_BUF_FROM_BYTE_ARRAY(index_bytes),
+                                     &encoded);
+    if(result || encoded.len != size_only.len) {
+        return 1200 + (int32_t)result;
+    }
+
+    /* --- Every kid is found with its own key --- */
+    result = t_cose_key_index_init_buffer(&index, encoded);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    for(i = 0; i < KEY_INDEX_TEST_COUNT; i++) {
+        result = t_cose_key_index_find(&index,
+                                       (struct q_useful_buf_c){kids[i], 3},
+                                       &cose_algorithm_id,
+                                       &public_key);
+        if(result) {
+            return 2100 + (int32_t)result;
+        }
+        if(cose_algorithm_id != (i % 2 ? T_COSE_ALGORITHM_ES256 : T_COSE_ALGORITHM_ES384) ||
+           q_useful_buf_compare(public_key, (struct q_useful_buf_c){points[i], sizeof(points[i])})) {
+            return 2200;
+        }
+    }
+    result = t_cose_key_index_find(&index,
+                                   Q_USEFUL_BUF_FROM_SZ_LITERAL("k1"),
+                                   &cose_algorithm_id,
+                                   &public_key);
+    if(result != T_COSE_ERR_UNKNOWN_KEY) {
+        return 2300 + (int32_t)result;
+    }
+
+    /* --- Damaged or unknown indexes are rejected --- */
+    result = t_cose_key_index_init_buffer(&index, q_useful_buf_head(encoded, encoded.len - 1));
+    if(result != T_COSE_ERR_KEY_INDEX_FORMAT) {
+        return 3000 + (int32_t)result;
+    }
+    index_bytes[4] = T_COSE_KEY_INDEX_VERSION + 1;
+    result = t_cose_key_index_init_buffer(&index, encoded);
+    index_bytes[4] = T_COSE_KEY_INDEX_VERSION;
+    if(result != T_COSE_ERR_KEY_INDEX_FORMAT) {
+        return 3100 + (int32_t)result;
+    }
+
+    /* --- Duplicate kids can't be put in an index --- */
+    kid            = entries[1].kid;
+    entries[1].kid = entries[0].kid;
+    result = t_cose_key_index_encode(entries,
+                                     KEY_INDEX_TEST_COUNT,
+                                     Q_USEFUL_BUF_FROM_BYTE_ARRAY(index_bytes),
+                                     &encoded);
+    entries[1].kid = kid;
+    if(result != T_COSE_ERR_INVALID_ARGUMENT) {
+        return 4000 + (int32_t)result;
+    }
+
+#ifdef T_COSE_ENABLE_FILE_IO
+    /* --- The same index works from a file --- */
+    result = t_cose_key_index_encode(entries,
+                                     KEY_INDEX_TEST_COUNT,
+                                     Q_USEFUL_BUF_FROM_BYTE_ARRAY(index_bytes),
+                                     &encoded);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+    fd = mkstemp(path);
+    if(fd < 0) {
+        return 5100;
+    }
+    if(write_all(fd, encoded)) {
+        close(fd);
+        unlink(path);
+        return 5200;
+    }
+    close(fd);
+
+    result = t_cose_key_index_open(&index, path);
+    unlink(path);
+    if(result) {
+        return 5300 + (int32_t)result;
+    }
+    result = t_cose_key_index_find(&index,
+                                   Q_USEFUL_BUF_FROM_SZ_LITERAL("k42"),
+                                   &cose_algorithm_id,
+                                   &public_key);
+    if(result || ((const uint8_t *)public_key.ptr)[1] != 42) {
+        t_cose_key_index_close(&index);
+        return 5400 + (int32_t)result;
+    }
+    t_cose_key_index_close(&index);
+
+    result = t_cose_key_index_open(&index, path);
+    if(result != T_COSE_ERR_FILE_IO) {
+        return 5500 + (int32_t)result;
+    }
+#endif /* T_COSE_ENABLE_FILE_IO */
+
+    return 0;
+}
+
+
+int_fast32_t kid_filter_test()
+{
+#define KID_FILTER_TEST_COUNT 1000
+    static char                  kid_bytes[KID_FILTER_TEST_COUNT * 2][6];
+    struct q_useful_buf_c        kids[KID_FILTER_TEST_COUNT];
+    static uint8_t               filter_bytes[3000];
+    struct q_useful_buf_c        encoded;
+    struct q_useful_buf_c        size_only;
+    struct t_cose_kid_filter     filter;
+    enum t_cose_err_t            result;
+    size_t                       i;
+    unsigned                     passed;
+
+    /* The first half are put in filters; the second half never are */
+    for(i = 0; i < KID_FILTER_TEST_COUNT * 2; i++) {
+        kid_bytes[i][0] = 'k';
+        kid_bytes[i][1] = (char)('0' + i / 1000);
+        kid_bytes[i][2] = (char)('0' + i / 100 % 10);
+        kid_bytes[i][3] = (char)('0' + i / 10 % 10);
+        kid_bytes[i][4] = (char)('0' + i % 10);
+        if(i < KID_FILTER_TEST_COUNT) {
+            kids[i] = (struct q_useful_buf_c){kid_bytes[i], 5};
+        }
+    }
+
+    /* --- Size calculation agrees with the filter made --- */
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_ALLOW,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      16,
+                                      (struct q_useful_buf){NULL, 0},
+                                      &size_only);
+    if(result || size_only.len > sizeof(filter_bytes)) {
+        return 1000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_ALLOW,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      16,
+                                      (struct q_useful_buf){filter_bytes, size_only.len - 1},
+                                      &encoded);
+    if(result != T_COSE_ERR_TOO_SMALL) {
+        return 1100 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_ALLOW,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      3,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                      &encoded);
+    if(result != T_COSE_ERR_INVALID_ARGUMENT) {
+        return 1200 + (int32_t)result;
+    }
+
+    /* --- Allow: every kid added passes, nearly all others don't --- */
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_ALLOW,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      16,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                      &encoded);
+    if(result || encoded.len != size_only.len) {
+        return 2000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    if(result) {
+        return 2100 + (int32_t)result;
+    }
+    passed = 0;
+    for(i = 0; i < KID_FILTER_TEST_COUNT * 2; i++) {
+        result = t_cose_kid_filter_check(&filter, (struct q_useful_buf_c){kid_bytes[i], 5});
+        if(i < KID_FILTER_TEST_COUNT && result) {
+            return 2200 + (int32_t)result;
+        }
+        if(i >= KID_FILTER_TEST_COUNT && result == T_COSE_SUCCESS) {
+            passed++;
+        }
+    }
+    /* About 1 in 1,000 is expected. 10 is very unlikely. */
+    if(passed > 10) {
+        return 2300;
+    }
+
+    /* --- Deny: every kid added is rejected, nearly all others pass --- */
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_DENY,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      16,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                      &encoded);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    if(result) {
+        return 3100 + (int32_t)result;
+    }
+    passed = 0;
+    for(i = 0; i < KID_FILTER_TEST_COUNT * 2; i++) {
+        result = t_cose_kid_filter_check(&filter, (struct q_useful_buf_c){kid_bytes[i], 5});
+        if(i < KID_FILTER_TEST_COUNT && result != T_COSE_ERR_KID_REJECTED) {
+            return 3200 + (int32_t)result;
+        }
+        if(i >= KID_FILTER_TEST_COUNT && result == T_COSE_SUCCESS) {
+            passed++;
+        }
+    }
+    if(passed < KID_FILTER_TEST_COUNT - 10) {
+        return 3300;
+    }
+
+    /* --- An empty deny filter passes everything --- */
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_DENY,
+                                      NULL,
+                                      0,
+                                      16,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                      &encoded);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    if(result) {
+        return 4100 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_check(&filter, kids[0]);
+    if(result) {
+        return 4200 + (int32_t)result;
+    }
+
+    /* --- Damaged or unknown filters are rejected --- */
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_ALLOW,
+                                      kids,
+                                      KID_FILTER_TEST_COUNT,
+                                      16,
+                                      Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                      &encoded);
+    if(result) {
+        return 5000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_init_buffer(&filter, q_useful_buf_head(encoded, encoded.len - 1));
+    if(result != T_COSE_ERR_KID_FILTER_FORMAT) {
+        return 5100 + (int32_t)result;
+    }
+    filter_bytes[4] = T_COSE_KID_FILTER_VERSION + 1;
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    filter_bytes[4] = T_COSE_KID_FILTER_VERSION;
+    if(result != T_COSE_ERR_KID_FILTER_FORMAT) {
+        return 5200 + (int32_t)result;
+    }
+    filter_bytes[6] = 3;
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    filter_bytes[6] = T_COSE_KID_FILTER_ALLOW;
+    if(result != T_COSE_ERR_KID_FILTER_FORMAT) {
+        return 5300 + (int32_t)result;
+    }
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+    /* --- Verification stops at the kid, even for decode only --- */
+    {
+        struct t_cose_sign1_sign_ctx    sign_ctx;
+        struct t_cose_sign1_verify_ctx  verify_ctx;
+        Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+        struct q_useful_buf_c           signed_cose;
+        struct q_useful_buf_c           payload;
+        struct t_cose_parameters        parameters;
+
+        result = t_cose_kid_filter_init_buffer(&filter, encoded);
+        if(result) {
+            return 6000 + (int32_t)result;
+        }
+
+        /* Decode only never looks at the signature so a
+         * short-circuit one will do */
+        t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+        t_cose_sign1_set_signing_key(&sign_ctx, T_COSE_NULL_KEY, kids[KID_FILTER_TEST_COUNT / 2]);
+        result = t_cose_sign1_sign(&sign_ctx,
+                                    s_input_payload,
+                                    signed_cose_buffer,
+                                   &signed_cose);
+        if(result) {
+            return 6100 + (int32_t)result;
+        }
+
+        t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
+        t_cose_sign1_set_kid_filter(&verify_ctx, &filter);
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result) {
+            return 6200 + (int32_t)result;
+        }
+
+        /* A deny filter of the same kids rejects it */
+        result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_DENY,
+                                          kids,
+                                          KID_FILTER_TEST_COUNT,
+                                          16,
+                                          Q_USEFUL_BUF_FROM_BYTE_ARRAY(filter_bytes),
+                                          &encoded);
+        if(result) {
+            return 6300 + (int32_t)result;
+        }
+        result = t_cose_kid_filter_init_buffer(&filter, encoded);
+        if(result) {
+            return 6400 + (int32_t)result;
+        }
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result != T_COSE_ERR_KID_REJECTED) {
+            return 6500 + (int32_t)result;
+        }
+        /* The kid is still returned to say what was rejected */
+        if(q_useful_buf_compare(parameters.kid, kids[KID_FILTER_TEST_COUNT / 2])) {
+            return 6600;
+        }
+
+        /* Without the filter it decodes */
+        t_cose_sign1_set_kid_filter(&verify_ctx, NULL);
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result) {
+            return 6700 + (int32_t)result;
+        }
+    }
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+    return 0;
+}
+
+
+#if defined(T_COSE_ENABLE_VERIFY_CACHE) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+int_fast32_t verify_cache_test()
+{
+    struct t_cose_sign1_sign_ctx      sign_ctx;
+    struct t_cose_sign1_verify_ctx    verify_ctx;
+    static struct t_cose_verify_cache verify_cache;
+    struct t_cose_kid_filter          filter;
+    Q_USEFUL_BUF_MAKE_STACK_UB(       signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(       filter_buffer, 100);
+    struct q_useful_buf_c             signed_cose;
+    struct q_useful_buf_c             payload;
+    struct q_useful_buf_c             encoded;
+    struct q_useful_buf_c             kid;
+    struct t_cose_parameters          parameters;
+    enum t_cose_err_t                 result;
+    int                               i;
+
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign(&sign_ctx, s_input_payload, signed_cose_buffer, &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+
+    /* --- A hit returns the same as verifying --- */
+    t_cose_verify_cache_init(&verify_cache, 300);
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    for(i = 0; i < 2; i++) {
+        payload = NULL_Q_USEFUL_BUF_C;
+        result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+        if(result) {
+            return 2000 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(payload, s_input_payload) ||
+           q_useful_buf_compare(parameters.kid, get_short_circuit_kid()) ||
+           parameters.cose_algorithm_id != T_COSE_ALGORITHM_ES256 ||
+           !q_useful_buf_c_is_null(parameters.iv)) {
+            return 2100 + i;
+        }
+    }
+
+    /* --- Other options aren't served from the cache --- */
+    t_cose_sign1_verify_init(&verify_ctx, 0);
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result != T_COSE_ERR_SHORT_CIRCUIT_SIG) {
+        return 3000 + (int32_t)result;
+    }
+
+    /* --- A kid filter still rejects on a hit --- */
+    kid = get_short_circuit_kid();
+    result = t_cose_kid_filter_encode(T_COSE_KID_FILTER_DENY, &kid, 1, 16, filter_buffer, &encoded);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    result = t_cose_kid_filter_init_buffer(&filter, encoded);
+    if(result) {
+        return 4100 + (int32_t)result;
+    }
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    t_cose_sign1_set_verify_cache(&verify_ctx, &verify_cache);
+    t_cose_sign1_set_kid_filter(&verify_ctx, &filter);
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result != T_COSE_ERR_KID_REJECTED) {
+        return 4200 + (int32_t)result;
+    }
+
+    return 0;
+}
+#endif /* T_COSE_ENABLE_VERIFY_CACHE && !T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+static struct test_case header_cache_tests_table[] = {
+    /* The cached kid is still seen as a duplicate of the unprotected one */
+    {T_COSE_TEST_KID_IN_PROTECTED, T_COSE_ERR_DUPLICATE_PARAMETER},
+
+#ifndef T_COSE_DISABLE_CONTENT_TYPE
+    {T_COSE_TEST_DUP_CONTENT_ID, T_COSE_ERR_DUPLICATE_PARAMETER},
+#endif /* T_COSE_DISABLE_CONTENT_TYPE */
+
+    /* Protected parameters with critical labels aren't cached */
+    {T_COSE_TEST_UNKNOWN_CRIT_UINT_PARAMETER, T_COSE_ERR_UNKNOWN_CRITICAL_PARAMETER},
+
+    {T_COSE_TEST_CRIT_PARAMETER_EXIST, T_COSE_SUCCESS},
+
+    {T_COSE_TEST_EXTRA_PARAMETER, T_COSE_SUCCESS},
+
+    {0, 0}
+};
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t header_cache_test()
+{
+    struct t_cose_sign1_sign_ctx      sign_ctx;
+    struct t_cose_sign1_verify_ctx    verify_ctx;
+    static struct t_cose_header_cache header_cache;
+    Q_USEFUL_BUF_MAKE_STACK_UB(       signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(       other_cose_buffer, 200);
+    struct q_useful_buf_c             signed_cose;
+    struct q_useful_buf_c             other_cose;
+    struct q_useful_buf_c             payload;
+    struct q_useful_buf_c             aad;
+    struct t_cose_parameters          parameters;
+    struct test_case                 *test;
+    enum t_cose_err_t                 result;
+    size_t                            offset;
+    int                               entry_count;
+    int                               i;
+
+    t_cose_header_cache_init(&header_cache);
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    t_cose_sign1_set_header_cache(&verify_ctx, &header_cache);
+
+    /* --- Messages with the same protected parameters share an entry --- */
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+    result = t_cose_sign1_sign(&sign_ctx,
+                               Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                               signed_cose_buffer,
+                               &signed_cose);
+    if(result) {
+        return 1000 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign(&sign_ctx, s_input_payload, other_cose_buffer, &other_cose);
+    if(result) {
+        return 1100 + (int32_t)result;
+    }
+
+    result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, &parameters);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    for(i = 0; i < 2; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, other_cose, &payload, &parameters);
+        if(result) {
+            return 2100 + (int32_t)result;
+        }
+        if(q_useful_buf_compare(payload, s_input_payload) ||
+           q_useful_buf_compare(parameters.kid, get_short_circuit_kid()) ||
+           parameters.cose_algorithm_id != T_COSE_ALGORITHM_ES256) {
+            return 2200 + i;
+        }
+    }
+    entry_count = 0;
+    for(i = 0; i < T_COSE_HEADER_CACHE_SIZE; i++) {
+        if(header_cache.entries[i].last_use != 0) {
+            entry_count++;
+        }
+    }
+    if(entry_count != 1) {
+        return 2300 + entry_count;
+    }
+
+    /* --- Hashing from the midstate still covers the payload --- */
+    offset = (size_t)((const uint8_t *)payload.ptr - (const uint8_t *)other_cose.ptr);
+    ((uint8_t *)other_cose_buffer.ptr)[offset]++;
+    result = t_cose_sign1_verify(&verify_ctx, other_cose, &payload, &parameters);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 3000 + (int32_t)result;
+    }
+
+    /* --- Detached payloads, all at once and streamed --- */
+    aad = Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad");
+    result = t_cose_sign1_sign_detached(&sign_ctx,
+                                        aad,
+                                        s_input_payload,
+                                        signed_cose_buffer,
+                                       &signed_cose);
+    if(result) {
+        return 4000 + (int32_t)result;
+    }
+    for(i = 0; i < 2; i++) {
+        result = t_cose_sign1_verify_detached(&verify_ctx,
+                                              signed_cose,
+                                              aad,
+                                              s_input_payload,
+                                              NULL);
+        if(result) {
+            return 4100 + (int32_t)result;
+        }
+    }
+    result = t_cose_sign1_verify_detached(&verify_ctx,
+                                          signed_cose,
+                                          NULL_Q_USEFUL_BUF_C,
+                                          s_input_payload,
+                                          NULL);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 4200 + (int32_t)result;
+    }
+
+    /* --- The same errors as without the cache, the second time too --- */
+    for(test = header_cache_tests_table; test->test_option; test++) {
+        result = t_cose_test_message_sign1_sign(&sign_ctx,
+                                                test->test_option,
+                                                Q_USEFUL_BUF_FROM_SZ_LITERAL("payload"),
+                                                signed_cose_buffer,
+                                                &signed_cose);
+        if(result) {
+            return 5000 + (int32_t)(test - header_cache_tests_table);
+        }
+        for(i = 0; i < 2; i++) {
+            result = t_cose_sign1_verify(&verify_ctx, signed_cose, &payload, NULL);
+            if(result != test->result) {
+                return 5100 + (int32_t)(test - header_cache_tests_table) * 10 + i;
+            }
+        }
+    }
+
+    t_cose_header_cache_clear(&header_cache);
+
+    return 0;
+}
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+
+#if defined(T_COSE_ENABLE_ASYNC) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+
+#define ASYNC_TEST_COUNT 100
+
+struct async_test_state {
+    struct t_cose_async_executor   executor;
+    struct t_cose_sign1_verify_ctx verify_ctx;
+    struct t_cose_async_request    sign_requests[ASYNC_TEST_COUNT];
+    struct t_cose_async_request    verify_requests[ASYNC_TEST_COUNT];
+    uint8_t                        payloads[ASYNC_TEST_COUNT][8];
+    uint8_t                        cose_buffers[ASYNC_TEST_COUNT][200];
+    int                            verified;
+    int                            failed;
+    int                            entered;
+    int                            released;
+};
+
+
+static void
+async_verified_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    struct async_test_state *state = (struct async_test_state *)done_ctx;
+    struct q_useful_buf_c    payload;
+    ptrdiff_t                i;
+
+    i       = request - state->verify_requests;
+    payload = (struct q_useful_buf_c){state->payloads[i], sizeof(state->payloads[i])};
+
+    if(t_cose_async_request_error(request) ||
+       q_useful_buf_compare(t_cose_async_request_output(request), payload) ||
+       q_useful_buf_compare(t_cose_async_request_parameters(request)->kid,
+                            get_short_circuit_kid())) {
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_add_fetch(&state->verified, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/*
+ * Goes on to verify what was signed on the same executor. A callback
+ * can't wait for room in the queues so it runs the verify itself if
+ * they are full.
+ */
+static void
+async_signed_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    struct async_test_state     *state = (struct async_test_state *)done_ctx;
+    struct t_cose_async_request *verify_request;
+    enum t_cose_err_t            result;
+
+    verify_request = &state->verify_requests[request - state->sign_requests];
+
+    if(t_cose_async_request_error(request)) {
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    t_cose_async_verify_request_init(verify_request,
+                                     &state->verify_ctx,
+                                     t_cose_async_request_output(request),
+                                     NULL_Q_USEFUL_BUF_C,
+                                     async_verified_cb,
+                                     state);
+    result = t_cose_async_submit(&state->executor, verify_request);
+    if(result == T_COSE_ERR_QUEUE_FULL) {
+        t_cose_async_request_run(verify_request);
+    } else if(result) {
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/* Holds up the worker running it until released */
+static void
+async_gate_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    struct async_test_state *state = (struct async_test_state *)done_ctx;
+
+    (void)request;
+    __atomic_store_n(&state->entered, 1, __ATOMIC_SEQ_CST);
+    while(!__atomic_load_n(&state->released, __ATOMIC_SEQ_CST));
+}
+
+
+static void
+async_count_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    struct async_test_state *state = (struct async_test_state *)done_ctx;
+
+    if(t_cose_async_request_error(request)) {
+        __atomic_add_fetch(&state->failed, 1, __ATOMIC_SEQ_CST);
+    } else {
+        __atomic_add_fetch(&state->verified, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+static void
+async_keep_cb(void *done_ctx, struct t_cose_async_request *request)
+{
+    *(struct t_cose_async_request **)done_ctx = request;
+}
+
+
+static enum t_cose_err_t
+async_inline_submit(void *executor_ctx, struct t_cose_async_request *request)
+{
+    (*(int *)executor_ctx)++;
+    t_cose_async_request_run(request);
+    return T_COSE_SUCCESS;
+}
+
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t async_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    static struct async_test_state  state;
+    static struct t_cose_async_pool pool;
+    static struct t_cose_async_request queue_requests[T_COSE_ASYNC_QUEUE_SIZE + 1];
+    struct t_cose_async_request     gate_request;
+    struct t_cose_async_request     request;
+    struct t_cose_async_request    *done_request;
+    struct t_cose_async_executor    inline_executor;
+    Q_USEFUL_BUF_MAKE_STACK_UB(     signed_cose_buffer, 200);
+    Q_USEFUL_BUF_MAKE_STACK_UB(     async_cose_buffer, 200);
+    struct q_useful_buf_c           signed_cose;
+    enum t_cose_err_t               result;
+    int                             submit_count;
+    int                             i;
+
+    memset(&state, 0, sizeof(state));
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+    t_cose_sign1_verify_init(&state.verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+
+    /* --- A custom executor, here one that runs requests inline --- */
+    submit_count = 0;
+    inline_executor.submit       = async_inline_submit;
+    inline_executor.executor_ctx = &submit_count;
+    done_request = NULL;
+    t_cose_async_sign_request_init(&request,
+                                   &sign_ctx,
+                                   NULL_Q_USEFUL_BUF_C,
+                                   s_input_payload,
+                                   async_cose_buffer,
+                                   async_keep_cb,
+                                   &done_request);
+    result = t_cose_async_submit(&inline_executor, &request);
+    if(result || submit_count != 1 || done_request != &request) {
+        return 1000 + (int32_t)result;
+    }
+    result = t_cose_sign1_sign(&sign_ctx, s_input_payload, signed_cose_buffer, &signed_cose);
+    if(result) {
+        return 1100 + (int32_t)result;
+    }
+    if(t_cose_async_request_error(&request) ||
+       q_useful_buf_compare(t_cose_async_request_output(&request), signed_cose)) {
+        return 1200;
+    }
+
+    /* Errors are in the request and there's no output */
+    t_cose_async_sign_request_init(&request,
+                                   &sign_ctx,
+                                   NULL_Q_USEFUL_BUF_C,
+                                   s_input_payload,
+                                   (struct q_useful_buf){async_cose_buffer.ptr, 10},
+                                   async_keep_cb,
+                                   &done_request);
+    result = t_cose_async_submit(&inline_executor, &request);
+    if(result ||
+       t_cose_async_request_error(&request) != T_COSE_ERR_TOO_SMALL ||
+       !q_useful_buf_c_is_null(t_cose_async_request_output(&request))) {
+        return 1300 + (int32_t)result;
+    }
+
+    /* --- Many signs on a pool, each verified from its callback --- */
+    result = t_cose_async_pool_start(&pool, 4);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    state.executor = t_cose_async_pool_executor(&pool);
+    for(i = 0; i < ASYNC_TEST_COUNT; i++) {
+        memset(state.payloads[i], i, sizeof(state.payloads[i]));
+        t_cose_async_sign_request_init(&state.sign_requests[i],
+                                       &sign_ctx,
+                                       NULL_Q_USEFUL_BUF_C,
+                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(state.payloads[i]),
+                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY(state.cose_buffers[i]),
+                                       async_signed_cb,
+                                       &state);
+        result = t_cose_async_submit(&state.executor, &state.sign_requests[i]);
+        if(result) {
+            return 2100 + (int32_t)result;
+        }
+    }
+    t_cose_async_pool_wait(&pool);
+    if(state.failed || state.verified != ASYNC_TEST_COUNT) {
+        return 2200 + state.failed;
+    }
+    t_cose_async_pool_stop(&pool);
+
+    /* --- The queue fills up when the only worker is held up --- */
+    result = t_cose_async_pool_start(&pool, 1);
+    if(result) {
+        return 3000 + (int32_t)result;
+    }
+    state.executor = t_cose_async_pool_executor(&pool);
+    state.verified = 0;
+    t_cose_async_verify_request_init(&gate_request,
+                                     &state.verify_ctx,
+                                     signed_cose,
+                                     NULL_Q_USEFUL_BUF_C,
+                                     async_gate_cb,
+                                     &state);
+    result = t_cose_async_submit(&state.executor, &gate_request);
+    if(result) {
+        return 3100 + (int32_t)result;
+    }
+    while(!__atomic_load_n(&state.entered, __ATOMIC_SEQ_CST));
+    for(i = 0; i <= T_COSE_ASYNC_QUEUE_SIZE; i++) {
+        t_cose_async_verify_request_init(&queue_requests[i],
+                                         &state.verify_ctx,
+                                         signed_cose,
+                                         NULL_Q_USEFUL_BUF_C,
+                                         async_count_cb,
+                                         &state);
+        result = t_cose_async_submit(&state.executor, &queue_requests[i]);
+        if(result != (i < T_COSE_ASYNC_QUEUE_SIZE ? T_COSE_SUCCESS : T_COSE_ERR_QUEUE_FULL)) {
+            __atomic_store_n(&state.released, 1, __ATOMIC_SEQ_CST);
+            t_cose_async_pool_stop(&pool);
+            return 3200 + (int32_t)result;
+        }
+    }
+    __atomic_store_n(&state.released, 1, __ATOMIC_SEQ_CST);
+    t_cose_async_pool_wait(&pool);
+    if(state.failed || state.verified != T_COSE_ASYNC_QUEUE_SIZE) {
+        return 3300 + state.failed;
+    }
+
+    /* --- Nothing is taken after stopping --- */
+    t_cose_async_pool_stop(&pool);
+    result = t_cose_async_submit(&state.executor, &gate_request);
+    if(result != T_COSE_ERR_THREADS) {
+        return 4000 + (int32_t)result;
+    }
+
+    return 0;
+}
+#endif /* T_COSE_ENABLE_ASYNC && !T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+
+#define VERIFY_BATCH_TEST_COUNT 20
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t verify_batch_test()
+{
+    struct t_cose_sign1_sign_ctx    sign_ctx;
+    struct t_cose_sign1_verify_ctx  verify_ctx;
+    static uint8_t                  cose_buffers[VERIFY_BATCH_TEST_COUNT][100];
+    static uint8_t                  payload_bytes[VERIFY_BATCH_TEST_COUNT][4];
+    struct q_useful_buf_c           cose_sign1s[VERIFY_BATCH_TEST_COUNT];
+    struct q_useful_buf_c           aads[VERIFY_BATCH_TEST_COUNT];
+    struct q_useful_buf_c           payloads[VERIFY_BATCH_TEST_COUNT];
+    struct t_cose_parameters        parameters[VERIFY_BATCH_TEST_COUNT];
+    enum t_cose_err_t               errors[VERIFY_BATCH_TEST_COUNT];
+    struct q_useful_buf_c           payload;
+    enum t_cose_err_t               result;
+    int                             i;
+
+    t_cose_sign1_sign_init(&sign_ctx, T_COSE_OPT_SHORT_CIRCUIT_SIG, T_COSE_ALGORITHM_ES256);
+    for(i = 0; i < VERIFY_BATCH_TEST_COUNT; i++) {
+        memset(payload_bytes[i], i, sizeof(payload_bytes[i]));
+        aads[i] = i % 3 ? Q_USEFUL_BUF_FROM_SZ_LITERAL("some aad") : NULL_Q_USEFUL_BUF_C;
+        result = t_cose_sign1_sign_aad(&sign_ctx,
+                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(payload_bytes[i]),
+                                       aads[i],
+                                       Q_USEFUL_BUF_FROM_BYTE_ARRAY(cose_buffers[i]),
+                                      &cose_sign1s[i]);
+        if(result) {
+            return 1000 + (int32_t)result;
+        }
+    }
+
+    /* --- All verify, across several chunks --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_ALLOW_SHORT_CIRCUIT);
+    result = t_cose_sign1_verify_batch(&verify_ctx,
+                                       cose_sign1s,
+                                       aads,
+                                       payloads,
+                                       parameters,
+                                       errors,
+                                       VERIFY_BATCH_TEST_COUNT);
+    if(result) {
+        return 2000 + (int32_t)result;
+    }
+    for(i = 0; i < VERIFY_BATCH_TEST_COUNT; i++) {
+        if(errors[i] ||
+           q_useful_buf_compare(payloads[i], Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(payload_bytes[i])) ||
+           q_useful_buf_compare(parameters[i].kid, get_short_circuit_kid()) ||
+           parameters[i].cose_algorithm_id != T_COSE_ALGORITHM_ES256) {
+            return 2100 + i;
+        }
+    }
+
+    /* --- Failures are per message and the same as one at a time --- */
+    cose_buffers[3][cose_sign1s[3].len - 1] ^= 0x01;
+    cose_sign1s[11].len = 5;
+    aads[17] = NULL_Q_USEFUL_BUF_C;
+    result = t_cose_sign1_verify_batch(&verify_ctx,
+                                       cose_sign1s,
+                                       aads,
+                                       payloads,
+                                       NULL,
+                                       errors,
+                                       VERIFY_BATCH_TEST_COUNT);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 3000 + (int32_t)result;
+    }
+    for(i = 0; i < VERIFY_BATCH_TEST_COUNT; i++) {
+        result = t_cose_sign1_verify_aad(&verify_ctx, cose_sign1s[i], aads[i], &payload, NULL);
+        if(errors[i] != result || ((i == 3 || i == 11 || i == 17) == (result == T_COSE_SUCCESS))) {
+            return 3100 + i;
+        }
+    }
+
+    /* --- No AADs at all --- */
+    result = t_cose_sign1_verify_batch(&verify_ctx,
+                                       cose_sign1s,
+                                       NULL,
+                                       payloads,
+                                       NULL,
+                                       errors,
+                                       VERIFY_BATCH_TEST_COUNT);
+    if(result != T_COSE_ERR_SIG_VERIFY) {
+        return 4000 + (int32_t)result;
+    }
+    for(i = 0; i < VERIFY_BATCH_TEST_COUNT; i++) {
+        result = t_cose_sign1_verify(&verify_ctx, cose_sign1s[i], &payload, NULL);
+        if(errors[i] != result) {
+            return 4100 + i;
+        }
+    }
+
+    /* --- Decode only doesn't check signatures --- */
+    t_cose_sign1_verify_init(&verify_ctx, T_COSE_OPT_DECODE_ONLY);
+    result = t_cose_sign1_verify_batch(&verify_ctx,
+                                       cose_sign1s,
+                                       aads,
+                                       payloads,
+                                       NULL,
+                                       errors,
+                                       VERIFY_BATCH_TEST_COUNT);
+    if(result == T_COSE_SUCCESS || errors[11] != result) {
+        return 5000 + (int32_t)result;
+    }
+    for(i = 0; i < VERIFY_BATCH_TEST_COUNT; i++) {
+        if(i != 11 && errors[i]) {
+            return 5100 + i;
+        }
+    }
+
+    /* --- An empty batch --- */
+    result = t_cose_sign1_verify_batch(&verify_ctx, NULL, NULL, NULL, NULL, NULL, 0);
+    if(result) {
+        return 6000 + (int32_t)result;
+    }
+
+    return 0;
+}
+#endif /* T_COSE_DISABLE_SHORT_CIRCUIT_SIGN */
+
+
+#define HASH_BATCH_TEST_COUNT 40
+
+/*
+ * Public function, see t_cose_test.h
+ */
+int_fast32_t hash_batch_test(void)
+{
+    static const uint8_t         abc_sha256[] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+        0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+        0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+    /* Around the lengths where the padding takes another block */
+    static const size_t          lengths[] = {0, 1, 3, 55, 56, 63, 64, 65, 119, 120, 128, 200};
+    static const size_t          counts[] = {1, 3, 8, 17, HASH_BATCH_TEST_COUNT};
+    uint8_t                      data[HASH_BATCH_TEST_COUNT + 200];
+    struct q_useful_buf_c        pieces[HASH_BATCH_TEST_COUNT][3];
+    const struct q_useful_buf_c *inputs[HASH_BATCH_TEST_COUNT];
+    uint8_t                      hash_storage[HASH_BATCH_TEST_COUNT][T_COSE_CRYPTO_SHA256_SIZE];
+    struct q_useful_buf          buffers_for_hash[HASH_BATCH_TEST_COUNT];
+    struct q_useful_buf_c        hashes[HASH_BATCH_TEST_COUNT];
+    Q_USEFUL_BUF_MAKE_STACK_UB(  single_buffer, T_COSE_CRYPTO_SHA256_SIZE);
+    struct q_useful_buf_c        single_hash;
+    struct t_cose_crypto_hash    hash_ctx;
+    enum t_cose_err_t            result;
+    size_t                       len;
+    size_t                       i;
+    size_t                       j;
+    size_t                       c;
+
+    for(i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)(i * 7 + 3);
+    }
+
+    /* Each input is in two pieces with an empty NULL piece between */
+    for(i = 0; i < HASH_BATCH_TEST_COUNT; i++) {
+        len = lengths[i % (sizeof(lengths) / sizeof(lengths[0]))];
+        pieces[i][0]        = (struct q_useful_buf_c){data + i, len / 3};
+        pieces[i][1]        = NULL_Q_USEFUL_BUF_C;
+        pieces[i][2]        = (struct q_useful_buf_c){data + i + len / 3, len - len / 3};
+        inputs[i]           = pieces[i];
+        buffers_for_hash[i] = Q_USEFUL_BUF_FROM_BYTE_ARRAY(hash_storage[i]);
+    }
+
+    /* --- The same hashes as one at a time for batches of any size --- */
+    for(c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        memset(hash_storage, 0, sizeof(hash_storage));
+        result = t_cose_crypto_hash_batch(COSE_ALGORITHM_SHA_256,
+                                          inputs,
+                                          3,
+                                          buffers_for_hash,
+                                          hashes,
+                                          counts[c]);
+        if(result) {
+            return 1000 * (int32_t)(c + 1) + (int32_t)result;
+        }
+        for(i = 0; i < counts[c]; i++) {
+            result = t_cose_crypto_hash_start(&hash_ctx, COSE_ALGORITHM_SHA_256);
+            if(result) {
+                return 1000 * (int32_t)(c + 1) + 100 + (int32_t)result;
+            }
+            for(j = 0; j < 3; j++) {
+                t_cose_crypto_hash_update(&hash_ctx, pieces[i][j]);
+            }
+            result = t_cose_crypto_hash_finish(&hash_ctx, single_buffer, &single_hash);
+            if(result) {
+                return 1000 * (int32_t)(c + 1) + 200 + (int32_t)result;
+            }
+            if(hashes[i].ptr != hash_storage[i] ||
+               q_useful_buf_compare(hashes[i], single_hash)) {
+                return 1000 * (int32_t)(c + 1) + 300 + (int32_t)i;
+            }
+        }
+    }
+
+    /* --- A known answer, two of them so more than one lane --- */
+    pieces[0][0] = Q_USEFUL_BUF_FROM_SZ_LITERAL("ab");
+    pieces[0][1] = NULL_Q_USEFUL_BUF_C;
+    pieces[0][2] = Q_USEFUL_BUF_FROM_SZ_LITERAL("c");
+    pieces[1][0] = Q_USEFUL_BUF_FROM_SZ_LITERAL("a");
+    pieces[1][1] = Q_USEFUL_BUF_FROM_SZ_LITERAL("bc");
+    pieces[1][2] = NULL_Q_USEFUL_BUF_C;
+    result = t_cose_crypto_hash_batch(COSE_ALGORITHM_SHA_256,
+                                      inputs,
+                                      3,
+                                      buffers_for_hash,
+                                      hashes,
+                                      2);
+    if(result) {
+        return 7000 + (int32_t)result;
+    }
+    if(q_useful_buf_compare(hashes[0], Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(abc_sha256)) ||
+       q_useful_buf_compare(hashes[1], Q_USEFUL_BUF_FROM_BYTE_ARRAY_LITERAL(abc_sha256))) {
+        return 7100;
+    }
+
+    /* --- An unsupported hash --- */
+    result = t_cose_crypto_hash_batch(T_COSE_INVALID_ALGORITHM_ID,
+                                      inputs,
+                                      3,
+                                      buffers_for_hash,
+                                      hashes,
+                                      2);
+    if(result != T_COSE_ERR_UNSUPPORTED_HASH) {
+        return 8000 + (int32_t)result;
+    }
+
+    /* --- An empty batch --- */
+    result = t_cose_crypto_hash_batch(COSE_ALGORITHM_SHA_256, NULL, 3, NULL, NULL, 0);
+    if(result) {
+        return 9000 + (int32_t)result;
+    }
+
+    return 0;
+}
@@ -155,4 +155,150 @@ int32_t get_size_test(void);
 int32_t indef_array_and_map_test(void);
 
 
+/*
+ * Test batch signing with short-circuit signatures including a
+ * message that fails, size calculation and an error common to all.
+ */
+int_fast32_t short_circuit_batch_test(void);
+
+
+/*
+ * Test that signing with a precomputed hash midstate gives the same
+ * output as signing without, including for batch signing.
+ */
+int_fast32_t short_circuit_midstate_test(void);
+
+
+/*
+ * Test signing with the header parameters encoded once in a
+ * template and with caller-encoded unprotected parameters.
+ */
+int_fast32_t short_circuit_header_template_test(void);
+
+
+/*
+ * Test streaming detached signing gives the same output as signing
+ * the whole payload at once and that payload length errors are
+ * caught.
+ */
+int_fast32_t short_circuit_sign_stream_test(void);
+
+
+/*
+ * Test streaming detached verification of good and bad payloads.
+ */
+int_fast32_t short_circuit_verify_stream_test(void);
+
+
+/*
+ * Test two-step verification: that header errors are found by the
+ * prepare and signature errors by the complete.
+ */
+int_fast32_t short_circuit_verify_prepare_test(void);
+
+
+/*
+ * Test signing in place gives the same output as signing normally
+ * without moving the payload and that lack of room is caught.
+ */
+int_fast32_t short_circuit_in_place_test(void);
+
+
+/*
+ * Test a payload encoded by a callback straight into the output gives
+ * the same result as signing the encoded payload.
+ */
+int_fast32_t short_circuit_encode_payload_test(void);
+
+
+/*
+ * Test signing split around an external signer gives the same output
+ * as signing normally, with several messages waiting at once.
+ */
+int_fast32_t short_circuit_external_sign_test(void);
+
+
+#ifdef T_COSE_ENABLE_FILE_IO
+/*
+ * Test signing and verifying detached payloads from regular files,
+ * paths and pipes.
+ */
+int_fast32_t short_circuit_file_test(void);
+#endif
+
+
+/*
+ * Test the kid cache hits, evicts the least recently used key, gives
+ * back keys for kids too long to cache and isn't used for
+ * short-circuit signatures.
+ */
+int_fast32_t key_resolver_test(void);
+
+
+/*
+ * Test making a key index, looking kids up in it in memory and from a
+ * file and rejecting damaged ones.
+ */
+int_fast32_t key_index_test(void);
+
+
+/*
+ * Test making allow and deny kid filters, their false positive rate,
+ * rejecting damaged ones and rejecting kids during verification.
+ */
+int_fast32_t kid_filter_test(void);
+
+
+#if defined(T_COSE_ENABLE_VERIFY_CACHE) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+/*
+ * Test that a verification cache hit returns the same payload and
+ * parameters and still applies the options and kid filter.
+ */
+int_fast32_t verify_cache_test(void);
+#endif
+
+
+#ifdef T_COSE_ENABLE_KEY_SET
+/*
+ * Test key set look up, publishing while a read is in progress and
+ * reclaiming once it is done.
+ */
+int_fast32_t key_set_test(void);
+#endif
+
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+/*
+ * Test that cached protected parameters and hash midstates give the
+ * same results as parsing and hashing them, including errors.
+ */
+int_fast32_t header_cache_test(void);
+#endif
+
+
+#if defined(T_COSE_ENABLE_ASYNC) && !defined(T_COSE_DISABLE_SHORT_CIRCUIT_SIGN)
+/*
+ * Test signing and verifying on a thread pool and a custom executor,
+ * chaining requests from callbacks and a full queue.
+ */
+int_fast32_t async_test(void);
+#endif
+
+
+#ifndef T_COSE_DISABLE_SHORT_CIRCUIT_SIGN
+/*
+ * Test that batch verification gives the same results for each
+ * message as verifying them one at a time.
+ */
+int_fast32_t verify_batch_test(void);
+#endif
+
+
+/*
+ * Test that hashing many inputs at once gives the same hashes as
+ * hashing them one at a time for batches of any size.
+ */
+int_fast32_t hash_batch_test(void);
+
+
 #endif /* t_cose_test_h */
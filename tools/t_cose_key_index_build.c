@@ -0,0 +1,176 @@
+/*
+ *  t_cose_key_index_build.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "t_cose/t_cose_key_index.h"
+
+
+/**
+ * \file t_cose_key_index_build.c
+ *
+ * \brief Make a key index file for t_cose_key_index_open().
+ *
+ *     t_cose_key_index_build <keys.txt> <index.tcki>
+ *
+ * Each line of the input is a kid, a COSE algorithm ID and a public
+ * key separated by spaces. The kid and public key are in hex and the
+ * public key is an uncompressed EC point. Blank lines and lines
+ * starting with # are skipped.
+ *
+ *     # kid                             alg  public key
+ *     0a1b2c3d4e5f60718293a4b5c6d7e8f9  -7   04e1b5...
+ *
+ * The index is written to a temporary file that is then renamed to
+ * the output so verifiers that open the output path never see a
+ * partly written index.
+ */
+
+
+/* Longest input line. Enough for a P-521 point and a long kid. */
+#define MAX_LINE 2048
+
+
+/*
+ * Decodes hex into out. Returns the number of bytes or -1 if the hex
+ * isn't valid.
+ */
+static long
+hex_decode(const char *hex, uint8_t *out)
+{
+    size_t       len = strlen(hex);
+    size_t       i;
+    unsigned int byte;
+
+    if(len == 0 || len % 2) {
+        return -1;
+    }
+    for(i = 0; i < len / 2; i++) {
+        if(sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return (long)(len / 2);
+}
+
+
+int main(int argc, const char *argv[])
+{
+    FILE                          *input;
+    FILE                          *output;
+    char                           line[MAX_LINE];
+    char                           kid_hex[MAX_LINE];
+    char                           key_hex[MAX_LINE];
+    char                           temp_path[4096];
+    long                           alg;
+    long                           kid_len;
+    long                           key_len;
+    struct t_cose_key_index_entry *entries = NULL;
+    size_t                         count = 0;
+    size_t                         allocated = 0;
+    uint8_t                       *bytes;
+    unsigned long                  line_number = 0;
+    struct q_useful_buf_c          index;
+    struct q_useful_buf            buffer;
+    enum t_cose_err_t              result;
+    int                            return_value = 1;
+
+    if(argc != 3) {
+        fprintf(stderr, "usage: %s <keys.txt> <index.tcki>\n", argv[0]);
+        return 2;
+    }
+
+    input = fopen(argv[1], "r");
+    if(input == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    while(fgets(line, sizeof(line), input) != NULL) {
+        line_number++;
+        if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if(sscanf(line, "%s %ld %s", kid_hex, &alg, key_hex) != 3) {
+            fprintf(stderr, "%s:%lu: expected kid, algorithm and key\n", argv[1], line_number);
+            goto Done;
+        }
+
+        if(count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            entries = realloc(entries, allocated * sizeof(entries[0]));
+            if(entries == NULL) {
+                fprintf(stderr, "out of memory\n");
+                goto Done;
+            }
+        }
+
+        /* Each entry's kid and key get their own allocation. These
+         * are never freed; the process ends soon enough. */
+        bytes = malloc(strlen(kid_hex) / 2 + strlen(key_hex) / 2);
+        if(bytes == NULL) {
+            fprintf(stderr, "out of memory\n");
+            goto Done;
+        }
+        kid_len = hex_decode(kid_hex, bytes);
+        key_len = kid_len < 0 ? -1 : hex_decode(key_hex, bytes + kid_len);
+        if(key_len < 0) {
+            fprintf(stderr, "%s:%lu: bad hex\n", argv[1], line_number);
+            goto Done;
+        }
+
+        entries[count].kid               = (struct q_useful_buf_c){bytes, (size_t)kid_len};
+        entries[count].cose_algorithm_id = (int32_t)alg;
+        entries[count].public_key        = (struct q_useful_buf_c){bytes + kid_len, (size_t)key_len};
+        count++;
+    }
+
+    /* Once to get the size and again to make it */
+    result = t_cose_key_index_encode(entries, count, (struct q_useful_buf){NULL, 0}, &index);
+    if(result == T_COSE_SUCCESS) {
+        buffer.len = index.len;
+        buffer.ptr = malloc(buffer.len);
+        if(buffer.ptr == NULL) {
+            fprintf(stderr, "out of memory\n");
+            goto Done;
+        }
+        result = t_cose_key_index_encode(entries, count, buffer, &index);
+    }
+    if(result != T_COSE_SUCCESS) {
+        fprintf(stderr, "making the index failed (%d); duplicate kid?\n", (int)result);
+        goto Done;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", argv[2]);
+    output = fopen(temp_path, "wb");
+    if(output == NULL) {
+        perror(temp_path);
+        goto Done;
+    }
+    if(fwrite(index.ptr, 1, index.len, output) != index.len || fclose(output) != 0) {
+        perror(temp_path);
+        remove(temp_path);
+        goto Done;
+    }
+    if(rename(temp_path, argv[2]) != 0) {
+        perror(argv[2]);
+        remove(temp_path);
+        goto Done;
+    }
+
+    printf("%zu keys, %zu bytes\n", count, index.len);
+    return_value = 0;
+
+Done:
+    fclose(input);
+    return return_value;
+}
@@ -0,0 +1,169 @@
+/*
+ *  t_cose_kid_filter_build.c
+ *
+ * Copyright 2019-2021, Laurence Lundblade
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * See BSD-3-Clause license in README.md
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "t_cose/t_cose_kid_filter.h"
+
+
+/**
+ * \file t_cose_kid_filter_build.c
+ *
+ * \brief Make a kid filter file for t_cose_kid_filter_open().
+ *
+ *     t_cose_kid_filter_build allow|deny <bits per kid> <kids.txt> <filter.tckf>
+ *
+ * Each line of the input is a kid in hex. Blank lines and lines
+ * starting with # are skipped.
+ *
+ * The filter is written to a temporary file that is then renamed to
+ * the output so verifiers that open the output path never see a
+ * partly written filter.
+ */
+
+
+/* Longest input line */
+#define MAX_LINE 2048
+
+
+/*
+ * Decodes hex into out. Returns the number of bytes or -1 if the hex
+ * isn't valid.
+ */
+static long
+hex_decode(const char *hex, uint8_t *out)
+{
+    size_t       len = strlen(hex);
+    size_t       i;
+    unsigned int byte;
+
+    if(len == 0 || len % 2) {
+        return -1;
+    }
+    for(i = 0; i < len / 2; i++) {
+        if(sscanf(hex + i * 2, "%2x", &byte) != 1) {
+            return -1;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return (long)(len / 2);
+}
+
+
+int main(int argc, const char *argv[])
+{
+    FILE                        *input;
+    FILE                        *output;
+    char                         line[MAX_LINE];
+    char                         kid_hex[MAX_LINE];
+    char                         temp_path[4096];
+    long                         kid_len;
+    enum t_cose_kid_filter_mode  mode;
+    unsigned                     bits_per_kid;
+    struct q_useful_buf_c       *kids = NULL;
+    size_t                       count = 0;
+    size_t                       allocated = 0;
+    uint8_t                     *bytes;
+    unsigned long                line_number = 0;
+    struct q_useful_buf_c        filter;
+    struct q_useful_buf          buffer;
+    enum t_cose_err_t            result;
+    int                          return_value = 1;
+
+    if(argc != 5 ||
+       (strcmp(argv[1], "allow") && strcmp(argv[1], "deny")) ||
+       sscanf(argv[2], "%u", &bits_per_kid) != 1) {
+        fprintf(stderr, "usage: %s allow|deny <bits per kid> <kids.txt> <filter.tckf>\n", argv[0]);
+        return 2;
+    }
+    mode = strcmp(argv[1], "allow") ? T_COSE_KID_FILTER_DENY : T_COSE_KID_FILTER_ALLOW;
+
+    input = fopen(argv[3], "r");
+    if(input == NULL) {
+        perror(argv[3]);
+        return 1;
+    }
+
+    while(fgets(line, sizeof(line), input) != NULL) {
+        line_number++;
+        if(line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+            continue;
+        }
+        if(sscanf(line, "%s", kid_hex) != 1) {
+            fprintf(stderr, "%s:%lu: expected a kid\n", argv[3], line_number);
+            goto Done;
+        }
+
+        if(count == allocated) {
+            allocated = allocated ? allocated * 2 : 1024;
+            kids = realloc(kids, allocated * sizeof(kids[0]));
+            if(kids == NULL) {
+                fprintf(stderr, "out of memory\n");
+                goto Done;
+            }
+        }
+
+        /* Never freed; the process ends soon enough */
+        bytes = malloc(strlen(kid_hex) / 2);
+        if(bytes == NULL) {
+            fprintf(stderr, "out of memory\n");
+            goto Done;
+        }
+        kid_len = hex_decode(kid_hex, bytes);
+        if(kid_len < 0) {
+            fprintf(stderr, "%s:%lu: bad hex\n", argv[3], line_number);
+            goto Done;
+        }
+
+        kids[count] = (struct q_useful_buf_c){bytes, (size_t)kid_len};
+        count++;
+    }
+
+    /* Once to get the size and again to make it */
+    result = t_cose_kid_filter_encode(mode, kids, count, bits_per_kid, (struct q_useful_buf){NULL, 0}, &filter);
+    if(result == T_COSE_SUCCESS) {
+        buffer.len = filter.len;
+        buffer.ptr = malloc(buffer.len);
+        if(buffer.ptr == NULL) {
+            fprintf(stderr, "out of memory\n");
+            goto Done;
+        }
+        result = t_cose_kid_filter_encode(mode, kids, count, bits_per_kid, buffer, &filter);
+    }
+    if(result != T_COSE_SUCCESS) {
+        fprintf(stderr, "making the filter failed (%d); bits per kid is 4 to 64\n", (int)result);
+        goto Done;
+    }
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", argv[4]);
+    output = fopen(temp_path, "wb");
+    if(output == NULL) {
+        perror(temp_path);
+        goto Done;
+    }
+    if(fwrite(filter.ptr, 1, filter.len, output) != filter.len || fclose(output) != 0) {
+        perror(temp_path);
+        remove(temp_path);
+        goto Done;
+    }
+    if(rename(temp_path, argv[4]) != 0) {
+        perror(argv[4]);
+        remove(temp_path);
+        goto Done;
+    }
+
+    printf("%zu kids, %zu bytes\n", count, filter.len);
+    return_value = 0;
+
+Done:
+    fclose(input);
+    return return_value;
+}